@@ -0,0 +1,90 @@
+#include "activations.hpp"
+#include <Eigen/Dense>
+#include <atomic>
+#include <cmath>
+#include <unsupported/Eigen/SpecialFunctions>
+
+namespace
+{
+
+std::atomic<demucscpp::activation_accuracy> accuracy{
+    demucscpp::activation_accuracy::fast};
+
+bool exact()
+{
+    return accuracy.load(std::memory_order_relaxed) ==
+           demucscpp::activation_accuracy::exact;
+}
+
+} // namespace
+
+void demucscpp::set_activation_accuracy(activation_accuracy a)
+{
+    accuracy.store(a, std::memory_order_relaxed);
+}
+
+demucscpp::activation_accuracy demucscpp::get_activation_accuracy()
+{
+    return accuracy.load(std::memory_order_relaxed);
+}
+
+void demucscpp::gelu_inplace(float *x, Eigen::Index n)
+{
+    if (exact())
+    {
+        for (Eigen::Index i = 0; i < n; ++i)
+        {
+            float a = x[i];
+            x[i] = 0.5f * a * (1.0f + std::erf(a / std::sqrt(2.0f)));
+        }
+        return;
+    }
+
+    Eigen::Map<Eigen::ArrayXf> a(x, n);
+    a = 0.5f * a * (1.0f + (a * (float)M_SQRT1_2).erf());
+}
+
+void demucscpp::sigmoid_inplace(float *x, Eigen::Index n)
+{
+    if (exact())
+    {
+        for (Eigen::Index i = 0; i < n; ++i)
+        {
+            x[i] = 1.0f / (1.0f + std::exp(-x[i]));
+        }
+        return;
+    }
+
+    Eigen::Map<Eigen::ArrayXf> a(x, n);
+    a = a.logistic();
+}
+
+void demucscpp::tanh_inplace(float *x, Eigen::Index n)
+{
+    if (exact())
+    {
+        for (Eigen::Index i = 0; i < n; ++i)
+        {
+            x[i] = std::tanh(x[i]);
+        }
+        return;
+    }
+
+    Eigen::Map<Eigen::ArrayXf> a(x, n);
+    a = a.tanh();
+}
+
+void demucscpp::exp_inplace(float *x, Eigen::Index n)
+{
+    if (exact())
+    {
+        for (Eigen::Index i = 0; i < n; ++i)
+        {
+            x[i] = std::exp(x[i]);
+        }
+        return;
+    }
+
+    Eigen::Map<Eigen::ArrayXf> a(x, n);
+    a = a.exp();
+}
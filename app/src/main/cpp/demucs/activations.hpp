@@ -0,0 +1,49 @@
+#ifndef ACTIVATIONS_HPP
+#define ACTIVATIONS_HPP
+
+#include <Eigen/Dense>
+
+namespace demucscpp
+{
+
+// the elementwise activations of the model (the gelu of the convs, the dconv
+// and the transformer feedforward, the sigmoid of the glu gates, the exp of
+// the attention softmax and the sigmoid and tanh of the lstm) all go through
+// the kernels below, which work in place on contiguous floats
+//
+// exact evaluates each element with the libm function, as the layers used to
+// inline, so the gelu and sigmoid layers give the same bits as before; fast
+// evaluates whole SIMD packets with the polynomial and rational
+// approximations of Eigen. demucs_bench --kernels measures both against a
+// double reference over [-10, 10], as the error relative to max(1, |y|)
+// (relative to |y| for exp), and fast stays within
+//   gelu    1.0e-6 (exact: 1.1e-7)
+//   sigmoid 1.0e-7 (exact: 8.9e-8)
+//   tanh    4.0e-7 (exact: 9.0e-8)
+//   exp     1.0e-7 (exact: 5.9e-8)
+// the gelu bound is set by erf, which Eigen clamps to -1 below -3.83, and by
+// the cancellation of 1 + erf(x) for negative x, which exact has too
+enum class activation_accuracy
+{
+    exact,
+    fast
+};
+
+// process-wide, like set_num_threads; fast is the default
+void set_activation_accuracy(activation_accuracy accuracy);
+
+activation_accuracy get_activation_accuracy();
+
+// x = 0.5 * x * (1 + erf(x / sqrt(2)))
+void gelu_inplace(float *x, Eigen::Index n);
+
+// x = 1 / (1 + exp(-x))
+void sigmoid_inplace(float *x, Eigen::Index n);
+
+void tanh_inplace(float *x, Eigen::Index n);
+
+void exp_inplace(float *x, Eigen::Index n);
+
+} // namespace demucscpp
+
+#endif // ACTIVATIONS_HPP
@@ -0,0 +1,173 @@
+#include "arena.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+#include <sstream>
+
+// the steps of [first, last], widened to the parallel regions they touch
+static std::pair<int, int>
+widen_to_regions(const demucscpp::activation_plan &plan, int first, int last)
+{
+    for (const auto &region : plan.parallel_regions)
+    {
+        if (first <= region.second && region.first <= last)
+        {
+            first = std::min(first, region.first);
+            last = std::max(last, region.second);
+        }
+    }
+    return {first, last};
+}
+
+static bool lifetimes_conflict(const demucscpp::activation_plan &plan,
+                               const demucscpp::activation &a,
+                               const demucscpp::activation &b)
+{
+    std::pair<int, int> la = {a.first_step, a.last_step};
+    std::pair<int, int> lb = {b.first_step, b.last_step};
+
+    if (a.lane != b.lane && a.lane != demucscpp::SERIAL_LANE &&
+        b.lane != demucscpp::SERIAL_LANE)
+    {
+        la = widen_to_regions(plan, la.first, la.second);
+        lb = widen_to_regions(plan, lb.first, lb.second);
+    }
+    return la.first <= lb.second && lb.first <= la.second;
+}
+
+static std::size_t align_up(std::size_t n)
+{
+    return (n + demucscpp::ARENA_ALIGN - 1) / demucscpp::ARENA_ALIGN *
+           demucscpp::ARENA_ALIGN;
+}
+
+void demucscpp::plan_activations(activation_plan &plan)
+{
+    std::vector<activation> &acts = plan.activations;
+
+    // largest first, ties by first use, so the plan does not depend on the
+    // order the activations were added in beyond that
+    std::vector<int> order(acts.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(),
+                     [&](int a, int b)
+                     {
+                         if (acts[a].nbytes() != acts[b].nbytes())
+                         {
+                             return acts[a].nbytes() > acts[b].nbytes();
+                         }
+                         return acts[a].first_step < acts[b].first_step;
+                     });
+
+    plan.arena_bytes = 0;
+    std::vector<int> placed;
+    for (int i : order)
+    {
+        // the byte ranges taken by the placed activations it conflicts with,
+        // by offset
+        std::vector<std::pair<std::size_t, std::size_t>> taken;
+        for (int j : placed)
+        {
+            if (lifetimes_conflict(plan, acts[i], acts[j]))
+            {
+                taken.push_back(
+                    {acts[j].offset, acts[j].offset + acts[j].nbytes()});
+            }
+        }
+        std::sort(taken.begin(), taken.end());
+
+        // the first gap that fits
+        std::size_t offset = 0;
+        for (const auto &range : taken)
+        {
+            if (offset + acts[i].nbytes() <= range.first)
+            {
+                break;
+            }
+            offset = std::max(offset, align_up(range.second));
+        }
+
+        acts[i].offset = offset;
+        plan.arena_bytes =
+            std::max(plan.arena_bytes, align_up(offset + acts[i].nbytes()));
+        placed.push_back(i);
+    }
+}
+
+const demucscpp::activation &
+demucscpp::activation_plan::find(const std::string &name) const
+{
+    for (const activation &a : activations)
+    {
+        if (a.name == name)
+        {
+            return a;
+        }
+    }
+    std::cerr << "No activation " << name << " in the plan" << std::endl;
+    std::abort();
+}
+
+std::size_t demucscpp::activation_plan::separate_bytes() const
+{
+    std::size_t total = 0;
+    for (const activation &a : activations)
+    {
+        total += a.nbytes();
+    }
+    return total;
+}
+
+std::string demucscpp::activation_plan::report() const
+{
+    const double mb = 1024.0 * 1024.0;
+
+    std::ostringstream ss;
+    ss << std::left << std::setw(28) << "activation" << std::right
+       << std::setw(6) << "lane" << std::setw(8) << "steps" << std::setw(12)
+       << "offset MB" << std::setw(10) << "size MB" << "\n";
+    ss << std::fixed << std::setprecision(2);
+    for (const activation &a : activations)
+    {
+        std::ostringstream steps;
+        steps << a.first_step << "-" << a.last_step;
+        ss << std::left << std::setw(28) << a.name << std::right
+           << std::setw(6) << a.lane << std::setw(8) << steps.str()
+           << std::setw(12) << a.offset / mb << std::setw(10)
+           << a.nbytes() / mb << "\n";
+    }
+    ss << "planned arena: " << arena_bytes / mb
+       << " MB, separate buffers: " << separate_bytes() / mb << " MB\n";
+    return ss.str();
+}
+
+demucscpp::activation_arena::activation_arena(const activation_plan &plan)
+    : plan(plan), storage(plan.arena_bytes / sizeof(float))
+{
+}
+
+Eigen::TensorMap<Eigen::Tensor3dXf>
+demucscpp::activation_arena::map(const std::string &name)
+{
+    const activation &a = plan.find(name);
+    return Eigen::TensorMap<Eigen::Tensor3dXf>(
+        storage.data() + a.offset / sizeof(float), a.dims);
+}
+
+Eigen::Tensor3dXfMap demucscpp::output_view(Eigen::Tensor3dXfMap &out,
+                                            Eigen::Index d0, Eigen::Index d1,
+                                            Eigen::Index d2)
+{
+    if (out.dimension(0) != d0 || out.dimension(1) != d1 ||
+        out.dimension(2) != d2)
+    {
+        std::cerr << "Output view is (" << out.dimension(0) << ", "
+                  << out.dimension(1) << ", " << out.dimension(2)
+                  << "), the layer writes (" << d0 << ", " << d1 << ", " << d2
+                  << ")" << std::endl;
+        std::abort();
+    }
+    return out;
+}
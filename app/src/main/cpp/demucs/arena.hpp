@@ -0,0 +1,167 @@
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include "tensor.hpp"
+#include <Eigen/Dense>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace demucscpp
+{
+
+// static memory planning of the activations of a forward pass
+//
+// every activation is described by its shape and the steps of the pass
+// between which it is live (from the step that writes it to the last step
+// that reads it, both included); plan_activations then gives each one an
+// offset in a single arena such that activations whose lifetimes overlap
+// never share bytes, and all the others may
+//
+// two branches of a pass can run concurrently: the steps of a parallel
+// region are numbered per branch (lane), so for activations of different
+// lanes a lifetime that touches a parallel region is widened to the whole
+// region, since there is no ordering between the steps of the two lanes
+
+// activations used outside of any parallel region
+constexpr int SERIAL_LANE = 0;
+
+struct activation
+{
+    std::string name;
+    Eigen::array<Eigen::Index, 3> dims;
+    int lane;
+    int first_step;
+    int last_step;
+
+    // set by plan_activations, in bytes
+    std::size_t offset = 0;
+
+    std::size_t nbytes() const
+    {
+        return (std::size_t)dims[0] * dims[1] * dims[2] * sizeof(float);
+    }
+};
+
+struct activation_plan
+{
+    std::vector<activation> activations;
+
+    // [first, last] steps of the regions where the lanes run concurrently
+    std::vector<std::pair<int, int>> parallel_regions;
+
+    // set by plan_activations
+    std::size_t arena_bytes = 0;
+
+    void add(const std::string &name, Eigen::array<Eigen::Index, 3> dims,
+             int lane, int first_step, int last_step)
+    {
+        activations.push_back({name, dims, lane, first_step, last_step});
+    }
+
+    const activation &find(const std::string &name) const;
+
+    // the bytes needed with one buffer per activation, as without a plan
+    std::size_t separate_bytes() const;
+
+    // a table of the activations with their lifetimes and offsets, and the
+    // planned arena size next to separate_bytes
+    std::string report() const;
+};
+
+// arena offsets are multiples of this, in bytes
+constexpr std::size_t ARENA_ALIGN = 64;
+
+// assign offsets greedily, the largest activations first, each at the lowest
+// aligned offset that does not overlap one already placed whose lifetime
+// conflicts with its own
+void plan_activations(activation_plan &plan);
+
+// the arena of a plan, with a tensor view for each activation
+class activation_arena
+{
+  public:
+    explicit activation_arena(const activation_plan &plan);
+
+    activation_arena(const activation_arena &) = delete;
+    activation_arena &operator=(const activation_arena &) = delete;
+
+    Eigen::TensorMap<Eigen::Tensor3dXf> map(const std::string &name);
+
+  private:
+    const activation_plan &plan;
+    std::vector<float> storage;
+};
+
+// storage for the temporaries of the layers, which change shape from one use
+// to the next: it is only reallocated when a shape needs more room than it
+// has, so a buffer that goes through the same shapes every segment stops
+// allocating after the first one
+//
+// the views share the storage, and the values in it are kept when it grows,
+// so a layer can reshape its own input or work on it in place
+class tensor_buffer
+{
+  public:
+    // the buffer seen as a tensor of the given shape, which it keeps as its
+    // current one
+    Eigen::Tensor3dXfMap tensor(Eigen::Index d0, Eigen::Index d1,
+                                Eigen::Index d2)
+    {
+        dims = {d0, d1, d2};
+        return Eigen::Tensor3dXfMap(reserve(d0 * d1 * d2), dims);
+    }
+
+    // the buffer in its current shape
+    Eigen::Tensor3dXfMap tensor()
+    {
+        return Eigen::Tensor3dXfMap(storage.data(), dims);
+    }
+
+    Eigen::Map<Eigen::MatrixXf> matrix(Eigen::Index rows, Eigen::Index cols)
+    {
+        return Eigen::Map<Eigen::MatrixXf>(reserve(rows * cols), rows, cols);
+    }
+
+    // the storage, with room for at least size floats
+    float *reserve(Eigen::Index size)
+    {
+        if (storage.size() < size)
+        {
+            storage.conservativeResize(size);
+        }
+        return storage.data();
+    }
+
+  private:
+    Eigen::VectorXf storage;
+    Eigen::array<Eigen::Index, 3> dims = {0, 0, 0};
+};
+
+// the destination of the out-parameter layers: a buffer is reshaped, a tensor
+// is resized (which only allocates when its size changes), and a view must
+// already have the shape of the result
+inline Eigen::Tensor3dXfMap output_view(tensor_buffer &out, Eigen::Index d0,
+                                        Eigen::Index d1, Eigen::Index d2)
+{
+    return out.tensor(d0, d1, d2);
+}
+
+inline Eigen::Tensor3dXfMap output_view(Eigen::Tensor3dXf &out,
+                                        Eigen::Index d0, Eigen::Index d1,
+                                        Eigen::Index d2)
+{
+    if (out.dimension(0) != d0 || out.dimension(1) != d1 ||
+        out.dimension(2) != d2)
+    {
+        out.resize(d0, d1, d2);
+    }
+    return Eigen::Tensor3dXfMap(out.data(), d0, d1, d2);
+}
+
+Eigen::Tensor3dXfMap output_view(Eigen::Tensor3dXfMap &out, Eigen::Index d0,
+                                 Eigen::Index d1, Eigen::Index d2);
+
+} // namespace demucscpp
+
+#endif // ARENA_HPP
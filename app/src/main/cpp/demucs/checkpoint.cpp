@@ -0,0 +1,297 @@
+#include "checkpoint.hpp"
+#include "stem_cache.hpp"
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <system_error>
+
+// "DCKP"
+static const uint32_t CHECKPOINT_MAGIC = 0x504b4344;
+static const uint32_t CHECKPOINT_VERSION = 2;
+static const char *CHECKPOINT_STATE_EXTENSION = ".ckpt";
+static const char *CHECKPOINT_FRAMES_EXTENSION = ".frames";
+
+template <typename T>
+static void put(std::string &buf, const T &value)
+{
+    buf.append(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+static void put_floats(std::string &buf, const float *data, Eigen::Index n)
+{
+    buf.append(reinterpret_cast<const char *>(data), n * sizeof(float));
+}
+
+template <typename T>
+static bool take(const std::string &buf, std::size_t &pos, T &value)
+{
+    if (pos + sizeof(T) > buf.size())
+    {
+        return false;
+    }
+    std::memcpy(&value, buf.data() + pos, sizeof(T));
+    pos += sizeof(T);
+    return true;
+}
+
+static bool take_floats(const std::string &buf, std::size_t &pos, float *data,
+                        Eigen::Index n)
+{
+    std::size_t nbytes = n * sizeof(float);
+    if (pos + nbytes > buf.size())
+    {
+        return false;
+    }
+    std::memcpy(data, buf.data() + pos, nbytes);
+    pos += nbytes;
+    return true;
+}
+
+demucscpp::job_checkpoint::job_checkpoint(const std::string &dir,
+                                          const std::string &key)
+    : dir(dir), key(key)
+{
+    std::ostringstream name;
+    name << std::hex << std::setfill('0') << std::setw(16)
+         << hash_bytes(key.data(), key.size());
+    state_path = this->dir / (name.str() + CHECKPOINT_STATE_EXTENSION);
+    frames_path = this->dir / (name.str() + CHECKPOINT_FRAMES_EXTENSION);
+}
+
+bool demucscpp::job_checkpoint::load()
+{
+    std::error_code ec;
+    std::filesystem::create_directories(dir, ec);
+
+    // only the latest job keeps its checkpoint
+    for (const auto &entry : std::filesystem::directory_iterator(dir, ec))
+    {
+        const std::filesystem::path &path = entry.path();
+        if (path.stem() != state_path.stem() &&
+            (path.extension() == CHECKPOINT_STATE_EXTENSION ||
+             path.extension() == CHECKPOINT_FRAMES_EXTENSION))
+        {
+            std::filesystem::remove(path, ec);
+        }
+    }
+
+    std::ifstream file(state_path, std::ios::binary);
+    if (!file)
+    {
+        // frames without a state are of no use
+        std::filesystem::remove(frames_path, ec);
+        return false;
+    }
+    std::string buf((std::istreambuf_iterator<char>(file)),
+                    std::istreambuf_iterator<char>());
+    file.close();
+
+    // the checksum is the last field, over everything before it
+    uint64_t checksum = 0;
+    bool valid = buf.size() > sizeof(checksum);
+    if (valid)
+    {
+        std::size_t payload = buf.size() - sizeof(checksum);
+        std::memcpy(&checksum, buf.data() + payload, sizeof(checksum));
+        valid = hash_bytes(buf.data(), payload) == checksum;
+    }
+
+    std::size_t pos = 0;
+    uint32_t magic = 0;
+    uint32_t version = 0;
+    uint32_t key_size = 0;
+    valid = valid && take(buf, pos, magic) && take(buf, pos, version) &&
+            take(buf, pos, key_size) && magic == CHECKPOINT_MAGIC &&
+            version == CHECKPOINT_VERSION && pos + key_size <= buf.size() &&
+            buf.compare(pos, key_size, key) == 0;
+    pos += key_size;
+
+    int32_t nb_offsets = 0;
+    valid = valid && take(buf, pos, nb_offsets) && nb_offsets >= 0 &&
+            pos + (std::size_t)nb_offsets * sizeof(int32_t) <= buf.size();
+    std::vector<int> offsets(valid ? nb_offsets : 0);
+    for (int &offset : offsets)
+    {
+        int32_t value = 0;
+        valid = valid && take(buf, pos, value) && value >= 0;
+        offset = value;
+    }
+
+    int32_t segment = 0;
+    int32_t frames = 0;
+    int32_t nb_sources = 0;
+    int32_t window_frames = 0;
+    valid = valid && take(buf, pos, segment) && take(buf, pos, frames) &&
+            take(buf, pos, nb_sources) && take(buf, pos, window_frames) &&
+            segment >= 0 && frames >= 0 && nb_sources > 0 &&
+            window_frames >= 0;
+
+    if (valid)
+    {
+        window_out.resize(nb_sources, 2, window_frames);
+        window_sum.resize(window_frames);
+        valid = take_floats(buf, pos, window_out.data(), window_out.size()) &&
+                take_floats(buf, pos, window_sum.data(), window_sum.size());
+    }
+
+    // the frames file may have more frames than the state refers to, if
+    // the job was killed between writing the two
+    std::uintmax_t frames_bytes =
+        (std::uintmax_t)frames * nb_sources * 2 * sizeof(float);
+    valid = valid && std::filesystem::file_size(frames_path, ec) >=
+                         frames_bytes;
+    if (valid)
+    {
+        std::filesystem::resize_file(frames_path, frames_bytes, ec);
+        valid = !ec;
+    }
+
+    if (!valid)
+    {
+        std::cerr << "Removing the invalid checkpoint " << state_path
+                  << std::endl;
+        remove();
+        return false;
+    }
+
+    shift_offsets = offsets;
+    next_segment = segment;
+    final_frames = frames;
+    resumed = true;
+    return true;
+}
+
+bool demucscpp::job_checkpoint::restore(Eigen::Tensor3dXf &out,
+                                        Eigen::VectorXf &sum_weight,
+                                        int total_segments)
+{
+    int window_frames = window_sum.size();
+    if (!resumed || out.dimension(0) != window_out.dimension(0) ||
+        final_frames + window_frames > out.dimension(2) ||
+        next_segment > total_segments)
+    {
+        return false;
+    }
+
+    // the final frames are already normalized, which a weight of 1 keeps
+    std::ifstream file(frames_path, std::ios::binary);
+    std::streamsize nbytes =
+        (std::streamsize)final_frames * out.dimension(0) * 2 * sizeof(float);
+    if (!file.read(reinterpret_cast<char *>(out.data()), nbytes))
+    {
+        return false;
+    }
+    sum_weight.head(final_frames).setOnes();
+
+    for (int i = 0; i < out.dimension(0); ++i)
+    {
+        for (int j = 0; j < 2; ++j)
+        {
+            for (int k = 0; k < window_frames; ++k)
+            {
+                out(i, j, final_frames + k) = window_out(i, j, k);
+            }
+        }
+    }
+    sum_weight.segment(final_frames, window_frames) = window_sum;
+
+    saved_frames = final_frames;
+    return true;
+}
+
+bool demucscpp::job_checkpoint::save(int next_segment, int final_frames,
+                                     int window_frames,
+                                     const Eigen::Tensor3dXf &out,
+                                     const Eigen::VectorXf &sum_weight)
+{
+    int nb_sources = out.dimension(0);
+
+    // append the frames that became final since the last save
+    if (final_frames > saved_frames)
+    {
+        Eigen::Tensor3dXf frames(nb_sources, 2, final_frames - saved_frames);
+        for (int k = saved_frames; k < final_frames; ++k)
+        {
+            for (int j = 0; j < 2; ++j)
+            {
+                for (int i = 0; i < nb_sources; ++i)
+                {
+                    frames(i, j, k - saved_frames) =
+                        out(i, j, k) / sum_weight[k];
+                }
+            }
+        }
+
+        std::ofstream file(frames_path, std::ios::binary | std::ios::app);
+        file.write(reinterpret_cast<const char *>(frames.data()),
+                   frames.size() * sizeof(float));
+        file.close();
+        if (!file)
+        {
+            return false;
+        }
+    }
+
+    std::string buf;
+    put(buf, CHECKPOINT_MAGIC);
+    put(buf, CHECKPOINT_VERSION);
+    put(buf, (uint32_t)key.size());
+    buf.append(key);
+    put(buf, (int32_t)shift_offsets.size());
+    for (int offset : shift_offsets)
+    {
+        put(buf, (int32_t)offset);
+    }
+    put(buf, (int32_t)next_segment);
+    put(buf, (int32_t)final_frames);
+    put(buf, (int32_t)nb_sources);
+    put(buf, (int32_t)window_frames);
+
+    Eigen::Tensor3dXf window(nb_sources, 2, window_frames);
+    for (int i = 0; i < nb_sources; ++i)
+    {
+        for (int j = 0; j < 2; ++j)
+        {
+            for (int k = 0; k < window_frames; ++k)
+            {
+                window(i, j, k) = out(i, j, final_frames + k);
+            }
+        }
+    }
+    put_floats(buf, window.data(), window.size());
+    put_floats(buf, sum_weight.data() + final_frames, window_frames);
+    put(buf, hash_bytes(buf.data(), buf.size()));
+
+    std::filesystem::path tmp_path = state_path;
+    tmp_path += ".tmp";
+    {
+        std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+        file.write(buf.data(), buf.size());
+        file.close();
+        if (!file)
+        {
+            return false;
+        }
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(tmp_path, state_path, ec);
+    if (ec)
+    {
+        return false;
+    }
+    saved_frames = final_frames;
+    return true;
+}
+
+void demucscpp::job_checkpoint::remove()
+{
+    std::error_code ec;
+    std::filesystem::remove(state_path, ec);
+    std::filesystem::remove(frames_path, ec);
+    resumed = false;
+}
@@ -0,0 +1,79 @@
+#ifndef CHECKPOINT_HPP
+#define CHECKPOINT_HPP
+
+#include "tensor.hpp"
+#include <Eigen/Dense>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace demucscpp
+{
+
+// seconds of inference between two checkpoints of a job
+const float CHECKPOINT_INTERVAL_SECS = 10.0f;
+
+// the progress of a split_inference job on disk, so that a job that was
+// stopped or killed resumes from its last committed segment instead of
+// starting over
+//
+// the frames that no later segment adds to are final: they are appended,
+// already normalized by the overlap-add weights, to <key hash>.frames; the
+// state file <key hash>.ckpt holds the key, the shift offsets, the number of
+// committed segments and of final frames, the accumulators of the overlap
+// that the next segment still adds to, and a checksum of all that; it is
+// replaced atomically, and only ever refers to frames written before it
+//
+// a directory only keeps the checkpoint of the latest job, so that the ones
+// of abandoned jobs, which are about as large as their output, don't pile up
+class job_checkpoint
+{
+  public:
+    job_checkpoint(const std::string &dir, const std::string &key);
+
+    // read the state of an earlier run of the job, if there is a valid one,
+    // and otherwise remove the checkpoints of other jobs
+    bool load();
+
+    // fill the output and weight sums of split_inference from the loaded
+    // state, as it was after next_segment of total_segments segments
+    bool restore(Eigen::Tensor3dXf &out, Eigen::VectorXf &sum_weight,
+                 int total_segments);
+
+    // write the state after next_segment committed segments, with the
+    // frames before final_frames final; it doesn't log, as it runs on the
+    // segment workers
+    bool save(int next_segment, int final_frames, int window_frames,
+              const Eigen::Tensor3dXf &out, const Eigen::VectorXf &sum_weight);
+
+    // drop the checkpoint of a job that finished
+    void remove();
+
+    // the shift offsets of the passes of the job, which a resumed job must
+    // reuse
+    std::vector<int> shift_offsets;
+
+    bool resumed = false;
+    int next_segment = 0;
+    int final_frames = 0;
+
+    // frames after the final ones in the loaded state
+    int window_frames() const { return window_sum.size(); }
+
+  private:
+    std::filesystem::path dir;
+    std::string key;
+    std::filesystem::path state_path;
+    std::filesystem::path frames_path;
+
+    // the accumulators after the final frames
+    Eigen::Tensor3dXf window_out;
+    Eigen::VectorXf window_sum;
+
+    // final frames already in the frames file
+    int saved_frames = 0;
+};
+
+} // namespace demucscpp
+
+#endif // CHECKPOINT_HPP
@@ -1,41 +1,156 @@
 #ifndef CONV_HPP
 #define CONV_HPP
 
+#include "activations.hpp"
+#include "arena.hpp"
+#include "gemm.hpp"
 #include "model.hpp"
 #include "tensor.hpp"
+#include "threadpool.hpp"
 #include <Eigen/Dense>
+#include <algorithm>
+#include <cmath>
 #include <iostream>
+#include <type_traits>
 #include <unsupported/Eigen/CXX11/Tensor>
 
 namespace demucscpp
 {
 
-template <int kernel_height, int kernel_width, int stride_height,
-          int stride_width, int pad_height, int pad_width, int dilation_height,
-          int dilation_width>
-inline Eigen::MatrixXf im2col(const Eigen::Tensor3dXf &input)
+// the convolutions below are implicit GEMMs: the im2col matrix, with one row
+// per output position and one column per (in channel, kh, kw) tap, is never
+// materialised in full; it is built a tile of rows at a time, small enough to
+// stay in cache, and each tile is multiplied with the packed weights right
+// away, so the extra memory per conv is one tile instead of the whole matrix
+
+// rows per tile: at least enough for the GEMM to run at full speed, and
+// otherwise about 256 KiB worth of im2col values, rounded down to a multiple
+// of 64 so that the tiles split evenly into GEMM panels
+inline int conv_tile_rows(int nb_cols)
 {
-    // Adjust the calculation of height_col and width_col for dilation
-    int in_channels = input.dimension(0);
-    int in_height = input.dimension(1);
-    int in_width = input.dimension(2);
+    int rows = (256 * 1024 / (int)sizeof(float)) / nb_cols;
+    return std::max(GEMM_PANEL_ALIGN,
+                    rows / GEMM_PANEL_ALIGN * GEMM_PANEL_ALIGN);
+}
 
-    // Apply floating point division before ceiling to correctly calculate
-    // dimensions
-    int height_col =
-        static_cast<int>(std::ceil((in_height + 2 * pad_height -
-                                    dilation_height * (kernel_height - 1) - 1) /
-                                   float(stride_height)) +
-                         1);
-    int width_col =
-        static_cast<int>(std::ceil((in_width + 2 * pad_width -
-                                    dilation_width * (kernel_width - 1) - 1) /
-                                   float(stride_width)) +
-                         1);
+// the tile buffers of implicit_gemm are kept per thread from one conv to the
+// next, so that they stop allocating once they have grown to the largest tile
+using conv_tile = Eigen::Map<Eigen::MatrixXf>;
+
+inline tensor_buffer &conv_tile_buffer(int i)
+{
+    thread_local tensor_buffer buffers[2];
+    return buffers[i];
+}
+
+// run the GEMM of nb_rows im2col rows with the packed weights w, tile by tile
+// fill_tile(row_begin, n, tile) writes rows [row_begin, row_begin + n) of the
+// im2col matrix into the first n rows of tile, and store(row_begin, n, result)
+// consumes the first n rows of their product with w, which it may overwrite
+//
+// with several threads, the tiles are shared out between them, each with its
+// own tile buffers, so fill_tile and store must only touch the rows they are
+// given; when there is a single tile, its GEMM is split instead
+template <typename FillTile, typename Store>
+inline void implicit_gemm(int nb_rows, const gemm_weight &w,
+                          FillTile fill_tile, Store store)
+{
+    if (nb_rows <= 0)
+    {
+        return;
+    }
+
+    int tile_rows = std::min(nb_rows, conv_tile_rows(w.cols()));
+    int nb_tiles = (nb_rows + tile_rows - 1) / tile_rows;
+    int nb_lanes =
+        in_worker_thread() ? 1 : std::min(get_num_threads(), nb_tiles);
+
+    demucscpp::parallel_for(
+        nb_lanes,
+        [&](int lane)
+        {
+            conv_tile tile = conv_tile_buffer(0).matrix(tile_rows, w.cols());
+            conv_tile result = conv_tile_buffer(1).matrix(tile_rows, w.rows());
+
+            for (int t = lane; t < nb_tiles; t += nb_lanes)
+            {
+                int row_begin = t * tile_rows;
+                int n = std::min(tile_rows, nb_rows - row_begin);
+                fill_tile(row_begin, n, tile);
+                if (nb_lanes == 1)
+                {
+                    gemm_nt(tile.topRows(n), w, result.topRows(n));
+                }
+                else
+                {
+                    gemm_nt_serial(tile.topRows(n), w, 0, w.rows(),
+                                   result.topRows(n));
+                }
+                store(row_begin, n, result);
+            }
+        });
+}
+
+// where the (channel, height, width) axes of a conv are in the tensors it
+// reads and writes: the 2d convs work on (C, H, W) tensors and the 1d convs on
+// (W, C, H) ones, i.e. along the last axis with the first one as a width
+// under a kernel of 1; the encoders and decoders also have convs read or
+// write the (H, C, W) tensors of the dconv, so no conv has to shuffle its
+// input or its output into place
+template <int c_axis, int h_axis, int w_axis> struct conv_layout
+{
+    template <typename Tensor>
+    static decltype(auto) at(Tensor &t, int c, int h, int w)
+    {
+        Eigen::array<Eigen::Index, 3> i;
+        i[c_axis] = c;
+        i[h_axis] = h;
+        i[w_axis] = w;
+        return t(i);
+    }
+
+    template <typename Tensor> static int channels(const Tensor &t)
+    {
+        return t.dimension(c_axis);
+    }
+
+    template <typename Tensor> static int height(const Tensor &t)
+    {
+        return t.dimension(h_axis);
+    }
+
+    template <typename Tensor> static int width(const Tensor &t)
+    {
+        return t.dimension(w_axis);
+    }
+
+    // the view of a (c, h, w) conv output in this layout
+    template <typename Output>
+    static Eigen::Tensor3dXfMap output(Output &out, int c, int h, int w)
+    {
+        Eigen::array<Eigen::Index, 3> dims;
+        dims[c_axis] = c;
+        dims[h_axis] = h;
+        dims[w_axis] = w;
+        return output_view(out, dims[0], dims[1], dims[2]);
+    }
+};
+
+using chw_layout = conv_layout<0, 1, 2>;
+using wch_layout = conv_layout<1, 2, 0>;
+using hcw_layout = conv_layout<1, 0, 2>;
 
-    Eigen::MatrixXf output(height_col * width_col,
-                           in_channels * kernel_height * kernel_width);
-    output.setZero();
+// rows [row_begin, row_begin + nb_rows) of the im2col matrix of input, where
+// row h * width_col + w holds the taps of output position (h, w)
+template <int kernel_height, int kernel_width, int stride_height,
+          int stride_width, int pad_height, int pad_width, int dilation_height,
+          int dilation_width, typename Layout, typename Input>
+inline void im2col_tile(const Input &input, int width_col, int row_begin,
+                        int nb_rows, conv_tile &tile)
+{
+    int in_channels = Layout::channels(input);
+    int in_height = Layout::height(input);
+    int in_width = Layout::width(input);
 
     for (int c = 0; c < in_channels; c++)
     {
@@ -43,110 +158,381 @@ inline Eigen::MatrixXf im2col(const Eigen::Tensor3dXf &input)
         {
             for (int kw = 0; kw < kernel_width; kw++)
             {
-                for (int h = 0; h < height_col; h++)
+                int col = c * kernel_height * kernel_width + kh * kernel_width +
+                          kw;
+                int h = row_begin / width_col;
+                int w = row_begin % width_col;
+                for (int r = 0; r < nb_rows; r++)
                 {
-                    for (int w = 0; w < width_col; w++)
+                    int h_pad =
+                        h * stride_height + kh * dilation_height - pad_height;
+                    int w_pad =
+                        w * stride_width + kw * dilation_width - pad_width;
+                    tile(r, col) = (h_pad >= 0 && h_pad < in_height &&
+                                    w_pad >= 0 && w_pad < in_width)
+                                       ? Layout::at(input, c, h_pad, w_pad)
+                                       : 0.0f;
+                    if (++w == width_col)
                     {
-                        int h_pad = h * stride_height + kh * dilation_height -
-                                    pad_height;
-                        int w_pad =
-                            w * stride_width + kw * dilation_width - pad_width;
-                        if (h_pad >= 0 && h_pad < in_height && w_pad >= 0 &&
-                            w_pad < in_width)
-                        {
-                            output(h * width_col + w,
-                                   c * kernel_height * kernel_width +
-                                       kh * kernel_width + kw) =
-                                input(c, h_pad, w_pad);
-                        }
+                        w = 0;
+                        ++h;
                     }
                 }
             }
         }
     }
-
-    return output;
 }
 
-template <int in_channels, int out_channels, int kernel_height,
-          int kernel_width, int stride_height, int stride_width, int pad_height,
-          int pad_width, int dilation_height, int dilation_width>
-Eigen::Tensor3dXf conv2d(const Eigen::Tensor3dXf &x, const Eigen::Tensor4dXf &w,
-                         const Eigen::Tensor1dXf &b)
+// same for transposed convolutions, where row h * expanded_width + w holds
+// the input values that the taps scatter onto output position (h, w)
+template <int kernel_height, int kernel_width, int stride_height,
+          int stride_width, int pad_height, int pad_width, int dilation_height,
+          int dilation_width, typename Layout, typename Input>
+inline void im2col_transposed_tile(const Input &input, int expanded_width,
+                                   int row_begin, int nb_rows,
+                                   conv_tile &tile)
 {
-    int in_height = x.dimension(1);
-    int in_width = x.dimension(2);
+    int channels = Layout::channels(input);
+    int input_height = Layout::height(input);
+    int input_width = Layout::width(input);
 
-    // Calculate output dimensions with the correct application of ceil
-    int out_height =
-        static_cast<int>(std::ceil(
-            (float)(in_height + 2 * pad_height - (kernel_height - 1) - 1) /
-            stride_height)) +
-        1;
-    int out_width =
-        static_cast<int>(std::ceil(
-            (float)(in_width + 2 * pad_width - (kernel_width - 1) - 1) /
-            stride_width)) +
-        1;
+    for (int c = 0; c < channels; ++c)
+    {
+        for (int kh = 0; kh < kernel_height; ++kh)
+        {
+            for (int kw = 0; kw < kernel_width; ++kw)
+            {
+                int col = c * kernel_height * kernel_width + kh * kernel_width +
+                          kw;
+                int expanded_h = row_begin / expanded_width;
+                int expanded_w = row_begin % expanded_width;
+                for (int r = 0; r < nb_rows; ++r)
+                {
+                    // the input position landing here through this tap, if
+                    // any: expanded = in * stride + k * dilation - pad
+                    int h_num = expanded_h + pad_height - kh * dilation_height;
+                    int w_num = expanded_w + pad_width - kw * dilation_width;
+                    float value = 0.0f;
+                    if (h_num >= 0 && w_num >= 0 && h_num % stride_height == 0 &&
+                        w_num % stride_width == 0)
+                    {
+                        int h = h_num / stride_height;
+                        int w = w_num / stride_width;
+                        if (h < input_height && w < input_width)
+                        {
+                            value = Layout::at(input, c, h, w);
+                        }
+                    }
+                    tile(r, col) = value;
+                    if (++expanded_w == expanded_width)
+                    {
+                        expanded_w = 0;
+                        ++expanded_h;
+                    }
+                }
+            }
+        }
+    }
+}
 
-    // Apply im2col
-    Eigen::MatrixXf im2col_matrix =
-        im2col<kernel_height, kernel_width, stride_height, stride_width,
-               pad_height, pad_width, dilation_height, dilation_width>(x);
+// the weights in GEMM-ready form: (out_channels, in_channels * kernel_height *
+// kernel_width), with the columns in the same order as the im2col columns
+// this is done once at load time so the conv functions below can go straight
+// to the GEMM; the overloads taking the original tensors pack on every call
 
-    // Reshape weights
+// conv weights are stored as (Cout, Cin, Kh, Kw)
+inline Eigen::MatrixXf pack_conv_weight(const Eigen::Tensor4dXf &w)
+{
     // reverse last 3 axes (out chanel x in chan x kernel height x kernel width
     // -> out chan x (kernel width x kernel height x in chan))
     Eigen::Tensor4dXf w_swapped = w.shuffle(Eigen::array<int, 4>({0, 3, 2, 1}));
     // then flatten to the last axis
-    Eigen::Tensor2dXf reshaped_weights_tensor =
-        w_swapped.reshape(Eigen::array<int, 2>{
-            out_channels, in_channels * kernel_width * kernel_height});
-    Eigen::MatrixXf reshaped_weights = Eigen::Map<Eigen::MatrixXf>(
-        reshaped_weights_tensor.data(), reshaped_weights_tensor.dimension(0),
-        reshaped_weights_tensor.dimension(1));
-
-    // Perform matrix multiplication with GEMM
-    Eigen::MatrixXf result = im2col_matrix * reshaped_weights.transpose();
-
-    // Add bias to each column of the result matrix
-    for (int chout = 0; chout < out_channels; ++chout)
+    return Eigen::Map<Eigen::MatrixXf>(
+        w_swapped.data(), w.dimension(0),
+        w.dimension(1) * w.dimension(2) * w.dimension(3));
+}
+
+// 1d conv weights (Cout, Cin, K) are 2d weights with a trailing width of 1
+inline Eigen::MatrixXf pack_conv_weight(const Eigen::Tensor3dXf &w)
+{
+    return pack_conv_weight(Eigen::Tensor4dXf(w.reshape(Eigen::array<int, 4>{
+        {(int)w.dimension(0), (int)w.dimension(1), (int)w.dimension(2), 1}})));
+}
+
+// transpose weights are stored as (Cin, Cout, Kh, Kw) (not Cout, Cin, Kh, Kw)
+inline Eigen::MatrixXf pack_conv_tr_weight(const Eigen::Tensor4dXf &w)
+{
+    Eigen::Tensor4dXf w_swapped = w.shuffle(Eigen::array<int, 4>({1, 3, 2, 0}));
+    return Eigen::Map<Eigen::MatrixXf>(
+        w_swapped.data(), w.dimension(1),
+        w.dimension(0) * w.dimension(2) * w.dimension(3));
+}
+
+inline Eigen::MatrixXf pack_conv_tr_weight(const Eigen::Tensor3dXf &w)
+{
+    return pack_conv_tr_weight(
+        Eigen::Tensor4dXf(w.reshape(Eigen::array<int, 4>{
+            {(int)w.dimension(0), (int)w.dimension(1), (int)w.dimension(2),
+             1}})));
+}
+
+// the convs below write into a caller-provided destination (see output_view
+// in arena.hpp), and read any tensor or view in their input layout; the
+// overloads that return a new tensor wrap them
+
+// the 1x1 convs have no taps to gather, so instead of going through the
+// im2col tiles of implicit_gemm they multiply the weights with their input
+// in place: a (C, H, W) tensor, or a (W, C, H) one of width 1, is a
+// (channels, positions) matrix, which gemm_wx takes as it is, and a (W, C, H)
+// or (H, C, W) tensor is a (positions, channels) matrix per height or per
+// width, which gemm_nt takes as it is; the GEMM writes the output directly
+// when it is in the same form, and otherwise a tile that stays in cache for
+// the bias, the glu or the change of layout
+
+// whether a tensor holds the channels of each position next to each other
+template <typename Layout, typename Tensor>
+inline bool conv1x1_channels_major(const Tensor &t)
+{
+    if constexpr (std::is_same<Layout, chw_layout>::value)
     {
-        result.col(chout).array() += b(chout);
+        return true;
     }
+    else if constexpr (std::is_same<Layout, wch_layout>::value)
+    {
+        return Layout::width(t) == 1;
+    }
+    return false;
+}
 
-    // Reshape result to 3D output tensor
-    Eigen::Tensor3dXf y_out(out_channels, out_height, out_width);
-    y_out.setZero();
+// the layouts a 1x1 conv goes between without a copy: the same one, or the
+// (H, C, W) of the freq dconv to the (C, H, W) of the freq encoders
+template <typename InLayout, typename OutLayout>
+constexpr bool conv1x1_layouts =
+    std::is_same<InLayout, OutLayout>::value ||
+    (std::is_same<InLayout, hcw_layout>::value &&
+     std::is_same<OutLayout, chw_layout>::value);
+
+// y = w * x + b, or with fused_glu its glu along the channels, where w has
+// out_channels rows and y then has half as many channels
+template <int in_channels, int out_channels, bool fused_glu, typename InLayout,
+          typename OutLayout, typename Input, typename Output>
+void conv1x1_gemm(const Input &x, const gemm_weight &w,
+                  const Eigen::Tensor1dXf &b, Output &y)
+{
+    static_assert(conv1x1_layouts<InLayout, OutLayout>,
+                  "no in-place 1x1 conv between these layouts");
+    constexpr int y_channels = fused_glu ? out_channels / 2 : out_channels;
+
+    int height = InLayout::height(x);
+    int width = InLayout::width(x);
+    Eigen::Tensor3dXfMap y_out =
+        OutLayout::output(y, y_channels, height, width);
+    if (height * width == 0)
+    {
+        return;
+    }
 
-    for (int chout = 0; chout < out_channels; ++chout)
+    // the positions are cut into slices that are one matrix each (a single
+    // one when x is channels-major, in which case so is y), and a slice
+    // starts at the same position in x and y
+    bool x_channels_major = conv1x1_channels_major<InLayout>(x);
+    bool y_channels_major = conv1x1_channels_major<OutLayout>(y_out);
+    int slice_len = x_channels_major ? height * width
+                    : std::is_same<InLayout, wch_layout>::value ? width
+                                                                : height;
+    int nb_slices = height * width / slice_len;
+
+    // a tile is part of a slice, or when the slices are too short for the
+    // GEMM to run at full speed (the 8 freqs of the last freq encoder), a
+    // group of whole slices, which are gathered into one matrix first
+    int tile_rows = conv_tile_rows(in_channels);
+    int group = slice_len < GEMM_PANEL_ALIGN ? tile_rows / slice_len : 1;
+    int tile_len = group > 1 ? slice_len : std::min(slice_len, tile_rows);
+    int slice_tiles = (slice_len + tile_len - 1) / tile_len;
+    int nb_tiles = group > 1 ? (nb_slices + group - 1) / group
+                             : nb_slices * slice_tiles;
+    int nb_lanes =
+        in_worker_thread() ? 1 : std::min(get_num_threads(), nb_tiles);
+
+    Eigen::Map<const Eigen::VectorXf> bias(b.data(), out_channels);
+    using strided_map = Eigen::Map<Eigen::MatrixXf, 0, Eigen::OuterStride<>>;
+    using const_strided_map =
+        Eigen::Map<const Eigen::MatrixXf, 0, Eigen::OuterStride<>>;
+
+    // with several lanes each GEMM is serial, as in implicit_gemm
+    auto multiply_wx = [&](const auto &x_tile, auto &&result)
     {
-        for (int h = 0; h < out_height; ++h)
+        if (nb_lanes == 1)
         {
-            for (int w_ = 0; w_ < out_width; ++w_)
+            gemm_wx(w, x_tile, result);
+        }
+        else
+        {
+            gemm_wx_serial(w, 0, w.rows(), x_tile, result);
+        }
+    };
+    auto multiply_nt = [&](const auto &x_tile, auto &&result)
+    {
+        if (nb_lanes == 1)
+        {
+            gemm_nt(x_tile, w, result);
+        }
+        else
+        {
+            gemm_nt_serial(x_tile, w, 0, w.rows(), result);
+        }
+    };
+
+    demucscpp::parallel_for(
+        nb_lanes,
+        [&](int lane)
+        {
+            for (int t = lane; t < nb_tiles; t += nb_lanes)
             {
-                int row_idx = h * out_width + w_;
-                // Assign the value from the GEMM output to the output tensor
-                if (row_idx < result.rows())
+                // slices [first, first + nb) and their positions
+                // [begin, begin + len)
+                int first = group > 1 ? t * group : t / slice_tiles;
+                int nb = group > 1 ? std::min(group, nb_slices - first) : 1;
+                int begin = group > 1 ? 0 : t % slice_tiles * tile_len;
+                int len = std::min(tile_len, slice_len - begin);
+                int n = nb * len;
+                Eigen::Index position = (Eigen::Index)first * slice_len + begin;
+
+                if (x_channels_major)
                 {
-                    y_out(chout, h, w_) = result(row_idx, chout);
+                    // (channels, n) tiles of x and y
+                    Eigen::Map<const Eigen::MatrixXf> x_tile(
+                        x.data() + position * in_channels, in_channels, n);
+                    Eigen::Map<Eigen::MatrixXf> y_tile(
+                        y_out.data() + position * y_channels, y_channels, n);
+                    if constexpr (fused_glu)
+                    {
+                        conv_tile result =
+                            conv_tile_buffer(1).matrix(out_channels, n);
+                        multiply_wx(x_tile, result);
+                        for (int r = 0; r < n; ++r)
+                        {
+                            auto gates = result.col(r).tail(y_channels);
+                            gates += bias.tail(y_channels);
+                            sigmoid_inplace(gates.data(), y_channels);
+                            y_tile.col(r) = (result.col(r).head(y_channels) +
+                                             bias.head(y_channels))
+                                                .cwiseProduct(gates);
+                        }
+                    }
+                    else
+                    {
+                        multiply_wx(x_tile, y_tile);
+                        y_tile.colwise() += bias;
+                    }
+                    continue;
+                }
+
+                // the (len, channels) block of slice s in x, which is also
+                // the form of y when it is not channels-major
+                auto x_block = [&](int s)
+                {
+                    return const_strided_map(
+                        x.data() + (Eigen::Index)s * slice_len * in_channels +
+                            begin,
+                        len, in_channels, Eigen::OuterStride<>(slice_len));
+                };
+                auto y_block = [&](int s)
+                {
+                    return strided_map(
+                        y_out.data() +
+                            (Eigen::Index)s * slice_len * y_channels + begin,
+                        len, y_channels, Eigen::OuterStride<>(slice_len));
+                };
+
+                conv_tile result = conv_tile_buffer(1).matrix(n, out_channels);
+                if (nb == 1)
+                {
+                    if (!fused_glu && !y_channels_major)
+                    {
+                        auto y_tile = y_block(first);
+                        multiply_nt(x_block(first), y_tile);
+                        y_tile.rowwise() += bias.transpose();
+                        continue;
+                    }
+                    multiply_nt(x_block(first), result);
+                }
+                else
+                {
+                    conv_tile tile = conv_tile_buffer(0).matrix(n, in_channels);
+                    for (int s = 0; s < nb; ++s)
+                    {
+                        tile.middleRows(s * len, len) = x_block(first + s);
+                    }
+                    multiply_nt(tile, result);
                 }
-            }
-        }
-    }
 
-    return y_out;
+                if constexpr (fused_glu)
+                {
+                    for (int c = y_channels; c < out_channels; ++c)
+                    {
+                        result.col(c).array() += bias(c);
+                        sigmoid_inplace(result.col(c).data(), n);
+                    }
+                }
+                if (y_channels_major)
+                {
+                    // the change of layout, a position of y at a time
+                    Eigen::Map<Eigen::MatrixXf> y_tile(
+                        y_out.data() + position * y_channels, y_channels, n);
+                    for (int r = 0; r < n; ++r)
+                    {
+                        for (int c = 0; c < y_channels; ++c)
+                        {
+                            float value = result(r, c) + bias(c);
+                            if constexpr (fused_glu)
+                            {
+                                value *= result(r, c + y_channels);
+                            }
+                            y_tile(c, r) = value;
+                        }
+                    }
+                    continue;
+                }
+                for (int s = 0; s < nb; ++s)
+                {
+                    auto y_tile = y_block(first + s);
+                    auto rows = result.middleRows(s * len, len);
+                    if constexpr (fused_glu)
+                    {
+                        y_tile = (rows.leftCols(y_channels).rowwise() +
+                                  bias.head(y_channels).transpose())
+                                     .cwiseProduct(rows.rightCols(y_channels));
+                    }
+                    else
+                    {
+                        y_tile = rows.rowwise() + bias.transpose();
+                    }
+                }
+            }
+        });
 }
 
 template <int in_channels, int out_channels, int kernel_height,
           int kernel_width, int stride_height, int stride_width, int pad_height,
-          int pad_width, int dilation_height, int dilation_width>
-Eigen::Tensor3dXf conv2d_fused_gelu(const Eigen::Tensor3dXf &x,
-                                    const Eigen::Tensor4dXf &w,
-                                    const Eigen::Tensor1dXf &b)
+          int pad_width, int dilation_height, int dilation_width,
+          bool fused_gelu, typename InLayout, typename OutLayout,
+          typename Input, typename Output>
+void conv2d_gemm(const Input &x, const gemm_weight &w,
+                 const Eigen::Tensor1dXf &b, Output &y)
 {
-    int in_height = x.dimension(1);
-    int in_width = x.dimension(2);
+    if constexpr (kernel_height == 1 && kernel_width == 1 &&
+                  stride_height == 1 && stride_width == 1 && pad_height == 0 &&
+                  pad_width == 0 && !fused_gelu &&
+                  conv1x1_layouts<InLayout, OutLayout>)
+    {
+        conv1x1_gemm<in_channels, out_channels, false, InLayout, OutLayout>(
+            x, w, b, y);
+        return;
+    }
+
+    int in_height = InLayout::height(x);
+    int in_width = InLayout::width(x);
 
     // Calculate output dimensions with the correct application of ceil
     int out_height =
@@ -160,317 +546,443 @@ Eigen::Tensor3dXf conv2d_fused_gelu(const Eigen::Tensor3dXf &x,
             stride_width)) +
         1;
 
-    // Apply im2col
-    Eigen::MatrixXf im2col_matrix =
-        im2col<kernel_height, kernel_width, stride_height, stride_width,
-               pad_height, pad_width, dilation_height, dilation_width>(x);
+    // the im2col dimensions also account for the dilation, so with dilation
+    // there are fewer of them than output positions, and the rest stay zero
+    int height_col =
+        static_cast<int>(std::ceil((in_height + 2 * pad_height -
+                                    dilation_height * (kernel_height - 1) - 1) /
+                                   float(stride_height)) +
+                         1);
+    int width_col =
+        static_cast<int>(std::ceil((in_width + 2 * pad_width -
+                                    dilation_width * (kernel_width - 1) - 1) /
+                                   float(stride_width)) +
+                         1);
 
-    // Reshape weights
-    // reverse last 3 axes (out chanel x in chan x kernel height x kernel width
-    // -> out chan x (kernel width x kernel height x in chan))
-    Eigen::Tensor4dXf w_swapped = w.shuffle(Eigen::array<int, 4>({0, 3, 2, 1}));
-    // then flatten to the last axis
-    Eigen::Tensor2dXf reshaped_weights_tensor =
-        w_swapped.reshape(Eigen::array<int, 2>{
-            out_channels, in_channels * kernel_width * kernel_height});
-    Eigen::MatrixXf reshaped_weights = Eigen::Map<Eigen::MatrixXf>(
-        reshaped_weights_tensor.data(), reshaped_weights_tensor.dimension(0),
-        reshaped_weights_tensor.dimension(1));
-
-    // Perform matrix multiplication with GEMM
-    Eigen::MatrixXf result = im2col_matrix * reshaped_weights.transpose();
-
-    // Add bias to each column of the result matrix
-    for (int chout = 0; chout < out_channels; ++chout)
-    {
-        result.col(chout).array() += b(chout);
-    }
+    Eigen::Tensor3dXfMap y_out =
+        OutLayout::output(y, out_channels, out_height, out_width);
 
-    // Reshape result to 3D output tensor
-    Eigen::Tensor3dXf y_out(out_channels, out_height, out_width);
-    y_out.setZero();
+    int nb_rows = std::min(height_col * width_col, out_height * out_width);
 
-    for (int chout = 0; chout < out_channels; ++chout)
-    {
-        for (int h = 0; h < out_height; ++h)
+    // the weights are already in im2col column order (see pack_conv_weight)
+    implicit_gemm(
+        nb_rows, w,
+        [&](int row_begin, int n, conv_tile &tile)
+        {
+            im2col_tile<kernel_height, kernel_width, stride_height,
+                        stride_width, pad_height, pad_width, dilation_height,
+                        dilation_width, InLayout>(x, width_col, row_begin, n,
+                                                  tile);
+        },
+        [&](int row_begin, int n, conv_tile &result)
         {
-            for (int w_ = 0; w_ < out_width; ++w_)
+            // the bias and the gelu, a channel of n rows at a time
+            if constexpr (fused_gelu)
+            {
+                for (int chout = 0; chout < out_channels; ++chout)
+                {
+                    result.col(chout).head(n).array() += b(chout);
+                    gelu_inplace(result.col(chout).data(), n);
+                }
+            }
+
+            int h = row_begin / out_width;
+            int w_ = row_begin % out_width;
+            for (int r = 0; r < n; ++r)
             {
-                int row_idx = h * out_width + w_;
-                // Assign the value from the GEMM output to the output tensor
-                // with gelu
-                float value = result(row_idx, chout);
-                float activated_value =
-                    0.5f * value * (1.0f + std::erf(value / std::sqrt(2.0f)));
-                // Assign the activated value to the output tensor
-                y_out(chout, h, w_) = activated_value;
+                for (int chout = 0; chout < out_channels; ++chout)
+                {
+                    // Add bias to the GEMM output
+                    float value = fused_gelu ? result(r, chout)
+                                             : result(r, chout) + b(chout);
+                    OutLayout::at(y_out, chout, h, w_) = value;
+                }
+                if (++w_ == out_width)
+                {
+                    w_ = 0;
+                    ++h;
+                }
             }
+        });
+
+    for (int row = nb_rows; row < out_height * out_width; ++row)
+    {
+        for (int chout = 0; chout < out_channels; ++chout)
+        {
+            OutLayout::at(y_out, chout, row / out_width, row % out_width) =
+                0.0f;
         }
     }
-
-    return y_out;
 }
 
-template <int in_channels, int out_channels, int kernel_size, int stride,
-          int pad, int dilation>
-Eigen::Tensor3dXf conv1d(const Eigen::Tensor3dXf &x, const Eigen::Tensor3dXf &w,
-                         const Eigen::Tensor1dXf &b)
+template <int in_channels, int out_channels, int kernel_height,
+          int kernel_width, int stride_height, int stride_width, int pad_height,
+          int pad_width, int dilation_height, int dilation_width,
+          typename InLayout = chw_layout, typename OutLayout = chw_layout,
+          typename Input, typename Output>
+void conv2d(const Input &x, const gemm_weight &w, const Eigen::Tensor1dXf &b,
+            Output &y)
 {
-    // copy w into a 4d tensor with trailing (,1) dimension
-    Eigen::Tensor4dXf w_4d = w.reshape(Eigen::array<int, 4>{
-        {(int)w.dimension(0), (int)w.dimension(1), (int)w.dimension(2), 1}});
-
-    // move 0 axis to the end
-    Eigen::Tensor3dXf x_shuff = x.shuffle(Eigen::array<int, 3>({1, 2, 0}));
-
-    // do 2d convolution inference here
-    // treating the in_freq dimension as a width dimension with a no-op kernel
-    Eigen::Tensor3dXf y_out =
-        demucscpp::conv2d<in_channels, out_channels, kernel_size, 1, stride, 1,
-                          pad, 0, dilation, 1>(x_shuff, w_4d, b);
+    conv2d_gemm<in_channels, out_channels, kernel_height, kernel_width,
+                stride_height, stride_width, pad_height, pad_width,
+                dilation_height, dilation_width, false, InLayout, OutLayout>(
+        x, w, b, y);
+}
 
-    // move end axis to the front
-    Eigen::Tensor3dXf y_out_shuf =
-        y_out.shuffle(Eigen::array<int, 3>({2, 0, 1}));
-    return y_out_shuf;
+template <int in_channels, int out_channels, int kernel_height,
+          int kernel_width, int stride_height, int stride_width, int pad_height,
+          int pad_width, int dilation_height, int dilation_width,
+          typename InLayout = chw_layout, typename OutLayout = chw_layout,
+          typename Input, typename Output>
+void conv2d_fused_gelu(const Input &x, const gemm_weight &w,
+                       const Eigen::Tensor1dXf &b, Output &y)
+{
+    conv2d_gemm<in_channels, out_channels, kernel_height, kernel_width,
+                stride_height, stride_width, pad_height, pad_width,
+                dilation_height, dilation_width, true, InLayout, OutLayout>(
+        x, w, b, y);
 }
 
+// a 1d conv along the last axis of (W, C, H) tensors is a 2d conv with a
+// kernel width of 1
 template <int in_channels, int out_channels, int kernel_size, int stride,
-          int pad, int dilation>
-Eigen::Tensor3dXf conv1d_fused_gelu(const Eigen::Tensor3dXf &x,
-                                    const Eigen::Tensor3dXf &w,
-                                    const Eigen::Tensor1dXf &b)
+          int pad, int dilation, typename Input, typename Output>
+void conv1d(const Input &x, const gemm_weight &w, const Eigen::Tensor1dXf &b,
+            Output &y)
 {
-    // copy w into a 4d tensor with trailing (,1) dimension
-    Eigen::Tensor4dXf w_4d = w.reshape(Eigen::array<int, 4>{
-        {(int)w.dimension(0), (int)w.dimension(1), (int)w.dimension(2), 1}});
-
-    // move 0 axis to the end
-    Eigen::Tensor3dXf x_shuff = x.shuffle(Eigen::array<int, 3>({1, 2, 0}));
-
-    // do 2d convolution inference here
-    // treating the in_freq dimension as a width dimension with a no-op kernel
-    Eigen::Tensor3dXf y_out =
-        demucscpp::conv2d_fused_gelu<in_channels, out_channels, kernel_size, 1,
-                                     stride, 1, pad, 0, dilation, 1>(x_shuff,
-                                                                     w_4d, b);
+    conv2d_gemm<in_channels, out_channels, kernel_size, 1, stride, 1, pad, 0,
+                dilation, 1, false, wch_layout, wch_layout>(x, w, b, y);
+}
 
-    // move end axis to the front
-    Eigen::Tensor3dXf y_out_shuf =
-        y_out.shuffle(Eigen::array<int, 3>({2, 0, 1}));
-    return y_out_shuf;
+template <int in_channels, int out_channels, int kernel_size, int stride,
+          int pad, int dilation, typename Input, typename Output>
+void conv1d_fused_gelu(const Input &x, const gemm_weight &w,
+                       const Eigen::Tensor1dXf &b, Output &y)
+{
+    conv2d_gemm<in_channels, out_channels, kernel_size, 1, stride, 1, pad, 0,
+                dilation, 1, true, wch_layout, wch_layout>(x, w, b, y);
 }
 
-template <int kernel_height, int kernel_width, int stride_height,
-          int stride_width, int pad_height, int pad_width, int dilation_height,
-          int dilation_width>
-Eigen::MatrixXf im2col_transposed(const Eigen::Tensor3dXf &input)
+template <int in_channels, int out_channels, int kernel_height,
+          int kernel_width, int stride_height, int stride_width, int pad_height,
+          int pad_width, int dilation_height, int dilation_width,
+          bool fused_gelu, typename InLayout, typename OutLayout,
+          typename Input, typename Output>
+void conv2d_tr_gemm(const Input &x, const gemm_weight &w,
+                    const Eigen::Tensor1dXf &b, Output &y)
 {
-    int channels = input.dimension(0);
-    int input_height = input.dimension(1);
-    int input_width = input.dimension(2);
+    int in_height = InLayout::height(x);
+    int in_width = InLayout::width(x);
 
-    // Calculate the effective kernel size after dilation
     int effective_kernel_height =
         kernel_height + (kernel_height - 1) * (dilation_height - 1);
     int effective_kernel_width =
         kernel_width + (kernel_width - 1) * (dilation_width - 1);
 
-    // Calculate the expanded output height and width considering dilation
-    int expanded_height =
-        (input_height - 1) * stride_height + effective_kernel_height;
-    int expanded_width =
-        (input_width - 1) * stride_width + effective_kernel_width;
+    int out_height = (in_height - 1) * stride_height + effective_kernel_height -
+                     2 * pad_height;
+    int out_width =
+        (in_width - 1) * stride_width + effective_kernel_width - 2 * pad_width;
 
-    // Initialize the output matrix
-    Eigen::MatrixXf output =
-        Eigen::MatrixXf::Zero(expanded_height * expanded_width,
-                              channels * kernel_height * kernel_width);
+    // width of the output before removing the padding
+    int expanded_width = (in_width - 1) * stride_width + effective_kernel_width;
 
-    // Populate the output matrix
-    for (int c = 0; c < channels; ++c)
-    {
-        for (int kh = 0; kh < kernel_height; ++kh)
+    Eigen::Tensor3dXfMap y_out =
+        OutLayout::output(y, out_channels, out_height, out_width);
+
+    // the weights are already in im2col column order (see
+    // pack_conv_tr_weight); every output position is a row, so each is
+    // written exactly once
+    implicit_gemm(
+        out_height * out_width, w,
+        [&](int row_begin, int n, conv_tile &tile)
         {
-            for (int kw = 0; kw < kernel_width; ++kw)
+            im2col_transposed_tile<kernel_height, kernel_width, stride_height,
+                                   stride_width, pad_height, pad_width,
+                                   dilation_height, dilation_width, InLayout>(
+                x, expanded_width, row_begin, n, tile);
+        },
+        [&](int row_begin, int n, conv_tile &result)
+        {
+            // the bias and the gelu, a channel of n rows at a time
+            if constexpr (fused_gelu)
             {
-                for (int h = 0; h < input_height; ++h)
+                for (int ch = 0; ch < out_channels; ++ch)
                 {
-                    for (int w = 0; w < input_width; ++w)
-                    {
-                        // Adjust calculation for dilation
-                        int expanded_h = h * stride_height +
-                                         (kh * dilation_height) - pad_height;
-                        int expanded_w = w * stride_width +
-                                         (kw * dilation_width) - pad_width;
-
-                        // Check if the indices are within the bounds of the
-                        // expanded output
-                        if (expanded_h >= 0 && expanded_h < expanded_height &&
-                            expanded_w >= 0 && expanded_w < expanded_width)
-                        {
-                            int col_index =
-                                expanded_h * expanded_width + expanded_w;
-                            int row_index = c * kernel_height * kernel_width +
-                                            kh * kernel_width + kw;
-                            output(col_index, row_index) = input(c, h, w);
-                        }
-                    }
+                    result.col(ch).head(n).array() += b(ch);
+                    gelu_inplace(result.col(ch).data(), n);
                 }
             }
-        }
-    }
 
-    return output;
+            int h = row_begin / out_width;
+            int w_ = row_begin % out_width;
+            for (int r = 0; r < n; ++r)
+            {
+                for (int ch = 0; ch < out_channels; ++ch)
+                {
+                    // Add bias to the GEMM output
+                    float value =
+                        fused_gelu ? result(r, ch) : result(r, ch) + b(ch);
+                    OutLayout::at(y_out, ch, h, w_) = value;
+                }
+                if (++w_ == out_width)
+                {
+                    w_ = 0;
+                    ++h;
+                }
+            }
+        });
 }
 
 template <int in_channels, int out_channels, int kernel_height,
           int kernel_width, int stride_height, int stride_width, int pad_height,
-          int pad_width, int dilation_height, int dilation_width>
-Eigen::Tensor3dXf conv2d_tr(const Eigen::Tensor3dXf &x,
-                            const Eigen::Tensor4dXf &w,
-                            const Eigen::Tensor1dXf &b)
+          int pad_width, int dilation_height, int dilation_width,
+          typename InLayout = chw_layout, typename OutLayout = chw_layout,
+          typename Input, typename Output>
+void conv2d_tr(const Input &x, const gemm_weight &w,
+               const Eigen::Tensor1dXf &b, Output &y)
 {
-    int in_height = x.dimension(1);
-    int in_width = x.dimension(2);
+    conv2d_tr_gemm<in_channels, out_channels, kernel_height, kernel_width,
+                   stride_height, stride_width, pad_height, pad_width,
+                   dilation_height, dilation_width, false, InLayout,
+                   OutLayout>(x, w, b, y);
+}
 
-    int effective_kernel_height =
-        kernel_height + (kernel_height - 1) * (dilation_height - 1);
-    int effective_kernel_width =
-        kernel_width + (kernel_width - 1) * (dilation_width - 1);
+template <int in_channels, int out_channels, int kernel_height,
+          int kernel_width, int stride_height, int stride_width, int pad_height,
+          int pad_width, int dilation_height, int dilation_width,
+          typename InLayout = chw_layout, typename OutLayout = chw_layout,
+          typename Input, typename Output>
+void conv2d_tr_fused_gelu(const Input &x, const gemm_weight &w,
+                          const Eigen::Tensor1dXf &b, Output &y)
+{
+    conv2d_tr_gemm<in_channels, out_channels, kernel_height, kernel_width,
+                   stride_height, stride_width, pad_height, pad_width,
+                   dilation_height, dilation_width, true, InLayout,
+                   OutLayout>(x, w, b, y);
+}
 
-    int out_height = (in_height - 1) * stride_height + effective_kernel_height -
-                     2 * pad_height;
-    int out_width =
-        (in_width - 1) * stride_width + effective_kernel_width - 2 * pad_width;
+template <int in_channels, int out_channels, int kernel_size, int stride,
+          int pad, int dilation, typename Input, typename Output>
+void conv1d_tr(const Input &x, const gemm_weight &w,
+               const Eigen::Tensor1dXf &b, Output &y)
+{
+    conv2d_tr_gemm<in_channels, out_channels, kernel_size, 1, stride, 1, pad,
+                   0, dilation, 1, false, wch_layout, wch_layout>(x, w, b, y);
+}
 
-    //  Apply an adapted im2col for transposed convolution
-    Eigen::MatrixXf im2col_matrix =
-        im2col_transposed<kernel_height, kernel_width, stride_height,
-                          stride_width, pad_height, pad_width, dilation_height,
-                          dilation_width>(x);
-
-    //  Reshape and prepare the weights as in conv2d_gemm
-    //  keeping in mind transpose weights are stored as (Cin, Cout, Kh, Kw) (not
-    //  Cout, Cin, Kh, Kw)
-    Eigen::Tensor4dXf w_swapped = w.shuffle(Eigen::array<int, 4>(
-        {1, 3, 2, 0})); // Note the change in the shuffle order
-    Eigen::Tensor2dXf reshaped_weights_tensor =
-        w_swapped.reshape(Eigen::array<int, 2>{
-            out_channels, in_channels * kernel_height * kernel_width});
-    Eigen::MatrixXf reshaped_weights = Eigen::Map<Eigen::MatrixXf>(
-        reshaped_weights_tensor.data(), reshaped_weights_tensor.dimension(0),
-        reshaped_weights_tensor.dimension(1));
-
-    // Perform matrix multiplication with GEMM
-    Eigen::MatrixXf result = im2col_matrix * reshaped_weights.transpose();
-
-    // Add bias to result
-    for (int chout = 0; chout < out_channels; ++chout)
-    {
-        result.col(chout).array() += b(chout);
-    }
+template <int in_channels, int out_channels, int kernel_size, int stride,
+          int pad, int dilation, typename Input, typename Output>
+void conv1d_tr_fused_gelu(const Input &x, const gemm_weight &w,
+                          const Eigen::Tensor1dXf &b, Output &y)
+{
+    conv2d_tr_gemm<in_channels, out_channels, kernel_size, 1, stride, 1, pad,
+                   0, dilation, 1, true, wch_layout, wch_layout>(x, w, b, y);
+}
 
-    Eigen::Tensor3dXf y_out(out_channels, out_height, out_width);
-    y_out.setZero();
+// a 1x1 conv, which conv1d and conv2d also turn into when they can
+template <int in_channels, int out_channels, typename InLayout = wch_layout,
+          typename OutLayout = wch_layout, typename Input, typename Output>
+void conv1x1(const Input &x, const gemm_weight &w, const Eigen::Tensor1dXf &b,
+             Output &y)
+{
+    conv1x1_gemm<in_channels, out_channels, false, InLayout, OutLayout>(x, w,
+                                                                        b, y);
+}
 
-    // Reshape and sum up the contributions to the output
-    for (int ch = 0; ch < out_channels; ++ch)
-    {
-        for (int h = 0; h < out_height; ++h)
-        {
-            for (int w_ = 0; w_ < out_width; ++w_)
-            {
-                // Calculate the linear index in the GEMM result corresponding
-                // to this output location
-                int gemm_row = h * out_width + w_;
-                int gemm_col = ch;
+// a 1x1 conv followed by a glu along the channels, as the rewrites of the
+// encoders are, so y has out_channels / 2 channels
+template <int in_channels, int out_channels, typename InLayout = wch_layout,
+          typename OutLayout = wch_layout, typename Input, typename Output>
+void conv1x1_glu(const Input &x, const gemm_weight &w,
+                 const Eigen::Tensor1dXf &b, Output &y)
+{
+    conv1x1_gemm<in_channels, out_channels, true, InLayout, OutLayout>(x, w, b,
+                                                                       y);
+}
 
-                // Assign the value from the GEMM result to the output tensor
-                y_out(ch, h, w_) += result(gemm_row, gemm_col);
-            }
-        }
-    }
+// the same, returning a new tensor
+
+template <int in_channels, int out_channels, int kernel_height,
+          int kernel_width, int stride_height, int stride_width, int pad_height,
+          int pad_width, int dilation_height, int dilation_width>
+Eigen::Tensor3dXf conv2d(const Eigen::Tensor3dXf &x, const gemm_weight &w,
+                         const Eigen::Tensor1dXf &b)
+{
+    Eigen::Tensor3dXf y;
+    conv2d<in_channels, out_channels, kernel_height, kernel_width,
+           stride_height, stride_width, pad_height, pad_width, dilation_height,
+           dilation_width>(x, w, b, y);
+    return y;
+}
 
-    return y_out;
+template <int in_channels, int out_channels, int kernel_height,
+          int kernel_width, int stride_height, int stride_width, int pad_height,
+          int pad_width, int dilation_height, int dilation_width>
+Eigen::Tensor3dXf conv2d_fused_gelu(const Eigen::Tensor3dXf &x,
+                                    const gemm_weight &w,
+                                    const Eigen::Tensor1dXf &b)
+{
+    Eigen::Tensor3dXf y;
+    conv2d_fused_gelu<in_channels, out_channels, kernel_height, kernel_width,
+                      stride_height, stride_width, pad_height, pad_width,
+                      dilation_height, dilation_width>(x, w, b, y);
+    return y;
+}
+
+template <int in_channels, int out_channels, int kernel_height,
+          int kernel_width, int stride_height, int stride_width, int pad_height,
+          int pad_width, int dilation_height, int dilation_width>
+Eigen::Tensor3dXf conv2d_tr(const Eigen::Tensor3dXf &x, const gemm_weight &w,
+                            const Eigen::Tensor1dXf &b)
+{
+    Eigen::Tensor3dXf y;
+    conv2d_tr<in_channels, out_channels, kernel_height, kernel_width,
+              stride_height, stride_width, pad_height, pad_width,
+              dilation_height, dilation_width>(x, w, b, y);
+    return y;
 }
 
 template <int in_channels, int out_channels, int kernel_height,
           int kernel_width, int stride_height, int stride_width, int pad_height,
           int pad_width, int dilation_height, int dilation_width>
 Eigen::Tensor3dXf conv2d_tr_fused_gelu(const Eigen::Tensor3dXf &x,
-                                       const Eigen::Tensor4dXf &w,
+                                       const gemm_weight &w,
                                        const Eigen::Tensor1dXf &b)
 {
-    int in_height = x.dimension(1);
-    int in_width = x.dimension(2);
+    Eigen::Tensor3dXf y;
+    conv2d_tr_fused_gelu<in_channels, out_channels, kernel_height, kernel_width,
+                         stride_height, stride_width, pad_height, pad_width,
+                         dilation_height, dilation_width>(x, w, b, y);
+    return y;
+}
 
-    int effective_kernel_height =
-        kernel_height + (kernel_height - 1) * (dilation_height - 1);
-    int effective_kernel_width =
-        kernel_width + (kernel_width - 1) * (dilation_width - 1);
+template <int in_channels, int out_channels, int kernel_size, int stride,
+          int pad, int dilation>
+Eigen::Tensor3dXf conv1d(const Eigen::Tensor3dXf &x, const gemm_weight &w,
+                         const Eigen::Tensor1dXf &b)
+{
+    Eigen::Tensor3dXf y;
+    conv1d<in_channels, out_channels, kernel_size, stride, pad,
+           dilation>(x, w, b, y);
+    return y;
+}
 
-    int out_height = (in_height - 1) * stride_height + effective_kernel_height -
-                     2 * pad_height;
-    int out_width =
-        (in_width - 1) * stride_width + effective_kernel_width - 2 * pad_width;
+template <int in_channels, int out_channels, int kernel_size, int stride,
+          int pad, int dilation>
+Eigen::Tensor3dXf conv1d_fused_gelu(const Eigen::Tensor3dXf &x,
+                                    const gemm_weight &w,
+                                    const Eigen::Tensor1dXf &b)
+{
+    Eigen::Tensor3dXf y;
+    conv1d_fused_gelu<in_channels, out_channels, kernel_size, stride, pad,
+                      dilation>(x, w, b, y);
+    return y;
+}
 
-    //  Apply an adapted im2col for transposed convolution
-    Eigen::MatrixXf im2col_matrix =
-        im2col_transposed<kernel_height, kernel_width, stride_height,
-                          stride_width, pad_height, pad_width, dilation_height,
-                          dilation_width>(x);
-
-    //  Reshape and prepare the weights as in conv2d_gemm
-    //  keeping in mind transpose weights are stored as (Cin, Cout, Kh, Kw) (not
-    //  Cout, Cin, Kh, Kw)
-    Eigen::Tensor4dXf w_swapped = w.shuffle(Eigen::array<int, 4>(
-        {1, 3, 2, 0})); // Note the change in the shuffle order
-    Eigen::Tensor2dXf reshaped_weights_tensor =
-        w_swapped.reshape(Eigen::array<int, 2>{
-            out_channels, in_channels * kernel_height * kernel_width});
-    Eigen::MatrixXf reshaped_weights = Eigen::Map<Eigen::MatrixXf>(
-        reshaped_weights_tensor.data(), reshaped_weights_tensor.dimension(0),
-        reshaped_weights_tensor.dimension(1));
-
-    // Perform matrix multiplication with GEMM
-    Eigen::MatrixXf result = im2col_matrix * reshaped_weights.transpose();
-
-    // Add bias to result
-    for (int chout = 0; chout < out_channels; ++chout)
-    {
-        result.col(chout).array() += b(chout);
-    }
+template <int in_channels, int out_channels, int kernel_size, int stride,
+          int pad, int dilation>
+Eigen::Tensor3dXf conv1d_tr(const Eigen::Tensor3dXf &x, const gemm_weight &w,
+                            const Eigen::Tensor1dXf &b)
+{
+    Eigen::Tensor3dXf y;
+    conv1d_tr<in_channels, out_channels, kernel_size, stride, pad,
+              dilation>(x, w, b, y);
+    return y;
+}
 
-    Eigen::Tensor3dXf y_out(out_channels, out_height, out_width);
-    y_out.setZero();
+template <int in_channels, int out_channels, int kernel_size, int stride,
+          int pad, int dilation>
+Eigen::Tensor3dXf conv1d_tr_fused_gelu(const Eigen::Tensor3dXf &x,
+                                       const gemm_weight &w,
+                                       const Eigen::Tensor1dXf &b)
+{
+    Eigen::Tensor3dXf y;
+    conv1d_tr_fused_gelu<in_channels, out_channels, kernel_size, stride, pad,
+                         dilation>(x, w, b, y);
+    return y;
+}
 
-    // Reshape and sum up the contributions to the output
-    for (int ch = 0; ch < out_channels; ++ch)
-    {
-        for (int h = 0; h < out_height; ++h)
-        {
-            for (int w_ = 0; w_ < out_width; ++w_)
-            {
-                // Calculate the linear index in the GEMM result corresponding
-                // to this output location
-                int gemm_row = h * out_width + w_;
-                int gemm_col = ch;
+// with the original weight tensors, which are packed on every call
 
-                // Compute the value from the GEMM result
-                float value = result(gemm_row, gemm_col);
+template <int in_channels, int out_channels, int kernel_height,
+          int kernel_width, int stride_height, int stride_width, int pad_height,
+          int pad_width, int dilation_height, int dilation_width>
+Eigen::Tensor3dXf conv2d(const Eigen::Tensor3dXf &x, const Eigen::Tensor4dXf &w,
+                         const Eigen::Tensor1dXf &b)
+{
+    Eigen::Tensor3dXf y;
+    conv2d<in_channels, out_channels, kernel_height, kernel_width,
+           stride_height, stride_width, pad_height, pad_width, dilation_height,
+           dilation_width>(x, pack_conv_weight(w), b, y);
+    return y;
+}
 
-                // Apply GeLU activation
-                float activated_value =
-                    0.5f * value * (1.0f + std::erf(value / std::sqrt(2.0f)));
+template <int in_channels, int out_channels, int kernel_height,
+          int kernel_width, int stride_height, int stride_width, int pad_height,
+          int pad_width, int dilation_height, int dilation_width>
+Eigen::Tensor3dXf conv2d_fused_gelu(const Eigen::Tensor3dXf &x,
+                                    const Eigen::Tensor4dXf &w,
+                                    const Eigen::Tensor1dXf &b)
+{
+    Eigen::Tensor3dXf y;
+    conv2d_fused_gelu<in_channels, out_channels, kernel_height, kernel_width,
+                      stride_height, stride_width, pad_height, pad_width,
+                      dilation_height,
+                      dilation_width>(x, pack_conv_weight(w), b, y);
+    return y;
+}
 
-                // Assign the activated value to the output tensor
-                y_out(ch, h, w_) += activated_value;
-            }
-        }
-    }
+template <int in_channels, int out_channels, int kernel_height,
+          int kernel_width, int stride_height, int stride_width, int pad_height,
+          int pad_width, int dilation_height, int dilation_width>
+Eigen::Tensor3dXf conv2d_tr(const Eigen::Tensor3dXf &x,
+                            const Eigen::Tensor4dXf &w,
+                            const Eigen::Tensor1dXf &b)
+{
+    Eigen::Tensor3dXf y;
+    conv2d_tr<in_channels, out_channels, kernel_height, kernel_width,
+              stride_height, stride_width, pad_height, pad_width,
+              dilation_height, dilation_width>(x, pack_conv_tr_weight(w), b, y);
+    return y;
+}
+
+template <int in_channels, int out_channels, int kernel_height,
+          int kernel_width, int stride_height, int stride_width, int pad_height,
+          int pad_width, int dilation_height, int dilation_width>
+Eigen::Tensor3dXf conv2d_tr_fused_gelu(const Eigen::Tensor3dXf &x,
+                                       const Eigen::Tensor4dXf &w,
+                                       const Eigen::Tensor1dXf &b)
+{
+    Eigen::Tensor3dXf y;
+    conv2d_tr_fused_gelu<in_channels, out_channels, kernel_height, kernel_width,
+                         stride_height, stride_width, pad_height, pad_width,
+                         dilation_height,
+                         dilation_width>(x, pack_conv_tr_weight(w), b, y);
+    return y;
+}
+
+template <int in_channels, int out_channels, int kernel_size, int stride,
+          int pad, int dilation>
+Eigen::Tensor3dXf conv1d(const Eigen::Tensor3dXf &x, const Eigen::Tensor3dXf &w,
+                         const Eigen::Tensor1dXf &b)
+{
+    Eigen::Tensor3dXf y;
+    conv1d<in_channels, out_channels, kernel_size, stride, pad,
+           dilation>(x, pack_conv_weight(w), b, y);
+    return y;
+}
 
-    return y_out;
+template <int in_channels, int out_channels, int kernel_size, int stride,
+          int pad, int dilation>
+Eigen::Tensor3dXf conv1d_fused_gelu(const Eigen::Tensor3dXf &x,
+                                    const Eigen::Tensor3dXf &w,
+                                    const Eigen::Tensor1dXf &b)
+{
+    Eigen::Tensor3dXf y;
+    conv1d_fused_gelu<in_channels, out_channels, kernel_size, stride, pad,
+                      dilation>(x, pack_conv_weight(w), b, y);
+    return y;
 }
 
 template <int in_channels, int out_channels, int kernel_size, int stride,
@@ -479,23 +991,10 @@ Eigen::Tensor3dXf conv1d_tr(const Eigen::Tensor3dXf &x,
                             const Eigen::Tensor3dXf &w,
                             const Eigen::Tensor1dXf &b)
 {
-    // Convert 1D convolution to 2D convolution by adding an extra dimension
-    Eigen::Tensor4dXf w_4d = w.reshape(Eigen::array<int, 4>{
-        {(int)w.dimension(0), (int)w.dimension(1), (int)w.dimension(2), 1}});
-
-    // Move 0 axis to the end
-    Eigen::Tensor3dXf x_shuff = x.shuffle(Eigen::array<int, 3>({1, 2, 0}));
-
-    // Call the 2D transposed convolution function
-    Eigen::Tensor3dXf y_out =
-        conv2d_tr<in_channels, out_channels, kernel_size, 1, stride, 1, pad, 0,
-                  dilation, 1>(x_shuff, w_4d, b);
-
-    // Move end axis to the front
-    Eigen::Tensor3dXf y_out_shuf =
-        y_out.shuffle(Eigen::array<int, 3>({2, 0, 1}));
-
-    return y_out_shuf;
+    Eigen::Tensor3dXf y;
+    conv1d_tr<in_channels, out_channels, kernel_size, stride, pad,
+              dilation>(x, pack_conv_tr_weight(w), b, y);
+    return y;
 }
 
 template <int in_channels, int out_channels, int kernel_size, int stride,
@@ -504,23 +1003,10 @@ Eigen::Tensor3dXf conv1d_tr_fused_gelu(const Eigen::Tensor3dXf &x,
                                        const Eigen::Tensor3dXf &w,
                                        const Eigen::Tensor1dXf &b)
 {
-    // Convert 1D convolution to 2D convolution by adding an extra dimension
-    Eigen::Tensor4dXf w_4d = w.reshape(Eigen::array<int, 4>{
-        {(int)w.dimension(0), (int)w.dimension(1), (int)w.dimension(2), 1}});
-
-    // Move 0 axis to the end
-    Eigen::Tensor3dXf x_shuff = x.shuffle(Eigen::array<int, 3>({1, 2, 0}));
-
-    // Call the 2D transposed convolution function
-    Eigen::Tensor3dXf y_out =
-        conv2d_tr_fused_gelu<in_channels, out_channels, kernel_size, 1, stride,
-                             1, pad, 0, dilation, 1>(x_shuff, w_4d, b);
-
-    // Move end axis to the front
-    Eigen::Tensor3dXf y_out_shuf =
-        y_out.shuffle(Eigen::array<int, 3>({2, 0, 1}));
-
-    return y_out_shuf;
+    Eigen::Tensor3dXf y;
+    conv1d_tr_fused_gelu<in_channels, out_channels, kernel_size, stride, pad,
+                         dilation>(x, pack_conv_tr_weight(w), b, y);
+    return y;
 }
 
 } // namespace demucscpp
@@ -1,6 +1,7 @@
 #include "crosstransformer.hpp"
 #include "layers.hpp"
 #include "model.hpp"
+#include "profiler.hpp"
 #include "tensor.hpp"
 #include <Eigen/Dense>
 
@@ -76,11 +77,42 @@ static Eigen::Tensor3dXf create_sin_embedding(int length, int dim,
     return pos_emb;
 }
 
+void demucscpp::init_positional_embeddings(
+    struct demucscpp::crosstransformer_base &ct)
+{
+    const int channels = ct.crosstransformer_norm_in_weight.dimension(0);
+    const int freq = 8;
+
+    Eigen::Tensor3dXf pos_embed_2d_pre_reshape =
+        create_2d_sin_embedding(channels, freq, FREQ_BRANCH_LEN);
+
+    // pos_embed = rearrange(pos_embed, "b c fr t1 -> b (t1 fr) c"), as x
+    ct.pos_embed_2d.resize(1, freq * FREQ_BRANCH_LEN, channels);
+    for (int i = 0; i < freq; ++i)
+    {
+        for (int j = 0; j < FREQ_BRANCH_LEN; ++j)
+        {
+            for (int k = 0; k < channels; ++k)
+            {
+                ct.pos_embed_2d(0, j * freq + i, k) =
+                    pos_embed_2d_pre_reshape(k, i, j);
+            }
+        }
+    }
+
+    ct.pos_embed_1d = create_sin_embedding(TIME_BRANCH_LEN_3, channels);
+}
+
 static void
 my_transformer_encoder_layer(const struct demucscpp::demucs_model &model,
                              Eigen::Tensor3dXf &x, int freq_or_time,
-                             int weight_idx, float eps = 1e-5)
+                             int weight_idx, demucscpp::layer_scratch &scratch,
+                             float eps = 1e-5)
 {
+    DEMUCS_PROFILE_SCOPE(freq_or_time == 0 ? "freq self-attention layer"
+                                           : "time self-attention layer",
+                         weight_idx);
+
     demucscpp::common_encoder_layer(
         x, // pass x as q
         x, // pass x as k
@@ -104,9 +136,6 @@ my_transformer_encoder_layer(const struct demucscpp::demucs_model &model,
         model.crosstransformer
             ->crosstransformer_my_layers_self_attn_out_proj_bias[freq_or_time]
                                                                 [weight_idx],
-        model.crosstransformer
-            ->crosstransformer_my_layers_gamma_1_scale[freq_or_time]
-                                                      [weight_idx],
         model.crosstransformer
             ->crosstransformer_my_layers_norm2_weight[freq_or_time][weight_idx],
         model.crosstransformer
@@ -121,9 +150,6 @@ my_transformer_encoder_layer(const struct demucscpp::demucs_model &model,
                                                        [weight_idx],
         model.crosstransformer
             ->crosstransformer_my_layers_linear2_bias[freq_or_time][weight_idx],
-        model.crosstransformer
-            ->crosstransformer_my_layers_gamma_2_scale[freq_or_time]
-                                                      [weight_idx],
         model.crosstransformer
             ->crosstransformer_my_layers_norm_out_weight[freq_or_time]
                                                         [weight_idx],
@@ -131,7 +157,7 @@ my_transformer_encoder_layer(const struct demucscpp::demucs_model &model,
             ->crosstransformer_my_layers_norm_out_bias[freq_or_time]
                                                       [weight_idx],
         8, // num_heads
-        eps,
+        scratch, eps,
         true); // define self_attention = true to skip norm2 recalculation
 }
 
@@ -140,8 +166,13 @@ cross_transformer_encoder_layer(const struct demucscpp::demucs_model &model,
                                 Eigen::Tensor3dXf &q,       // q = x = frequency
                                 const Eigen::Tensor3dXf &k, // k = xt = time
                                 int freq_or_time, int weight_idx,
+                                demucscpp::layer_scratch &scratch,
                                 float eps = 1e-5)
 {
+    DEMUCS_PROFILE_SCOPE(freq_or_time == 0 ? "freq cross-attention layer"
+                                           : "time cross-attention layer",
+                         weight_idx);
+
     demucscpp::common_encoder_layer(
         q, k,
         model.crosstransformer
@@ -168,9 +199,6 @@ cross_transformer_encoder_layer(const struct demucscpp::demucs_model &model,
         model.crosstransformer
             ->crosstransformer_cross_layers_cross_attn_out_proj_bias
                 [freq_or_time][weight_idx],
-        model.crosstransformer
-            ->crosstransformer_cross_layers_gamma_1_scale[freq_or_time]
-                                                         [weight_idx],
         model.crosstransformer
             ->crosstransformer_cross_layers_norm3_weight[freq_or_time]
                                                         [weight_idx],
@@ -189,9 +217,6 @@ cross_transformer_encoder_layer(const struct demucscpp::demucs_model &model,
         model.crosstransformer
             ->crosstransformer_cross_layers_linear2_bias[freq_or_time]
                                                         [weight_idx],
-        model.crosstransformer
-            ->crosstransformer_cross_layers_gamma_2_scale[freq_or_time]
-                                                         [weight_idx],
         model.crosstransformer
             ->crosstransformer_cross_layers_norm_out_weight[freq_or_time]
                                                            [weight_idx],
@@ -199,71 +224,75 @@ cross_transformer_encoder_layer(const struct demucscpp::demucs_model &model,
             ->crosstransformer_cross_layers_norm_out_bias[freq_or_time]
                                                          [weight_idx],
         8, // num_heads
-        eps);
+        scratch, eps);
 }
 
 void demucscpp::apply_crosstransformer(
     const struct demucscpp::demucs_model &model,
     Eigen::Tensor3dXf &x,  // frequency branch
     Eigen::Tensor3dXf &xt, // time branch
-    demucscpp::ProgressCallback cb, float current_progress,
-    float segment_progress)
+    demucscpp::layer_scratch &scratch, const demucscpp::ProgressCallback &cb,
+    float current_progress, float segment_progress)
 {
-    cb(current_progress + segment_progress * 8.0f / 26.0f,
-       "Applying crosstransformer");
+    DEMUCS_PROFILE_SCOPE("crosstransformer");
 
-    Eigen::Tensor3dXf pos_embed_2d_pre_reshape =
-        create_2d_sin_embedding(x.dimension(0), x.dimension(1), x.dimension(2));
+    demucscpp::report_progress(
+        cb, current_progress + segment_progress * 8.0f / 26.0f,
+        "Applying crosstransformer");
+
+    const auto &ct = *model.crosstransformer;
+    if (x.dimension(1) * x.dimension(2) != ct.pos_embed_2d.dimension(1) ||
+        xt.dimension(2) != ct.pos_embed_1d.dimension(1))
+    {
+        std::cerr << "Crosstransformer input does not match the positional "
+                     "embeddings built at load"
+                  << std::endl;
+        std::exit(1);
+    }
 
-    Eigen::Tensor3dXf pos_embed_2d(1, x.dimension(1) * x.dimension(2),
-                                   x.dimension(0));
-    Eigen::Tensor3dXf x_reshape(1, x.dimension(1) * x.dimension(2),
-                                x.dimension(0));
+    // the reshapes go through scratch.a, and x and xt are resized to the
+    // same number of elements, so none of them allocates
+    Eigen::Tensor3dXfMap x_reshape = scratch.a.tensor(
+        1, x.dimension(1) * x.dimension(2), x.dimension(0));
 
     // x = rearrange(x, "b c fr t1 -> b (t1 fr) c")
 
     // implement above with eigen for loops
-    // rearrange x too
     for (int i = 0; i < x.dimension(1); ++i)
     {
         for (int j = 0; j < x.dimension(2); ++j)
         {
             for (int k = 0; k < x.dimension(0); ++k)
             {
-                pos_embed_2d(0, j * x.dimension(1) + i, k) =
-                    pos_embed_2d_pre_reshape(k, i, j);
                 x_reshape(0, j * x.dimension(1) + i, k) = x(k, i, j);
             }
         }
     }
 
-    x = x_reshape;
-
     float eps = 1e-5;
 
-    x = demucscpp::layer_norm(
-            x, model.crosstransformer->crosstransformer_norm_in_weight,
-            model.crosstransformer->crosstransformer_norm_in_bias, eps) +
-        pos_embed_2d;
-    cb(current_progress + segment_progress * 8.0f / 26.0f,
-       "Freq (crosstransformer): norm + pos_embed");
-
-    // (B, C, T2) = xt.shape
-    int C = xt.dimension(1);
-    int T2 = xt.dimension(2);
-
-    Eigen::Tensor3dXf pos_embed_1d = create_sin_embedding(T2, C);
+    x.resize(x_reshape.dimensions());
+    demucscpp::layer_norm(x_reshape, ct.crosstransformer_norm_in_weight,
+                          ct.crosstransformer_norm_in_bias, eps, x);
+    x += ct.pos_embed_2d;
+    demucscpp::report_progress(
+        cb, current_progress + segment_progress * 8.0f / 26.0f,
+        "Freq (crosstransformer): norm + pos_embed");
 
     // shuffle axes of xt from 0,1,2 to 0,2,1
-    Eigen::Tensor3dXf xt_shuf = xt.shuffle(Eigen::array<int, 3>{0, 2, 1});
+    Eigen::array<int, 3> permute_dims = {0, 2, 1};
+    Eigen::Tensor3dXfMap xt_shuf =
+        scratch.a.tensor(xt.dimension(0), xt.dimension(2), xt.dimension(1));
+    xt_shuf = xt.shuffle(permute_dims);
 
-    xt = demucscpp::layer_norm(
-             xt_shuf, model.crosstransformer->crosstransformer_norm_in_t_weight,
-             model.crosstransformer->crosstransformer_norm_in_t_bias, eps) +
-         pos_embed_1d;
+    xt.resize(xt_shuf.dimensions());
+    demucscpp::layer_norm(xt_shuf, ct.crosstransformer_norm_in_t_weight,
+                          ct.crosstransformer_norm_in_t_bias, eps, xt);
+    xt += ct.pos_embed_1d;
 
-    cb(current_progress + segment_progress * 8.0f / 26.0f,
-       "Time (crosstransformer): norm + pos_embed");
+    demucscpp::report_progress(
+        cb, current_progress + segment_progress * 8.0f / 26.0f,
+        "Time (crosstransformer): norm + pos_embed");
 
     // actual crosstransformer layers here
 
@@ -274,66 +303,82 @@ void demucscpp::apply_crosstransformer(
 
     // x = self.layers[0](x)
     // xt = self.layers_t[0](xt)
-    my_transformer_encoder_layer(model, x, 0, 0);
-    cb(current_progress + segment_progress * 9.0f / 26.0f,
-       "Freq (crosstransformer): layer 0");
+    my_transformer_encoder_layer(model, x, 0, 0, scratch);
+    demucscpp::report_progress(
+        cb, current_progress + segment_progress * 9.0f / 26.0f,
+        "Freq (crosstransformer): layer 0");
 
-    my_transformer_encoder_layer(model, xt, 1, 0);
-    cb(current_progress + segment_progress * 10.0f / 26.0f,
-       "Time (crosstransformer): layer 0");
+    my_transformer_encoder_layer(model, xt, 1, 0, scratch);
+    demucscpp::report_progress(
+        cb, current_progress + segment_progress * 10.0f / 26.0f,
+        "Time (crosstransformer): layer 0");
 
     // make a copy of x
-    Eigen::Tensor3dXf old_x = x;
+    Eigen::Tensor3dXf &old_x = scratch.cross_input;
+    old_x = x;
 
     // x is modified in-place and is the final value of x
     // xt is not modified (const)
-    cross_transformer_encoder_layer(model, x, xt, 0, 0);
-    cb(current_progress + segment_progress * 11.0f / 26.0f,
-       "Freq (crosstransformer): layer 1");
+    cross_transformer_encoder_layer(model, x, xt, 0, 0, scratch);
+    demucscpp::report_progress(
+        cb, current_progress + segment_progress * 11.0f / 26.0f,
+        "Freq (crosstransformer): layer 1");
 
     // xt is modified in-place and is the final value of xt
-    cross_transformer_encoder_layer(model, xt, old_x, 1, 0);
-    cb(current_progress + segment_progress * 12.0f / 26.0f,
-       "Time (crosstransformer): layer 1");
+    cross_transformer_encoder_layer(model, xt, old_x, 1, 0, scratch);
+    demucscpp::report_progress(
+        cb, current_progress + segment_progress * 12.0f / 26.0f,
+        "Time (crosstransformer): layer 1");
 
-    my_transformer_encoder_layer(model, x, 0, 1);
-    cb(current_progress + segment_progress * 13.0f / 26.0f,
-       "Freq (crosstransformer): layer 2");
+    my_transformer_encoder_layer(model, x, 0, 1, scratch);
+    demucscpp::report_progress(
+        cb, current_progress + segment_progress * 13.0f / 26.0f,
+        "Freq (crosstransformer): layer 2");
 
-    my_transformer_encoder_layer(model, xt, 1, 1);
-    cb(current_progress + segment_progress * 14.0f / 26.0f,
-       "Time (crosstransformer): layer 2");
+    my_transformer_encoder_layer(model, xt, 1, 1, scratch);
+    demucscpp::report_progress(
+        cb, current_progress + segment_progress * 14.0f / 26.0f,
+        "Time (crosstransformer): layer 2");
 
     // make a copy of x
     old_x = x;
 
     // x is modified in-place and is the final value of x
-    cross_transformer_encoder_layer(model, x, xt, 0, 1);
-    cb(current_progress + segment_progress * 15.0f / 26.0f,
-       "Freq (crosstransformer): layer 3");
+    cross_transformer_encoder_layer(model, x, xt, 0, 1, scratch);
+    demucscpp::report_progress(
+        cb, current_progress + segment_progress * 15.0f / 26.0f,
+        "Freq (crosstransformer): layer 3");
 
     // old_xt is modified in-place and is the final value of xt
-    cross_transformer_encoder_layer(model, xt, old_x, 1, 1);
-    cb(current_progress + segment_progress * 16.0f / 26.0f,
-       "Time (crosstransformer): layer 3");
+    cross_transformer_encoder_layer(model, xt, old_x, 1, 1, scratch);
+    demucscpp::report_progress(
+        cb, current_progress + segment_progress * 16.0f / 26.0f,
+        "Time (crosstransformer): layer 3");
 
-    my_transformer_encoder_layer(model, x, 0, 2);
-    cb(current_progress + segment_progress * 17.0f / 26.0f,
-       "Freq (crosstransformer): layer 4");
+    my_transformer_encoder_layer(model, x, 0, 2, scratch);
+    demucscpp::report_progress(
+        cb, current_progress + segment_progress * 17.0f / 26.0f,
+        "Freq (crosstransformer): layer 4");
 
-    my_transformer_encoder_layer(model, xt, 1, 2);
-    cb(current_progress + segment_progress * 18.0f / 26.0f,
-       "Time (crosstransformer): layer 4");
+    my_transformer_encoder_layer(model, xt, 1, 2, scratch);
+    demucscpp::report_progress(
+        cb, current_progress + segment_progress * 18.0f / 26.0f,
+        "Time (crosstransformer): layer 4");
 
     // permute last two dims of xt
-    Eigen::array<int, 3> permute_dims = {0, 2, 1};
-    Eigen::Tensor3dXf xt_ret = xt.shuffle(permute_dims);
+    Eigen::Tensor3dXfMap xt_ret =
+        scratch.a.tensor(xt.dimension(0), xt.dimension(2), xt.dimension(1));
+    xt_ret = xt.shuffle(permute_dims);
+    xt.resize(xt_ret.dimensions());
     xt = xt_ret;
 
     // for x, transform from shape (1, 2688, 512) to
     // (512, 8, 336)
 
     // first also permute x
-    Eigen::Tensor3dXf x_shuf = x.shuffle(permute_dims);
+    Eigen::Tensor3dXfMap x_shuf =
+        scratch.a.tensor(x.dimension(0), x.dimension(2), x.dimension(1));
+    x_shuf = x.shuffle(permute_dims);
+    x.resize(x_shuf.dimensions());
     x = x_shuf;
 }
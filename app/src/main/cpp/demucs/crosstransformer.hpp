@@ -7,11 +7,16 @@
 
 namespace demucscpp
 {
+// build the positional embeddings of the fixed segment shape, which
+// apply_crosstransformer adds to its inputs
+void init_positional_embeddings(crosstransformer_base &ct);
+
 void apply_crosstransformer(
     const struct demucscpp::demucs_model &model,
     Eigen::Tensor3dXf &x,  // frequency branch
     Eigen::Tensor3dXf &xt, // time branch with leading dim (1, ...)
-    ProgressCallback cb, float current_progress, float segment_progress);
+    layer_scratch &scratch, const ProgressCallback &cb, float current_progress,
+    float segment_progress);
 } // namespace demucscpp
 
 #endif // CROSSTRANSFORMER_HPP
@@ -1,4 +1,6 @@
 #include "dsp.hpp"
+#include "profiler.hpp"
+#include "threadpool.hpp"
 #include <algorithm>
 #include <cmath>
 #include <cstdlib>
@@ -8,178 +10,149 @@
 #include <unsupported/Eigen/FFT>
 #include <vector>
 
-// forward declaration of inner stft
-void stft_inner(struct demucscpp::stft_buffers &stft_buf,
-                Eigen::FFT<float> &cfg);
-
-void istft_inner(struct demucscpp::stft_buffers &stft_buf,
-                 Eigen::FFT<float> &cfg);
-
-// reflect padding
-void pad_signal(struct demucscpp::stft_buffers &stft_buf)
+// lanes are created on the calling thread, before the parallel loop that uses
+// them
+static void reserve_lanes(struct demucscpp::stft_buffers &stft_buf,
+                          int nb_lanes)
 {
-    // copy from stft_buf.padded_waveform_mono_in+pad into stft_buf.pad_start,
-    // stft_buf.pad_end
-    std::copy_n(stft_buf.padded_waveform_mono_in.begin() + stft_buf.pad,
-                stft_buf.pad, stft_buf.pad_start.begin());
-    std::copy_n(stft_buf.padded_waveform_mono_in.end() - 2 * stft_buf.pad,
-                stft_buf.pad, stft_buf.pad_end.begin());
-
-    std::reverse(stft_buf.pad_start.begin(), stft_buf.pad_start.end());
-    std::reverse(stft_buf.pad_end.begin(), stft_buf.pad_end.end());
-
-    // copy stft_buf.pad_start into stft_buf.padded_waveform_mono_in
-    std::copy_n(stft_buf.pad_start.begin(), stft_buf.pad,
-                stft_buf.padded_waveform_mono_in.begin());
-
-    // copy stft_buf.pad_end into stft_buf.padded_waveform_mono_in
-    std::copy_n(stft_buf.pad_end.begin(), stft_buf.pad,
-                stft_buf.padded_waveform_mono_in.end() - stft_buf.pad);
+    while ((int)stft_buf.lanes.size() < nb_lanes)
+    {
+        stft_buf.lanes.push_back(
+            std::make_unique<struct demucscpp::stft_lane>(stft_buf.n_samples));
+    }
 }
 
-Eigen::FFT<float> get_fft_cfg()
+// reflect padding
+static void pad_signal(std::vector<float> &padded, int pad)
 {
-    Eigen::FFT<float> cfg;
-
-    cfg.SetFlag(Eigen::FFT<float>::Speedy);
-    // cfg.SetFlag(Eigen::FFT<float>::HalfSpectrum);
-    // cfg.SetFlag(Eigen::FFT<float>::Unscaled);
+    int size = padded.size();
 
-    return cfg;
+    // this mirrors the pad samples next to each edge, including the edge
+    // sample itself
+    for (int i = 0; i < pad; ++i)
+    {
+        padded[i] = padded[2 * pad - 1 - i];
+        padded[size - pad + i] = padded[size - pad - 1 - i];
+    }
 }
 
-void demucscpp::stft(struct stft_buffers &stft_buf)
+static void stft_channel(struct demucscpp::stft_buffers &stft_buf,
+                         struct demucscpp::stft_lane &lane, int channel)
 {
-    // get the fft config
-    Eigen::FFT<float> cfg = get_fft_cfg();
+    std::vector<float> &padded = lane.padded_waveform;
 
-    /*****************************************/
-    /*  operate on each channel sequentially */
-    /*****************************************/
+    // apply padding equivalent to center padding with center=True
+    // in torch.stft:
+    // https://pytorch.org/docs/stable/generated/torch.stft.html
+    Eigen::Map<Eigen::VectorXf>(padded.data() + stft_buf.pad,
+                                stft_buf.n_samples) =
+        stft_buf.waveform.row(channel).transpose();
+    pad_signal(padded, stft_buf.pad);
 
-    for (int channel = 0; channel < 2; ++channel)
+    // Loop over the waveform with a stride of hop_size
+    for (int frame_idx = 0; frame_idx < stft_buf.nb_frames; ++frame_idx)
     {
-        Eigen::VectorXf row_vec = stft_buf.waveform.row(channel);
-
-        std::copy_n(row_vec.data(), row_vec.size(),
-                    stft_buf.padded_waveform_mono_in.begin() + stft_buf.pad);
-
-        // apply padding equivalent to center padding with center=True
-        // in torch.stft:
-        // https://pytorch.org/docs/stable/generated/torch.stft.html
+        const float *src = padded.data() + frame_idx * demucscpp::FFT_HOP_SIZE;
 
-        // reflect pads stft_buf.padded_waveform_mono in-place
-        pad_signal(stft_buf);
-
-        // does forward fft on stft_buf.padded_waveform_mono, stores spectrum in
-        // complex_spec_mono
-        stft_inner(stft_buf, cfg);
+        // the analysis window also applies the 1/sqrt(nfft) scaling
+        for (int i = 0; i < demucscpp::FFT_WINDOW_SIZE; ++i)
+        {
+            lane.frame[i] = src[i] * stft_buf.analysis_window[i];
+        }
+        lane.cfg.fwd(lane.spectrum.data(), lane.frame.data(),
+                     demucscpp::FFT_WINDOW_SIZE);
 
         for (int i = 0; i < stft_buf.nb_bins; ++i)
         {
-            for (int j = 0; j < stft_buf.nb_frames; ++j)
-            {
-                stft_buf.spec(channel, i, j) = stft_buf.complex_spec_mono[j][i];
-            }
+            stft_buf.spec(channel, i, frame_idx) = lane.spectrum[i];
         }
     }
 }
 
-void demucscpp::istft(struct stft_buffers &stft_buf)
+static void istft_channel(struct demucscpp::stft_buffers &stft_buf,
+                          struct demucscpp::stft_lane &lane,
+                          const Eigen::Tensor3dXcf &spec, int channel,
+                          Eigen::MatrixXf &waveform)
 {
-    // get the fft config
-    Eigen::FFT<float> cfg = get_fft_cfg();
-
-    /*****************************************/
-    /*  operate on each channel sequentially */
-    /*****************************************/
+    std::vector<float> &padded = lane.padded_waveform;
+    std::fill(padded.begin(), padded.end(), 0.0f);
 
-    for (int channel = 0; channel < 2; ++channel)
+    // Loop over the input with a stride of (hop_size)
+    for (int frame_idx = 0; frame_idx < stft_buf.nb_frames; ++frame_idx)
     {
-        // Populate the nested vectors
         for (int i = 0; i < stft_buf.nb_bins; ++i)
         {
-            for (int j = 0; j < stft_buf.nb_frames; ++j)
-            {
-                stft_buf.complex_spec_mono[j][i] = stft_buf.spec(channel, i, j);
-            }
+            lane.spectrum[i] = spec(channel, i, frame_idx);
         }
+        lane.cfg.inv(lane.frame.data(), lane.spectrum.data(),
+                     demucscpp::FFT_WINDOW_SIZE);
 
-        // does inverse fft on stft_buf.complex_spec_mono, stores waveform in
-        // padded_waveform_mono
-        istft_inner(stft_buf, cfg);
+        // Apply window and add to output
+        float *dst = padded.data() + frame_idx * demucscpp::FFT_HOP_SIZE;
+        for (int i = 0; i < demucscpp::FFT_WINDOW_SIZE; ++i)
+        {
+            dst[i] += lane.frame[i] * stft_buf.window[i];
+        }
+    }
 
-        // copies waveform_mono into stft_buf.waveform past first pad samples
-        stft_buf.waveform.row(channel) = Eigen::Map<Eigen::MatrixXf>(
-            stft_buf.padded_waveform_mono_out.data() + stft_buf.pad, 1,
-            stft_buf.padded_waveform_mono_out.size() - FFT_WINDOW_SIZE);
+    // x[start+i] is the sum of squared window values
+    // https://github.com/librosa/librosa/blob/main/librosa/core/spectrum.py#L613
+    // and only the samples past the first pad are kept
+    for (int i = 0; i < stft_buf.n_samples; ++i)
+    {
+        waveform(channel, i) = padded[stft_buf.pad + i] *
+                               stft_buf.synthesis_scale[stft_buf.pad + i];
     }
 }
 
-void stft_inner(struct demucscpp::stft_buffers &stft_buf,
-                Eigen::FFT<float> &cfg)
+void demucscpp::stft(struct stft_buffers &stft_buf)
 {
-    int frame_idx = 0;
+    DEMUCS_PROFILE_SCOPE("stft");
 
-    // Loop over the waveform with a stride of hop_size
-    for (std::size_t start = 0;
-         start <=
-         stft_buf.padded_waveform_mono_in.size() - demucscpp::FFT_WINDOW_SIZE;
-         start += demucscpp::FFT_HOP_SIZE)
-    {
-        // Apply window and run FFT
-        for (int i = 0; i < demucscpp::FFT_WINDOW_SIZE; ++i)
-        {
-            stft_buf.windowed_waveform_mono[i] =
-                stft_buf.padded_waveform_mono_in[start + i] *
-                stft_buf.window[i];
-        }
-        cfg.fwd(stft_buf.complex_spec_mono[frame_idx],
-                stft_buf.windowed_waveform_mono);
-        // now scale stft_buf.complex_spec_mono[frame_idx] by 1.0f /
-        // sqrt(float(FFT_WINDOW_SIZE)))
+    reserve_lanes(stft_buf, 2);
 
-        for (int i = 0; i < demucscpp::FFT_WINDOW_SIZE / 2 + 1; ++i)
-        {
-            stft_buf.complex_spec_mono[frame_idx][i] *=
-                1.0f / sqrt(float(demucscpp::FFT_WINDOW_SIZE));
-        }
-        frame_idx++;
-    }
+    demucscpp::parallel_for(
+        2, [&](int channel)
+        { stft_channel(stft_buf, *stft_buf.lanes[channel], channel); });
 }
 
-void istft_inner(struct demucscpp::stft_buffers &stft_buf,
-                 Eigen::FFT<float> &cfg)
+void demucscpp::istft(struct stft_buffers &stft_buf)
 {
-    // clear padded_waveform_mono
-    std::fill(stft_buf.padded_waveform_mono_out.begin(),
-              stft_buf.padded_waveform_mono_out.end(), 0.0f);
+    DEMUCS_PROFILE_SCOPE("istft");
 
-    // Loop over the input with a stride of (hop_size)
-    for (int start = 0; start < stft_buf.nb_frames * demucscpp::FFT_HOP_SIZE;
-         start += demucscpp::FFT_HOP_SIZE)
-    {
-        int frame_idx = start / demucscpp::FFT_HOP_SIZE;
-        // undo sqrt(nfft) scaling
-        for (int i = 0; i < demucscpp::FFT_WINDOW_SIZE / 2 + 1; ++i)
-        {
-            stft_buf.complex_spec_mono[frame_idx][i] *=
-                sqrt(float(demucscpp::FFT_WINDOW_SIZE));
-        }
-        // Run iFFT
-        cfg.inv(stft_buf.windowed_waveform_mono,
-                stft_buf.complex_spec_mono[frame_idx]);
+    reserve_lanes(stft_buf, 2);
 
-        // Apply window and add to output
-        for (int i = 0; i < demucscpp::FFT_WINDOW_SIZE; ++i)
+    demucscpp::parallel_for(
+        2,
+        [&](int channel)
         {
-            // x[start+i] is the sum of squared window values
-            // https://github.com/librosa/librosa/blob/main/librosa/core/spectrum.py#L613
-            // 1e-8f is a small number to avoid division by zero
-            stft_buf.padded_waveform_mono_out[start + i] +=
-                stft_buf.windowed_waveform_mono[i] * stft_buf.window[i] * 1.0f /
-                float(demucscpp::FFT_WINDOW_SIZE) /
-                (stft_buf.normalized_window[start + i] + 1e-8f);
-        }
+            istft_channel(stft_buf, *stft_buf.lanes[channel], stft_buf.spec,
+                          channel, stft_buf.waveform);
+        });
+}
+
+void demucscpp::istft(struct stft_buffers &stft_buf,
+                      const std::vector<Eigen::Tensor3dXcf> &specs,
+                      std::vector<Eigen::MatrixXf> &waveforms)
+{
+    DEMUCS_PROFILE_SCOPE("istft");
+
+    int nb_specs = specs.size();
+
+    waveforms.resize(nb_specs);
+    for (auto &waveform : waveforms)
+    {
+        waveform.resize(2, stft_buf.n_samples);
     }
+
+    reserve_lanes(stft_buf, 2 * nb_specs);
+
+    demucscpp::parallel_for(2 * nb_specs,
+                            [&](int task)
+                            {
+                                int s = task / 2;
+                                int channel = task % 2;
+                                istft_channel(stft_buf, *stft_buf.lanes[task],
+                                              specs[s], channel, waveforms[s]);
+                            });
 }
@@ -4,6 +4,7 @@
 #include <Eigen/Dense>
 #include <complex>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <tensor.hpp>
 #include <unsupported/Eigen/FFT>
@@ -17,43 +18,70 @@ const int FFT_WINDOW_SIZE = 4096;
 
 const int FFT_HOP_SIZE = 1024; // 25% hop i.e. 75% overlap
 
+// per-lane state of the stft: one channel of one spectrogram is transformed
+// at a time on each lane, and lanes run in parallel
+//
+// the fft config caches its plan (twiddles and scratch) after the first use,
+// so keeping it here means the plan is built once per lane instead of on
+// every call
+struct stft_lane
+{
+    Eigen::FFT<float> cfg;
+
+    // the reflect-padded input of the stft, or the overlap-add output of the
+    // istft
+    std::vector<float> padded_waveform;
+    std::vector<float> frame;
+    std::vector<std::complex<float>> spectrum;
+
+    explicit stft_lane(int n_samples)
+        : padded_waveform(n_samples + FFT_WINDOW_SIZE),
+          frame(FFT_WINDOW_SIZE), spectrum(FFT_WINDOW_SIZE / 2 + 1)
+    {
+        // real input, so only the non-negative frequencies are computed
+        cfg.SetFlag(Eigen::FFT<float>::HalfSpectrum);
+        // the scaling is folded into the windows below
+        cfg.SetFlag(Eigen::FFT<float>::Unscaled);
+    }
+};
+
 struct stft_buffers
 {
+    int n_samples;
     int nb_frames;
     int nb_bins;
     int pad;
 
     Eigen::MatrixXf waveform;
 
+    // hann window, scaled by 1/sqrt(nfft) for the forward transform
+    const std::vector<float> analysis_window;
     const std::vector<float> window;
-    const std::vector<float> normalized_window;
 
-    std::vector<float> pad_start;
-    std::vector<float> pad_end;
-    std::vector<float> padded_waveform_mono_in;
-    std::vector<float> padded_waveform_mono_out;
-    std::vector<float> windowed_waveform_mono;
+    // per-sample scale of the overlap-added istft output: undoes the
+    // 1/sqrt(nfft) scaling of the spectrum and divides by the sum of squared
+    // windows
+    const std::vector<float> synthesis_scale;
 
-    std::vector<std::vector<std::complex<float>>> complex_spec_mono;
+    // created on demand, one per parallel task
+    std::vector<std::unique_ptr<stft_lane>> lanes;
 
     Eigen::Tensor3dXcf spec;
 
+    // the spectrograms and waveforms of the batched istft of the sources,
+    // kept from one segment to the next
+    std::vector<Eigen::Tensor3dXcf> source_specs;
+    std::vector<Eigen::MatrixXf> source_waveforms;
+
     // constructor for stft_buffers that takes some parameters
     // to hint at the sizes of the buffers
     explicit stft_buffers(int n_samples)
-        : nb_frames(n_samples / FFT_HOP_SIZE + 1),
+        : n_samples(n_samples), nb_frames(n_samples / FFT_HOP_SIZE + 1),
           nb_bins(FFT_WINDOW_SIZE / 2 + 1), pad(FFT_WINDOW_SIZE / 2),
           waveform(Eigen::MatrixXf(2, n_samples)),
+          analysis_window(init_const_analysis_window()),
           window(init_const_hann_window()),
-          normalized_window(init_const_normalized_window(window, nb_frames)),
-          pad_start(std::vector<float>(pad)), pad_end(std::vector<float>(pad)),
-          padded_waveform_mono_in(
-              std::vector<float>(n_samples + FFT_WINDOW_SIZE)),
-          padded_waveform_mono_out(
-              std::vector<float>(n_samples + FFT_WINDOW_SIZE)),
-          windowed_waveform_mono(std::vector<float>(FFT_WINDOW_SIZE)),
-          complex_spec_mono(std::vector<std::vector<std::complex<float>>>(
-              nb_frames, std::vector<std::complex<float>>(nb_bins))),
+          synthesis_scale(init_const_synthesis_scale(window, nb_frames)),
           spec(Eigen::Tensor3dXcf(2, nb_bins, nb_frames)){};
 
     static std::vector<float> init_const_hann_window()
@@ -74,11 +102,20 @@ struct stft_buffers
         return window;
     }
 
+    static std::vector<float> init_const_analysis_window()
+    {
+        std::vector<float> window = init_const_hann_window();
+        for (auto &w : window)
+        {
+            w *= 1.0f / sqrtf(float(FFT_WINDOW_SIZE));
+        }
+        return window;
+    }
+
     static std::vector<float>
-    init_const_normalized_window(const std::vector<float> &window,
-                                 int nb_frames)
+    init_const_synthesis_scale(const std::vector<float> &window, int nb_frames)
     {
-        float window_normalization_factor =
+        int window_normalization_factor =
             FFT_WINDOW_SIZE + FFT_HOP_SIZE * (nb_frames - 1);
         std::vector<float> normalized_window =
             std::vector<float>(window_normalization_factor, 0.0f);
@@ -89,20 +126,40 @@ struct stft_buffers
         for (int i = 0; i < nb_frames; ++i)
         {
             auto sample = i * FFT_HOP_SIZE;
-            for (int j = sample; j < std::min((int)window_normalization_factor,
+            for (int j = sample; j < std::min(window_normalization_factor,
                                               sample + FFT_WINDOW_SIZE);
                  ++j)
             {
                 normalized_window[j] += window[j - sample] * window[j - sample];
             }
         }
+
+        // the unscaled inverse fft of a spectrum scaled by 1/sqrt(nfft) is
+        // sqrt(nfft) times the windowed frame
+        // 1e-8f is a small number to avoid division by zero
+        for (auto &v : normalized_window)
+        {
+            v = 1.0f / (sqrtf(float(FFT_WINDOW_SIZE)) * (v + 1e-8f));
+        }
         return normalized_window;
     }
 };
 
+// stft_buf.waveform (2, n_samples) into stft_buf.spec (2, nb_bins, nb_frames),
+// with the two channels in parallel
 void stft(struct stft_buffers &stft_buf);
+
+// stft_buf.spec into stft_buf.waveform, the inverse of the above
 void istft(struct stft_buffers &stft_buf);
 
+// batched istft of several stereo spectrograms, e.g. one per source, with
+// all of their channels in parallel; specs[i] has the shape of stft_buf.spec
+// and waveforms[i] is resized to the shape of stft_buf.waveform, which only
+// allocates the first time
+void istft(struct stft_buffers &stft_buf,
+           const std::vector<Eigen::Tensor3dXcf> &specs,
+           std::vector<Eigen::MatrixXf> &waveforms);
+
 } // namespace demucscpp
 
 #endif // DSP_HPP
@@ -1,89 +1,88 @@
 #include "encdec.hpp"
 #include "layers.hpp"
 #include "model.hpp"
+#include "profiler.hpp"
 #include <Eigen/Core>
 #include <Eigen/Dense>
 #include <cmath>
 
 void demucscpp::apply_freq_encoder(const struct demucscpp::demucs_model &model,
                                    int encoder_idx,
-                                   const Eigen::Tensor3dXf &x_in,
-                                   Eigen::Tensor3dXf &x_out)
+                                   const Eigen::Tensor3dXfMap &x_in,
+                                   Eigen::Tensor3dXfMap &x_out,
+                                   demucscpp::layer_scratch &scratch)
 {
-    Eigen::Tensor3dXf x_shuf = x_in.shuffle(Eigen::array<int, 3>({2, 0, 1}));
-
-    // 2D Convolution operation
-    Eigen::Tensor3dXf y;
+    DEMUCS_PROFILE_SCOPE("freq encoder", encoder_idx);
 
+    // 2D Convolution operation, a kernel of 8 along the frequency axis,
+    // written as H,C,W for the dconv
     switch (encoder_idx)
     {
     case 0:
-        y = demucscpp::conv1d_fused_gelu<4, 48, 8, 4, 2, 1>(
-            x_shuf, model.encoder_conv_weight[encoder_idx],
-            model.encoder_conv_bias[encoder_idx]);
+        demucscpp::conv2d_fused_gelu<4, 48, 8, 1, 4, 1, 2, 0, 1, 1,
+                                     chw_layout, hcw_layout>(
+            x_in, model.encoder_conv_weight_packed[encoder_idx],
+            model.encoder_conv_bias[encoder_idx], scratch.y);
         break;
     case 1:
-        y = demucscpp::conv1d_fused_gelu<48, 96, 8, 4, 2, 1>(
-            x_shuf, model.encoder_conv_weight[encoder_idx],
-            model.encoder_conv_bias[encoder_idx]);
+        demucscpp::conv2d_fused_gelu<48, 96, 8, 1, 4, 1, 2, 0, 1, 1,
+                                     chw_layout, hcw_layout>(
+            x_in, model.encoder_conv_weight_packed[encoder_idx],
+            model.encoder_conv_bias[encoder_idx], scratch.y);
         break;
     case 2:
-        y = demucscpp::conv1d_fused_gelu<96, 192, 8, 4, 2, 1>(
-            x_shuf, model.encoder_conv_weight[encoder_idx],
-            model.encoder_conv_bias[encoder_idx]);
+        demucscpp::conv2d_fused_gelu<96, 192, 8, 1, 4, 1, 2, 0, 1, 1,
+                                     chw_layout, hcw_layout>(
+            x_in, model.encoder_conv_weight_packed[encoder_idx],
+            model.encoder_conv_bias[encoder_idx], scratch.y);
         break;
     case 3:
-        y = demucscpp::conv1d_fused_gelu<192, 384, 8, 4, 2, 1>(
-            x_shuf, model.encoder_conv_weight[encoder_idx],
-            model.encoder_conv_bias[encoder_idx]);
+        demucscpp::conv2d_fused_gelu<192, 384, 8, 1, 4, 1, 2, 0, 1, 1,
+                                     chw_layout, hcw_layout>(
+            x_in, model.encoder_conv_weight_packed[encoder_idx],
+            model.encoder_conv_bias[encoder_idx], scratch.y);
         break;
     };
 
-    // reverse all dims
-    Eigen::Tensor3dXf y_shuff = y.shuffle(Eigen::array<int, 3>({2, 1, 0}));
-    demucscpp::apply_dconv(model, y_shuff, 0, 0, encoder_idx,
-                           y_shuff.dimension(2));
-
-    // swap back from H,C,W to C,H,W
-    // then put W in front to use conv1d function for width=1 conv2d
-    y = y_shuff.shuffle(Eigen::array<int, 3>({2, 1, 0}));
+    Eigen::Tensor3dXfMap y = demucscpp::apply_dconv(
+        model, scratch.y.tensor(), 0, 0, encoder_idx,
+        scratch.y.tensor().dimension(2), scratch);
 
     // need rewrite, norm2, glu
+    // the 1x1 rewrite reads H,C,W and its glu writes C,H,W into x_out
     switch (encoder_idx)
     {
     case 0:
-        y = demucscpp::conv1d<48, 96, 1, 1, 0, 1>(
-            y, model.encoder_rewrite_weight[encoder_idx],
-            model.encoder_rewrite_bias[encoder_idx]);
+        demucscpp::conv1x1_glu<48, 96, hcw_layout, chw_layout>(
+            y, model.encoder_rewrite_weight_packed[encoder_idx],
+            model.encoder_rewrite_bias[encoder_idx], x_out);
         break;
     case 1:
-        y = demucscpp::conv1d<96, 192, 1, 1, 0, 1>(
-            y, model.encoder_rewrite_weight[encoder_idx],
-            model.encoder_rewrite_bias[encoder_idx]);
+        demucscpp::conv1x1_glu<96, 192, hcw_layout, chw_layout>(
+            y, model.encoder_rewrite_weight_packed[encoder_idx],
+            model.encoder_rewrite_bias[encoder_idx], x_out);
         break;
     case 2:
-        y = demucscpp::conv1d<192, 384, 1, 1, 0, 1>(
-            y, model.encoder_rewrite_weight[encoder_idx],
-            model.encoder_rewrite_bias[encoder_idx]);
+        demucscpp::conv1x1_glu<192, 384, hcw_layout, chw_layout>(
+            y, model.encoder_rewrite_weight_packed[encoder_idx],
+            model.encoder_rewrite_bias[encoder_idx], x_out);
         break;
     case 3:
-        y = demucscpp::conv1d<384, 768, 1, 1, 0, 1>(
-            y, model.encoder_rewrite_weight[encoder_idx],
-            model.encoder_rewrite_bias[encoder_idx]);
+        demucscpp::conv1x1_glu<384, 768, hcw_layout, chw_layout>(
+            y, model.encoder_rewrite_weight_packed[encoder_idx],
+            model.encoder_rewrite_bias[encoder_idx], x_out);
         break;
     };
-
-    y_shuff = y.shuffle(Eigen::array<int, 3>({1, 2, 0}));
-
-    // copy into x_out
-    x_out = demucscpp::glu(y_shuff, 0);
 }
 
 void demucscpp::apply_time_encoder(const struct demucscpp::demucs_model &model,
                                    int tencoder_idx,
-                                   const Eigen::Tensor3dXf &xt_in,
-                                   Eigen::Tensor3dXf &xt_out)
+                                   const Eigen::Tensor3dXfMap &xt_in,
+                                   Eigen::Tensor3dXfMap &xt_out,
+                                   demucscpp::layer_scratch &scratch)
 {
+    DEMUCS_PROFILE_SCOPE("time encoder", tencoder_idx);
+
     int crop = demucscpp::TIME_BRANCH_LEN_0;
     // switch case for tencoder_idx
     switch (tencoder_idx)
@@ -104,170 +103,183 @@ void demucscpp::apply_time_encoder(const struct demucscpp::demucs_model &model,
     // now implement the forward pass
     // first, apply the convolution
     // Conv1d(2, 48, kernel_size=(8,), stride=(4,), padding=(2,))
-    Eigen::Tensor3dXf yt;
-
     switch (tencoder_idx)
     {
     case 0:
-        yt = demucscpp::conv1d_fused_gelu<2, 48, 8, 4, 2, 1>(
-            xt_in, model.tencoder_conv_weight[tencoder_idx],
-            model.tencoder_conv_bias[tencoder_idx]);
+        demucscpp::conv1d_fused_gelu<2, 48, 8, 4, 2, 1>(
+            xt_in, model.tencoder_conv_weight_packed[tencoder_idx],
+            model.tencoder_conv_bias[tencoder_idx], scratch.y);
         break;
     case 1:
-        yt = demucscpp::conv1d_fused_gelu<48, 96, 8, 4, 2, 1>(
-            xt_in, model.tencoder_conv_weight[tencoder_idx],
-            model.tencoder_conv_bias[tencoder_idx]);
+        demucscpp::conv1d_fused_gelu<48, 96, 8, 4, 2, 1>(
+            xt_in, model.tencoder_conv_weight_packed[tencoder_idx],
+            model.tencoder_conv_bias[tencoder_idx], scratch.y);
         break;
     case 2:
-        yt = demucscpp::conv1d_fused_gelu<96, 192, 8, 4, 2, 1>(
-            xt_in, model.tencoder_conv_weight[tencoder_idx],
-            model.tencoder_conv_bias[tencoder_idx]);
+        demucscpp::conv1d_fused_gelu<96, 192, 8, 4, 2, 1>(
+            xt_in, model.tencoder_conv_weight_packed[tencoder_idx],
+            model.tencoder_conv_bias[tencoder_idx], scratch.y);
         break;
     case 3:
-        yt = demucscpp::conv1d_fused_gelu<192, 384, 8, 4, 2, 1>(
-            xt_in, model.tencoder_conv_weight[tencoder_idx],
-            model.tencoder_conv_bias[tencoder_idx]);
+        demucscpp::conv1d_fused_gelu<192, 384, 8, 4, 2, 1>(
+            xt_in, model.tencoder_conv_weight_packed[tencoder_idx],
+            model.tencoder_conv_bias[tencoder_idx], scratch.y);
         break;
     };
 
     // now dconv time
-    demucscpp::apply_dconv(model, yt, 1, 0, tencoder_idx, crop);
+    Eigen::Tensor3dXfMap yt = demucscpp::apply_dconv(
+        model, scratch.y.tensor(), 1, 0, tencoder_idx, crop, scratch);
 
     // end of dconv?
 
     // need rewrite, norm2, glu
+    // the glu of the 1x1 rewrite writes into xt_out
     switch (tencoder_idx)
     {
     case 0:
-        yt = demucscpp::conv1d<48, 96, 1, 1, 0, 1>(
-            yt, model.tencoder_rewrite_weight[tencoder_idx],
-            model.tencoder_rewrite_bias[tencoder_idx]);
+        demucscpp::conv1x1_glu<48, 96>(
+            yt, model.tencoder_rewrite_weight_packed[tencoder_idx],
+            model.tencoder_rewrite_bias[tencoder_idx], xt_out);
         break;
     case 1:
-        yt = demucscpp::conv1d<96, 192, 1, 1, 0, 1>(
-            yt, model.tencoder_rewrite_weight[tencoder_idx],
-            model.tencoder_rewrite_bias[tencoder_idx]);
+        demucscpp::conv1x1_glu<96, 192>(
+            yt, model.tencoder_rewrite_weight_packed[tencoder_idx],
+            model.tencoder_rewrite_bias[tencoder_idx], xt_out);
         break;
     case 2:
-        yt = demucscpp::conv1d<192, 384, 1, 1, 0, 1>(
-            yt, model.tencoder_rewrite_weight[tencoder_idx],
-            model.tencoder_rewrite_bias[tencoder_idx]);
+        demucscpp::conv1x1_glu<192, 384>(
+            yt, model.tencoder_rewrite_weight_packed[tencoder_idx],
+            model.tencoder_rewrite_bias[tencoder_idx], xt_out);
         break;
     case 3:
-        yt = demucscpp::conv1d<384, 768, 1, 1, 0, 1>(
-            yt, model.tencoder_rewrite_weight[tencoder_idx],
-            model.tencoder_rewrite_bias[tencoder_idx]);
+        demucscpp::conv1x1_glu<384, 768>(
+            yt, model.tencoder_rewrite_weight_packed[tencoder_idx],
+            model.tencoder_rewrite_bias[tencoder_idx], xt_out);
         break;
     };
-
-    xt_out = demucscpp::glu(yt, 1);
 }
 
 void demucscpp::apply_freq_decoder(const struct demucscpp::demucs_model &model,
                                    int decoder_idx,
-                                   const Eigen::Tensor3dXf &x_in,
-                                   Eigen::Tensor3dXf &x_out,
-                                   const Eigen::Tensor3dXf &skip)
+                                   const Eigen::Tensor3dXfMap &x_in,
+                                   Eigen::Tensor3dXfMap &x_out,
+                                   const Eigen::Tensor3dXfMap &skip,
+                                   demucscpp::layer_scratch &scratch)
 {
-    Eigen::Tensor3dXf y = x_in + skip;
+    DEMUCS_PROFILE_SCOPE("freq decoder", decoder_idx);
+
+    Eigen::Tensor3dXfMap y_in = scratch.a.tensor(
+        x_in.dimension(0), x_in.dimension(1), x_in.dimension(2));
+    y_in = x_in + skip;
 
     // need rewrite, norm2, glu
+    // the rewrite writes H,C,W for the dconv
     switch (decoder_idx)
     {
     case 0:
-        y = demucscpp::conv2d<384, 768, 3, 3, 1, 1, 1, 1, 1, 1>(
-            y, model.decoder_rewrite_weight[decoder_idx],
-            model.decoder_rewrite_bias[decoder_idx]);
+        demucscpp::conv2d<384, 768, 3, 3, 1, 1, 1, 1, 1, 1, chw_layout,
+                          hcw_layout>(
+            y_in, model.decoder_rewrite_weight_packed[decoder_idx],
+            model.decoder_rewrite_bias[decoder_idx], scratch.b);
         break;
     case 1:
-        y = demucscpp::conv2d<192, 384, 3, 3, 1, 1, 1, 1, 1, 1>(
-            y, model.decoder_rewrite_weight[decoder_idx],
-            model.decoder_rewrite_bias[decoder_idx]);
+        demucscpp::conv2d<192, 384, 3, 3, 1, 1, 1, 1, 1, 1, chw_layout,
+                          hcw_layout>(
+            y_in, model.decoder_rewrite_weight_packed[decoder_idx],
+            model.decoder_rewrite_bias[decoder_idx], scratch.b);
         break;
     case 2:
-        y = demucscpp::conv2d<96, 192, 3, 3, 1, 1, 1, 1, 1, 1>(
-            y, model.decoder_rewrite_weight[decoder_idx],
-            model.decoder_rewrite_bias[decoder_idx]);
+        demucscpp::conv2d<96, 192, 3, 3, 1, 1, 1, 1, 1, 1, chw_layout,
+                          hcw_layout>(
+            y_in, model.decoder_rewrite_weight_packed[decoder_idx],
+            model.decoder_rewrite_bias[decoder_idx], scratch.b);
         break;
     case 3:
-        y = demucscpp::conv2d<48, 96, 3, 3, 1, 1, 1, 1, 1, 1>(
-            y, model.decoder_rewrite_weight[decoder_idx],
-            model.decoder_rewrite_bias[decoder_idx]);
+        demucscpp::conv2d<48, 96, 3, 3, 1, 1, 1, 1, 1, 1, chw_layout,
+                          hcw_layout>(
+            y_in, model.decoder_rewrite_weight_packed[decoder_idx],
+            model.decoder_rewrite_bias[decoder_idx], scratch.b);
         break;
     };
 
-    y = demucscpp::glu(y, 0);
-
-    // swap first and second dimensions
-    // from C,H,W into H,C,W
-    Eigen::Tensor3dXf y_shuff = y.shuffle(Eigen::array<int, 3>({1, 0, 2}));
-    y = y_shuff;
+    demucscpp::glu(scratch.b.tensor(), 1, scratch.y);
 
     // start the DConv
-    demucscpp::apply_dconv(model, y, 0, 1, 4 - decoder_idx - 1, y.dimension(2));
+    Eigen::Tensor3dXfMap y = demucscpp::apply_dconv(
+        model, scratch.y.tensor(), 0, 1, 4 - decoder_idx - 1,
+        scratch.y.tensor().dimension(2), scratch);
 
     // dconv finished
 
-    // swap back from H,C,W to C,H,W
-    Eigen::Tensor3dXf y_shuff_2 = y.shuffle(Eigen::array<int, 3>({1, 0, 2}));
-
-    // now time for the transpose convolution
+    // now time for the transpose convolution, reading H,C,W and writing
+    // C,H,W
 
     // 2D Convolution operation
     switch (decoder_idx)
     {
     case 0:
-        y = demucscpp::conv2d_tr_fused_gelu<384, 192, 8, 1, 4, 1, 0, 0, 1, 1>(
-            y_shuff_2, model.decoder_conv_tr_weight[decoder_idx],
-            model.decoder_conv_tr_bias[decoder_idx]);
+        demucscpp::conv2d_tr_fused_gelu<384, 192, 8, 1, 4, 1, 0, 0, 1, 1,
+                                        hcw_layout, chw_layout>(
+            y, model.decoder_conv_tr_weight_packed[decoder_idx],
+            model.decoder_conv_tr_bias[decoder_idx], scratch.a);
         break;
     case 1:
-        y = demucscpp::conv2d_tr_fused_gelu<192, 96, 8, 1, 4, 1, 0, 0, 1, 1>(
-            y_shuff_2, model.decoder_conv_tr_weight[decoder_idx],
-            model.decoder_conv_tr_bias[decoder_idx]);
+        demucscpp::conv2d_tr_fused_gelu<192, 96, 8, 1, 4, 1, 0, 0, 1, 1,
+                                        hcw_layout, chw_layout>(
+            y, model.decoder_conv_tr_weight_packed[decoder_idx],
+            model.decoder_conv_tr_bias[decoder_idx], scratch.a);
         break;
     case 2:
-        y = demucscpp::conv2d_tr_fused_gelu<96, 48, 8, 1, 4, 1, 0, 0, 1, 1>(
-            y_shuff_2, model.decoder_conv_tr_weight[decoder_idx],
-            model.decoder_conv_tr_bias[decoder_idx]);
+        demucscpp::conv2d_tr_fused_gelu<96, 48, 8, 1, 4, 1, 0, 0, 1, 1,
+                                        hcw_layout, chw_layout>(
+            y, model.decoder_conv_tr_weight_packed[decoder_idx],
+            model.decoder_conv_tr_bias[decoder_idx], scratch.a);
         break;
     case 3:
         if (model.num_sources == 6)
         {
-            y = demucscpp::conv2d_tr<48, 24, 8, 1, 4, 1, 0, 0, 1, 1>(
-                y_shuff_2, model.decoder_conv_tr_weight[decoder_idx],
-                model.decoder_conv_tr_bias[decoder_idx]);
+            demucscpp::conv2d_tr<48, 24, 8, 1, 4, 1, 0, 0, 1, 1, hcw_layout,
+                                 chw_layout>(
+                y, model.decoder_conv_tr_weight_packed[decoder_idx],
+                model.decoder_conv_tr_bias[decoder_idx], scratch.a);
         }
         else if (model.num_sources == 4)
         {
-            y = demucscpp::conv2d_tr<48, 16, 8, 1, 4, 1, 0, 0, 1, 1>(
-                y_shuff_2, model.decoder_conv_tr_weight[decoder_idx],
-                model.decoder_conv_tr_bias[decoder_idx]);
+            demucscpp::conv2d_tr<48, 16, 8, 1, 4, 1, 0, 0, 1, 1, hcw_layout,
+                                 chw_layout>(
+                y, model.decoder_conv_tr_weight_packed[decoder_idx],
+                model.decoder_conv_tr_bias[decoder_idx], scratch.a);
         }
         else if (model.num_sources == 2)
         {
-            y = demucscpp::conv2d_tr<48, 8, 8, 1, 4, 1, 0, 0, 1, 1>(
-                y_shuff_2, model.decoder_conv_tr_weight[decoder_idx],
-                model.decoder_conv_tr_bias[decoder_idx]);
+            demucscpp::conv2d_tr<48, 8, 8, 1, 4, 1, 0, 0, 1, 1, hcw_layout,
+                                 chw_layout>(
+                y, model.decoder_conv_tr_weight_packed[decoder_idx],
+                model.decoder_conv_tr_bias[decoder_idx], scratch.a);
         }
         break;
     };
 
+    Eigen::Tensor3dXfMap y_tr = scratch.a.tensor();
     int y_dim1_begin = 2;
-    int y_dim1_end = y.dimension(1) - 4;
+    int y_dim1_end = y_tr.dimension(1) - 4;
 
     // remove 2 elements from begin and end of y along dimension 1 (0, 1, 2)
-    x_out = y.slice(Eigen::array<Eigen::Index, 3>({0, y_dim1_begin, 0}),
-                    Eigen::array<Eigen::Index, 3>(
-                        {y.dimension(0), y_dim1_end, y.dimension(2)}));
+    x_out = y_tr.slice(Eigen::array<Eigen::Index, 3>({0, y_dim1_begin, 0}),
+                       Eigen::array<Eigen::Index, 3>(
+                           {y_tr.dimension(0), y_dim1_end, y_tr.dimension(2)}));
 }
 
 void demucscpp::apply_time_decoder(const struct demucscpp::demucs_model &model,
                                    int tdecoder_idx,
-                                   const Eigen::Tensor3dXf &xt_in,
-                                   Eigen::Tensor3dXf &xt_out,
-                                   const Eigen::Tensor3dXf &skip)
+                                   const Eigen::Tensor3dXfMap &xt_in,
+                                   Eigen::Tensor3dXfMap &xt_out,
+                                   const Eigen::Tensor3dXfMap &skip,
+                                   demucscpp::layer_scratch &scratch)
 {
+    DEMUCS_PROFILE_SCOPE("time decoder", tdecoder_idx);
+
     int crop = demucscpp::TIME_BRANCH_LEN_3;
     int out_length = demucscpp::TIME_BRANCH_LEN_2;
     // switch case for tdecoder_idx
@@ -289,94 +301,99 @@ void demucscpp::apply_time_decoder(const struct demucscpp::demucs_model &model,
         break;
     }
 
+    Eigen::Tensor3dXfMap yt_in = scratch.a.tensor(
+        xt_in.dimension(0), xt_in.dimension(1), xt_in.dimension(2));
+    yt_in = xt_in + skip;
+
     // need rewrite, norm2, glu
-    Eigen::Tensor3dXf yt;
     switch (tdecoder_idx)
     {
     case 0:
-        yt = demucscpp::conv1d<384, 768, 3, 1, 1, 1>(
-            xt_in + skip, model.tdecoder_rewrite_weight[tdecoder_idx],
-            model.tdecoder_rewrite_bias[tdecoder_idx]);
+        demucscpp::conv1d<384, 768, 3, 1, 1, 1>(
+            yt_in, model.tdecoder_rewrite_weight_packed[tdecoder_idx],
+            model.tdecoder_rewrite_bias[tdecoder_idx], scratch.b);
         break;
     case 1:
-        yt = demucscpp::conv1d<192, 384, 3, 1, 1, 1>(
-            xt_in + skip, model.tdecoder_rewrite_weight[tdecoder_idx],
-            model.tdecoder_rewrite_bias[tdecoder_idx]);
+        demucscpp::conv1d<192, 384, 3, 1, 1, 1>(
+            yt_in, model.tdecoder_rewrite_weight_packed[tdecoder_idx],
+            model.tdecoder_rewrite_bias[tdecoder_idx], scratch.b);
         break;
     case 2:
-        yt = demucscpp::conv1d<96, 192, 3, 1, 1, 1>(
-            xt_in + skip, model.tdecoder_rewrite_weight[tdecoder_idx],
-            model.tdecoder_rewrite_bias[tdecoder_idx]);
+        demucscpp::conv1d<96, 192, 3, 1, 1, 1>(
+            yt_in, model.tdecoder_rewrite_weight_packed[tdecoder_idx],
+            model.tdecoder_rewrite_bias[tdecoder_idx], scratch.b);
         break;
     case 3:
-        yt = demucscpp::conv1d<48, 96, 3, 1, 1, 1>(
-            xt_in + skip, model.tdecoder_rewrite_weight[tdecoder_idx],
-            model.tdecoder_rewrite_bias[tdecoder_idx]);
+        demucscpp::conv1d<48, 96, 3, 1, 1, 1>(
+            yt_in, model.tdecoder_rewrite_weight_packed[tdecoder_idx],
+            model.tdecoder_rewrite_bias[tdecoder_idx], scratch.b);
         break;
     };
 
-    yt = demucscpp::glu(yt, 1);
+    demucscpp::glu(scratch.b.tensor(), 1, scratch.y);
 
     // start the DConv
-    demucscpp::apply_dconv(model, yt, 1, 1, 4 - tdecoder_idx - 1, crop);
+    Eigen::Tensor3dXfMap yt = demucscpp::apply_dconv(
+        model, scratch.y.tensor(), 1, 1, 4 - tdecoder_idx - 1, crop, scratch);
 
     // dconv finished
 
     // next, apply the final transpose convolution
-    Eigen::Tensor3dXf yt_tmp;
-
     switch (tdecoder_idx)
     {
     case 0:
-        yt_tmp = demucscpp::conv1d_tr_fused_gelu<384, 192, 8, 4, 0, 1>(
-            yt, model.tdecoder_conv_tr_weight[tdecoder_idx],
-            model.tdecoder_conv_tr_bias[tdecoder_idx]);
+        demucscpp::conv1d_tr_fused_gelu<384, 192, 8, 4, 0, 1>(
+            yt, model.tdecoder_conv_tr_weight_packed[tdecoder_idx],
+            model.tdecoder_conv_tr_bias[tdecoder_idx], scratch.a);
         break;
     case 1:
-        yt_tmp = demucscpp::conv1d_tr_fused_gelu<192, 96, 8, 4, 0, 1>(
-            yt, model.tdecoder_conv_tr_weight[tdecoder_idx],
-            model.tdecoder_conv_tr_bias[tdecoder_idx]);
+        demucscpp::conv1d_tr_fused_gelu<192, 96, 8, 4, 0, 1>(
+            yt, model.tdecoder_conv_tr_weight_packed[tdecoder_idx],
+            model.tdecoder_conv_tr_bias[tdecoder_idx], scratch.a);
         break;
     case 2:
-        yt_tmp = demucscpp::conv1d_tr_fused_gelu<96, 48, 8, 4, 0, 1>(
-            yt, model.tdecoder_conv_tr_weight[tdecoder_idx],
-            model.tdecoder_conv_tr_bias[tdecoder_idx]);
+        demucscpp::conv1d_tr_fused_gelu<96, 48, 8, 4, 0, 1>(
+            yt, model.tdecoder_conv_tr_weight_packed[tdecoder_idx],
+            model.tdecoder_conv_tr_bias[tdecoder_idx], scratch.a);
         break;
     case 3:
         if (model.num_sources == 6)
         {
-            yt_tmp = demucscpp::conv1d_tr<48, 12, 8, 4, 0, 1>(
-                yt, model.tdecoder_conv_tr_weight[tdecoder_idx],
-                model.tdecoder_conv_tr_bias[tdecoder_idx]);
+            demucscpp::conv1d_tr<48, 12, 8, 4, 0, 1>(
+                yt, model.tdecoder_conv_tr_weight_packed[tdecoder_idx],
+                model.tdecoder_conv_tr_bias[tdecoder_idx], scratch.a);
         }
         else if (model.num_sources == 4)
         {
-            yt_tmp = demucscpp::conv1d_tr<48, 8, 8, 4, 0, 1>(
-                yt, model.tdecoder_conv_tr_weight[tdecoder_idx],
-                model.tdecoder_conv_tr_bias[tdecoder_idx]);
+            demucscpp::conv1d_tr<48, 8, 8, 4, 0, 1>(
+                yt, model.tdecoder_conv_tr_weight_packed[tdecoder_idx],
+                model.tdecoder_conv_tr_bias[tdecoder_idx], scratch.a);
         }
         else if (model.num_sources == 2)
         {
-            yt_tmp = demucscpp::conv1d_tr<48, 4, 8, 4, 0, 1>(
-                yt, model.tdecoder_conv_tr_weight[tdecoder_idx],
-                model.tdecoder_conv_tr_bias[tdecoder_idx]);
+            demucscpp::conv1d_tr<48, 4, 8, 4, 0, 1>(
+                yt, model.tdecoder_conv_tr_weight_packed[tdecoder_idx],
+                model.tdecoder_conv_tr_bias[tdecoder_idx], scratch.a);
         }
         break;
     };
 
-    yt = yt_tmp;
+    Eigen::Tensor3dXfMap yt_tr = scratch.a.tensor();
 
     // remove padding
     // 2:2+length
-    xt_out = yt.slice(Eigen::array<Eigen::Index, 3>({0, 0, 2}),
-                      Eigen::array<Eigen::Index, 3>(
-                          {yt.dimension(0), yt.dimension(1), out_length}));
+    xt_out = yt_tr.slice(Eigen::array<Eigen::Index, 3>({0, 0, 2}),
+                         Eigen::array<Eigen::Index, 3>(
+                             {yt_tr.dimension(0), yt_tr.dimension(1),
+                              out_length}));
 }
 
 void demucscpp_v3::apply_freq_encoder_v3(
     const struct demucscpp_v3::demucs_v3_model &model, int encoder_idx,
     const Eigen::Tensor3dXf &x_in, Eigen::Tensor3dXf &x_out)
 {
+    DEMUCS_PROFILE_SCOPE("freq encoder", encoder_idx);
+
     Eigen::Tensor3dXf x_shuf = x_in.shuffle(Eigen::array<int, 3>({2, 0, 1}));
 
     // 2D Convolution operation
@@ -450,6 +467,8 @@ void demucscpp_v3::apply_time_encoder_v3(
     const struct demucscpp_v3::demucs_v3_model &model, int tencoder_idx,
     const Eigen::Tensor3dXf &xt_in, Eigen::Tensor3dXf &xt_out)
 {
+    DEMUCS_PROFILE_SCOPE("time encoder", tencoder_idx);
+
     int crop = demucscpp::TIME_BRANCH_LEN_0;
     // switch case for tencoder_idx
     switch (tencoder_idx)
@@ -533,6 +552,8 @@ void demucscpp_v3::apply_time_encoder_4(
     const struct demucscpp_v3::demucs_v3_model &model,
     const Eigen::Tensor3dXf &xt_in, Eigen::Tensor3dXf &xt_out)
 {
+    DEMUCS_PROFILE_SCOPE("time encoder", 4);
+
     // now implement the forward pass
     // first, apply the convolution
     // Conv1d(2, 48, kernel_size=(8,), stride=(4,), padding=(2,))
@@ -548,6 +569,8 @@ void demucscpp_v3::apply_freq_encoder_4(
     Eigen::Tensor3dXf &x_out,
     struct demucscpp_v3::demucs_v3_segment_buffers &buffers)
 {
+    DEMUCS_PROFILE_SCOPE("freq encoder", 4);
+
     const int encoder_idx = 0;
 
     // 2D Convolution operation
@@ -590,6 +613,8 @@ void demucscpp_v3::apply_shared_encoder_5(
     const Eigen::Tensor3dXf &x_in, Eigen::Tensor3dXf &x_out,
     struct demucscpp_v3::demucs_v3_segment_buffers &buffers)
 {
+    DEMUCS_PROFILE_SCOPE("shared encoder", 5);
+
     // 2D Convolution operation
     Eigen::Tensor3dXf y;
     Eigen::Tensor3dXf y_shuff;
@@ -631,6 +656,8 @@ Eigen::Tensor3dXf demucscpp_v3::apply_shared_decoder_0(
     const struct demucscpp_v3::demucs_v3_model &model, Eigen::Tensor3dXf &x_out,
     const Eigen::Tensor3dXf &skip)
 {
+    DEMUCS_PROFILE_SCOPE("shared decoder", 0);
+
     const int decoder_idx = 0;
 
     // input is empty, so we use skip directly
@@ -673,6 +700,8 @@ Eigen::Tensor3dXf demucscpp_v3::apply_freq_decoder_1(
     const Eigen::Tensor3dXf &x_in, Eigen::Tensor3dXf &x_out,
     const Eigen::Tensor3dXf &skip)
 {
+    DEMUCS_PROFILE_SCOPE("freq decoder", 1);
+
     const int decoder_idx = 1;
 
     Eigen::Tensor3dXf y = x_in.shuffle(Eigen::array<int, 3>({1, 0, 2})) + skip;
@@ -714,6 +743,8 @@ void demucscpp_v3::apply_time_decoder_0(
     const struct demucscpp_v3::demucs_v3_model &model,
     const Eigen::Tensor3dXf &x_in, Eigen::Tensor3dXf &x_out)
 {
+    DEMUCS_PROFILE_SCOPE("time decoder", 0);
+
     // simple decoder
     // rewrite and conv_tr, no group norms
     // swap first two dims
@@ -744,6 +775,10 @@ void demucscpp_v3::apply_common_decoder(
     const Eigen::Tensor3dXf &x_in, Eigen::Tensor3dXf &x_out,
     const Eigen::Tensor3dXf &skip)
 {
+    DEMUCS_PROFILE_SCOPE(freq_or_time_idx == 0 ? "freq decoder"
+                                               : "time decoder",
+                         decoder_idx);
+
     // simple decoder
     // rewrite and conv_tr, no group norms
 
@@ -7,26 +7,30 @@
 
 namespace demucscpp
 {
+// the encoders and decoders write their output into the view they are given,
+// with their temporaries in the scratch of their branch
 void apply_freq_encoder(const struct demucscpp::demucs_model &model,
-                        int encoder_idx, const Eigen::Tensor3dXf &x_in,
-                        Eigen::Tensor3dXf &x_out);
+                        int encoder_idx, const Eigen::Tensor3dXfMap &x_in,
+                        Eigen::Tensor3dXfMap &x_out, layer_scratch &scratch);
 
 // forward declaration to apply a frequency decoder
 void apply_freq_decoder(const struct demucscpp::demucs_model &model,
-                        int decoder_idx, const Eigen::Tensor3dXf &x_in,
-                        Eigen::Tensor3dXf &x_out,
-                        const Eigen::Tensor3dXf &skip);
+                        int decoder_idx, const Eigen::Tensor3dXfMap &x_in,
+                        Eigen::Tensor3dXfMap &x_out,
+                        const Eigen::Tensor3dXfMap &skip,
+                        layer_scratch &scratch);
 
 // forward declaration to apply a time encoder
 void apply_time_encoder(const struct demucscpp::demucs_model &model,
-                        int encoder_idx, const Eigen::Tensor3dXf &xt_in,
-                        Eigen::Tensor3dXf &xt_out);
+                        int encoder_idx, const Eigen::Tensor3dXfMap &xt_in,
+                        Eigen::Tensor3dXfMap &xt_out, layer_scratch &scratch);
 
 // forward declaration to apply a time decoder
 void apply_time_decoder(const struct demucscpp::demucs_model &model,
-                        int decoder_idx, const Eigen::Tensor3dXf &xt_in,
-                        Eigen::Tensor3dXf &xt_out,
-                        const Eigen::Tensor3dXf &skip);
+                        int decoder_idx, const Eigen::Tensor3dXfMap &xt_in,
+                        Eigen::Tensor3dXfMap &xt_out,
+                        const Eigen::Tensor3dXfMap &skip,
+                        layer_scratch &scratch);
 } // namespace demucscpp
 
 namespace demucscpp_v3
@@ -0,0 +1,500 @@
+#include "gemm.hpp"
+#include "threadpool.hpp"
+#include <Eigen/Dense>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#if defined(__ARM_FEATURE_DOTPROD)
+#include <arm_neon.h>
+#endif
+
+// split the longer of the m x n output dimensions into about two panels per
+// thread, for some slack in the load balancing, and run
+// panel(split_rows, begin, len) for each of them
+template <typename PanelFn>
+static void run_panels(int m, int n, int k, const PanelFn &panel_fn)
+{
+    double flops = (double)m * n * k;
+
+    int num_threads = demucscpp::get_num_threads();
+    if (num_threads == 1 || demucscpp::in_worker_thread() ||
+        flops < demucscpp::GEMM_MIN_PARALLEL_FLOPS)
+    {
+        panel_fn(true, 0, m);
+        return;
+    }
+
+    const int align = demucscpp::GEMM_PANEL_ALIGN;
+    bool split_rows = m >= n;
+    int dim = split_rows ? m : n;
+    int panel = (dim + 2 * num_threads - 1) / (2 * num_threads);
+    panel = std::max(align, (panel + align - 1) / align * align);
+    int nb_panels = (dim + panel - 1) / panel;
+
+    demucscpp::parallel_for(
+        nb_panels,
+        [&](int p)
+        {
+            int begin = p * panel;
+            panel_fn(split_rows, begin, std::min(panel, dim - begin));
+        });
+}
+
+// the temporaries of the products below, kept per thread from one product to
+// the next and only ever grown, so that the products stop allocating once
+// they have reached their largest size
+enum scratch_slot
+{
+    LHS_PACK,
+    RHS_PACK,
+    ROW_SCALES,
+    INVERSE_SCALES,
+    WEIGHT_BLOCK,
+    QUANTIZED_ROWS,
+};
+
+template <typename Scalar, scratch_slot slot>
+static Scalar *scratch(Eigen::Index size)
+{
+    thread_local Eigen::Matrix<Scalar, Eigen::Dynamic, 1> storage;
+    if (storage.size() < size)
+    {
+        storage.resize(size);
+    }
+    return storage.data();
+}
+
+// the blocking of Eigen's GEMM kernel, with the block sizes Eigen picks for a
+// single thread, and the packing buffers taken from the scratch; Eigen's own
+// products allocate them for every product once they are over its stack
+// allocation limit
+class scratch_blocking : public Eigen::internal::level3_blocking<float, float>
+{
+  public:
+    scratch_blocking(Eigen::Index rows, Eigen::Index cols, Eigen::Index depth)
+    {
+        m_mc = rows;
+        m_nc = cols;
+        m_kc = depth;
+        Eigen::internal::computeProductBlockingSizes<float, float, 1>(
+            m_kc, m_mc, m_nc);
+        m_blockA = scratch<float, LHS_PACK>(m_mc * m_kc);
+        m_blockB = scratch<float, RHS_PACK>(m_kc * m_nc);
+    }
+};
+
+// c = lhs * rhs with Eigen's GEMM kernel, for operands and a column-major c
+// that have direct access to their coefficients
+template <typename Lhs, typename Rhs, typename Result>
+static void kernel_product(const Lhs &lhs, const Rhs &rhs, Result &c)
+{
+    constexpr int lhs_order = Lhs::IsRowMajor ? Eigen::RowMajor
+                                              : Eigen::ColMajor;
+    constexpr int rhs_order = Rhs::IsRowMajor ? Eigen::RowMajor
+                                              : Eigen::ColMajor;
+
+    // the kernel accumulates into c
+    c.setZero();
+    scratch_blocking blocking(lhs.rows(), rhs.cols(), lhs.cols());
+    Eigen::internal::general_matrix_matrix_product<
+        Eigen::Index, float, lhs_order, false, float, rhs_order, false,
+        Eigen::ColMajor, 1>::run(lhs.rows(), rhs.cols(), lhs.cols(),
+                                 lhs.data(), lhs.outerStride(), rhs.data(),
+                                 rhs.outerStride(), c.data(), 1,
+                                 c.outerStride(), 1.0f, blocking);
+}
+
+// c = a * b^T, where b is a block of rows of a weight matrix, as
+// c.noalias() = a * b.transpose() computes it
+//
+// a and c are either plain column-major matrices or the transposed views of
+// gemm_wx, in which case the product is run as c^T = b * a^T, so that the
+// kernel always writes a column-major result
+//
+// the products that Eigen evaluates without its GEMM kernel (the small ones,
+// by coefficients, and the matrix-vector ones) still go through Eigen
+template <typename Activations, typename Weights, typename Result>
+static void product_nt(const Activations &a, const Weights &b, Result c)
+{
+    const Eigen::Index m = a.rows();
+    const Eigen::Index n = b.rows();
+    const Eigen::Index k = a.cols();
+    if (m <= 1 || n <= 1 || k == 0 ||
+        k + m + n < EIGEN_GEMM_TO_COEFFBASED_THRESHOLD)
+    {
+        c.noalias() = a * b.transpose();
+        return;
+    }
+
+    if constexpr (Result::IsRowMajor)
+    {
+        auto c_t = c.transpose();
+        kernel_product(b, a.transpose(), c_t);
+    }
+    else
+    {
+        kernel_product(a, b.transpose(), c);
+    }
+}
+
+#if defined(__ARM_FEATURE_DOTPROD)
+// the operands stay int8 for sdot
+using qvalue = int8_t;
+#else
+// the operands are widened to int16, so that the compiler can use the
+// multiply-adds of int16 pairs into int32 (pmaddwd, smlal)
+using qvalue = int16_t;
+#endif
+
+using MatrixXq =
+    Eigen::Matrix<qvalue, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+using MatrixXqMap = Eigen::Map<MatrixXq>;
+
+// out[r * S + s] = the int32 dot product of rows r of a and s of w, over k
+template <int R, int S>
+static inline void dot_tile(const qvalue *a, int lda, const qvalue *w,
+                            int ldw, int k, int32_t *out)
+{
+    int32_t acc[R][S] = {};
+    for (int x = 0; x < k; ++x)
+    {
+        for (int r = 0; r < R; ++r)
+        {
+            for (int s = 0; s < S; ++s)
+            {
+                acc[r][s] += (int32_t)a[r * lda + x] * (int32_t)w[s * ldw + x];
+            }
+        }
+    }
+    for (int r = 0; r < R; ++r)
+    {
+        for (int s = 0; s < S; ++s)
+        {
+            out[r * S + s] = acc[r][s];
+        }
+    }
+}
+
+#if defined(__ARM_FEATURE_DOTPROD)
+// sdot: 16 products summed into 4 lanes per instruction
+template <>
+inline void dot_tile<2, 4>(const qvalue *a, int lda, const qvalue *w,
+                           int ldw, int k, int32_t *out)
+{
+    int32x4_t acc[2][4];
+    for (int r = 0; r < 2; ++r)
+    {
+        for (int s = 0; s < 4; ++s)
+        {
+            acc[r][s] = vdupq_n_s32(0);
+        }
+    }
+
+    int x = 0;
+    for (; x + 16 <= k; x += 16)
+    {
+        int8x16_t a0 = vld1q_s8(a + x);
+        int8x16_t a1 = vld1q_s8(a + lda + x);
+        for (int s = 0; s < 4; ++s)
+        {
+            int8x16_t ws = vld1q_s8(w + s * ldw + x);
+            acc[0][s] = vdotq_s32(acc[0][s], a0, ws);
+            acc[1][s] = vdotq_s32(acc[1][s], a1, ws);
+        }
+    }
+
+    int32_t tail[8];
+    dot_tile<2, 4>(a + x, lda, w + x, ldw, k - x, tail);
+    for (int r = 0; r < 2; ++r)
+    {
+        for (int s = 0; s < 4; ++s)
+        {
+            out[r * 4 + s] = vaddvq_s32(acc[r][s]) + tail[r * 4 + s];
+        }
+    }
+}
+#endif
+
+// c(i0 + r, j0 + s) for an R x S tile of rows of qa and of the block wb
+template <int R, int S, typename Result>
+static inline void store_tile(const MatrixXqMap &qa,
+                              const Eigen::Map<Eigen::VectorXf> &a_scales,
+                              const MatrixXqMap &wb, const float *w_scales,
+                              int i0, int j0, int jb0, Result &c)
+{
+    const int k = qa.cols();
+    int32_t out[R * S];
+    dot_tile<R, S>(qa.row(i0).data(), k, wb.row(jb0).data(), k, k, out);
+    for (int s = 0; s < S; ++s)
+    {
+        for (int r = 0; r < R; ++r)
+        {
+            c(i0 + r, j0 + s) =
+                (float)out[r * S + s] * a_scales(i0 + r) * w_scales[s];
+        }
+    }
+}
+
+// symmetric quantization of the rows of a, scales(r) = max |a.row(r)| / 127
+template <typename Activations, typename Quantized, typename Scales>
+static void quantize_rows(const Activations &a, Quantized &q, Scales &scales)
+{
+    scales = a.cwiseAbs().rowwise().maxCoeff() / 127.0f;
+    Eigen::Map<Eigen::VectorXf> inv(scratch<float, INVERSE_SCALES>(a.rows()),
+                                    a.rows());
+    inv = (scales.array() > 0.0f).select(scales.array().inverse(), 0.0f);
+    q = (a.array().colwise() * inv.array())
+            .round()
+            .template cast<typename Quantized::Scalar>();
+}
+
+// c = a * w^T for rows [row_begin, row_begin + nb_rows) of an int8 w
+//
+// the activations are quantized per row, and the weights are widened to
+// qvalue a block of rows at a time; the 2 x 4 tiles of the output are dot
+// products of 2 rows of a with 4 rows of the block, which keeps 8 int32
+// accumulators in registers
+template <typename Activations, typename Result>
+static void gemm_nt_int8(const Activations &a, const demucscpp::gemm_weight &w,
+                         int row_begin, int nb_rows, Result c)
+{
+    const int m = a.rows();
+    const int k = a.cols();
+
+    MatrixXqMap qa(scratch<qvalue, QUANTIZED_ROWS>(m * k), m, k);
+    Eigen::Map<Eigen::VectorXf> a_scales(scratch<float, ROW_SCALES>(m), m);
+    quantize_rows(a, qa, a_scales);
+
+    // blocks of weight rows of about 128 KiB, a multiple of 4 rows
+    const int block_rows =
+        std::max(4, (128 * 1024 / (k * (int)sizeof(qvalue))) / 4 * 4);
+    const int wb_rows = std::min(block_rows, nb_rows);
+    MatrixXqMap wb(scratch<qvalue, WEIGHT_BLOCK>(wb_rows * k), wb_rows, k);
+
+    for (int j0 = 0; j0 < nb_rows; j0 += block_rows)
+    {
+        const int nb = std::min(block_rows, nb_rows - j0);
+        wb.topRows(nb) =
+            w.i8.middleRows(row_begin + j0, nb).template cast<qvalue>();
+        const float *w_scales = w.i8_scales.data() + row_begin + j0;
+
+        const int m2 = m / 2 * 2;
+        const int nb4 = nb / 4 * 4;
+        for (int i = 0; i < m2; i += 2)
+        {
+            for (int j = 0; j < nb4; j += 4)
+            {
+                store_tile<2, 4>(qa, a_scales, wb, w_scales + j, i, j0 + j, j,
+                                 c);
+            }
+            for (int j = nb4; j < nb; ++j)
+            {
+                store_tile<2, 1>(qa, a_scales, wb, w_scales + j, i, j0 + j, j,
+                                 c);
+            }
+        }
+        for (int i = m2; i < m; ++i)
+        {
+            for (int j = 0; j < nb; ++j)
+            {
+                store_tile<1, 1>(qa, a_scales, wb, w_scales + j, i, j0 + j, j,
+                                 c);
+            }
+        }
+    }
+}
+
+// Eigen only has hardware fp16 conversions on aarch64 and with F16C and
+// otherwise emulates them bit by bit, so there the weights are widened with a
+// lookup table over all 2^16 bit patterns instead, as in model_load.cpp
+#if defined(__aarch64__) || defined(__F16C__)
+static constexpr bool native_fp16 = true;
+#else
+static constexpr bool native_fp16 = false;
+#endif
+
+using MatrixXfr =
+    Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+using MatrixXfrMap = Eigen::Map<MatrixXfr>;
+
+static void widen_f16_rows(const demucscpp::MatrixXh &h, int row_begin,
+                           int nb_rows, MatrixXfrMap &out)
+{
+    if constexpr (native_fp16)
+    {
+        out.topRows(nb_rows) = h.middleRows(row_begin, nb_rows).cast<float>();
+    }
+    else
+    {
+        static const std::vector<float> table = []()
+        {
+            std::vector<float> t(1 << 16);
+            for (int bits = 0; bits < (1 << 16); ++bits)
+            {
+                t[bits] = static_cast<float>(
+                    Eigen::numext::bit_cast<Eigen::half>((uint16_t)bits));
+            }
+            return t;
+        }();
+
+        const int k = h.cols();
+        for (int r = 0; r < nb_rows; ++r)
+        {
+            const Eigen::half *src = h.row(row_begin + r).data();
+            float *dst = out.row(r).data();
+            for (int x = 0; x < k; ++x)
+            {
+                dst[x] = table[Eigen::numext::bit_cast<uint16_t>(src[x])];
+            }
+        }
+    }
+}
+
+// c = a * w^T for rows [row_begin, row_begin + nb_rows) of an fp16 w
+//
+// the weights are widened to float a block of rows at a time, small enough
+// to stay in cache for the Eigen product that follows, so the float copy of
+// the whole matrix never exists; the products (and their accumulation) are
+// in float, as in the f32 path
+template <typename Activations, typename Result>
+static void gemm_nt_f16(const Activations &a, const demucscpp::gemm_weight &w,
+                        int row_begin, int nb_rows, Result c)
+{
+    const int k = a.cols();
+
+    // blocks of weight rows of about 256 KiB, a multiple of 16 rows
+    const int block_rows =
+        std::max(16, (256 * 1024 / (k * (int)sizeof(float))) / 16 * 16);
+    const int wb_rows = std::min(block_rows, nb_rows);
+    MatrixXfrMap wb(scratch<float, WEIGHT_BLOCK>(wb_rows * k), wb_rows, k);
+
+    for (int j0 = 0; j0 < nb_rows; j0 += block_rows)
+    {
+        const int nb = std::min(block_rows, nb_rows - j0);
+        widen_f16_rows(w.f16, row_begin + j0, nb, wb);
+        product_nt(a, wb.topRows(nb), c.middleCols(j0, nb));
+    }
+}
+
+void demucscpp::gemm_weight::quantize_int8()
+{
+    if (f32.size() == 0)
+    {
+        return;
+    }
+    quantize_rows(f32, i8, i8_scales);
+    f32 = Eigen::MatrixXf();
+}
+
+void demucscpp::gemm_weight::convert_f16()
+{
+    if (f32.size() == 0)
+    {
+        return;
+    }
+    f16 = f32.cast<Eigen::half>();
+    f32 = Eigen::MatrixXf();
+}
+
+std::size_t demucscpp::gemm_weight::nbytes() const
+{
+    return f32.size() * sizeof(float) + i8.size() * sizeof(int8_t) +
+           i8_scales.size() * sizeof(float) +
+           f16.size() * sizeof(Eigen::half);
+}
+
+// c = a * w^T for rows [row_begin, row_begin + nb_rows) of w, with any of
+// the weight formats
+template <typename Activations, typename Result>
+static void serial_nt(const Activations &a, const demucscpp::gemm_weight &w,
+                      int row_begin, int nb_rows, Result c)
+{
+    if (w.is_int8())
+    {
+        gemm_nt_int8(a, w, row_begin, nb_rows, c);
+    }
+    else if (w.is_f16())
+    {
+        gemm_nt_f16(a, w, row_begin, nb_rows, c);
+    }
+    else
+    {
+        product_nt(a, w.f32.middleRows(row_begin, nb_rows), c);
+    }
+}
+
+void demucscpp::gemm_nt_serial(const Eigen::Ref<const Eigen::MatrixXf> &a,
+                               const gemm_weight &w, int row_begin,
+                               int nb_rows, Eigen::Ref<Eigen::MatrixXf> c)
+{
+    serial_nt(a, w, row_begin, nb_rows, c);
+}
+
+void demucscpp::gemm_wx_serial(const gemm_weight &w, int row_begin,
+                               int nb_rows,
+                               const Eigen::Ref<const Eigen::MatrixXf> &x,
+                               Eigen::Ref<Eigen::MatrixXf> c)
+{
+    serial_nt(x.transpose(), w, row_begin, nb_rows, c.transpose());
+}
+
+void demucscpp::gemm_nt(const Eigen::Ref<const Eigen::MatrixXf> &a,
+                        const Eigen::MatrixXf &b, Eigen::Ref<Eigen::MatrixXf> c)
+{
+    run_panels(a.rows(), b.rows(), a.cols(),
+               [&](bool split_rows, int begin, int len)
+               {
+                   if (split_rows)
+                   {
+                       product_nt(a.middleRows(begin, len), b,
+                                  c.middleRows(begin, len));
+                   }
+                   else
+                   {
+                       product_nt(a, b.middleRows(begin, len),
+                                  c.middleCols(begin, len));
+                   }
+               });
+}
+
+void demucscpp::gemm_nt(const Eigen::Ref<const Eigen::MatrixXf> &a,
+                        const gemm_weight &w, int row_begin, int nb_rows,
+                        Eigen::Ref<Eigen::MatrixXf> c)
+{
+    run_panels(a.rows(), nb_rows, a.cols(),
+               [&](bool split_rows, int begin, int len)
+               {
+                   if (split_rows)
+                   {
+                       gemm_nt_serial(a.middleRows(begin, len), w, row_begin,
+                                      nb_rows, c.middleRows(begin, len));
+                   }
+                   else
+                   {
+                       gemm_nt_serial(a, w, row_begin + begin, len,
+                                      c.middleCols(begin, len));
+                   }
+               });
+}
+
+void demucscpp::gemm_wx(const gemm_weight &w, int row_begin, int nb_rows,
+                        const Eigen::Ref<const Eigen::MatrixXf> &x,
+                        Eigen::Ref<Eigen::MatrixXf> c)
+{
+    run_panels(x.cols(), nb_rows, x.rows(),
+               [&](bool split_rows, int begin, int len)
+               {
+                   if (split_rows)
+                   {
+                       gemm_wx_serial(w, row_begin, nb_rows,
+                                      x.middleCols(begin, len),
+                                      c.middleCols(begin, len));
+                   }
+                   else
+                   {
+                       gemm_wx_serial(w, row_begin + begin, len, x,
+                                      c.middleRows(begin, len));
+                   }
+               });
+}
@@ -0,0 +1,153 @@
+#ifndef GEMM_HPP
+#define GEMM_HPP
+
+#include <Eigen/Dense>
+#include <cstdint>
+#include <utility>
+
+namespace demucscpp
+{
+
+// the dense matrix products of the model (the linear layers of the
+// transformers, the lstm input projections, and the conv tiles and 1x1 convs
+// of conv.hpp) all go through here, so that a different backend only has to
+// replace gemm.cpp
+//
+// products are split into panels of rows (or columns, whichever dimension is
+// longer) that run on the thread pool of threadpool.hpp, so the thread count
+// is the one given to set_num_threads; panels are multiples of 64 rows, which
+// divides the channel counts of htdemucs evenly, and each panel is an Eigen
+// product of its own
+
+// the smallest product (in multiply-adds) worth splitting across threads
+constexpr double GEMM_MIN_PARALLEL_FLOPS = 1 << 20;
+
+// the panel size is rounded to a multiple of this
+constexpr int GEMM_PANEL_ALIGN = 64;
+
+// how the weights of a model are kept in memory
+enum class weight_precision
+{
+    f32,
+    // int8 with one scale per output channel, for the weights of the
+    // transformer linear layers and the 1x1 convs; the activations are
+    // quantized per row on the fly, and the products accumulate in int32
+    int8,
+    // fp16, widened back to float a block of rows at a time inside the
+    // product, for the same weights as int8; half the memory and bandwidth
+    // of f32 at close to its accuracy
+    f16,
+};
+
+using MatrixXi8 =
+    Eigen::Matrix<int8_t, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+using MatrixXh = Eigen::Matrix<Eigen::half, Eigen::Dynamic, Eigen::Dynamic,
+                               Eigen::RowMajor>;
+
+// a weight matrix as used by gemm_nt, with one output channel per row (the
+// way torch stores linear and packed conv weights), held either in float,
+// after quantize_int8 as int8 rows where row r is i8.row(r) * i8_scales(r),
+// or after convert_f16 in fp16
+struct gemm_weight
+{
+    gemm_weight() = default;
+
+    // implicit, so that weights can be initialized and packed as before
+    gemm_weight(Eigen::MatrixXf w) : f32(std::move(w)) {}
+
+    Eigen::MatrixXf f32;
+    MatrixXi8 i8;
+    Eigen::VectorXf i8_scales;
+    MatrixXh f16;
+
+    bool is_int8() const { return i8.size() > 0; }
+    bool is_f16() const { return f16.size() > 0; }
+    int rows() const
+    {
+        return is_int8() ? i8.rows() : is_f16() ? f16.rows() : f32.rows();
+    }
+    int cols() const
+    {
+        return is_int8() ? i8.cols() : is_f16() ? f16.cols() : f32.cols();
+    }
+
+    // replace the float weights by their symmetric int8 quantization
+    void quantize_int8();
+
+    // replace the float weights by their fp16 rounding
+    void convert_f16();
+
+    // bytes of weight data held
+    std::size_t nbytes() const;
+};
+
+// c = a * b^T, where c is already sized a.rows() x b.rows()
+//
+// the call is serial when it is small, when there is only one thread, or
+// when it is made from a pool worker
+void gemm_nt(const Eigen::Ref<const Eigen::MatrixXf> &a,
+             const Eigen::MatrixXf &b, Eigen::Ref<Eigen::MatrixXf> c);
+
+// c = a * w^T with rows [row_begin, row_begin + nb_rows) of w, where c is
+// already sized a.rows() x nb_rows
+void gemm_nt(const Eigen::Ref<const Eigen::MatrixXf> &a,
+             const gemm_weight &w, int row_begin, int nb_rows,
+             Eigen::Ref<Eigen::MatrixXf> c);
+
+// the same, always on the calling thread, for callers that already share
+// their work out between threads
+void gemm_nt_serial(const Eigen::Ref<const Eigen::MatrixXf> &a,
+                    const gemm_weight &w, int row_begin, int nb_rows,
+                    Eigen::Ref<Eigen::MatrixXf> c);
+
+inline void gemm_nt(const Eigen::Ref<const Eigen::MatrixXf> &a,
+                    const gemm_weight &w, Eigen::Ref<Eigen::MatrixXf> c)
+{
+    gemm_nt(a, w, 0, w.rows(), c);
+}
+
+// c = w * x with rows [row_begin, row_begin + nb_rows) of w, i.e. the same
+// product for activations that hold one input per column, as the tensors of
+// the 1x1 convs do (see conv1x1 in conv.hpp), where c is already sized
+// nb_rows x x.cols(); this runs gemm_nt on the transposed views of x and c,
+// so nothing is copied into place
+void gemm_wx(const gemm_weight &w, int row_begin, int nb_rows,
+             const Eigen::Ref<const Eigen::MatrixXf> &x,
+             Eigen::Ref<Eigen::MatrixXf> c);
+
+void gemm_wx_serial(const gemm_weight &w, int row_begin, int nb_rows,
+                    const Eigen::Ref<const Eigen::MatrixXf> &x,
+                    Eigen::Ref<Eigen::MatrixXf> c);
+
+inline void gemm_wx(const gemm_weight &w,
+                    const Eigen::Ref<const Eigen::MatrixXf> &x,
+                    Eigen::Ref<Eigen::MatrixXf> c)
+{
+    gemm_wx(w, 0, w.rows(), x, c);
+}
+
+// the overloads below resize c first
+inline void gemm_nt(const Eigen::Ref<const Eigen::MatrixXf> &a,
+                    const Eigen::MatrixXf &b, Eigen::MatrixXf &c)
+{
+    c.resize(a.rows(), b.rows());
+    gemm_nt(a, b, Eigen::Ref<Eigen::MatrixXf>(c));
+}
+
+inline void gemm_nt(const Eigen::Ref<const Eigen::MatrixXf> &a,
+                    const gemm_weight &w, int row_begin, int nb_rows,
+                    Eigen::MatrixXf &c)
+{
+    c.resize(a.rows(), nb_rows);
+    gemm_nt(a, w, row_begin, nb_rows, Eigen::Ref<Eigen::MatrixXf>(c));
+}
+
+inline void gemm_nt(const Eigen::Ref<const Eigen::MatrixXf> &a,
+                    const gemm_weight &w, Eigen::MatrixXf &c)
+{
+    gemm_nt(a, w, 0, w.rows(), c);
+}
+
+} // namespace demucscpp
+
+#endif // GEMM_HPP
@@ -1,9 +1,16 @@
 #include "layers.hpp"
+#include "activations.hpp"
 #include "conv.hpp"
+#include "gemm.hpp"
 #include "lstm.hpp"
 #include "model.hpp"
+#include "profiler.hpp"
 #include "tensor.hpp"
+#include "threadpool.hpp"
 #include <Eigen/Dense>
+#include <algorithm>
+#include <cmath>
+#include <limits>
 #include <unsupported/Eigen/CXX11/Tensor>
 
 Eigen::Tensor3dXf demucscpp::group_norm(const Eigen::Tensor3dXf &x,
@@ -11,40 +18,8 @@ Eigen::Tensor3dXf demucscpp::group_norm(const Eigen::Tensor3dXf &x,
                                         const Eigen::Tensor1dXf &b,
                                         int num_groups, float eps)
 {
-    int freq = x.dimension(0);
-    int channels = x.dimension(1);
-    int width = x.dimension(2);
-
-    Eigen::Tensor3dXf y_out(freq, channels, width);
-    y_out.setZero();
-
-    int group_size = channels / num_groups;
-
-    for (int i = 0; i < freq; ++i)
-    {
-        for (int g = 0; g < num_groups; ++g)
-        {
-            int start = g * group_size;
-            int end = (g + 1) * group_size;
-
-            Eigen::Tensor3dXf slice =
-                x.slice(Eigen::array<int, 3>{i, start, 0},
-                        Eigen::array<int, 3>{1, group_size, width});
-            Eigen::Tensor<float, 0> mean_tensor = slice.mean();
-            float mean = mean_tensor(0);
-            float var = demucscpp::calculate_variance(slice, mean);
-
-            for (int c = start; c < end; ++c)
-            {
-                for (int w = 0; w < width; ++w)
-                {
-                    float norm_val = (x(i, c, w) - mean) / std::sqrt(var + eps);
-                    y_out(i, c, w) = norm_val * weight(c) + b(c);
-                }
-            }
-        }
-    }
-
+    Eigen::Tensor3dXf y_out;
+    demucscpp::group_norm(x, weight, b, num_groups, eps, y_out);
     return y_out;
 }
 
@@ -53,325 +28,359 @@ demucscpp::group_norm_fused_gelu(const Eigen::Tensor3dXf &x,
                                  const Eigen::Tensor1dXf &weight,
                                  const Eigen::Tensor1dXf &bias, float eps)
 {
-    int freq = x.dimension(0);
-    int channels = x.dimension(1);
-    int width = x.dimension(2);
-
-    Eigen::Tensor3dXf y_out(freq, channels, width);
-    y_out.setZero();
+    Eigen::Tensor3dXf y_out;
+    demucscpp::group_norm_fused_gelu(x, weight, bias, eps, y_out);
+    return y_out;
+}
 
-    // Normalizing over the entire channel since num_groups is always 1
-    for (int i = 0; i < freq; ++i)
-    {
-        // Calculate mean and variance for the entire channel
-        Eigen::Tensor2dXf slice = x.chip<0>(i);
-        Eigen::Tensor<float, 0> mean_tensor = slice.mean();
-        float mean = mean_tensor(0);
-        float var = demucscpp::calculate_variance(slice, mean);
+Eigen::Tensor3dXf demucscpp::glu(const Eigen::Tensor3dXf &x, const int dim)
+{
+    Eigen::Tensor3dXf y_out;
+    demucscpp::glu(x, dim, y_out);
+    return y_out;
+}
 
-        for (int c = 0; c < channels; ++c)
-        {
-            for (int w = 0; w < width; ++w)
-            {
-                // Normalize
-                float norm_val = (x(i, c, w) - mean) / std::sqrt(var + eps);
+Eigen::Tensor3dXf demucscpp::layer_norm(const Eigen::Tensor3dXf &x,
+                                        const Eigen::Tensor1dXf &weight,
+                                        const Eigen::Tensor1dXf &bias,
+                                        float eps)
+{
+    Eigen::Tensor3dXf y_out;
+    demucscpp::layer_norm(x, weight, bias, eps, y_out);
+    return y_out;
+}
 
-                // Apply GroupNorm weight and bias
-                norm_val = norm_val * weight(c) + bias(c);
+Eigen::Tensor3dXf
+demucscpp::layer_scale(const Eigen::Tensor3dXf &x,
+                       const Eigen::Tensor1dXf &scale_weights)
+{
+    Eigen::Tensor3dXf y_out;
+    demucscpp::layer_scale(x, scale_weights, y_out);
+    return y_out;
+}
 
-                // Apply GeLU activation
-                float activated_val =
-                    0.5f * norm_val *
-                    (1.0f + std::erf(norm_val / std::sqrt(2.0f)));
+// stores rows [row_begin, row_begin + n) of a conv output, the GEMM result
+// plus the bias, into out, and their sums and sums of squares into the first
+// and second halves of row_stats
+static void store_rows_with_sums(const demucscpp::conv_tile &result,
+                                 const Eigen::Tensor1dXf &bias, int row_begin,
+                                 int n, Eigen::Map<Eigen::MatrixXf> &out,
+                                 double *row_stats)
+{
+    double *sums = row_stats + row_begin;
+    double *squares = row_stats + out.rows() + row_begin;
+    std::fill(sums, sums + n, 0.0);
+    std::fill(squares, squares + n, 0.0);
 
-                // Assign the activated value back to the tensor
-                y_out(i, c, w) = activated_val;
-            }
+    for (int c = 0; c < out.cols(); ++c)
+    {
+        for (int r = 0; r < n; ++r)
+        {
+            float value = result(r, c) + bias(c);
+            out(row_begin + r, c) = value;
+            sums[r] += value;
+            squares[r] += (double)value * value;
         }
     }
-
-    return y_out;
 }
 
-Eigen::Tensor3dXf demucscpp::glu(const Eigen::Tensor3dXf &x, const int dim)
+// the mean and standard deviation of the group norm (of one group) of each
+// frequency, from the row sums of its (time, freq) rows
+static void group_stats(const double *row_stats, int nb_rows, int freq,
+                        int nb_channels, float eps, float *mean,
+                        float *std_dev)
 {
-    if (x.dimension(dim) % 2 != 0)
+    const double *sums = row_stats;
+    const double *squares = row_stats + nb_rows;
+    for (int w = 0; w < freq; ++w)
     {
-        std::cerr << "Dimension size must be evenly divisible by 2"
-                  << std::endl;
-        std::exit(1);
-    }
-
-    int split_size = x.dimension(dim) / 2;
-
-    Eigen::array<int, 3> start_indices = {0, 0, 0};
-    Eigen::array<int, 3> sizes = {(int)x.dimension(0), (int)x.dimension(1),
-                                  (int)x.dimension(2)};
-    start_indices[dim] = split_size;
-    sizes[dim] = split_size;
-
-    auto first_half = x.slice(Eigen::array<int, 3>({0, 0, 0}), sizes);
-    auto second_half = x.slice(start_indices, sizes);
-    auto sigmoid_second_half = second_half.unaryExpr(
-        [](float v) { return 1.0f / (1.0f + std::exp(-v)); });
+        double sum = 0.0;
+        double sum_squares = 0.0;
+        for (int r = w; r < nb_rows; r += freq)
+        {
+            sum += sums[r];
+            sum_squares += squares[r];
+        }
 
-    return first_half * sigmoid_second_half;
+        // the variance is unbiased, as in group_norm
+        double n = (double)(nb_rows / freq) * nb_channels;
+        double m = sum / n;
+        float var = (float)((sum_squares - sum * m) / (n - 1.0));
+        mean[w] = (float)m;
+        std_dev[w] = std::sqrt(var + eps);
+    }
 }
 
-Eigen::Tensor3dXf demucscpp::layer_norm(const Eigen::Tensor3dXf &x,
-                                        const Eigen::Tensor1dXf &weight,
-                                        const Eigen::Tensor1dXf &bias,
-                                        float eps)
+// one residual branch of the dconv, fused:
+//     y += layer_scale(glu(group_norm(conv_3(gelu(group_norm(conv_0(y)))))))
+// over the first crop time steps of y, the (freq, channels, time) view of
+// scratch.y, which the sum then has as its time axis
+//
+// conv_0 (kernel 3, with the given dilation) and conv_3 (1x1) are implicit
+// GEMMs over the (time, freq) positions, one row each; their outputs are
+// kept in that row order, so no layer writes a strided tensor. The group
+// norms (of one group, i.e. over all the channels and times of a frequency)
+// get their statistics from the GEMM epilogues as the rows are stored, in
+// one pass and in double, instead of reading each frequency back. The first
+// norm and its gelu are applied as conv_3 reads its input tiles, and the
+// second norm, the glu and the residual add in a single pass over the output
+// of conv_3, which is the only one that has to wait for the statistics of the
+// whole tensor; the layer scale is folded into the second norm at load
+template <int channels, int hidden, int branch>
+static void dconv_branch(const struct demucscpp::demucs_model &model,
+                         int freq_idx, int encdec_idx, int layer_idx,
+                         const Eigen::Tensor3dXfMap &y, int crop,
+                         demucscpp::layer_scratch &scratch)
 {
-    int freq = x.dimension(0);
-    int channels = x.dimension(1);
-    int width = x.dimension(2);
-
-    Eigen::Tensor3dXf y_out(freq, channels, width);
-
-    for (int i = 0; i < freq; ++i)
+    constexpr int dilation = 1 << branch;
+    const float eps = 1e-05;
+
+    const int freq = y.dimension(0);
+    const int nb_rows = freq * crop;
+
+    const auto &conv0_weight =
+        model.dconv_layers_0_conv1d_weight_packed[freq_idx][encdec_idx]
+                                                 [layer_idx][branch];
+    const auto &conv0_bias =
+        model.dconv_layers_0_conv1d_bias[freq_idx][encdec_idx][layer_idx]
+                                        [branch];
+    const auto &norm1_weight =
+        model.dconv_layers_1_groupnorm_weight[freq_idx][encdec_idx][layer_idx]
+                                             [branch];
+    const auto &norm1_bias =
+        model.dconv_layers_1_groupnorm_bias[freq_idx][encdec_idx][layer_idx]
+                                           [branch];
+    const auto &conv3_weight =
+        model.dconv_layers_3_conv1d_weight_packed[freq_idx][encdec_idx]
+                                                 [layer_idx][branch];
+    const auto &conv3_bias =
+        model.dconv_layers_3_conv1d_bias[freq_idx][encdec_idx][layer_idx]
+                                        [branch];
+    const auto &norm4_weight =
+        model.dconv_layers_4_groupnorm_weight[freq_idx][encdec_idx][layer_idx]
+                                             [branch];
+    const auto &norm4_bias =
+        model.dconv_layers_4_groupnorm_bias[freq_idx][encdec_idx][layer_idx]
+                                           [branch];
+
+    Eigen::Map<Eigen::MatrixXf> hidden_rows =
+        scratch.a.matrix(nb_rows, hidden);
+    Eigen::Map<Eigen::MatrixXf> gated_rows =
+        scratch.b.matrix(nb_rows, 2 * channels);
+
+    // the row sums and squares, then the mean and deviation of each freq
+    scratch.stats.resize(2 * nb_rows);
+    double *row_stats = scratch.stats.data();
+    float *mean = scratch.q.reserve(2 * freq);
+    float *std_dev = mean + freq;
+
+    // conv_0, only for the rows that are kept
+    demucscpp::implicit_gemm(
+        nb_rows, conv0_weight,
+        [&](int row_begin, int n, demucscpp::conv_tile &tile)
+        {
+            demucscpp::im2col_tile<3, 1, 1, 1, dilation, 0, dilation, 1,
+                                   demucscpp::wch_layout>(y, freq, row_begin,
+                                                          n, tile);
+        },
+        [&](int row_begin, int n, const demucscpp::conv_tile &result)
+        {
+            store_rows_with_sums(result, conv0_bias, row_begin, n, hidden_rows,
+                                 row_stats);
+        });
+    group_stats(row_stats, nb_rows, freq, hidden, eps, mean, std_dev);
+
+    // conv_3, on the normalized hidden rows
+    demucscpp::implicit_gemm(
+        nb_rows, conv3_weight,
+        [&](int row_begin, int n, demucscpp::conv_tile &tile)
+        {
+            for (int c = 0; c < hidden; ++c)
+            {
+                int w = row_begin % freq;
+                for (int r = 0; r < n; ++r)
+                {
+                    float norm_val =
+                        (hidden_rows(row_begin + r, c) - mean[w]) / std_dev[w];
+                    tile(r, c) = norm_val * norm1_weight(c) + norm1_bias(c);
+                    if (++w == freq)
+                    {
+                        w = 0;
+                    }
+                }
+                demucscpp::gelu_inplace(tile.col(c).data(), n);
+            }
+        },
+        [&](int row_begin, int n, const demucscpp::conv_tile &result)
+        {
+            store_rows_with_sums(result, conv3_bias, row_begin, n, gated_rows,
+                                 row_stats);
+        });
+    group_stats(row_stats, nb_rows, freq, 2 * channels, eps, mean, std_dev);
+
+    // the time axis is the last one, so cropping it keeps the values of y in
+    // place; the gates of a time step are normalized into a buffer first, so
+    // that their sigmoid runs over all of them at once
+    Eigen::Tensor3dXfMap y_crop(y.data(), freq, channels, crop);
+    float *gates = scratch.k.reserve(channels * freq);
+    for (int h = 0; h < crop; ++h)
     {
         for (int c = 0; c < channels; ++c)
         {
-            Eigen::Tensor1dXf slice = x.chip(i, 0).chip(c, 0);
-            Eigen::Tensor<float, 0> mean_tensor = slice.mean();
-            float mean = mean_tensor(0);
-            float var = demucscpp::calculate_variance(slice, mean);
+            for (int w = 0; w < freq; ++w)
+            {
+                int r = h * freq + w;
+                float gate =
+                    (gated_rows(r, c + channels) - mean[w]) / std_dev[w];
+                gates[c * freq + w] = gate * norm4_weight(c + channels) +
+                                      norm4_bias(c + channels);
+            }
+        }
+        demucscpp::sigmoid_inplace(gates, channels * freq);
 
-            for (int w = 0; w < width; ++w)
+        for (int c = 0; c < channels; ++c)
+        {
+            for (int w = 0; w < freq; ++w)
             {
-                float norm_val = (x(i, c, w) - mean) / std::sqrt(var + eps);
-                y_out(i, c, w) = norm_val * weight(w) + bias(w);
+                int r = h * freq + w;
+                float value = (gated_rows(r, c) - mean[w]) / std_dev[w];
+                value = value * norm4_weight(c) + norm4_bias(c);
+                y_crop(w, c, h) += value * gates[c * freq + w];
             }
         }
     }
-
-    return y_out;
 }
 
-void demucscpp::apply_dconv(const struct demucscpp::demucs_model &model,
-                            Eigen::Tensor3dXf &y, int freq_idx, int encdec_idx,
-                            int layer_idx, int mid_crop)
+template <int channels, int hidden>
+static void dconv_layer(const struct demucscpp::demucs_model &model,
+                        int freq_idx, int encdec_idx, int layer_idx,
+                        const Eigen::Tensor3dXfMap &y, int mid_crop,
+                        demucscpp::layer_scratch &scratch)
 {
-    // store another copy of y to sum back later
-    Eigen::Tensor3dXf y_copy = y;
+    dconv_branch<channels, hidden, 0>(model, freq_idx, encdec_idx, layer_idx,
+                                      y, y.dimension(2), scratch);
+    dconv_branch<channels, hidden, 1>(model, freq_idx, encdec_idx, layer_idx,
+                                      y, mid_crop, scratch);
+}
 
-    // now dconv time
+Eigen::Tensor3dXfMap
+demucscpp::apply_dconv(const struct demucscpp::demucs_model &model,
+                       const Eigen::Tensor3dXfMap &y, int freq_idx,
+                       int encdec_idx, int layer_idx, int mid_crop,
+                       demucscpp::layer_scratch &scratch)
+{
+    DEMUCS_PROFILE_SCOPE(freq_idx == 0 ? "freq dconv" : "time dconv",
+                         layer_idx);
 
-    switch (layer_idx)
+    if (mid_crop > y.dimension(2))
     {
-    case 0:
-        y = demucscpp::conv1d<48, 6, 3, 1, 1, 1>(
-            y,
-            model.dconv_layers_0_conv1d_weight[freq_idx][encdec_idx][layer_idx]
-                                              [0],
-            model.dconv_layers_0_conv1d_bias[freq_idx][encdec_idx][layer_idx]
-                                            [0]);
-        break;
-    case 1:
-        y = demucscpp::conv1d<96, 12, 3, 1, 1, 1>(
-            y,
-            model.dconv_layers_0_conv1d_weight[freq_idx][encdec_idx][layer_idx]
-                                              [0],
-            model.dconv_layers_0_conv1d_bias[freq_idx][encdec_idx][layer_idx]
-                                            [0]);
-        break;
-    case 2:
-        y = demucscpp::conv1d<192, 24, 3, 1, 1, 1>(
-            y,
-            model.dconv_layers_0_conv1d_weight[freq_idx][encdec_idx][layer_idx]
-                                              [0],
-            model.dconv_layers_0_conv1d_bias[freq_idx][encdec_idx][layer_idx]
-                                            [0]);
-        break;
-    case 3:
-        y = demucscpp::conv1d<384, 48, 3, 1, 1, 1>(
-            y,
-            model.dconv_layers_0_conv1d_weight[freq_idx][encdec_idx][layer_idx]
-                                              [0],
-            model.dconv_layers_0_conv1d_bias[freq_idx][encdec_idx][layer_idx]
-                                            [0]);
-        break;
-    };
-
-    y = demucscpp::group_norm_fused_gelu(
-        y,
-        model.dconv_layers_1_groupnorm_weight[freq_idx][encdec_idx][layer_idx]
-                                             [0],
-        model.dconv_layers_1_groupnorm_bias[freq_idx][encdec_idx][layer_idx][0],
-        1e-05);
+        std::cerr << "DConv crop " << mid_crop << " is longer than its input "
+                  << y.dimension(2) << std::endl;
+        std::exit(1);
+    }
 
     switch (layer_idx)
     {
     case 0:
-        y = demucscpp::conv1d<6, 96, 1, 1, 0, 1>(
-            y,
-            model.dconv_layers_3_conv1d_weight[freq_idx][encdec_idx][layer_idx]
-                                              [0],
-            model.dconv_layers_3_conv1d_bias[freq_idx][encdec_idx][layer_idx]
-                                            [0]);
+        dconv_layer<48, 6>(model, freq_idx, encdec_idx, layer_idx, y,
+                           mid_crop, scratch);
         break;
     case 1:
-        y = demucscpp::conv1d<12, 192, 1, 1, 0, 1>(
-            y,
-            model.dconv_layers_3_conv1d_weight[freq_idx][encdec_idx][layer_idx]
-                                              [0],
-            model.dconv_layers_3_conv1d_bias[freq_idx][encdec_idx][layer_idx]
-                                            [0]);
+        dconv_layer<96, 12>(model, freq_idx, encdec_idx, layer_idx, y,
+                            mid_crop, scratch);
         break;
     case 2:
-        y = demucscpp::conv1d<24, 384, 1, 1, 0, 1>(
-            y,
-            model.dconv_layers_3_conv1d_weight[freq_idx][encdec_idx][layer_idx]
-                                              [0],
-            model.dconv_layers_3_conv1d_bias[freq_idx][encdec_idx][layer_idx]
-                                            [0]);
+        dconv_layer<192, 24>(model, freq_idx, encdec_idx, layer_idx, y,
+                             mid_crop, scratch);
         break;
     case 3:
-        y = demucscpp::conv1d<48, 768, 1, 1, 0, 1>(
-            y,
-            model.dconv_layers_3_conv1d_weight[freq_idx][encdec_idx][layer_idx]
-                                              [0],
-            model.dconv_layers_3_conv1d_bias[freq_idx][encdec_idx][layer_idx]
-                                            [0]);
+        dconv_layer<384, 48>(model, freq_idx, encdec_idx, layer_idx, y,
+                             mid_crop, scratch);
         break;
     };
 
-    y = demucscpp::group_norm(
-        y,
-        model.dconv_layers_4_groupnorm_weight[freq_idx][encdec_idx][layer_idx]
-                                             [0],
-        model.dconv_layers_4_groupnorm_bias[freq_idx][encdec_idx][layer_idx][0],
-        1, 1e-05);
-
-    y = demucscpp::glu(y, 1);
-
-    y = demucscpp::layer_scale(
-        y, model.dconv_layers_6_scale[freq_idx][encdec_idx][layer_idx][0]);
+    return scratch.y.tensor(y.dimension(0), y.dimension(1), mid_crop);
+}
 
-    // now we add y to itself
-    y = y + y_copy;
+// the per-task buffers of tiled_attention, kept per thread
+static demucscpp::tensor_buffer &attention_buffer(int i)
+{
+    thread_local demucscpp::tensor_buffer buffers[4];
+    return buffers[i];
+}
 
-    // store another copy of y to sum back later
-    y_copy = y;
+// multi-head scaled dot-product attention with an online softmax, as in
+// flash attention: for each block of query rows, the keys and values are
+// streamed in blocks while a running row max and row sum rescale the partial
+// outputs, so the T x S score matrix is never held in full
+//
+// Q is (T, C), K and V are (S, C), and head h is columns
+// [h * head_split, (h + 1) * head_split) of each; the (head, query block)
+// pairs are independent and run on the thread pool
+static void tiled_attention(const Eigen::Ref<const Eigen::MatrixXf> &Q,
+                            const Eigen::Ref<const Eigen::MatrixXf> &K,
+                            const Eigen::Ref<const Eigen::MatrixXf> &V,
+                            int num_heads, Eigen::Ref<Eigen::MatrixXf> out)
+{
+    const int query_block = 128;
+    const int key_block = 256;
 
-    // NEXT ENTIRE SUBSEQUENCE OF DCONV WITH SLIGHTLY DIFFERENT PARAMS
+    int T = Q.rows();
+    int S = K.rows();
+    int head_split = Q.cols() / num_heads;
+    float scale = 1.0f / std::sqrt((float)head_split);
 
-    // Conv1d(48, 6, kernel_size=(3,), stride=(1,), padding=(2,), dilation=(2,))
-    switch (layer_idx)
-    {
-    case 0:
-        y = demucscpp::conv1d<48, 6, 3, 1, 2, 2>(
-            y,
-            model.dconv_layers_0_conv1d_weight[freq_idx][encdec_idx][layer_idx]
-                                              [1],
-            model.dconv_layers_0_conv1d_bias[freq_idx][encdec_idx][layer_idx]
-                                            [1]);
-        break;
-    case 1:
-        y = demucscpp::conv1d<96, 12, 3, 1, 2, 2>(
-            y,
-            model.dconv_layers_0_conv1d_weight[freq_idx][encdec_idx][layer_idx]
-                                              [1],
-            model.dconv_layers_0_conv1d_bias[freq_idx][encdec_idx][layer_idx]
-                                            [1]);
-        break;
-    case 2:
-        y = demucscpp::conv1d<192, 24, 3, 1, 2, 2>(
-            y,
-            model.dconv_layers_0_conv1d_weight[freq_idx][encdec_idx][layer_idx]
-                                              [1],
-            model.dconv_layers_0_conv1d_bias[freq_idx][encdec_idx][layer_idx]
-                                            [1]);
-        break;
-    case 3:
-        y = demucscpp::conv1d<384, 48, 3, 1, 2, 2>(
-            y,
-            model.dconv_layers_0_conv1d_weight[freq_idx][encdec_idx][layer_idx]
-                                              [1],
-            model.dconv_layers_0_conv1d_bias[freq_idx][encdec_idx][layer_idx]
-                                            [1]);
-        break;
-    };
+    int nb_query_blocks = (T + query_block - 1) / query_block;
 
-    Eigen::Tensor3dXf y_cropped =
-        y.slice(Eigen::array<Eigen::Index, 3>({0, 0, 0}),
-                Eigen::array<Eigen::Index, 3>(
-                    {y.dimension(0), y.dimension(1), mid_crop}));
+    demucscpp::parallel_for(
+        num_heads * nb_query_blocks,
+        [&](int task)
+        {
+            int h = task / nb_query_blocks;
+            int q0 = (task % nb_query_blocks) * query_block;
+            int nq = std::min(query_block, T - q0);
 
-    y = y_cropped;
+            auto Q_block = Q.block(q0, h * head_split, nq, head_split);
 
-    y = demucscpp::group_norm_fused_gelu(
-        y,
-        model.dconv_layers_1_groupnorm_weight[freq_idx][encdec_idx][layer_idx]
-                                             [1],
-        model.dconv_layers_1_groupnorm_bias[freq_idx][encdec_idx][layer_idx][1],
-        1e-05);
+            auto acc = attention_buffer(0).matrix(nq, head_split);
+            auto row_max = attention_buffer(1).matrix(nq, 1).col(0);
+            auto row_sum = attention_buffer(2).matrix(nq, 1).col(0);
+            auto scores = attention_buffer(3).matrix(nq, key_block);
+            acc.setZero();
+            row_max.setConstant(-std::numeric_limits<float>::infinity());
+            row_sum.setZero();
 
-    // Conv1d(6, 96, kernel_size=(1,), stride=(1,))
-    switch (layer_idx)
-    {
-    case 0:
-        y = demucscpp::conv1d<6, 96, 1, 1, 0, 1>(
-            y,
-            model.dconv_layers_3_conv1d_weight[freq_idx][encdec_idx][layer_idx]
-                                              [1],
-            model.dconv_layers_3_conv1d_bias[freq_idx][encdec_idx][layer_idx]
-                                            [1]);
-        break;
-    case 1:
-        y = demucscpp::conv1d<12, 192, 1, 1, 0, 1>(
-            y,
-            model.dconv_layers_3_conv1d_weight[freq_idx][encdec_idx][layer_idx]
-                                              [1],
-            model.dconv_layers_3_conv1d_bias[freq_idx][encdec_idx][layer_idx]
-                                            [1]);
-        break;
-    case 2:
-        y = demucscpp::conv1d<24, 384, 1, 1, 0, 1>(
-            y,
-            model.dconv_layers_3_conv1d_weight[freq_idx][encdec_idx][layer_idx]
-                                              [1],
-            model.dconv_layers_3_conv1d_bias[freq_idx][encdec_idx][layer_idx]
-                                            [1]);
-        break;
-    case 3:
-        y = demucscpp::conv1d<48, 768, 1, 1, 0, 1>(
-            y,
-            model.dconv_layers_3_conv1d_weight[freq_idx][encdec_idx][layer_idx]
-                                              [1],
-            model.dconv_layers_3_conv1d_bias[freq_idx][encdec_idx][layer_idx]
-                                            [1]);
-        break;
-    };
-
-    y = demucscpp::group_norm(
-        y,
-        model.dconv_layers_4_groupnorm_weight[freq_idx][encdec_idx][layer_idx]
-                                             [1],
-        model.dconv_layers_4_groupnorm_bias[freq_idx][encdec_idx][layer_idx][1],
-        1, 1e-05);
+            for (int k0 = 0; k0 < S; k0 += key_block)
+            {
+                int nk = std::min(key_block, S - k0);
+                auto K_block = K.block(k0, h * head_split, nk, head_split);
+                auto V_block = V.block(k0, h * head_split, nk, head_split);
 
-    y = demucscpp::glu(y, 1);
-    y = demucscpp::layer_scale(
-        y, model.dconv_layers_6_scale[freq_idx][encdec_idx][layer_idx][1]);
+                auto block_scores = scores.leftCols(nk);
+                block_scores.noalias() = Q_block * K_block.transpose();
+                block_scores *= scale;
 
-    // if y_copy is shorter than y in the last dim
-    // pad the last dim with zeros to match
+                for (int i = 0; i < nq; ++i)
+                {
+                    float new_max =
+                        std::max(row_max(i), block_scores.row(i).maxCoeff());
+                    // rescale what was accumulated against the old max
+                    float correction = std::exp(row_max(i) - new_max);
+                    row_max(i) = new_max;
+                    row_sum(i) *= correction;
+                    acc.row(i) *= correction;
+                }
 
-    if (y_copy.dimension(2) < y.dimension(2))
-    {
-        // pad the last dim with zeros to match
-        Eigen::Tensor3dXf padded_tensor_copy(
-            y_copy.dimension(0), y_copy.dimension(1), y.dimension(2));
-        padded_tensor_copy.setZero();
-        padded_tensor_copy.slice(Eigen::array<Eigen::Index, 3>({0, 0, 0}),
-                                 y_copy.dimensions()) = y_copy;
-        y_copy = padded_tensor_copy;
-    }
+                // the block is contiguous, as scores has nq rows
+                block_scores.colwise() -= row_max;
+                demucscpp::exp_inplace(block_scores.data(), nq * nk);
+                row_sum += block_scores.rowwise().sum();
+                acc.noalias() += block_scores * V_block;
+            }
 
-    // now sum with itself
-    y = y + y_copy;
+            out.block(q0, h * head_split, nq, head_split) =
+                acc.array().colwise() / row_sum.array();
+        });
 }
 
 void demucscpp::common_encoder_layer(
@@ -379,34 +388,26 @@ void demucscpp::common_encoder_layer(
     const Eigen::Tensor3dXf &k, // k = xt = time
     const Eigen::Tensor1dXf &norm1_weight, const Eigen::Tensor1dXf &norm1_bias,
     const Eigen::Tensor1dXf &norm2_weight, const Eigen::Tensor1dXf &norm2_bias,
-    const Eigen::MatrixXf &in_proj_weight, const Eigen::VectorXf &in_proj_bias,
-    const Eigen::MatrixXf &out_proj_weight,
-    const Eigen::VectorXf &out_proj_bias, const Eigen::VectorXf &gamma1_scale,
+    const demucscpp::gemm_weight &in_proj_weight,
+    const Eigen::VectorXf &in_proj_bias,
+    const demucscpp::gemm_weight &out_proj_weight,
+    const Eigen::VectorXf &out_proj_bias,
     const Eigen::Tensor1dXf &norm3_weight, const Eigen::Tensor1dXf &norm3_bias,
-    const Eigen::MatrixXf &linear1_weight, const Eigen::VectorXf &linear1_bias,
-    const Eigen::MatrixXf &linear2_weight, const Eigen::VectorXf &linear2_bias,
-    const Eigen::VectorXf &gamma2_scale,
+    const demucscpp::gemm_weight &linear1_weight,
+    const Eigen::VectorXf &linear1_bias,
+    const demucscpp::gemm_weight &linear2_weight,
+    const Eigen::VectorXf &linear2_bias,
     const Eigen::Tensor1dXf &norm_out_weight,
     const Eigen::Tensor1dXf &norm_out_bias, const int num_heads,
+    demucscpp::layer_scratch &scratch,
     // optional params
     float eps, const bool self_attention)
 {
-    // Normalize x using the norm1 weights and biases
-    Eigen::Tensor3dXf q_norm =
-        demucscpp::layer_norm(q, norm1_weight, norm1_bias, eps);
-
-    Eigen::Tensor3dXf k_norm;
-    if (self_attention)
-    {
-        k_norm = q_norm;
-    }
-    else
-    {
-        k_norm = demucscpp::layer_norm(k, norm2_weight, norm2_bias, eps);
-    }
+    DEMUCS_PROFILE_SCOPE("transformer layer");
 
-    // Cross-attention block
-    // Compute Q, K, V matrices
+    // the temporaries are views of the scratch buffers: q_norm in a, k_norm
+    // in b, Q, K and V in q, k and v, and the attention output in y; once
+    // the attention is done, q, k and v are reused for the projections
 
     int B = q.dimension(0);
     int T = q.dimension(1);
@@ -414,120 +415,92 @@ void demucscpp::common_encoder_layer(
 
     int S = k.dimension(1);
 
-    // Reshape q, k to 2D matrix of dimensions (T*B, C)
+    // Normalize x using the norm1 weights and biases
+    demucscpp::layer_norm(q, norm1_weight, norm1_bias, eps, scratch.a);
 
-    // Use Eigen::Map to avoid manual loops for reshaping
-    Eigen::MatrixXf q_norm_2d =
-        Eigen::Map<const Eigen::MatrixXf>(q_norm.data(), T, C);
-    Eigen::MatrixXf k_norm_2d =
-        Eigen::Map<const Eigen::MatrixXf>(k_norm.data(), S, C);
+    // Reshape q, k to 2D matrix of dimensions (T*B, C)
+    Eigen::Map<const Eigen::MatrixXf> q_norm_2d(scratch.a.tensor().data(), T,
+                                                C);
+    const float *k_norm_data = scratch.a.tensor().data();
+    if (!self_attention)
+    {
+        demucscpp::layer_norm(k, norm2_weight, norm2_bias, eps, scratch.b);
+        k_norm_data = scratch.b.tensor().data();
+    }
+    Eigen::Map<const Eigen::MatrixXf> k_norm_2d(k_norm_data, S, C);
 
     // Compute Q, K, V matrices
-    Eigen::MatrixXf Q =
-        q_norm_2d * in_proj_weight.block(0, 0, C, C).transpose();
-    Eigen::MatrixXf K =
-        k_norm_2d * in_proj_weight.block(C, 0, C, C).transpose();
-    Eigen::MatrixXf V =
-        k_norm_2d * in_proj_weight.block(2 * C, 0, C, C).transpose();
-
-    Eigen::VectorXf q_bias = in_proj_bias.segment(0, C);
-    Eigen::VectorXf k_bias = in_proj_bias.segment(C, C);
-    Eigen::VectorXf v_bias = in_proj_bias.segment(2 * C, C);
+    Eigen::Map<Eigen::MatrixXf> Q = scratch.q.matrix(T, C);
+    Eigen::Map<Eigen::MatrixXf> K = scratch.k.matrix(S, C);
+    Eigen::Map<Eigen::MatrixXf> V = scratch.v.matrix(S, C);
+    demucscpp::gemm_nt(q_norm_2d, in_proj_weight, 0, C, Q);
+    demucscpp::gemm_nt(k_norm_2d, in_proj_weight, C, C, K);
+    demucscpp::gemm_nt(k_norm_2d, in_proj_weight, 2 * C, C, V);
 
     // copied from linear layer: ff1.rowwise() += linear1_bias.transpose();
-    Q.rowwise() += q_bias.transpose();
-    K.rowwise() += k_bias.transpose();
-    V.rowwise() += v_bias.transpose();
-
-    int head_split = C / num_heads;
-
-    // map matrices to tensors
-    Eigen::Tensor3dXf Q_heads =
-        Eigen::TensorMap<Eigen::Tensor3dXf>(Q.data(), T, head_split, num_heads);
-    Eigen::Tensor3dXf K_heads =
-        Eigen::TensorMap<Eigen::Tensor3dXf>(K.data(), S, head_split, num_heads);
-    Eigen::Tensor3dXf V_heads =
-        Eigen::TensorMap<Eigen::Tensor3dXf>(V.data(), S, head_split, num_heads);
+    Q.rowwise() += in_proj_bias.segment(0, C).transpose();
+    K.rowwise() += in_proj_bias.segment(C, C).transpose();
+    V.rowwise() += in_proj_bias.segment(2 * C, C).transpose();
 
-    Eigen::MatrixXf cross_attn_out(T, C);
-
-    for (int h = 0; h < num_heads; ++h)
-    {
-        // Extract the h-th head from Q_heads and K_heads
-        Eigen::Tensor2dXf Q_head_tensor = Q_heads.chip(h, 2);
-        Eigen::Tensor2dXf K_head_tensor = K_heads.chip(h, 2);
-        Eigen::Tensor2dXf V_head_tensor = V_heads.chip(h, 2);
-
-        // Reshape the tensors to matrices
-        Eigen::Map<Eigen::MatrixXf> Q_head(Q_head_tensor.data(), T, head_split);
-        Eigen::Map<Eigen::MatrixXf> K_head(K_head_tensor.data(), S, head_split);
-        Eigen::Map<Eigen::MatrixXf> V_head(V_head_tensor.data(), S, head_split);
-
-        // Compute the dot product of Q_head and K_head
-        Eigen::MatrixXf dot_product =
-            Q_head * K_head.transpose() / std::sqrt((float)head_split);
-
-        // Apply softmax to the dot product
-        Eigen::ArrayXf max_vals = dot_product.rowwise().maxCoeff();
-        Eigen::MatrixXf max_vals_expanded = max_vals.replicate(1, S);
-        Eigen::MatrixXf softmax_scores =
-            (dot_product - max_vals_expanded).array().exp().matrix();
-        Eigen::VectorXf row_sums = softmax_scores.rowwise().sum();
-        Eigen::MatrixXf divisor = row_sums.replicate(1, S);
-        softmax_scores = (softmax_scores.array() / divisor.array()).matrix();
-
-        Eigen::MatrixXf cross_attn_head = softmax_scores * V_head;
-        cross_attn_out.block(0, h * head_split, T, head_split) =
-            cross_attn_head;
-    }
+    // the heads are column blocks of Q, K and V
+    Eigen::Map<Eigen::MatrixXf> cross_attn_out = scratch.y.matrix(T, C);
+    tiled_attention(Q, K, V, num_heads, cross_attn_out);
 
     // Copy q into q_2d (Map q to 2D matrix)
     Eigen::Map<Eigen::MatrixXf> q_2d(q.data(), T, C);
 
-    // Apply output projection with gamma1_scale
-    Eigen::MatrixXf out_proj = cross_attn_out * out_proj_weight.transpose();
+    // Apply output projection, with gamma_1 folded into it at load
+    Eigen::Map<Eigen::MatrixXf> out_proj = scratch.q.matrix(T, C);
+    demucscpp::gemm_nt(cross_attn_out, out_proj_weight, out_proj);
     out_proj.array().rowwise() += out_proj_bias.transpose().array();
-    out_proj = out_proj.array().rowwise() * gamma1_scale.transpose().array();
 
     // Add to q
     q_2d += out_proj;
 
     // before feedforward, apply norm3 to x i.e. q
-    q_norm = demucscpp::layer_norm(q, norm3_weight, norm3_bias, eps);
-    q_norm_2d = Eigen::Map<const Eigen::MatrixXf>(q_norm.data(), T, C);
+    demucscpp::layer_norm(q, norm3_weight, norm3_bias, eps, scratch.a);
+    Eigen::Map<const Eigen::MatrixXf> q_norm3_2d(scratch.a.tensor().data(),
+                                                 T, C);
 
     // Feedforward block
     // Linear layer 1
-    Eigen::MatrixXf ff1 = q_norm_2d * linear1_weight.transpose();
+    Eigen::Map<Eigen::MatrixXf> ff1 =
+        scratch.k.matrix(T, linear1_weight.rows());
+    demucscpp::gemm_nt(q_norm3_2d, linear1_weight, ff1);
     ff1.rowwise() += linear1_bias.transpose();
 
-    ff1 = demucscpp::gelu(ff1);
+    demucscpp::gelu_inplace(ff1.data(), ff1.size());
 
-    // Linear layer 2
-    Eigen::MatrixXf ff2 = ff1 * linear2_weight.transpose();
+    // Linear layer 2, with gamma_2 folded into it at load
+    Eigen::Map<Eigen::MatrixXf> ff2 = scratch.v.matrix(T, C);
+    demucscpp::gemm_nt(ff1, linear2_weight, ff2);
     ff2.rowwise() += linear2_bias.transpose();
 
-    // Apply gamma_2 scale directly on 2D matrix
-    ff2 = ff2.array().rowwise() * gamma2_scale.transpose().array();
-
     // now x = x + self.gamma_2(self._ff_block(self.norm3(q))))
     q_2d += ff2;
 
-    // Map the 2D data back into a 3D tensor with dimensions (T, B, C)
-    q = Eigen::TensorMap<Eigen::Tensor3dXf>(q_2d.data(), T, B, C);
-
-    // Swap the first and last dimensions to get a tensor with dimensions (B, C,
-    // T)
-    Eigen::array<int, 3> permute_dims_3 = {1, 2, 0};
-    Eigen::Tensor3dXf q_shuf = q.shuffle(permute_dims_3);
-
-    // Normalize the output with norm_out/MyGroupNorm
-    q = demucscpp::group_norm(q_shuf, norm_out_weight, norm_out_bias, 1, eps);
-
-    Eigen::array<int, 3> permute_dims_4 = {0, 2, 1};
-    q_shuf = q.shuffle(permute_dims_4);
+    // Normalize the output with norm_out/MyGroupNorm, which normalizes each
+    // batch item over (C, T); the statistics are reduced over the (B, C, T)
+    // view of q, in the order of the shuffled copy this used to make, and
+    // the norm is applied to q in place
+    auto q_bct = q.shuffle(Eigen::array<int, 3>({0, 2, 1}));
+    for (int b = 0; b < B; ++b)
+    {
+        float mean, var;
+        demucscpp::mean_and_variance(
+            q_bct.slice(Eigen::array<int, 3>{b, 0, 0},
+                        Eigen::array<int, 3>{1, C, T}),
+            C * T, mean, var);
 
-    q = q_shuf;
+        for (int c = 0; c < C; ++c)
+        {
+            for (int t = 0; t < T; ++t)
+            {
+                float norm_val = (q(b, t, c) - mean) / std::sqrt(var + eps);
+                q(b, t, c) = norm_val * norm_out_weight(c) + norm_out_bias(c);
+            }
+        }
+    }
 }
 
 void demucscpp_v3::local_attention(
@@ -543,6 +516,8 @@ void demucscpp_v3::local_attention(
     const Eigen::Tensor3dXf &proj_weight, const Eigen::Tensor1dXf &proj_bias,
     const int hidden_size)
 {
+    DEMUCS_PROFILE_SCOPE("local attention");
+
     // local-attention block
 
     int B = x.dimension(0);
@@ -724,6 +699,8 @@ void demucscpp_v3::apply_dconv_v3(
     const struct demucscpp_v3::demucs_v3_model &model, Eigen::Tensor3dXf &y,
     int freq_idx, int layer_idx, int mid_crop)
 {
+    DEMUCS_PROFILE_SCOPE("dconv v3");
+
     // store another copy of y to sum back later
     Eigen::Tensor3dXf y_copy = y;
 
@@ -898,6 +875,8 @@ void demucscpp_v3::apply_dconv_v3_encoder_4_5(
     int encoder_idx, int mid_crop,
     struct demucscpp_v3::demucs_v3_segment_buffers &buffers)
 {
+    DEMUCS_PROFILE_SCOPE("dconv v3");
+
     int lstm_hidden_size = encoder_idx == 0 ? demucscpp_v3::LSTM_HIDDEN_SIZE_0
                                             : demucscpp_v3::LSTM_HIDDEN_SIZE_1;
 
@@ -1,6 +1,8 @@
 #ifndef LAYERS_HPP
 #define LAYERS_HPP
 
+#include "activations.hpp"
+#include "arena.hpp"
 #include "conv.hpp"
 #include "model.hpp"
 #include "tensor.hpp"
@@ -11,9 +13,14 @@
 namespace demucscpp
 {
 
-void apply_dconv(const struct demucscpp::demucs_model &model,
-                 Eigen::Tensor3dXf &y, int freq_idx, int encdec_idx,
-                 int layer_idx, int mid_crop);
+// the dconv of y, a (freq, channels, time) view of scratch.y, in place: the
+// result, whose time axis is mid_crop long, is returned as a new view of
+// scratch.y, and scratch.a, scratch.b, scratch.q, scratch.k and scratch.stats
+// hold the temporaries
+Eigen::Tensor3dXfMap apply_dconv(const struct demucscpp::demucs_model &model,
+                                 const Eigen::Tensor3dXfMap &y, int freq_idx,
+                                 int encdec_idx, int layer_idx, int mid_crop,
+                                 layer_scratch &scratch);
 
 // used for implementing both self-attention and cross-attention
 // let's not modify the second argument
@@ -22,16 +29,15 @@ void common_encoder_layer(
     const Eigen::Tensor3dXf &k, // k = xt = time|frequency, _or_ k == q
     const Eigen::Tensor1dXf &norm1_weight, const Eigen::Tensor1dXf &norm1_bias,
     const Eigen::Tensor1dXf &norm2_weight, const Eigen::Tensor1dXf &norm2_bias,
-    const Eigen::MatrixXf &in_proj_weight, const Eigen::VectorXf &in_proj_bias,
-    const Eigen::MatrixXf &out_proj_weight,
-    const Eigen::VectorXf &out_proj_bias, const Eigen::VectorXf &gamma_1_scale,
+    const gemm_weight &in_proj_weight, const Eigen::VectorXf &in_proj_bias,
+    const gemm_weight &out_proj_weight, const Eigen::VectorXf &out_proj_bias,
     const Eigen::Tensor1dXf &norm3_weight, const Eigen::Tensor1dXf &norm3_bias,
-    const Eigen::MatrixXf &linear1_weight, const Eigen::VectorXf &linear1_bias,
-    const Eigen::MatrixXf &linear2_weight, const Eigen::VectorXf &linear2_bias,
-    const Eigen::VectorXf &gamma_2_scale,
+    const gemm_weight &linear1_weight, const Eigen::VectorXf &linear1_bias,
+    const gemm_weight &linear2_weight, const Eigen::VectorXf &linear2_bias,
     const Eigen::Tensor1dXf &norm_out_weight,
     const Eigen::Tensor1dXf &norm_out_bias, const int num_heads,
-    float eps = 1e-5, const bool self_attention = false);
+    layer_scratch &scratch, float eps = 1e-5,
+    const bool self_attention = false);
 
 Eigen::Tensor3dXf group_norm(const Eigen::Tensor3dXf &x,
                              const Eigen::Tensor1dXf &w,
@@ -50,27 +56,194 @@ Eigen::Tensor3dXf glu(const Eigen::Tensor3dXf &x, const int dim);
 
 inline Eigen::Tensor3dXf gelu(const Eigen::Tensor3dXf &x)
 {
-    return x.unaryExpr(
-        [](float a)
-        { return 0.5f * a * (1.0f + std::erf(a / std::sqrt(2.0f))); });
+    Eigen::Tensor3dXf y = x;
+    gelu_inplace(y.data(), y.size());
+    return y;
 }
 
 inline Eigen::MatrixXf gelu(const Eigen::MatrixXf &x)
 {
-    return x.unaryExpr(
-        [](float a)
-        { return 0.5f * a * (1.0f + std::erf(a / std::sqrt(2.0f))); });
+    Eigen::MatrixXf y = x;
+    gelu_inplace(y.data(), y.size());
+    return y;
 }
 
-inline Eigen::Tensor3dXf layer_scale(const Eigen::Tensor3dXf &x,
-                                     const Eigen::Tensor1dXf &scale_weights)
+Eigen::Tensor3dXf layer_scale(const Eigen::Tensor3dXf &x,
+                              const Eigen::Tensor1dXf &scale_weights);
+
+// the layers above return a new tensor; the ones below write into a
+// caller-provided destination instead (see output_view in arena.hpp), and
+// allocate nothing themselves
+//
+// the norms and layer_scale work in place when y_out is a buffer or tensor
+// that x is a view of
+
+// the mean and (unbiased) variance of the n values of a tensor expression,
+// reduced as calculate_variance does but without copying them out first
+template <typename Expr>
+inline void mean_and_variance(const Expr &x, Eigen::Index n, float &mean,
+                              float &var)
 {
-    Eigen::Tensor3dXf y_out(x.dimensions());
-    for (int i = 0; i < x.dimension(1); ++i)
+    Eigen::TensorFixedSize<float, Eigen::Sizes<>> mean_tensor = x.mean();
+    mean = mean_tensor(0);
+    Eigen::TensorFixedSize<float, Eigen::Sizes<>> sum_squares =
+        (x - mean).square().sum();
+    var = sum_squares(0) / (n - 1);
+}
+
+template <typename Input, typename Output>
+void group_norm(const Input &x, const Eigen::Tensor1dXf &weight,
+                const Eigen::Tensor1dXf &b, int num_groups, float eps,
+                Output &y_out)
+{
+    int freq = x.dimension(0);
+    int channels = x.dimension(1);
+    int width = x.dimension(2);
+
+    Eigen::Tensor3dXfMap y = output_view(y_out, freq, channels, width);
+
+    int group_size = channels / num_groups;
+
+    for (int i = 0; i < freq; ++i)
     {
-        y_out.chip<1>(i) = x.chip<1>(i) * scale_weights(i);
+        for (int g = 0; g < num_groups; ++g)
+        {
+            int start = g * group_size;
+            int end = (g + 1) * group_size;
+
+            float mean, var;
+            mean_and_variance(
+                x.slice(Eigen::array<int, 3>{i, start, 0},
+                        Eigen::array<int, 3>{1, group_size, width}),
+                group_size * width, mean, var);
+
+            for (int c = start; c < end; ++c)
+            {
+                for (int w = 0; w < width; ++w)
+                {
+                    float norm_val = (x(i, c, w) - mean) / std::sqrt(var + eps);
+                    y(i, c, w) = norm_val * weight(c) + b(c);
+                }
+            }
+        }
+    }
+}
+
+template <typename Input, typename Output>
+void group_norm_fused_gelu(const Input &x, const Eigen::Tensor1dXf &weight,
+                           const Eigen::Tensor1dXf &bias, float eps,
+                           Output &y_out)
+{
+    int freq = x.dimension(0);
+    int channels = x.dimension(1);
+    int width = x.dimension(2);
+
+    Eigen::Tensor3dXfMap y = output_view(y_out, freq, channels, width);
+
+    // Normalizing over the entire channel since num_groups is always 1
+    for (int i = 0; i < freq; ++i)
+    {
+        float mean, var;
+        mean_and_variance(x.template chip<0>(i), channels * width, mean, var);
+
+        for (int c = 0; c < channels; ++c)
+        {
+            for (int w = 0; w < width; ++w)
+            {
+                float norm_val = (x(i, c, w) - mean) / std::sqrt(var + eps);
+                y(i, c, w) = norm_val * weight(c) + bias(c);
+            }
+        }
+    }
+    gelu_inplace(y.data(), y.size());
+}
+
+template <typename Input, typename Output>
+void layer_norm(const Input &x, const Eigen::Tensor1dXf &weight,
+                const Eigen::Tensor1dXf &bias, float eps, Output &y_out)
+{
+    int freq = x.dimension(0);
+    int channels = x.dimension(1);
+    int width = x.dimension(2);
+
+    Eigen::Tensor3dXfMap y = output_view(y_out, freq, channels, width);
+
+    for (int i = 0; i < freq; ++i)
+    {
+        for (int c = 0; c < channels; ++c)
+        {
+            float mean, var;
+            mean_and_variance(x.chip(i, 0).chip(c, 0), width, mean, var);
+
+            for (int w = 0; w < width; ++w)
+            {
+                float norm_val = (x(i, c, w) - mean) / std::sqrt(var + eps);
+                y(i, c, w) = norm_val * weight(w) + bias(w);
+            }
+        }
+    }
+}
+
+// y_out must not share memory with x, which is twice its size along dim
+template <typename Input, typename Output>
+void glu(const Input &x, const int dim, Output &y_out)
+{
+    if (x.dimension(dim) % 2 != 0)
+    {
+        std::cerr << "Dimension size must be evenly divisible by 2"
+                  << std::endl;
+        std::exit(1);
+    }
+
+    Eigen::array<Eigen::Index, 3> sizes = {x.dimension(0), x.dimension(1),
+                                           x.dimension(2)};
+    sizes[dim] /= 2;
+    Eigen::array<Eigen::Index, 3> offset = {0, 0, 0};
+    offset[dim] = sizes[dim];
+
+    Eigen::Tensor3dXfMap y = output_view(y_out, sizes[0], sizes[1], sizes[2]);
+
+    // the sigmoid of the gates in y first, over all of them at once
+    for (int w = 0; w < sizes[2]; ++w)
+    {
+        for (int c = 0; c < sizes[1]; ++c)
+        {
+            for (int i = 0; i < sizes[0]; ++i)
+            {
+                y(i, c, w) = x(i + offset[0], c + offset[1], w + offset[2]);
+            }
+        }
+    }
+    sigmoid_inplace(y.data(), y.size());
+
+    for (int w = 0; w < sizes[2]; ++w)
+    {
+        for (int c = 0; c < sizes[1]; ++c)
+        {
+            for (int i = 0; i < sizes[0]; ++i)
+            {
+                y(i, c, w) = x(i, c, w) * y(i, c, w);
+            }
+        }
+    }
+}
+
+template <typename Input, typename Output>
+void layer_scale(const Input &x, const Eigen::Tensor1dXf &scale_weights,
+                 Output &y_out)
+{
+    Eigen::Tensor3dXfMap y = output_view(y_out, x.dimension(0),
+                                         x.dimension(1), x.dimension(2));
+    for (int w = 0; w < x.dimension(2); ++w)
+    {
+        for (int c = 0; c < x.dimension(1); ++c)
+        {
+            for (int i = 0; i < x.dimension(0); ++i)
+            {
+                y(i, c, w) = x(i, c, w) * scale_weights(c);
+            }
+        }
     }
-    return y_out;
 }
 
 inline float calculate_variance(const Eigen::Tensor3dXf &tensor, float mean)
@@ -80,6 +253,14 @@ inline float calculate_variance(const Eigen::Tensor3dXf &tensor, float mean)
     return variance;
 }
 
+inline float calculate_variance(const Eigen::Tensor3dXfMap &tensor,
+                                float mean)
+{
+    Eigen::Tensor<float, 0> sum_squares = (tensor - mean).square().sum();
+    float variance = sum_squares(0) / (tensor.size() - 1);
+    return variance;
+}
+
 inline float calculate_variance(const Eigen::Tensor2dXf &tensor, float mean)
 {
     Eigen::Tensor<float, 0> sum_squares = (tensor - mean).square().sum();
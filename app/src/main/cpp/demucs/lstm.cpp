@@ -1,5 +1,7 @@
 #include "lstm.hpp"
+#include "activations.hpp"
 #include "Eigen/Dense"
+#include "gemm.hpp"
 #include "model.hpp"
 #include <iostream>
 
@@ -33,11 +35,6 @@
 //     i.e. Hadamard product
 // ht = o * tanh(c)
 
-static Eigen::MatrixXf sigmoid(const Eigen::MatrixXf &x)
-{
-    return 1.0 / (1.0 + (-x).array().exp());
-}
-
 void demucscpp_v3::lstm_reset_zero(
     const int encoder_idx, const int dconv_idx,
     struct demucscpp_v3::demucs_v3_segment_buffers &buffers)
@@ -86,33 +83,51 @@ void demucscpp_v3::lstm_forward(const demucs_v3_model &model,
             // buffers.lstm_cell[encoder_idx][dconv_idx][lstm_layer][direction].setZero(hidden_state_size,
             // 1);
 
+            // the input projections of all the timesteps do not depend on
+            // the hidden state, so they are one GEMM up front (with both
+            // biases), leaving only the hidden projection in the loop
+            Eigen::MatrixXf input_gates;
+            demucscpp::gemm_nt(
+                loop_input,
+                model.encoder_4_5_dconv_layers_3_lstm_ih_w[encoder_idx]
+                                                          [dconv_idx]
+                                                          [lstm_layer]
+                                                          [direction],
+                input_gates);
+            Eigen::RowVectorXf gate_bias =
+                (model.encoder_4_5_dconv_layers_3_lstm_ih_b
+                     [encoder_idx][dconv_idx][lstm_layer][direction] +
+                 model.encoder_4_5_dconv_layers_3_lstm_hh_b
+                     [encoder_idx][dconv_idx][lstm_layer][direction])
+                    .transpose();
+            input_gates.rowwise() += gate_bias;
+
             for (int t = (direction == 0 ? 0 : seq_len - 1);
                  (direction == 0 ? t < seq_len : t > -1);
                  t += (direction == 0 ? 1 : -1))
             {
                 Eigen::MatrixXf gates =
-                    model.encoder_4_5_dconv_layers_3_lstm_ih_w
-                            [encoder_idx][dconv_idx][lstm_layer][direction] *
-                        loop_input.row(t).transpose() +
-                    model.encoder_4_5_dconv_layers_3_lstm_ih_b
-                        [encoder_idx][dconv_idx][lstm_layer][direction] +
+                    input_gates.row(t).transpose() +
                     model.encoder_4_5_dconv_layers_3_lstm_hh_w
                             [encoder_idx][dconv_idx][lstm_layer][direction] *
                         buffers.lstm_hidden[encoder_idx][dconv_idx][lstm_layer]
-                                           [direction] +
-                    model.encoder_4_5_dconv_layers_3_lstm_hh_b
-                        [encoder_idx][dconv_idx][lstm_layer][direction];
+                                           [direction];
 
-                Eigen::MatrixXf i_t =
-                    sigmoid(gates.block(0, 0, hidden_state_size, 1));
-                Eigen::MatrixXf f_t = sigmoid(
-                    gates.block(hidden_state_size, 0, hidden_state_size, 1));
-                Eigen::MatrixXf g_t =
-                    gates.block(2 * hidden_state_size, 0, hidden_state_size, 1)
-                        .array()
-                        .tanh();
-                Eigen::MatrixXf o_t = sigmoid(gates.block(
-                    3 * hidden_state_size, 0, hidden_state_size, 1));
+                // the gates are stacked as i, f, g, o in the column
+                demucscpp::sigmoid_inplace(gates.data(),
+                                           2 * hidden_state_size);
+                demucscpp::tanh_inplace(gates.data() + 2 * hidden_state_size,
+                                        hidden_state_size);
+                demucscpp::sigmoid_inplace(gates.data() +
+                                               3 * hidden_state_size,
+                                           hidden_state_size);
+                auto i_t = gates.block(0, 0, hidden_state_size, 1);
+                auto f_t =
+                    gates.block(hidden_state_size, 0, hidden_state_size, 1);
+                auto g_t =
+                    gates.block(2 * hidden_state_size, 0, hidden_state_size, 1);
+                auto o_t = gates.block(3 * hidden_state_size, 0,
+                                       hidden_state_size, 1);
 
                 Eigen::MatrixXf c_t =
                     f_t.array() * buffers
@@ -120,7 +135,9 @@ void demucscpp_v3::lstm_forward(const demucs_v3_model &model,
                                                 [lstm_layer][direction]
                                       .array() +
                     i_t.array() * g_t.array();
-                Eigen::MatrixXf h_t = o_t.array() * c_t.array().tanh();
+                Eigen::MatrixXf h_t = c_t;
+                demucscpp::tanh_inplace(h_t.data(), h_t.size());
+                h_t.array() *= o_t.array();
 
                 buffers.lstm_hidden[encoder_idx][dconv_idx][lstm_layer]
                                    [direction] = h_t;
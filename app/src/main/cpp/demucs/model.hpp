@@ -1,12 +1,17 @@
 #ifndef MODEL_HPP
 #define MODEL_HPP
 
+#include "arena.hpp"
 #include "dsp.hpp"
+#include "gemm.hpp"
+#include "stem_cache.hpp"
 #include "tensor.hpp"
 #include <Eigen/Dense>
 #include <array>
+#include <cstdint>
 #include <functional>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -16,6 +21,11 @@ namespace demucscpp
 // Define a type for your callback function
 using ProgressCallback = std::function<void(float, const std::string &)>;
 
+// cb(progress, msg) through a string that keeps its storage on each thread,
+// so that the progress messages of a segment don't allocate
+void report_progress(const ProgressCallback &cb, float progress,
+                     const char *msg);
+
 const int FREQ_BRANCH_LEN = 336;
 const int TIME_BRANCH_LEN_IN = 343980;
 const int TIME_BRANCH_LEN_0 = 85995;
@@ -35,13 +45,13 @@ struct crosstransformer_base
 
     // MyTransformerEncoderLayer: index 0, 2, 4
     // second index [2] represents the frequency and time weights (same shapes)
-    Eigen::MatrixXf crosstransformer_my_layers_self_attn_in_proj_weight[2][3];
+    gemm_weight crosstransformer_my_layers_self_attn_in_proj_weight[2][3];
     Eigen::VectorXf crosstransformer_my_layers_self_attn_in_proj_bias[2][3];
-    Eigen::MatrixXf crosstransformer_my_layers_self_attn_out_proj_weight[2][3];
+    gemm_weight crosstransformer_my_layers_self_attn_out_proj_weight[2][3];
     Eigen::VectorXf crosstransformer_my_layers_self_attn_out_proj_bias[2][3];
-    Eigen::MatrixXf crosstransformer_my_layers_linear1_weight[2][3];
+    gemm_weight crosstransformer_my_layers_linear1_weight[2][3];
     Eigen::VectorXf crosstransformer_my_layers_linear1_bias[2][3];
-    Eigen::MatrixXf crosstransformer_my_layers_linear2_weight[2][3];
+    gemm_weight crosstransformer_my_layers_linear2_weight[2][3];
     Eigen::VectorXf crosstransformer_my_layers_linear2_bias[2][3];
     Eigen::Tensor1dXf crosstransformer_my_layers_norm1_weight[2][3];
     Eigen::Tensor1dXf crosstransformer_my_layers_norm1_bias[2][3];
@@ -49,21 +59,21 @@ struct crosstransformer_base
     Eigen::Tensor1dXf crosstransformer_my_layers_norm2_bias[2][3];
     Eigen::Tensor1dXf crosstransformer_my_layers_norm_out_weight[2][3];
     Eigen::Tensor1dXf crosstransformer_my_layers_norm_out_bias[2][3];
+    // the gamma scales are folded into out_proj and linear2 at load, and
+    // released
     Eigen::VectorXf crosstransformer_my_layers_gamma_1_scale[2][3];
     Eigen::VectorXf crosstransformer_my_layers_gamma_2_scale[2][3];
 
     // CrossTransformerEncoderLayer: index 1, 3
     // second index [2] represents the frequency and time weights (same shapes)
-    Eigen::MatrixXf crosstransformer_cross_layers_cross_attn_in_proj_weight[2]
-                                                                           [2];
+    gemm_weight crosstransformer_cross_layers_cross_attn_in_proj_weight[2][2];
     Eigen::VectorXf crosstransformer_cross_layers_cross_attn_in_proj_bias[2][2];
-    Eigen::MatrixXf crosstransformer_cross_layers_cross_attn_out_proj_weight[2]
-                                                                            [2];
+    gemm_weight crosstransformer_cross_layers_cross_attn_out_proj_weight[2][2];
     Eigen::VectorXf crosstransformer_cross_layers_cross_attn_out_proj_bias[2]
                                                                           [2];
-    Eigen::MatrixXf crosstransformer_cross_layers_linear1_weight[2][2];
+    gemm_weight crosstransformer_cross_layers_linear1_weight[2][2];
     Eigen::VectorXf crosstransformer_cross_layers_linear1_bias[2][2];
-    Eigen::MatrixXf crosstransformer_cross_layers_linear2_weight[2][2];
+    gemm_weight crosstransformer_cross_layers_linear2_weight[2][2];
     Eigen::VectorXf crosstransformer_cross_layers_linear2_bias[2][2];
     Eigen::Tensor1dXf crosstransformer_cross_layers_norm1_weight[2][2];
     Eigen::Tensor1dXf crosstransformer_cross_layers_norm1_bias[2][2];
@@ -73,9 +83,15 @@ struct crosstransformer_base
     Eigen::Tensor1dXf crosstransformer_cross_layers_norm3_bias[2][2];
     Eigen::Tensor1dXf crosstransformer_cross_layers_norm_out_weight[2][2];
     Eigen::Tensor1dXf crosstransformer_cross_layers_norm_out_bias[2][2];
+    // folded and released at load, as above
     Eigen::VectorXf crosstransformer_cross_layers_gamma_1_scale[2][2];
     Eigen::VectorXf crosstransformer_cross_layers_gamma_2_scale[2][2];
 
+    // the positional embeddings, which only depend on the segment shape, are
+    // built once at load by init_positional_embeddings
+    Eigen::Tensor3dXf pos_embed_2d; // (1, 8 * FREQ_BRANCH_LEN, channels)
+    Eigen::Tensor3dXf pos_embed_1d; // (1, TIME_BRANCH_LEN_3, channels)
+
     crosstransformer_base(int size1, int size2, int size3)
         : crosstransformer_norm_in_weight(Eigen::Tensor1dXf(size1)),
           crosstransformer_norm_in_bias(Eigen::Tensor1dXf(size1)),
@@ -275,6 +291,12 @@ struct demucs_crosstransformer_4s : crosstransformer_base
     Eigen::Tensor3dXf channel_downsampler_t_weight{
         Eigen::Tensor3dXf(384, 512, 1)};
     Eigen::Tensor1dXf channel_downsampler_t_bias{Eigen::Tensor1dXf(384)};
+
+    // GEMM-ready conv weights, see demucs_model
+    gemm_weight channel_upsampler_weight_packed;
+    gemm_weight channel_downsampler_weight_packed;
+    gemm_weight channel_upsampler_t_weight_packed;
+    gemm_weight channel_downsampler_t_weight_packed;
 };
 
 struct demucs_crosstransformer_6s : crosstransformer_base
@@ -526,6 +548,8 @@ struct demucs_model
           {Eigen::Tensor1dXf(384), Eigen::Tensor1dXf(384)},
           {Eigen::Tensor1dXf(768), Eigen::Tensor1dXf(768)}}}};
 
+    // the layer scales are folded into the value half of dconv_layers_4 at
+    // load, and released
     Eigen::Tensor1dXf dconv_layers_6_scale[2][2][4][2]{
         {
             {{Eigen::Tensor1dXf(48), Eigen::Tensor1dXf(48)},
@@ -551,6 +575,24 @@ struct demucs_model
     // freq_emb
     Eigen::MatrixXf freq_emb_embedding_weight{Eigen::MatrixXf(512, 48)};
 
+    // freq_emb_embedding_weight transposed and scaled once loading is done,
+    // (48, 512), after which the original is released
+    Eigen::MatrixXf freq_emb_scaled;
+
+    // the conv weights above, packed for the GEMM by pack_conv_weight and
+    // pack_conv_tr_weight once loading is done; the original tensors are
+    // released then, since inference only uses these
+    gemm_weight encoder_conv_weight_packed[4];
+    gemm_weight encoder_rewrite_weight_packed[4];
+    gemm_weight tencoder_conv_weight_packed[4];
+    gemm_weight tencoder_rewrite_weight_packed[4];
+    gemm_weight decoder_conv_tr_weight_packed[4];
+    gemm_weight decoder_rewrite_weight_packed[4];
+    gemm_weight tdecoder_conv_tr_weight_packed[4];
+    gemm_weight tdecoder_rewrite_weight_packed[4];
+    gemm_weight dconv_layers_0_conv1d_weight_packed[2][2][4][2];
+    gemm_weight dconv_layers_3_conv1d_weight_packed[2][2][4][2];
+
     std::unique_ptr<crosstransformer_base> crosstransformer;
 };
 
@@ -567,6 +609,28 @@ initialize_crosstransformer(bool use_4source_transformer)
     }
 }
 
+// the temporaries of the layers of one branch (see tensor_buffer): y, a and
+// b for the encoders, decoders and dconv, and q, k and v as well for the
+// transformer layers; stats holds the group norm sums of the dconv, and
+// cross_input the copy of the freq branch that the time branch attends to
+// in the cross layers of the crosstransformer
+struct layer_scratch
+{
+    tensor_buffer y;
+    tensor_buffer a;
+    tensor_buffer b;
+    tensor_buffer q;
+    tensor_buffer k;
+    tensor_buffer v;
+    std::vector<double> stats;
+    Eigen::Tensor3dXf cross_input;
+};
+
+// the activations of model_inference for one segment, with their lifetimes
+// over its steps, laid out in a single arena by plan_activations
+activation_plan plan_segment_activations(int nb_channels, int segment_samples,
+                                         int nb_sources);
+
 struct demucs_segment_buffers
 {
     int segment_samples;
@@ -582,35 +646,48 @@ struct demucs_segment_buffers
     Eigen::MatrixXf padded_mix;
     Eigen::Tensor3dXcf z;
 
-    // freq branch, one for each encoded representation
-    Eigen::Tensor3dXf x;     // input
-    Eigen::Tensor3dXf x_out; // input
-    Eigen::Tensor3dXf x_0;
-    Eigen::Tensor3dXf x_1;
-    Eigen::Tensor3dXf x_2;
-    Eigen::Tensor3dXf x_3;
-    Eigen::Tensor3dXf x_3_channel_upsampled;
+    // the encoder and decoder activations below are views into one arena,
+    // where those that are never live at the same time share memory
+    activation_plan plan;
+    activation_arena arena;
+
+    // freq branch
+    Eigen::Tensor3dXfMap x;     // input
+    Eigen::Tensor3dXfMap x_out; // output
+    // decoder inputs, x_3 coming from the crosstransformer
+    Eigen::Tensor3dXfMap x_0;
+    Eigen::Tensor3dXfMap x_1;
+    Eigen::Tensor3dXfMap x_2;
+    Eigen::Tensor3dXfMap x_3;
 
     // time branch
-    Eigen::Tensor3dXf xt;     // input
-    Eigen::Tensor3dXf xt_out; // output
-    Eigen::Tensor3dXf xt_0;
-    Eigen::Tensor3dXf xt_1;
-    Eigen::Tensor3dXf xt_2;
-    Eigen::Tensor3dXf xt_3;
+    Eigen::Tensor3dXfMap xt;     // input
+    Eigen::Tensor3dXfMap xt_out; // output
+    Eigen::Tensor3dXfMap xt_0;
+    Eigen::Tensor3dXfMap xt_1;
+    Eigen::Tensor3dXfMap xt_2;
+    Eigen::Tensor3dXfMap xt_3;
+
+    // encoder outputs, which are also the skip conns of the decoders
+    Eigen::Tensor3dXfMap saved_0;
+    Eigen::Tensor3dXfMap saved_1;
+    Eigen::Tensor3dXfMap saved_2;
+    Eigen::Tensor3dXfMap saved_3;
+
+    Eigen::Tensor3dXfMap savedt_0;
+    Eigen::Tensor3dXfMap savedt_1;
+    Eigen::Tensor3dXfMap savedt_2;
+    Eigen::Tensor3dXfMap savedt_3;
+
+    // the crosstransformer inputs and outputs, which it reshapes in place so
+    // they keep their own storage
+    Eigen::Tensor3dXf x_3_channel_upsampled;
     Eigen::Tensor3dXf xt_3_channel_upsampled;
 
-    // skip conns for frequency and time
-    // easier as hardcoded matrix sizes
-    Eigen::Tensor3dXf saved_0;
-    Eigen::Tensor3dXf saved_1;
-    Eigen::Tensor3dXf saved_2;
-    Eigen::Tensor3dXf saved_3;
-
-    Eigen::Tensor3dXf savedt_0;
-    Eigen::Tensor3dXf savedt_1;
-    Eigen::Tensor3dXf savedt_2;
-    Eigen::Tensor3dXf savedt_3;
+    // the layer temporaries of each branch, which keep their storage from
+    // one segment to the next; the crosstransformer uses the freq one
+    layer_scratch freq_scratch;
+    layer_scratch time_scratch;
 
     // constructor for demucs_segment_buffers that takes int parameters
 
@@ -628,23 +705,20 @@ struct demucs_segment_buffers
           targets_out(nb_sources, nb_channels, segment_samples),
           padded_mix(nb_channels, padded_segment_samples),
           z(nb_channels, nb_stft_bins, nb_stft_frames),
-          // complex-as-channels implies 2*nb_channels for real+imag
-          x(2 * nb_channels, nb_stft_bins - 1, nb_stft_frames),
-          x_out(nb_sources * 2 * nb_channels, nb_stft_bins - 1, nb_stft_frames),
-          x_0(48, 512, FREQ_BRANCH_LEN), x_1(96, 128, FREQ_BRANCH_LEN),
-          x_2(192, 32, FREQ_BRANCH_LEN), x_3(384, 8, FREQ_BRANCH_LEN),
+          plan(plan_segment_activations(nb_channels, segment_samples,
+                                        nb_sources)),
+          arena(plan), x(arena.map("x")), x_out(arena.map("x_out")),
+          x_0(arena.map("x_0")), x_1(arena.map("x_1")),
+          x_2(arena.map("x_2")), x_3(arena.map("x_3")),
+          xt(arena.map("xt")), xt_out(arena.map("xt_out")),
+          xt_0(arena.map("xt_0")), xt_1(arena.map("xt_1")),
+          xt_2(arena.map("xt_2")), xt_3(arena.map("xt_3")),
+          saved_0(arena.map("saved_0")), saved_1(arena.map("saved_1")),
+          saved_2(arena.map("saved_2")), saved_3(arena.map("saved_3")),
+          savedt_0(arena.map("savedt_0")), savedt_1(arena.map("savedt_1")),
+          savedt_2(arena.map("savedt_2")), savedt_3(arena.map("savedt_3")),
           x_3_channel_upsampled(512, 8, FREQ_BRANCH_LEN),
-          xt(1, nb_channels, segment_samples),
-          xt_out(1, nb_sources * nb_channels, segment_samples),
-          xt_0(1, 48, TIME_BRANCH_LEN_0), xt_1(1, 96, TIME_BRANCH_LEN_1),
-          xt_2(1, 192, TIME_BRANCH_LEN_2), xt_3(1, 384, TIME_BRANCH_LEN_3),
-          xt_3_channel_upsampled(1, 512, TIME_BRANCH_LEN_3),
-          saved_0(48, 512, FREQ_BRANCH_LEN), saved_1(96, 128, FREQ_BRANCH_LEN),
-          saved_2(192, 32, FREQ_BRANCH_LEN), saved_3(384, 8, FREQ_BRANCH_LEN),
-          savedt_0(1, 48, TIME_BRANCH_LEN_0),
-          savedt_1(1, 96, TIME_BRANCH_LEN_1),
-          savedt_2(1, 192, TIME_BRANCH_LEN_2),
-          savedt_3(1, 384, TIME_BRANCH_LEN_3)
+          xt_3_channel_upsampled(1, 512, TIME_BRANCH_LEN_3)
     {
         std::cout << "segment_samples: " << segment_samples << std::endl;
         std::cout << "padded segment_samples: " << padded_segment_samples
@@ -656,7 +730,14 @@ struct demucs_segment_buffers
         std::cout << "pad: " << pad
                   << " plus le * FFT_HOP_SIZE: " << le * FFT_HOP_SIZE
                   << " minus segment_samples: " << segment_samples << std::endl;
+
+        std::cout << "activation arena: " << plan.arena_bytes / 1024 / 1024
+                  << " MB planned, " << plan.separate_bytes() / 1024 / 1024
+                  << " MB as separate buffers" << std::endl;
     };
+
+    demucs_segment_buffers(const demucs_segment_buffers &) = delete;
+    demucs_segment_buffers &operator=(const demucs_segment_buffers &) = delete;
 };
 
 bool load_demucs_model(const std::vector<char> &model_data,
@@ -665,20 +746,173 @@ bool load_demucs_model(const std::vector<char> &model_data,
 bool load_demucs_model(const char* model_data, int n_bytes,
                                   struct demucs_model *model);
 
+// mmaps the model file and converts the weights straight from the mapping,
+// without reading the file into memory first; content_hash, if given, gets a
+// hash of the whole file
+bool load_demucs_model_file(const std::string &model_file,
+                            struct demucs_model *model,
+                            uint64_t *content_hash = nullptr);
+
+// convert a loaded model's weights to the given precision (see
+// weight_precision); the float weights are released, so a model cannot be
+// converted back, and f32 leaves the model as it is
+void set_weight_precision(struct demucs_model *model,
+                          weight_precision precision);
+
 const float SEGMENT_LEN_SECS = 7.8;      // 8 seconds, the demucs chunk size
 const float SEGMENT_OVERLAP_SECS = 0.25; // 0.25 overlap
 const float MAX_SHIFT_SECS = 0.5;        // max shift
 const float OVERLAP = 0.25;              // overlap between segments
 const float TRANSITION_POWER = 1.0;      // transition between segments
 
+// what the stems of a segment skipped by the silence gate are: zero, or an
+// equal share of the mix for each stem
+enum class silence_fill
+{
+    zero,
+    mix,
+};
+
+// an energy gate in front of the model: a segment whose normalized mix has
+// both its rms and its peak below the thresholds is not run through
+// model_inference, and gets its stems from fill instead, which crossfade
+// with the neighbouring segments through the usual overlap-add
+//
+// the mix is normalized to a standard deviation of 1 first, so the
+// thresholds are relative to the level of the whole input (the defaults are
+// -60 dB rms and -40 dB peak below it); the gate is off by default, since a
+// skipped segment does not get the small output the model gives for silence
+struct silence_gate
+{
+    bool enabled = false;
+    float rms_threshold = 1e-3f;
+    float peak_threshold = 1e-2f;
+    silence_fill fill = silence_fill::zero;
+};
+
+// num_threads > 1 runs that many segments concurrently, each worker with its
+// own segment and stft buffers; cb is only ever invoked on the calling thread
+// and the output is bit-identical to the single-threaded path
 Eigen::Tensor3dXf demucs_inference(const struct demucs_model &model,
+                                   const Eigen::MatrixXf &full_audio,
+                                   ProgressCallback cb, int num_threads = 1,
+                                   const silence_gate &gate = silence_gate());
+
+// per-worker segment and stft buffers of demucs_inference, which can be kept
+// across calls so that back-to-back jobs don't reallocate them
+struct demucs_workspace
+{
+    std::vector<std::unique_ptr<demucs_segment_buffers>> segment_buffers;
+    std::vector<std::unique_ptr<stft_buffers>> stft_bufs;
+
+    // the stems of segments that were committed, whose storage the next
+    // segments reuse
+    std::vector<Eigen::Tensor3dXf> spare_chunks;
+
+    // the segments of the last call, and how many of them the silence gate
+    // skipped
+    int nb_segments = 0;
+    int nb_silent_segments = 0;
+};
+
+// a loaded model with its warm buffers and thread count, to run many jobs on
+struct demucs_session
+{
+    demucs_model model;
+    demucs_workspace workspace;
+    int num_threads = 1;
+    silence_gate silence;
+
+    // number of randomly shifted passes to average, as the shifts option of
+    // demucs; the segments of all the passes share one queue, so that they
+    // run side by side on the session's threads; it must be at least 1
+    int shifts = 1;
+
+    // the seed of the random shifts, which each job draws afresh, so that
+    // the same input always gets the same stems (and the cached stems are
+    // the ones the job would compute)
+    unsigned int shift_seed = 0;
+
+    // a hash of the model file contents and the weight precision, as part of
+    // the stem cache key
+    std::string model_id;
+
+    // set to look up and keep the stems of whole inputs on disk
+    std::shared_ptr<stem_cache> cache;
+
+    // set to checkpoint each job in that directory, so that a job that was
+    // stopped or killed resumes where it was on the same input (see
+    // checkpoint.hpp)
+    std::string checkpoint_dir;
+};
+
+bool load_demucs_session(
+    const std::string &model_file, int num_threads,
+    struct demucs_session *session,
+    weight_precision precision = weight_precision::f32);
+
+// same as demucs_inference, reusing the session's buffers and thread pool,
+// and going through the session's stem cache and checkpoints if it has them;
+// invalid shifts give an empty tensor
+Eigen::Tensor3dXf demucs_inference(struct demucs_session &session,
                                    const Eigen::MatrixXf &full_audio,
                                    ProgressCallback cb);
 
+// the stems of the frames [begin, end) of full_audio only, e.g. to preview a
+// section before separating the whole file
+//
+// only the segments overlapping the range are run, and the normalization
+// still uses the whole input, so the result is bit-identical to those frames
+// of demucs_inference on the same session; the range is cut from the cached
+// stems of the whole input when there are some, but is not stored itself; an
+// invalid range or invalid shifts give an empty tensor
+Eigen::Tensor3dXf demucs_inference_range(struct demucs_session &session,
+                                         const Eigen::MatrixXf &full_audio,
+                                         int begin, int end,
+                                         ProgressCallback cb);
+
+// global normalization of the mix, as computed by demucs from the mean of
+// the two channels: wav = (wav - ref.mean()) / ref.std()
+struct normalization_stats
+{
+    float mean;
+    float std;
+    int64_t nb_frames; // number of stereo frames the stats were computed on
+};
+
+// streaming source: fill up to max_frames stereo frames into the leading
+// columns of buffer (2 x max_frames) and return how many were written,
+// 0 once the input is exhausted
+using AudioSourceCallback = std::function<int(Eigen::MatrixXf &, int)>;
+
+// streaming sink: receives consecutive finished frames of the separated
+// stems, shaped (nb_sources, 2, n_frames)
+using StemSinkCallback = std::function<void(const Eigen::Tensor3dXf &)>;
+
+normalization_stats compute_normalization_stats(const Eigen::MatrixXf &audio);
+
+// cheap pre-pass that drains source, for when the caller can replay the input
+// (e.g. by decoding a file twice) but cannot hold all of it in memory
+normalization_stats compute_normalization_stats(AudioSourceCallback source);
+
+// bounded-memory variant of demucs_inference for arbitrarily long inputs:
+// only about two segments of input and output are resident at any time, in
+// addition to one set of segment buffers
+//
+// the output is the same as demucs_inference for the same stats, shift
+// offset and silence gate; stats.nb_frames is only used for progress
+// reporting and may be 0
+void demucs_inference_streaming(const struct demucs_model &model,
+                                AudioSourceCallback source,
+                                StemSinkCallback sink,
+                                const normalization_stats &stats,
+                                ProgressCallback cb,
+                                const silence_gate &gate = silence_gate());
+
 void model_inference(const struct demucs_model &model,
                      struct demucscpp::demucs_segment_buffers &buffers,
                      struct demucscpp::stft_buffers &stft_buf,
-                     ProgressCallback cb, float current_progress,
+                     const ProgressCallback &cb, float current_progress,
                      float segment_progress);
 } // namespace demucscpp
 
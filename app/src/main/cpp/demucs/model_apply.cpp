@@ -1,26 +1,38 @@
+#include "checkpoint.hpp"
 #include "crosstransformer.hpp"
 #include "dsp.hpp"
 #include "encdec.hpp"
 #include "layers.hpp"
 #include "model.hpp"
+#include "profiler.hpp"
+#include "stem_cache.hpp"
 #include "tensor.hpp"
+#include "threadpool.hpp"
 #include <Eigen/Dense>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
 #include <cstdlib>
 #include <filesystem>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <random>
 #include <sstream>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <tuple>
 #include <unsupported/Eigen/FFT>
 #include <unsupported/Eigen/MatrixFunctions>
 #include <vector>
 
 static std::tuple<int, int>
-symmetric_zero_padding(Eigen::MatrixXf &padded, const Eigen::MatrixXf &original,
+symmetric_zero_padding(Eigen::MatrixXf &padded,
+                       const Eigen::Ref<const Eigen::MatrixXf> &original,
                        int total_padding)
 {
     int left_padding = std::floor((float)total_padding / 2.0f);
@@ -43,40 +55,110 @@ symmetric_zero_padding(Eigen::MatrixXf &padded, const Eigen::MatrixXf &original,
     return std::make_tuple(left_padding, right_padding);
 }
 
+// whether a chunk of the normalized mix is below both thresholds of the gate
+static bool is_silent(const Eigen::Ref<const Eigen::MatrixXf> &chunk,
+                      const demucscpp::silence_gate &gate)
+{
+    if (!gate.enabled || chunk.size() == 0)
+    {
+        return false;
+    }
+    float peak = chunk.cwiseAbs().maxCoeff();
+    float rms = std::sqrt(chunk.squaredNorm() / (float)chunk.size());
+    return rms < gate.rms_threshold && peak < gate.peak_threshold;
+}
+
+// the stems of a silent chunk in place of segment_inference, in the
+// normalized domain, so that they come out of the denormalization as zero
+// or as an equal share of the mix; like segment_inference, it writes the
+// first chunk length frames of chunk_out
+static void silent_segment(const Eigen::Ref<const Eigen::MatrixXf> &chunk,
+                           int nb_out_sources,
+                           const demucscpp::silence_gate &gate,
+                           const demucscpp::normalization_stats &stats,
+                           Eigen::Tensor3dXf &chunk_out)
+{
+    DEMUCS_PROFILE_SCOPE("silent segment");
+
+    // s * std + mean = share * (x * std + mean)
+    float share = gate.fill == demucscpp::silence_fill::mix
+                      ? 1.0f / (float)nb_out_sources
+                      : 0.0f;
+    float bias = (share - 1.0f) * stats.mean / stats.std;
+
+    int chunk_length = chunk.cols();
+    for (int i = 0; i < nb_out_sources; ++i)
+    {
+        for (int j = 0; j < 2; ++j)
+        {
+            for (int k = 0; k < chunk_length; ++k)
+            {
+                chunk_out(i, j, k) = share * chunk(j, k) + bias;
+            }
+        }
+    }
+}
+
 // forward declaration of inner fns
+// both only produce the frames [range_begin, range_end) of the input, and
+// resume from and update the checkpoint if there is one; the shift offsets
+// are drawn from gen
 static Eigen::Tensor3dXf
 shift_inference(const struct demucscpp::demucs_model &model,
-                Eigen::MatrixXf &full_audio, demucscpp::ProgressCallback cb);
-
+                Eigen::MatrixXf &full_audio,
+                struct demucscpp::demucs_workspace &workspace,
+                demucscpp::ProgressCallback cb,
+                const demucscpp::silence_gate &gate,
+                const demucscpp::normalization_stats &stats, int range_begin,
+                int range_end, int shifts, std::mt19937 &gen,
+                demucscpp::job_checkpoint *checkpoint);
+
+// the average of the shifted passes, each an input with the frame at which
+// the range starts in it
 static Eigen::Tensor3dXf
 split_inference(const struct demucscpp::demucs_model &model,
-                Eigen::MatrixXf &full_audio, demucscpp::ProgressCallback cb);
+                const std::vector<Eigen::Map<const Eigen::MatrixXf>> &passes,
+                const std::vector<int> &range_begins, int range_length,
+                struct demucscpp::demucs_workspace &workspace,
+                demucscpp::ProgressCallback cb,
+                const demucscpp::silence_gate &gate,
+                const demucscpp::normalization_stats &stats,
+                demucscpp::job_checkpoint *checkpoint);
+
+// the stems of a chunk of at most segment_samples frames, into the first
+// chunk length frames of chunk_out, which is (sources, 2, segment_samples);
+// it allocates nothing once the buffers and chunk_out have been used
+static void segment_inference(
+    const struct demucscpp::demucs_model &model,
+    const Eigen::Ref<const Eigen::MatrixXf> &chunk, int segment_samples,
+    struct demucscpp::demucs_segment_buffers &buffers,
+    struct demucscpp::stft_buffers &stft_buf,
+    const demucscpp::ProgressCallback &cb, float current_progress,
+    float segment_progress, Eigen::Tensor3dXf &chunk_out);
 
-static Eigen::Tensor3dXf segment_inference(
-    const struct demucscpp::demucs_model &model, Eigen::MatrixXf chunk,
-    int segment_sample, struct demucscpp::demucs_segment_buffers &buffers,
-    struct demucscpp::stft_buffers &stft_buf, demucscpp::ProgressCallback cb,
-    float current_progress, float segment_progress);
-
-Eigen::Tensor3dXf demucscpp::demucs_inference(const struct demucs_model &model,
-                                              const Eigen::MatrixXf &audio,
-                                              demucscpp::ProgressCallback cb)
+static Eigen::Tensor3dXf
+workspace_inference(const struct demucscpp::demucs_model &model,
+                    const Eigen::MatrixXf &audio,
+                    struct demucscpp::demucs_workspace &workspace,
+                    demucscpp::ProgressCallback cb, int num_threads,
+                    const demucscpp::silence_gate &gate, int range_begin,
+                    int range_end, int shifts, std::mt19937 &gen,
+                    demucscpp::job_checkpoint *checkpoint = nullptr)
 {
+    DEMUCS_PROFILE_SCOPE("demucs_inference");
+
+    demucscpp::set_num_threads(num_threads);
+
     std::cout << std::fixed << std::setprecision(20) << std::endl;
 
     // working copy to modify
     Eigen::MatrixXf full_audio = audio;
 
     // first, normalize the audio to mean and std
-    // ref = wav.mean(0)
-    // wav = (wav - ref.mean()) / ref.std()
-    // Calculate the overall mean and standard deviation
-    // Compute the mean and standard deviation separately for each channel
-    Eigen::VectorXf ref_mean_0 = full_audio.colwise().mean();
-
-    float ref_mean = ref_mean_0.mean();
-    float ref_std = std::sqrt((ref_mean_0.array() - ref_mean).square().sum() /
-                              (ref_mean_0.size() - 1));
+    demucscpp::normalization_stats stats =
+        demucscpp::compute_normalization_stats(full_audio);
+    float ref_mean = stats.mean;
+    float ref_std = stats.std;
 
     // Normalize the audio
     Eigen::MatrixXf normalized_audio =
@@ -84,7 +166,9 @@ Eigen::Tensor3dXf demucscpp::demucs_inference(const struct demucs_model &model,
 
     full_audio = normalized_audio;
 
-    Eigen::Tensor3dXf waveform_outputs = shift_inference(model, full_audio, cb);
+    Eigen::Tensor3dXf waveform_outputs =
+        shift_inference(model, full_audio, workspace, cb, gate, stats,
+                        range_begin, range_end, shifts, gen, checkpoint);
 
     // now inverse the normalization in Eigen C++
     // sources = sources * ref.std() + ref.mean()
@@ -93,12 +177,376 @@ Eigen::Tensor3dXf demucscpp::demucs_inference(const struct demucs_model &model,
     return waveform_outputs;
 }
 
+Eigen::Tensor3dXf demucscpp::demucs_inference(const struct demucs_model &model,
+                                              const Eigen::MatrixXf &audio,
+                                              demucscpp::ProgressCallback cb,
+                                              int num_threads,
+                                              const silence_gate &gate)
+{
+    // the buffers only live for this call
+    struct demucscpp::demucs_workspace workspace;
+
+    // the shift still follows the srand() seed
+    std::mt19937 gen(rand());
+    return workspace_inference(model, audio, workspace, cb, num_threads,
+                               gate, 0, audio.cols(), 1, gen);
+}
+
+// with no shifted pass there is nothing to average
+static bool check_shifts(const struct demucscpp::demucs_session &session)
+{
+    if (session.shifts < 1)
+    {
+        std::cerr << "Invalid number of shifts " << session.shifts
+                  << ", it must be at least 1" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+Eigen::Tensor3dXf demucscpp::demucs_inference(struct demucs_session &session,
+                                              const Eigen::MatrixXf &audio,
+                                              demucscpp::ProgressCallback cb)
+{
+    if (!check_shifts(session))
+    {
+        return Eigen::Tensor3dXf();
+    }
+
+    std::mt19937 gen(session.shift_seed);
+    if (!session.cache && session.checkpoint_dir.empty())
+    {
+        return workspace_inference(session.model, audio, session.workspace, cb,
+                                   session.num_threads, session.silence, 0,
+                                   audio.cols(), session.shifts, gen);
+    }
+
+    // the cache and the checkpoints identify a job the same way
+    std::string key = demucscpp::stem_cache_key(session, audio);
+    Eigen::Tensor3dXf stems;
+    if (session.cache)
+    {
+        if (session.cache->load(key, stems))
+        {
+            std::cout << "Stems loaded from the cache: " << key << std::endl;
+            cb(1.0f, "Stems loaded from the cache");
+            return stems;
+        }
+    }
+
+    std::unique_ptr<demucscpp::job_checkpoint> checkpoint;
+    if (!session.checkpoint_dir.empty())
+    {
+        checkpoint = std::make_unique<demucscpp::job_checkpoint>(
+            session.checkpoint_dir, key);
+        checkpoint->load();
+    }
+
+    stems = workspace_inference(session.model, audio, session.workspace, cb,
+                                session.num_threads, session.silence, 0,
+                                audio.cols(), session.shifts, gen,
+                                checkpoint.get());
+
+    if (checkpoint)
+    {
+        checkpoint->remove();
+    }
+    if (session.cache)
+    {
+        session.cache->store(key, stems);
+    }
+    return stems;
+}
+
+Eigen::Tensor3dXf demucscpp::demucs_inference_range(
+    struct demucs_session &session, const Eigen::MatrixXf &audio, int begin,
+    int end, demucscpp::ProgressCallback cb)
+{
+    if (begin < 0 || end > audio.cols() || begin >= end)
+    {
+        std::cerr << "Invalid range [" << begin << ", " << end
+                  << ") of an input of " << audio.cols() << " frames"
+                  << std::endl;
+        return Eigen::Tensor3dXf();
+    }
+    if (!check_shifts(session))
+    {
+        return Eigen::Tensor3dXf();
+    }
+
+    if (session.cache)
+    {
+        Eigen::Tensor3dXf stems;
+        if (session.cache->load(demucscpp::stem_cache_key(session, audio),
+                                stems))
+        {
+            cb(1.0f, "Stems loaded from the cache");
+            return stems.slice(
+                Eigen::array<Eigen::Index, 3>({0, 0, begin}),
+                Eigen::array<Eigen::Index, 3>(
+                    {stems.dimension(0), stems.dimension(1), end - begin}));
+        }
+    }
+
+    std::mt19937 gen(session.shift_seed);
+    return workspace_inference(session.model, audio, session.workspace, cb,
+                               session.num_threads, session.silence, begin,
+                               end, session.shifts, gen);
+}
+
+demucscpp::normalization_stats
+demucscpp::compute_normalization_stats(const Eigen::MatrixXf &audio)
+{
+    // ref = wav.mean(0)
+    // wav = (wav - ref.mean()) / ref.std()
+    // Calculate the overall mean and standard deviation
+    // Compute the mean and standard deviation separately for each channel
+    Eigen::VectorXf ref_mean_0 = audio.colwise().mean();
+
+    float ref_mean = ref_mean_0.mean();
+    float ref_std = std::sqrt((ref_mean_0.array() - ref_mean).square().sum() /
+                              (ref_mean_0.size() - 1));
+
+    return {ref_mean, ref_std, audio.cols()};
+}
+
+demucscpp::normalization_stats
+demucscpp::compute_normalization_stats(demucscpp::AudioSourceCallback source)
+{
+    const int block_frames = demucscpp::SUPPORTED_SAMPLE_RATE;
+    Eigen::MatrixXf block(2, block_frames);
+
+    // Welford's running mean and variance of the mid signal, in double
+    // since hour-long inputs have hundreds of millions of frames
+    int64_t n = 0;
+    double mean = 0.0;
+    double m2 = 0.0;
+
+    for (;;)
+    {
+        int nb_read = source(block, block_frames);
+        if (nb_read <= 0)
+        {
+            break;
+        }
+        for (int k = 0; k < nb_read; ++k)
+        {
+            double x = 0.5 * ((double)block(0, k) + (double)block(1, k));
+            ++n;
+            double delta = x - mean;
+            mean += delta / (double)n;
+            m2 += delta * (x - mean);
+        }
+    }
+
+    float ref_std = n > 1 ? (float)std::sqrt(m2 / (double)(n - 1)) : 1.0f;
+    return {(float)mean, ref_std, n};
+}
+
+void demucscpp::demucs_inference_streaming(
+    const struct demucs_model &model, demucscpp::AudioSourceCallback source,
+    demucscpp::StemSinkCallback sink, const normalization_stats &stats,
+    demucscpp::ProgressCallback cb, const silence_gate &gate)
+{
+    std::cout << std::fixed << std::setprecision(20) << std::endl;
+
+    // this mirrors shift_inference + split_inference on a virtual input
+    // stream of [max_shift - offset zeros | normalized audio], where only
+    // the segment being processed and its overlap-add accumulators are kept
+    int max_shift =
+        (int)(demucscpp::MAX_SHIFT_SECS * demucscpp::SUPPORTED_SAMPLE_RATE);
+    std::mt19937 gen(rand());
+    int offset = gen() % max_shift;
+    int lead_samples = max_shift - offset;
+
+    std::cout << "1., apply model w/ shift, offset: " << offset << std::endl;
+
+    int segment_samples =
+        (int)(demucscpp::SEGMENT_LEN_SECS * demucscpp::SUPPORTED_SAMPLE_RATE);
+    int stride_samples = (int)((1 - demucscpp::OVERLAP) * segment_samples);
+    int nb_out_sources = model.num_sources;
+
+    struct demucscpp::demucs_segment_buffers buffers(2, segment_samples,
+                                                     nb_out_sources);
+    struct demucscpp::stft_buffers stft_buf(buffers.padded_segment_samples);
+
+    Eigen::VectorXf weight(segment_samples);
+    weight.setZero();
+
+    weight.head(segment_samples / 2) =
+        Eigen::VectorXf::LinSpaced(segment_samples / 2, 1, segment_samples / 2);
+    weight.tail(segment_samples / 2) =
+        weight.head(segment_samples / 2).reverse();
+    weight /= weight.maxCoeff();
+    weight = weight.array().pow(demucscpp::TRANSITION_POWER);
+
+    // input window starting at the current segment offset of the stream
+    Eigen::MatrixXf in_window = Eigen::MatrixXf::Zero(2, segment_samples);
+    Eigen::MatrixXf read_block(2, segment_samples);
+    int in_length = lead_samples;
+
+    // the stems of the current segment
+    Eigen::Tensor3dXf chunk_out(nb_out_sources, 2, segment_samples);
+    bool eof = false;
+
+    // overlap-add accumulators, also starting at the current segment offset
+    Eigen::Tensor3dXf out(nb_out_sources, 2, segment_samples);
+    out.setZero();
+    Eigen::VectorXf sum_weight = Eigen::VectorXf::Zero(segment_samples);
+
+    // stream frames still to be dropped from the front of the output
+    int to_trim = lead_samples;
+
+    // roughly 1 / total_chunks as in split_inference, if the length is known
+    float increment_per_chunk = 0.0f;
+    if (stats.nb_frames > 0)
+    {
+        increment_per_chunk = std::min(
+            1.0f, (float)stride_samples /
+                      (float)(stats.nb_frames + (int64_t)lead_samples));
+    }
+    float inference_progress = 0.0f;
+    int nb_segments = 0;
+    int nb_silent_segments = 0;
+
+    for (int64_t segment_offset = 0;; segment_offset += stride_samples)
+    {
+        while (!eof && in_length < segment_samples)
+        {
+            int nb_wanted = segment_samples - in_length;
+            int nb_read = source(read_block, nb_wanted);
+            if (nb_read <= 0)
+            {
+                eof = true;
+                break;
+            }
+            nb_read = std::min(nb_read, nb_wanted);
+            in_window.block(0, in_length, 2, nb_read) =
+                (read_block.leftCols(nb_read).array() - stats.mean) /
+                stats.std;
+            in_length += nb_read;
+        }
+
+        if (in_length == 0)
+        {
+            break;
+        }
+
+        std::cout << "2., apply model w/ split, offset: " << segment_offset
+                  << ", chunk shape: (2, " << in_length << ")" << std::endl;
+
+        auto chunk = in_window.leftCols(in_length);
+        int chunk_length = in_length;
+
+        ++nb_segments;
+        if (is_silent(chunk, gate))
+        {
+            ++nb_silent_segments;
+            silent_segment(chunk, nb_out_sources, gate, stats, chunk_out);
+            cb(inference_progress + increment_per_chunk,
+               "Segment skipped (silent)");
+        }
+        else
+        {
+            segment_inference(model, chunk, segment_samples, buffers,
+                              stft_buf, cb, inference_progress,
+                              increment_per_chunk, chunk_out);
+        }
+
+        for (int i = 0; i < nb_out_sources; ++i)
+        {
+            for (int j = 0; j < 2; ++j)
+            {
+                for (int k = 0; k < chunk_length; ++k)
+                {
+                    out(i, j, k) +=
+                        weight(k % chunk_length) * chunk_out(i, j, k);
+                }
+            }
+        }
+        for (int k = 0; k < chunk_length; ++k)
+        {
+            sum_weight(k) += weight(k % chunk_length);
+        }
+
+        // frames before the next segment offset won't receive any more
+        // contributions and can be handed to the sink
+        bool last_segment = eof && chunk_length <= stride_samples;
+        int nb_final = last_segment ? chunk_length : stride_samples;
+
+        int nb_skip = std::min(to_trim, nb_final);
+        to_trim -= nb_skip;
+        if (nb_final > nb_skip)
+        {
+            Eigen::Tensor3dXf finished(nb_out_sources, 2, nb_final - nb_skip);
+            for (int i = 0; i < nb_out_sources; ++i)
+            {
+                for (int j = 0; j < 2; ++j)
+                {
+                    for (int k = nb_skip; k < nb_final; ++k)
+                    {
+                        finished(i, j, k - nb_skip) =
+                            out(i, j, k) / sum_weight[k];
+                    }
+                }
+            }
+
+            // sources = sources * ref.std() + ref.mean()
+            finished = (finished * stats.std).eval() + stats.mean;
+            sink(finished);
+        }
+
+        if (last_segment)
+        {
+            break;
+        }
+
+        // slide the input window and the accumulators by one stride
+        int nb_keep = segment_samples - stride_samples;
+
+        in_length -= stride_samples;
+        in_window.leftCols(nb_keep) =
+            in_window.block(0, stride_samples, 2, nb_keep).eval();
+
+        for (int i = 0; i < nb_out_sources; ++i)
+        {
+            for (int j = 0; j < 2; ++j)
+            {
+                for (int k = 0; k < nb_keep; ++k)
+                {
+                    out(i, j, k) = out(i, j, k + stride_samples);
+                }
+                for (int k = nb_keep; k < segment_samples; ++k)
+                {
+                    out(i, j, k) = 0.0f;
+                }
+            }
+        }
+        sum_weight.head(nb_keep) =
+            sum_weight.segment(stride_samples, nb_keep).eval();
+        sum_weight.tail(segment_samples - nb_keep).setZero();
+
+        inference_progress += increment_per_chunk;
+    }
+
+    if (gate.enabled)
+    {
+        std::cout << "Skipped " << nb_silent_segments << " of " << nb_segments
+                  << " segments as silent" << std::endl;
+    }
+}
+
 static Eigen::Tensor3dXf
 shift_inference(const struct demucscpp::demucs_model &model,
-                Eigen::MatrixXf &full_audio, demucscpp::ProgressCallback cb)
+                Eigen::MatrixXf &full_audio,
+                struct demucscpp::demucs_workspace &workspace,
+                demucscpp::ProgressCallback cb,
+                const demucscpp::silence_gate &gate,
+                const demucscpp::normalization_stats &stats, int range_begin,
+                int range_end, int shifts, std::mt19937 &gen,
+                demucscpp::job_checkpoint *checkpoint)
 {
     // first, apply shifts for time invariance
-    // we simply only support shift=1, the demucs default
     // shifts (int): if > 0, will shift in time `mix` by a random amount between
     // 0 and 0.5 sec
     //     and apply the oppositve shift to the output. This is repeated
@@ -110,50 +558,72 @@ shift_inference(const struct demucscpp::demucs_model &model,
 
     int length = full_audio.cols();
 
+    // every shifted pass reads its input from the same padded mix
     Eigen::MatrixXf padded_mix(2, length + 2 * max_shift);
 
     symmetric_zero_padding(padded_mix, full_audio, 2 * max_shift);
 
-    int offset = rand() % max_shift;
+    // drawn up front, so that they only depend on the seed of gen
+    std::vector<int> offsets(shifts);
+    for (int s = 0; s < shifts; ++s)
+    {
+        offsets[s] = gen() % max_shift;
+    }
     // int offset = 1337;
 
-    std::cout << "1., apply model w/ shift, offset: " << offset << std::endl;
-
-    Eigen::MatrixXf shifted_audio =
-        padded_mix.block(0, offset, 2, length + max_shift - offset);
-
-    Eigen::Tensor3dXf waveform_outputs =
-        split_inference(model, shifted_audio, cb);
-
-    int nb_out_sources = model.num_sources;
+    // a resumed job goes on with the shifts it started with
+    if (checkpoint != nullptr)
+    {
+        const std::vector<int> &resumed = checkpoint->shift_offsets;
+        if (checkpoint->resumed && resumed.size() == offsets.size() &&
+            std::all_of(resumed.begin(), resumed.end(),
+                        [&](int offset) { return offset < max_shift; }))
+        {
+            offsets = resumed;
+        }
+        else
+        {
+            checkpoint->remove();
+            checkpoint->shift_offsets = offsets;
+        }
+    }
 
-    // trim the output to the original length
+    // trim the output to the original length, which split_inference does
+    // by only producing those frames
     // waveform_outputs = waveform_outputs[..., max_shift:max_shift + length]
-    Eigen::Tensor3dXf trimmed_waveform_outputs =
-        waveform_outputs
-            .reshape(Eigen::array<int, 3>(
-                {nb_out_sources, 2,
-                 static_cast<int>(waveform_outputs.dimension(2))}))
-            .slice(Eigen::array<int, 3>({0, 0, max_shift - offset}),
-                   Eigen::array<int, 3>({nb_out_sources, 2, length}));
+    std::vector<Eigen::Map<const Eigen::MatrixXf>> shifted_audio;
+    std::vector<int> range_begins;
+    for (int offset : offsets)
+    {
+        std::cout << "1., apply model w/ shift, offset: " << offset
+                  << std::endl;
 
-    return trimmed_waveform_outputs;
+        shifted_audio.emplace_back(padded_mix.data() + 2 * (Eigen::Index)offset,
+                                   2, length + max_shift - offset);
+        range_begins.push_back(range_begin + max_shift - offset);
+    }
+
+    return split_inference(model, shifted_audio, range_begins,
+                           range_end - range_begin, workspace, cb, gate, stats,
+                           checkpoint);
 }
 
 static Eigen::Tensor3dXf
 split_inference(const struct demucscpp::demucs_model &model,
-                Eigen::MatrixXf &full_audio, demucscpp::ProgressCallback cb)
+                const std::vector<Eigen::Map<const Eigen::MatrixXf>> &passes,
+                const std::vector<int> &range_begins, int range_length,
+                struct demucscpp::demucs_workspace &workspace,
+                demucscpp::ProgressCallback cb,
+                const demucscpp::silence_gate &gate,
+                const demucscpp::normalization_stats &stats,
+                demucscpp::job_checkpoint *checkpoint)
 {
     // calculate segment in samples
     int segment_samples =
         (int)(demucscpp::SEGMENT_LEN_SECS * demucscpp::SUPPORTED_SAMPLE_RATE);
 
     int nb_out_sources = model.num_sources;
-
-    // let's create reusable buffers with padded sizes
-    struct demucscpp::demucs_segment_buffers buffers(2, segment_samples,
-                                                     nb_out_sources);
-    struct demucscpp::stft_buffers stft_buf(buffers.padded_segment_samples);
+    int nb_passes = passes.size();
 
     // next, use splits with weighted transition and overlap
     // split (bool): if True, the input will be broken down in 8 seconds
@@ -164,11 +634,8 @@ split_inference(const struct demucscpp::demucs_model &model,
 
     int stride_samples = (int)((1 - demucscpp::OVERLAP) * segment_samples);
 
-    int length = full_audio.cols();
-
     // create an output tensor of zeros for four source waveforms
-    Eigen::Tensor3dXf out = Eigen::Tensor3dXf(nb_out_sources, 2, length);
-    out.setZero();
+    Eigen::Tensor3dXf out = Eigen::Tensor3dXf(nb_out_sources, 2, range_length);
 
     // create weight tensor
     Eigen::VectorXf weight(segment_samples);
@@ -181,43 +648,179 @@ split_inference(const struct demucscpp::demucs_model &model,
     weight /= weight.maxCoeff();
     weight = weight.array().pow(demucscpp::TRANSITION_POWER);
 
-    Eigen::VectorXf sum_weight(length);
-    sum_weight.setZero();
+    Eigen::VectorXf sum_weight(range_length);
 
-    // i prefer using `std::ceilf` but :shrug:
-    int total_chunks = ::ceilf((float)length / (float)stride_samples);
+    // only the segments overlapping the range contribute to it; they are the
+    // same segments, on the same grid, as for the whole input, so that the
+    // overlap-add of the range is too
+    std::vector<std::vector<int>> pass_offsets(nb_passes);
+    for (int p = 0; p < nb_passes; ++p)
+    {
+        int length = passes[p].cols();
+        int range_begin = range_begins[p];
+        for (int offset = 0; offset < length; offset += stride_samples)
+        {
+            int chunk_end = offset + std::min(segment_samples, length - offset);
+            if (offset < range_begin + range_length && chunk_end > range_begin)
+            {
+                pass_offsets[p].push_back(offset);
+            }
+        }
+    }
+
+    // the segments of all the passes in one queue, interleaved so that the
+    // passes run side by side and share the workers and their buffers
+    std::vector<int> chunk_pass;
+    std::vector<int> offsets;
+    for (std::size_t c = 0;; ++c)
+    {
+        bool any = false;
+        for (int p = 0; p < nb_passes; ++p)
+        {
+            if (c < pass_offsets[p].size())
+            {
+                chunk_pass.push_back(p);
+                offsets.push_back(pass_offsets[p][c]);
+                any = true;
+            }
+        }
+        if (!any)
+        {
+            break;
+        }
+    }
+
+    int total_chunks = offsets.size();
     float increment_per_chunk = 1.0f / (float)total_chunks;
-    float inference_progress = 0.0f;
 
-    for (int offset = 0; offset < length; offset += stride_samples)
+    // with several passes, each chunk is scaled when it is added so that out
+    // is their average right away, instead of keeping an output per pass:
+    // the weights that a pass sums to at each frame only depend on its
+    // offsets, and the sum of weights of out is then 1 everywhere
+    std::vector<Eigen::VectorXf> pass_scale;
+    if (nb_passes > 1)
     {
-        // create a chunk of the padded_full_audio
-        int chunk_end = std::min(segment_samples, length - offset);
-        Eigen::MatrixXf chunk = full_audio.block(0, offset, 2, chunk_end);
-        int chunk_length = chunk.cols();
+        pass_scale.assign(nb_passes, Eigen::VectorXf::Zero(range_length));
+        for (int c = 0; c < total_chunks; ++c)
+        {
+            int p = chunk_pass[c];
+            int offset = offsets[c];
+            int range_begin = range_begins[p];
+            int chunk_length =
+                std::min(segment_samples, (int)passes[p].cols() - offset);
+            int k_begin = std::max(0, range_begin - offset);
+            int k_end =
+                std::min(chunk_length, range_begin + range_length - offset);
+            for (int k = k_begin; k < k_end; ++k)
+            {
+                pass_scale[p](offset + k - range_begin) += weight(k);
+            }
+        }
+        for (Eigen::VectorXf &scale : pass_scale)
+        {
+            scale = (scale.array() * (float)nb_passes).inverse();
+        }
+    }
 
-        std::cout << "2., apply model w/ split, offset: " << offset
-                  << ", chunk shape: (" << chunk.rows() << ", " << chunk.cols()
-                  << ")" << std::endl;
+    auto reset_output = [&]()
+    {
+        out.setZero();
+        if (nb_passes > 1)
+        {
+            sum_weight.setOnes();
+        }
+        else
+        {
+            sum_weight.setZero();
+        }
+    };
+    reset_output();
 
-        Eigen::Tensor3dXf chunk_out =
-            segment_inference(model, chunk, segment_samples, buffers, stft_buf,
-                              cb, inference_progress, increment_per_chunk);
+    // the end of the frames that committed segments have added to
+    int committed_end = 0;
+
+    // a resumed job starts with the output of its committed segments
+    int first_chunk = 0;
+    if (checkpoint != nullptr && checkpoint->resumed)
+    {
+        if (checkpoint->restore(out, sum_weight, total_chunks))
+        {
+            first_chunk = checkpoint->next_segment;
+            committed_end = checkpoint->final_frames +
+                            (int)checkpoint->window_frames();
+            std::cout << "Resuming from a checkpoint after " << first_chunk
+                      << " of " << total_chunks << " segments" << std::endl;
+        }
+        else
+        {
+            checkpoint->remove();
+            reset_output();
+        }
+    }
+
+    // each worker gets its own set of reusable buffers with padded sizes,
+    // kept in the workspace so they are only allocated on first use
+    // they are created here since the constructors log to std::cout, which
+    // must only be used from the calling thread
+    int nb_workers = std::min(demucscpp::get_num_threads(), total_chunks);
+
+    std::vector<std::unique_ptr<struct demucscpp::demucs_segment_buffers>>
+        &worker_buffers = workspace.segment_buffers;
+    std::vector<std::unique_ptr<struct demucscpp::stft_buffers>>
+        &worker_stft_bufs = workspace.stft_bufs;
+    for (int w = worker_buffers.size(); w < nb_workers; ++w)
+    {
+        worker_buffers.push_back(
+            std::make_unique<struct demucscpp::demucs_segment_buffers>(
+                2, segment_samples, nb_out_sources));
+        worker_stft_bufs.push_back(
+            std::make_unique<struct demucscpp::stft_buffers>(
+                worker_buffers[w]->padded_segment_samples));
+    }
+
+    // add the weighted chunk to the output
+    auto commit_chunk = [&](int c, const Eigen::Tensor3dXf &chunk_out)
+    {
+        DEMUCS_PROFILE_SCOPE("overlap-add");
+
+        int p = chunk_pass[c];
+        int offset = offsets[c];
+        int range_begin = range_begins[p];
+        int chunk_length =
+            std::min(segment_samples, (int)passes[p].cols() - offset);
+
+        // the part of the chunk inside the range
+        int k_begin = std::max(0, range_begin - offset);
+        int k_end = std::min(chunk_length, range_begin + range_length - offset);
+        committed_end = std::max(committed_end, offset + k_end - range_begin);
+
+        if (nb_passes > 1)
+        {
+            const Eigen::VectorXf &scale = pass_scale[p];
+            for (int i = 0; i < nb_out_sources; ++i)
+            {
+                for (int j = 0; j < 2; ++j)
+                {
+                    for (int k = k_begin; k < k_end; ++k)
+                    {
+                        int frame = offset + k - range_begin;
+                        out(i, j, frame) +=
+                            weight(k) * chunk_out(i, j, k) * scale(frame);
+                    }
+                }
+            }
+            return;
+        }
 
-        // add the weighted chunk to the output
         // out[..., offset:offset + segment] += (weight[:chunk_length] *
         // chunk_out).to(mix.device)
         for (int i = 0; i < nb_out_sources; ++i)
         {
             for (int j = 0; j < 2; ++j)
             {
-                for (int k = 0; k < chunk_length; ++k)
+                for (int k = k_begin; k < k_end; ++k)
                 {
-                    if (offset + k >= length)
-                    {
-                        break;
-                    }
-                    out(i, j, offset + k) +=
+                    out(i, j, offset + k - range_begin) +=
                         weight(k % chunk_length) * chunk_out(i, j, k);
                 }
             }
@@ -225,23 +828,195 @@ split_inference(const struct demucscpp::demucs_model &model,
 
         // sum_weight[offset:offset + segment] +=
         // weight[:chunk_length].to(mix.device)
-        for (int k = 0; k < chunk_length; ++k)
+        for (int k = k_begin; k < k_end; ++k)
         {
-            if (offset + k >= length)
+            sum_weight(offset + k - range_begin) += weight(k % chunk_length);
+        }
+    };
+
+    // segments can finish out of order across workers, but the overlap-add
+    // is always committed in queue order so that the floating point sums
+    // are the same as in the serial loop, whatever the number of threads
+    std::vector<Eigen::Tensor3dXf> pending_chunks(total_chunks);
+    std::vector<Eigen::Tensor3dXf> &spare_chunks = workspace.spare_chunks;
+    std::vector<bool> chunk_ready(total_chunks, false);
+    int next_commit = first_chunk;
+    std::mutex commit_mutex;
+
+    // the frames before the first segment still to commit of every pass are
+    // final, and those segments only add to the overlap after them
+    auto last_checkpoint = std::chrono::steady_clock::now();
+    bool checkpoint_ok = true;
+    auto save_checkpoint = [&]()
+    {
+        DEMUCS_PROFILE_SCOPE("checkpoint");
+
+        // as the queue is interleaved, the next segment of each pass is
+        // among the next nb_passes ones
+        int final_frames = range_length;
+        int last = std::min(total_chunks, next_commit + nb_passes);
+        for (int c = next_commit; c < last; ++c)
+        {
+            int begin = offsets[c] - range_begins[chunk_pass[c]];
+            final_frames = std::min(final_frames, std::max(0, begin));
+        }
+        int window_frames = std::max(0, committed_end - final_frames);
+
+        checkpoint_ok = checkpoint->save(next_commit, final_frames,
+                                         window_frames, out, sum_weight) &&
+                        checkpoint_ok;
+        last_checkpoint = std::chrono::steady_clock::now();
+    };
+    auto checkpoint_due = [&]()
+    {
+        std::chrono::duration<float> since =
+            std::chrono::steady_clock::now() - last_checkpoint;
+        return since.count() >= demucscpp::CHECKPOINT_INTERVAL_SECS;
+    };
+
+    std::atomic<int> next_chunk(first_chunk);
+    std::atomic<int> nb_silent_chunks(0);
+    std::atomic<bool> stop_requested(false);
+    const std::thread::id caller_id = std::this_thread::get_id();
+
+    // the user callback (e.g. a JNI progress bar) only runs on the calling
+    // thread; the other workers only check whether it asked to stop
+    demucscpp::ProgressCallback caller_cb =
+        [&](float progress, const std::string &msg)
+    {
+        try
+        {
+            cb(progress, msg);
+        }
+        catch (...)
+        {
+            stop_requested = true;
+            throw;
+        }
+    };
+    demucscpp::ProgressCallback worker_cb = [&](float, const std::string &)
+    {
+        if (stop_requested)
+        {
+            throw std::runtime_error("segment inference stopped");
+        }
+    };
+
+    try
+    {
+        demucscpp::parallel_for(
+            nb_workers,
+            [&](int w)
             {
-                break;
-            }
-            sum_weight(offset + k) += weight(k % chunk_length);
+                bool is_caller = std::this_thread::get_id() == caller_id;
+
+                for (int c = next_chunk++; c < total_chunks; c = next_chunk++)
+                {
+                    const Eigen::Map<const Eigen::MatrixXf> &full_audio =
+                        passes[chunk_pass[c]];
+                    int length = full_audio.cols();
+                    int offset = offsets[c];
+
+                    // a view of the chunk of the padded_full_audio
+                    int chunk_end = std::min(segment_samples, length - offset);
+                    auto chunk = full_audio.block(0, offset, 2, chunk_end);
+
+                    if (is_caller)
+                    {
+                        std::cout << "2., apply model w/ split, offset: "
+                                  << offset << ", chunk shape: ("
+                                  << chunk.rows() << ", " << chunk.cols()
+                                  << ")" << std::endl;
+                    }
+
+                    // the output of a committed segment if there is one,
+                    // so that its storage is reused
+                    Eigen::Tensor3dXf chunk_out;
+                    {
+                        std::lock_guard<std::mutex> lock(commit_mutex);
+                        if (!spare_chunks.empty())
+                        {
+                            chunk_out = std::move(spare_chunks.back());
+                            spare_chunks.pop_back();
+                        }
+                    }
+                    chunk_out.resize(nb_out_sources, 2, segment_samples);
+
+                    // a silent chunk still goes through the overlap-add, so
+                    // that it crossfades with its neighbours as usual
+                    if (is_silent(chunk, gate))
+                    {
+                        ++nb_silent_chunks;
+                        silent_segment(chunk, nb_out_sources, gate, stats,
+                                       chunk_out);
+                        demucscpp::report_progress(
+                            is_caller ? caller_cb : worker_cb,
+                            (c + 1) * increment_per_chunk,
+                            "Segment skipped (silent)");
+                    }
+                    else
+                    {
+                        segment_inference(
+                            model, chunk, segment_samples, *worker_buffers[w],
+                            *worker_stft_bufs[w],
+                            is_caller ? caller_cb : worker_cb,
+                            c * increment_per_chunk, increment_per_chunk,
+                            chunk_out);
+                    }
+
+                    std::lock_guard<std::mutex> lock(commit_mutex);
+                    pending_chunks[c] = std::move(chunk_out);
+                    chunk_ready[c] = true;
+                    while (next_commit < total_chunks &&
+                           chunk_ready[next_commit])
+                    {
+                        commit_chunk(next_commit, pending_chunks[next_commit]);
+                        spare_chunks.push_back(
+                            std::move(pending_chunks[next_commit]));
+                        ++next_commit;
+                    }
+
+                    if (checkpoint != nullptr && next_commit < total_chunks &&
+                        checkpoint_due())
+                    {
+                        save_checkpoint();
+                    }
+                }
+            });
+    }
+    catch (...)
+    {
+        // the workers are done, so this is the state of the committed
+        // segments; the job is stopped either way if it can't be saved
+        if (checkpoint != nullptr && next_commit > first_chunk)
+        {
+            save_checkpoint();
+            std::cout << "Checkpoint after " << next_commit << " of "
+                      << total_chunks << " segments" << std::endl;
         }
+        throw;
+    }
 
-        inference_progress += increment_per_chunk;
+    if (!checkpoint_ok)
+    {
+        std::cerr << "Cannot write the checkpoint of the job" << std::endl;
     }
 
+    workspace.nb_segments = total_chunks;
+    workspace.nb_silent_segments = nb_silent_chunks;
+    if (gate.enabled)
+    {
+        std::cout << "Skipped " << workspace.nb_silent_segments << " of "
+                  << total_chunks << " segments as silent" << std::endl;
+    }
+
+    DEMUCS_PROFILE_SCOPE("overlap-add normalization");
+
     for (int i = 0; i < nb_out_sources; ++i)
     {
         for (int j = 0; j < 2; ++j)
         {
-            for (int k = 0; k < length; ++k)
+            for (int k = 0; k < range_length; ++k)
             {
                 out(i, j, k) /= sum_weight[k];
             }
@@ -250,12 +1025,16 @@ split_inference(const struct demucscpp::demucs_model &model,
     return out;
 }
 
-static Eigen::Tensor3dXf segment_inference(
-    const struct demucscpp::demucs_model &model, Eigen::MatrixXf chunk,
-    int segment_samples, struct demucscpp::demucs_segment_buffers &buffers,
-    struct demucscpp::stft_buffers &stft_buf, demucscpp::ProgressCallback cb,
-    float current_progress, float segment_progress)
+static void segment_inference(
+    const struct demucscpp::demucs_model &model,
+    const Eigen::Ref<const Eigen::MatrixXf> &chunk, int segment_samples,
+    struct demucscpp::demucs_segment_buffers &buffers,
+    struct demucscpp::stft_buffers &stft_buf,
+    const demucscpp::ProgressCallback &cb, float current_progress,
+    float segment_progress, Eigen::Tensor3dXf &chunk_out)
 {
+    DEMUCS_PROFILE_SCOPE("segment");
+
     int chunk_length = chunk.cols();
 
     // copy chunk into buffers.mix with symmetric zero-padding
@@ -270,10 +1049,6 @@ static Eigen::Tensor3dXf segment_inference(
     int nb_out_sources = model.num_sources;
 
     // copy from buffers.targets_out into chunk_out with center trimming
-    Eigen::Tensor3dXf chunk_out =
-        Eigen::Tensor3dXf(nb_out_sources, 2, chunk_length);
-    chunk_out.setZero();
-
     for (int i = 0; i < nb_out_sources; ++i)
     {
         for (int j = 0; j < 2; ++j)
@@ -286,8 +1061,6 @@ static Eigen::Tensor3dXf segment_inference(
             }
         }
     }
-
-    return chunk_out;
 }
 
 // forward declaration of inner fns
@@ -313,15 +1086,10 @@ Eigen::Tensor3dXf demucscpp_v3::demucs_v3_inference(
     Eigen::MatrixXf full_audio = audio;
 
     // first, normalize the audio to mean and std
-    // ref = wav.mean(0)
-    // wav = (wav - ref.mean()) / ref.std()
-    // Calculate the overall mean and standard deviation
-    // Compute the mean and standard deviation separately for each channel
-    Eigen::VectorXf ref_mean_0 = full_audio.colwise().mean();
-
-    float ref_mean = ref_mean_0.mean();
-    float ref_std = std::sqrt((ref_mean_0.array() - ref_mean).square().sum() /
-                              (ref_mean_0.size() - 1));
+    demucscpp::normalization_stats stats =
+        demucscpp::compute_normalization_stats(full_audio);
+    float ref_mean = stats.mean;
+    float ref_std = stats.std;
 
     // Normalize the audio
     Eigen::MatrixXf normalized_audio =
@@ -449,6 +1217,8 @@ split_inference(const struct demucscpp_v3::demucs_v3_model &model,
             segment_inference(model, chunk, segment_samples, buffers, stft_buf,
                               cb, inference_progress, increment_per_chunk);
 
+        DEMUCS_PROFILE_SCOPE("overlap-add");
+
         // add the weighted chunk to the output
         // out[..., offset:offset + segment] += (weight[:chunk_length] *
         // chunk_out).to(mix.device)
@@ -482,6 +1252,8 @@ split_inference(const struct demucscpp_v3::demucs_v3_model &model,
         inference_progress += increment_per_chunk;
     }
 
+    DEMUCS_PROFILE_SCOPE("overlap-add normalization");
+
     for (int i = 0; i < nb_out_sources; ++i)
     {
         for (int j = 0; j < 2; ++j)
@@ -503,6 +1275,8 @@ segment_inference(const struct demucscpp_v3::demucs_v3_model &model,
                   demucscpp::ProgressCallback cb, float current_progress,
                   float segment_progress)
 {
+    DEMUCS_PROFILE_SCOPE("segment");
+
     int chunk_length = chunk.cols();
 
     // copy chunk into buffers.mix with symmetric zero-padding
@@ -3,8 +3,11 @@
 #include "encdec.hpp"
 #include "layers.hpp"
 #include "model.hpp"
+#include "profiler.hpp"
 #include "tensor.hpp"
+#include "threadpool.hpp"
 #include <Eigen/Dense>
+#include <cstdio>
 #include <cstdlib>
 #include <filesystem>
 #include <fstream>
@@ -18,6 +21,14 @@
 #include <unsupported/Eigen/MatrixFunctions>
 #include <vector>
 
+void demucscpp::report_progress(const ProgressCallback &cb, float progress,
+                                const char *msg)
+{
+    thread_local std::string message;
+    message.assign(msg);
+    cb(progress, message);
+}
+
 // Function to do reflection padding
 static void reflect_padding(Eigen::MatrixXf &padded_mix,
                             const Eigen::MatrixXf &mix, int left_padding,
@@ -45,18 +56,218 @@ static void reflect_padding(Eigen::MatrixXf &padded_mix,
     }
 }
 
+// the mask stage shared by v3 and v4: undoes the normalization of both
+// branches, unstacks the complex-as-channels spectrogram of every source,
+// runs a batched istft over all sources and channels, and sums the
+// frequency and time branches into targets_out
+static void apply_mask_istft(const Eigen::Tensor3dXfMap &x_out,
+                             const Eigen::Tensor3dXfMap &xt_out, float std_,
+                             float mean, float stdt, float meant,
+                             int nb_out_sources, int pad,
+                             struct demucscpp::stft_buffers &stft_buf,
+                             Eigen::Tensor3dXf &targets_out)
+{
+    DEMUCS_PROFILE_SCOPE("mask + istft");
+
+    int nb_bins = x_out.dimension(1);
+    int nb_frames = x_out.dimension(2);
+    int segment_samples = targets_out.dimension(2);
+
+    // x_out is (sources * 2 channels * 2 complex channels, F bins, T frames)
+    // i.e. in pytorch it's (16, 2048, 336), then `.view(4, -1, freq, time)`
+    // each spectrogram needs the 2049th bin and the 2 + 2 frames dropped after
+    // the stft zero-padded back in, the opposite of _spec in apply.py
+    std::vector<Eigen::Tensor3dXcf> &specs = stft_buf.source_specs;
+    specs.resize(nb_out_sources);
+
+    demucscpp::parallel_for(
+        nb_out_sources,
+        [&](int source)
+        {
+            Eigen::Tensor3dXcf &spec = specs[source];
+            spec.resize(2, stft_buf.nb_bins, stft_buf.nb_frames);
+            spec.setZero();
+
+            // apply opposite of
+            // x(i, j, k) = (x(i, j, k) - mean) / (epsilon + std_);
+            for (int k = 0; k < nb_frames; ++k)
+            {
+                for (int j = 0; j < nb_bins; ++j)
+                {
+                    for (int i = 0; i < 2; ++i)
+                    {
+                        spec(i, j, k + 2) = std::complex<float>(
+                            std_ * x_out(source * 4 + 2 * i, j, k) + mean,
+                            std_ * x_out(source * 4 + 2 * i + 1, j, k) + mean);
+                    }
+                }
+            }
+        });
+
+    std::vector<Eigen::MatrixXf> &waveforms = stft_buf.source_waveforms;
+    demucscpp::istft(stft_buf, specs, waveforms);
+
+    // undo the reflect pad 1d and sum with xt, the time branch, whose dim 0 is
+    // a fake dim of 1 for symmetry with the frequency branch
+    for (int source = 0; source < nb_out_sources; ++source)
+    {
+        for (int k = 0; k < segment_samples; ++k)
+        {
+            for (int j = 0; j < 2; ++j)
+            {
+                targets_out(source, j, k) =
+                    waveforms[source](j, pad + k) +
+                    stdt * xt_out(0, source * 2 + j, k) + meant;
+            }
+        }
+    }
+}
+
+// the two branches of model_inference, which run concurrently between the
+// normalization and the crosstransformer, and again between the
+// crosstransformer and the mask
+static constexpr int FREQ_LANE = 1;
+static constexpr int TIME_LANE = 2;
+
+// the steps of model_inference:
+//   0      normalization, writes x and xt
+//   1-4    encoder i of each branch reads x (xt) or saved_i-1 (savedt_i-1)
+//          and writes saved_i (savedt_i)
+//   5-7    channel upsampling, crosstransformer and downsampling, which read
+//          saved_3 and savedt_3 and write x_3 and xt_3
+//   8-11   decoder i of each branch reads x_3-i and the skip saved_3-i and
+//          writes x_2-i, the last one writing x_out (and the same for xt)
+//   12     mask and istft, which read x_out and xt_out
+demucscpp::activation_plan
+demucscpp::plan_segment_activations(int nb_channels, int segment_samples,
+                                    int nb_sources)
+{
+    int nb_stft_frames = segment_samples / demucscpp::FFT_HOP_SIZE + 1;
+    int nb_stft_bins = demucscpp::FFT_WINDOW_SIZE / 2 + 1;
+
+    demucscpp::activation_plan plan;
+    plan.parallel_regions = {{1, 4}, {8, 11}};
+
+    plan.add("x", {2 * nb_channels, nb_stft_bins - 1, nb_stft_frames},
+             FREQ_LANE, 0, 1);
+    plan.add("saved_0", {48, 512, FREQ_BRANCH_LEN}, FREQ_LANE, 1, 11);
+    plan.add("saved_1", {96, 128, FREQ_BRANCH_LEN}, FREQ_LANE, 2, 10);
+    plan.add("saved_2", {192, 32, FREQ_BRANCH_LEN}, FREQ_LANE, 3, 9);
+    plan.add("saved_3", {384, 8, FREQ_BRANCH_LEN}, FREQ_LANE, 4, 8);
+    plan.add("x_3", {384, 8, FREQ_BRANCH_LEN}, FREQ_LANE, 7, 8);
+    plan.add("x_2", {192, 32, FREQ_BRANCH_LEN}, FREQ_LANE, 8, 9);
+    plan.add("x_1", {96, 128, FREQ_BRANCH_LEN}, FREQ_LANE, 9, 10);
+    plan.add("x_0", {48, 512, FREQ_BRANCH_LEN}, FREQ_LANE, 10, 11);
+    plan.add("x_out",
+             {nb_sources * 2 * nb_channels, nb_stft_bins - 1, nb_stft_frames},
+             FREQ_LANE, 11, 12);
+
+    plan.add("xt", {1, nb_channels, segment_samples}, TIME_LANE, 0, 1);
+    plan.add("savedt_0", {1, 48, TIME_BRANCH_LEN_0}, TIME_LANE, 1, 11);
+    plan.add("savedt_1", {1, 96, TIME_BRANCH_LEN_1}, TIME_LANE, 2, 10);
+    plan.add("savedt_2", {1, 192, TIME_BRANCH_LEN_2}, TIME_LANE, 3, 9);
+    plan.add("savedt_3", {1, 384, TIME_BRANCH_LEN_3}, TIME_LANE, 4, 8);
+    plan.add("xt_3", {1, 384, TIME_BRANCH_LEN_3}, TIME_LANE, 7, 8);
+    plan.add("xt_2", {1, 192, TIME_BRANCH_LEN_2}, TIME_LANE, 8, 9);
+    plan.add("xt_1", {1, 96, TIME_BRANCH_LEN_1}, TIME_LANE, 9, 10);
+    plan.add("xt_0", {1, 48, TIME_BRANCH_LEN_0}, TIME_LANE, 10, 11);
+    plan.add("xt_out", {1, nb_sources * nb_channels, segment_samples},
+             TIME_LANE, 11, 12);
+
+    demucscpp::plan_activations(plan);
+    return plan;
+}
+
+// the encoders of the frequency branch, from buffers.x to buffers.saved_3
+static void
+apply_freq_encoders(const struct demucscpp::demucs_model &model,
+                    struct demucscpp::demucs_segment_buffers &buffers)
+{
+    demucscpp::apply_freq_encoder(model, 0, buffers.x, buffers.saved_0,
+                                  buffers.freq_scratch);
+
+    // apply embedding to buffers.saved_0, broadcast over time; the scaled
+    // embedding is built at load and has the layout of one time step
+    const Eigen::MatrixXf &emb = model.freq_emb_scaled;
+    for (int k = 0; k < buffers.saved_0.dimension(2); ++k)
+    {
+        for (int j = 0; j < 512; ++j)
+        {
+            for (int i = 0; i < 48; ++i)
+            {
+                buffers.saved_0(i, j, k) += emb(i, j);
+            }
+        }
+    }
+
+    demucscpp::apply_freq_encoder(model, 1, buffers.saved_0, buffers.saved_1,
+                                  buffers.freq_scratch);
+    demucscpp::apply_freq_encoder(model, 2, buffers.saved_1, buffers.saved_2,
+                                  buffers.freq_scratch);
+    demucscpp::apply_freq_encoder(model, 3, buffers.saved_2, buffers.saved_3,
+                                  buffers.freq_scratch);
+}
+
+// the encoders of the time branch, from buffers.xt to buffers.savedt_3
+static void
+apply_time_encoders(const struct demucscpp::demucs_model &model,
+                    struct demucscpp::demucs_segment_buffers &buffers)
+{
+    demucscpp::apply_time_encoder(model, 0, buffers.xt, buffers.savedt_0,
+                                  buffers.time_scratch);
+    demucscpp::apply_time_encoder(model, 1, buffers.savedt_0,
+                                  buffers.savedt_1, buffers.time_scratch);
+    demucscpp::apply_time_encoder(model, 2, buffers.savedt_1,
+                                  buffers.savedt_2, buffers.time_scratch);
+    demucscpp::apply_time_encoder(model, 3, buffers.savedt_2,
+                                  buffers.savedt_3, buffers.time_scratch);
+}
+
+// the decoders of the frequency branch, from buffers.x_3 to buffers.x_out
+static void
+apply_freq_decoders(const struct demucscpp::demucs_model &model,
+                    struct demucscpp::demucs_segment_buffers &buffers)
+{
+    demucscpp::apply_freq_decoder(model, 0, buffers.x_3, buffers.x_2,
+                                  buffers.saved_3, buffers.freq_scratch);
+    demucscpp::apply_freq_decoder(model, 1, buffers.x_2, buffers.x_1,
+                                  buffers.saved_2, buffers.freq_scratch);
+    demucscpp::apply_freq_decoder(model, 2, buffers.x_1, buffers.x_0,
+                                  buffers.saved_1, buffers.freq_scratch);
+    demucscpp::apply_freq_decoder(model, 3, buffers.x_0, buffers.x_out,
+                                  buffers.saved_0, buffers.freq_scratch);
+}
+
+// the decoders of the time branch, from buffers.xt_3 to buffers.xt_out
+static void
+apply_time_decoders(const struct demucscpp::demucs_model &model,
+                    struct demucscpp::demucs_segment_buffers &buffers)
+{
+    demucscpp::apply_time_decoder(model, 0, buffers.xt_3, buffers.xt_2,
+                                  buffers.savedt_3, buffers.time_scratch);
+    demucscpp::apply_time_decoder(model, 1, buffers.xt_2, buffers.xt_1,
+                                  buffers.savedt_2, buffers.time_scratch);
+    demucscpp::apply_time_decoder(model, 2, buffers.xt_1, buffers.xt_0,
+                                  buffers.savedt_1, buffers.time_scratch);
+    demucscpp::apply_time_decoder(model, 3, buffers.xt_0, buffers.xt_out,
+                                  buffers.savedt_0, buffers.time_scratch);
+}
+
 void demucscpp::model_inference(
     const struct demucscpp::demucs_model &model,
     struct demucscpp::demucs_segment_buffers &buffers,
-    struct demucscpp::stft_buffers &stft_buf, demucscpp::ProgressCallback cb,
-    float current_progress, float segment_progress)
+    struct demucscpp::stft_buffers &stft_buf,
+    const demucscpp::ProgressCallback &cb, float current_progress,
+    float segment_progress)
 {
+    DEMUCS_PROFILE_SCOPE("model_inference");
+
     // apply demucs inference
-    std::ostringstream ss;
-    ss << "3., apply_model mix shape: (" << buffers.mix.rows() << ", "
-       << buffers.mix.cols() << ")";
-    cb(current_progress + 0.0f, ss.str());
-    ss.str("");
+    // the messages are formatted on the stack, as a stream would allocate
+    char msg[128];
+    std::snprintf(msg, sizeof(msg), "3., apply_model mix shape: (%d, %d)",
+                  (int)buffers.mix.rows(), (int)buffers.mix.cols());
+    demucscpp::report_progress(cb, current_progress + 0.0f, msg);
 
     // pad buffers.pad on the left, reflect
     // pad buffers.pad_end on the right, reflect
@@ -78,10 +289,10 @@ void demucscpp::model_inference(
                              (int)stft_buf.spec.dimension(2) - 4});
 
     // print z shape
-    ss << "buffers.z: " << buffers.z.dimension(0) << ", "
-       << buffers.z.dimension(1) << ", " << buffers.z.dimension(2);
-    cb(current_progress + 0.0f, ss.str());
-    ss.str("");
+    std::snprintf(msg, sizeof(msg), "buffers.z: %d, %d, %d",
+                  (int)buffers.z.dimension(0), (int)buffers.z.dimension(1),
+                  (int)buffers.z.dimension(2));
+    demucscpp::report_progress(cb, current_progress + 0.0f, msg);
 
     // x = mag = z.abs(), but for CaC we're simply stacking the complex
     // spectrogram along the channel dimension
@@ -101,10 +312,10 @@ void demucscpp::model_inference(
     // x shape is complex*chan, nb_frames, nb_bins (2048)
     // using CaC (complex-as-channels)
     // print x shape
-    ss << "buffers.x: " << buffers.x.dimension(0) << ", "
-       << buffers.x.dimension(1) << ", " << buffers.x.dimension(2);
-    cb(current_progress + 0.0f, ss.str());
-    ss.str("");
+    std::snprintf(msg, sizeof(msg), "buffers.x: %d, %d, %d",
+                  (int)buffers.x.dimension(0), (int)buffers.x.dimension(1),
+                  (int)buffers.x.dimension(2));
+    demucscpp::report_progress(cb, current_progress + 0.0f, msg);
 
     // apply following pytorch operations to buffers.x in Eigen C++ code:
     //  mean = x.mean(dim=(1, 2, 3), keepdim=True)
@@ -112,9 +323,8 @@ void demucscpp::model_inference(
     //  x = (x - mean) / (1e-5 + std)
 
     // Compute mean and standard deviation using Eigen
-    Eigen::Tensor<float, 0> mean_tensor = buffers.x.mean();
-    float mean = mean_tensor(0);
-    float variance = demucscpp::calculate_variance(buffers.x, mean);
+    float mean, variance;
+    demucscpp::mean_and_variance(buffers.x, buffers.x.size(), mean, variance);
     float std_ = std::sqrt(variance);
 
     // Normalize x
@@ -132,18 +342,20 @@ void demucscpp::model_inference(
         }
     }
 
-    cb(current_progress + 0.0f, "Freq branch: normalized");
+    demucscpp::report_progress(cb, current_progress + 0.0f,
+                               "Freq branch: normalized");
 
     // apply similar mean, std normalization as above using 2d mean, std
-    Eigen::Tensor<float, 0> meant_tensor = buffers.xt.mean();
-    float meant = meant_tensor(0);
-    float variancet = demucscpp::calculate_variance(buffers.xt, meant);
+    float meant, variancet;
+    demucscpp::mean_and_variance(buffers.xt, buffers.xt.size(), meant,
+                                 variancet);
     float stdt = std::sqrt(variancet);
 
     // Normalize x
     buffers.xt = (buffers.xt - meant) / (stdt + epsilon);
 
-    cb(current_progress + 0.0f, "Time branch: normalized");
+    demucscpp::report_progress(cb, current_progress + 0.0f,
+                               "Time branch: normalized");
 
     // buffers.xt will be the time branch input
 
@@ -152,64 +364,28 @@ void demucscpp::model_inference(
 
     // apply tenc, enc
 
-    demucscpp::apply_time_encoder(model, 0, buffers.xt, buffers.xt_0);
-    cb(current_progress + segment_progress * 1.0f / 26.0f, "Time encoder 0");
-
-    demucscpp::apply_freq_encoder(model, 0, buffers.x, buffers.x_0);
-    cb(current_progress + segment_progress * 2.0f / 26.0f, "Freq encoder 0");
-
-    // absorb both scaling factors in one expression
-    //   i.e. eliminate const float freq_emb_scale = 0.2f;
-    const float emb_scale = 10.0f * 0.2f;
-
-    Eigen::MatrixXf emb =
-        model.freq_emb_embedding_weight.transpose() * emb_scale;
-
-    // apply embedding to buffers.x_0
-    for (int i = 0; i < 48; ++i)
-    {
-        for (int j = 0; j < 512; ++j)
+    // the frequency and time branches only meet in the crosstransformer (and
+    // again in the mask stage), so each branch's encoders run as one task and
+    // the two tasks join before the crosstransformer
+    //
+    // the progress callback (e.g. a JNI progress bar) is only called from
+    // this thread, after the join
+    demucscpp::parallel_for(
+        2,
+        [&](int branch)
         {
-            for (int k = 0; k < buffers.x_0.dimension(2); ++k)
+            if (branch == 0)
             {
-                // implicit broadcasting
-                buffers.x_0(i, j, k) += emb(i, j);
+                apply_freq_encoders(model, buffers);
             }
-        }
-    }
-
-    buffers.saved_0 = buffers.x_0;
-    buffers.savedt_0 = buffers.xt_0;
-
-    cb(current_progress + segment_progress * 2.0f / 26.0f,
-       "Freq branch: applied frequency embedding");
-
-    apply_time_encoder(model, 1, buffers.xt_0, buffers.xt_1);
-    cb(current_progress + segment_progress * 3.0f / 26.0f, "Time encoder 1");
-
-    apply_freq_encoder(model, 1, buffers.x_0, buffers.x_1);
-    cb(current_progress + segment_progress * 4.0f / 26.0f, "Freq encoder 1");
-
-    buffers.saved_1 = buffers.x_1;
-    buffers.savedt_1 = buffers.xt_1;
-
-    apply_time_encoder(model, 2, buffers.xt_1, buffers.xt_2);
-    cb(current_progress + segment_progress * 5.0f / 26.0f, "Time encoder 2");
-
-    apply_freq_encoder(model, 2, buffers.x_1, buffers.x_2);
-    cb(current_progress + segment_progress * 6.0f / 26.0f, "Freq encoder 2");
-
-    buffers.saved_2 = buffers.x_2;
-    buffers.savedt_2 = buffers.xt_2;
-
-    apply_time_encoder(model, 3, buffers.xt_2, buffers.xt_3);
-    cb(current_progress + segment_progress * 7.0f / 26.0f, "Time encoder 3");
-
-    apply_freq_encoder(model, 3, buffers.x_2, buffers.x_3);
-    cb(current_progress + segment_progress * 8.0f / 26.0f, "Freq encoder 3");
-
-    buffers.saved_3 = buffers.x_3;
-    buffers.savedt_3 = buffers.xt_3;
+            else
+            {
+                apply_time_encoders(model, buffers);
+            }
+        });
+    demucscpp::report_progress(
+        cb, current_progress + segment_progress * 8.0f / 26.0f,
+        "Time and freq encoders finished");
 
     if (model.use_4source_crosstransformer)
     {
@@ -220,253 +396,126 @@ void demucscpp::model_inference(
         /*****************************/
         /*  FREQ CHANNEL UPSAMPLING  */
         /*****************************/
-        int n_stft_frames = buffers.x_3.dimension(2);
-
-        // Reshape buffers.x_3 into x_3_reshaped
-        // Apply the conv1d function
-        // Reshape back to 512x8x336 and store in buffers.x_3_channel_upsampled
-        Eigen::Tensor3dXf x_3_reshaped = buffers.x_3.reshape(
-            Eigen::array<int, 3>({1, 384, 8 * n_stft_frames}));
-        Eigen::Tensor3dXf x_3_reshaped_upsampled =
-            demucscpp::conv1d<384, 512, 1, 1, 0, 1>(
-                x_3_reshaped, ct_4s->channel_upsampler_weight,
-                ct_4s->channel_upsampler_bias);
-        buffers.x_3_channel_upsampled = x_3_reshaped_upsampled.reshape(
-            Eigen::array<int, 3>({512, 8, n_stft_frames}));
-
-        cb(current_progress + segment_progress * 8.0f / 26.0f,
-           "Freq channels upsampled");
+        // the 1x1 conv multiplies the channels of every (freq, frame)
+        // position of buffers.saved_3 in place, so it goes from 384x8x336 to
+        // 512x8x336 without reshaping either side
+        demucscpp::conv1x1<384, 512, demucscpp::chw_layout,
+                           demucscpp::chw_layout>(
+            buffers.saved_3, ct_4s->channel_upsampler_weight_packed,
+            ct_4s->channel_upsampler_bias, buffers.x_3_channel_upsampled);
+
+        demucscpp::report_progress(
+            cb, current_progress + segment_progress * 8.0f / 26.0f,
+            "Freq channels upsampled");
 
         /*****************************/
         /*  TIME CHANNEL UPSAMPLING  */
         /*****************************/
 
         // for time channel upsampling
-        // apply upsampler directly to xt_3 no reshaping drama needed
-        buffers.xt_3_channel_upsampled =
-            demucscpp::conv1d<384, 512, 1, 1, 0, 1>(
-                buffers.xt_3, ct_4s->channel_upsampler_t_weight,
-                ct_4s->channel_upsampler_t_bias);
+        // apply upsampler directly to savedt_3 no reshaping drama needed
+        demucscpp::conv1x1<384, 512>(
+            buffers.savedt_3, ct_4s->channel_upsampler_t_weight_packed,
+            ct_4s->channel_upsampler_t_bias, buffers.xt_3_channel_upsampled);
 
-        cb(current_progress + segment_progress * 8.0f / 26.0f,
-           "Time channels upsampled");
+        demucscpp::report_progress(
+            cb, current_progress + segment_progress * 8.0f / 26.0f,
+            "Time channels upsampled");
 
         /*************************/
         /*  CROSS-TRANSFORMER!  */
         /************************/
-        demucscpp::apply_crosstransformer(model, buffers.x_3_channel_upsampled,
-                                          buffers.xt_3_channel_upsampled, cb,
-                                          current_progress, segment_progress);
-        cb(current_progress + segment_progress * 18.0f / 26.0f,
-           "Crosstransformer finished");
-
-        // reshape buffers.x_3_channel_upsampled into 1, 512, 2688
-        // when skipping the crosstransformer
-        // Eigen::Tensor3dXf x_3_reshaped_upsampled_2 =
-        // buffers.x_3_channel_upsampled.reshape(Eigen::array<int, 3>({1, 512,
-        // 8*336})); buffers.x_3_channel_upsampled = x_3_reshaped_upsampled_2;
-
-        // then apply the conv1d_2d function
-
-        Eigen::Tensor3dXf x_3_reshaped_downsampled =
-            demucscpp::conv1d<512, 384, 1, 1, 0, 0>(
-                buffers.x_3_channel_upsampled,
-                ct_4s->channel_downsampler_weight,
-                ct_4s->channel_downsampler_bias);
-        buffers.x_3 = x_3_reshaped_downsampled.reshape(
-            Eigen::array<int, 3>({384, 8, n_stft_frames}));
-        cb(current_progress + segment_progress * 18.0f / 26.0f,
-           "Freq channels downsampled");
+        demucscpp::apply_crosstransformer(
+            model, buffers.x_3_channel_upsampled,
+            buffers.xt_3_channel_upsampled, buffers.freq_scratch, cb,
+            current_progress, segment_progress);
+        demucscpp::report_progress(
+            cb, current_progress + segment_progress * 18.0f / 26.0f,
+            "Crosstransformer finished");
+
+        // the crosstransformer leaves x as 1x512x2688, which the 1x1 conv
+        // writes as 1x384x2688 into the memory of the 384x8x336 buffers.x_3
+        Eigen::Tensor3dXfMap x_3_flat(buffers.x_3.data(), 1, 384,
+                                      buffers.x_3.dimension(1) *
+                                          buffers.x_3.dimension(2));
+        demucscpp::conv1x1<512, 384>(buffers.x_3_channel_upsampled,
+                                     ct_4s->channel_downsampler_weight_packed,
+                                     ct_4s->channel_downsampler_bias,
+                                     x_3_flat);
+        demucscpp::report_progress(
+            cb, current_progress + segment_progress * 18.0f / 26.0f,
+            "Freq channels downsampled");
 
         // apply upsampler directly to xt_3
-        buffers.xt_3 = demucscpp::conv1d<512, 384, 1, 1, 0, 0>(
-            buffers.xt_3_channel_upsampled, ct_4s->channel_downsampler_t_weight,
-            ct_4s->channel_downsampler_t_bias);
-        cb(current_progress + segment_progress * 18.0f / 26.0f,
-           "Time channels downsampled");
+        demucscpp::conv1x1<512, 384>(buffers.xt_3_channel_upsampled,
+                                     ct_4s->channel_downsampler_t_weight_packed,
+                                     ct_4s->channel_downsampler_t_bias,
+                                     buffers.xt_3);
+        demucscpp::report_progress(
+            cb, current_progress + segment_progress * 18.0f / 26.0f,
+            "Time channels downsampled");
     }
     else
     {
         /*************************/
         /*  CROSS-TRANSFORMER!  */
         /************************/
-        demucscpp::apply_crosstransformer(model, buffers.x_3, buffers.xt_3, cb,
-                                          current_progress, segment_progress);
+        // the crosstransformer works in place on tensors it reshapes, so it
+        // gets copies of the skip conns
+        buffers.x_3_channel_upsampled = buffers.saved_3;
+        buffers.xt_3_channel_upsampled = buffers.savedt_3;
+        demucscpp::apply_crosstransformer(
+            model, buffers.x_3_channel_upsampled,
+            buffers.xt_3_channel_upsampled, buffers.freq_scratch, cb,
+            current_progress, segment_progress);
         // we need to swap axis and reshape into 384, 8, 336
 
-        // swap axis
+        // swap axis, through the freq scratch so that it doesn't allocate
         Eigen::array<int, 3> perm = {1, 0, 2};
-        Eigen::Tensor3dXf x_3_swapped = buffers.x_3.shuffle(perm);
+        const Eigen::Tensor3dXf &x_up = buffers.x_3_channel_upsampled;
+        Eigen::Tensor3dXfMap x_3_swapped = buffers.freq_scratch.a.tensor(
+            x_up.dimension(1), x_up.dimension(0), x_up.dimension(2));
+        x_3_swapped = x_up.shuffle(perm);
         // now unflatten last 2 dims from 1, 2688 to 8, 336
 
-        Eigen::Tensor3dXf x_3_reshaped =
-            x_3_swapped.reshape(Eigen::array<int, 3>({384, 8, 336}));
-
-        buffers.x_3 = x_3_reshaped;
+        buffers.x_3 = x_3_swapped.reshape(Eigen::array<int, 3>({384, 8, 336}));
+        buffers.xt_3 = buffers.xt_3_channel_upsampled;
 
-        cb(current_progress + segment_progress * 18.0f / 26.0f,
-           "Crosstransformer finished");
+        demucscpp::report_progress(
+            cb, current_progress + segment_progress * 18.0f / 26.0f,
+            "Crosstransformer finished");
     }
 
     // now decoder time!
 
-    // skip == saved_3
-    demucscpp::apply_freq_decoder(model, 0, buffers.x_3, buffers.x_2,
-                                  buffers.saved_3);
-    cb(current_progress + segment_progress * 19.0f / 26.0f, "Freq: decoder 0");
-
-    demucscpp::apply_time_decoder(model, 0, buffers.xt_3, buffers.xt_2,
-                                  buffers.savedt_3);
-    cb(current_progress + segment_progress * 20.0f / 26.0f, "Time: decoder 0");
-
-    demucscpp::apply_freq_decoder(model, 1, buffers.x_2, buffers.x_1,
-                                  buffers.saved_2);
-    cb(current_progress + segment_progress * 21.0f / 26.0f, "Freq: decoder 1");
-
-    demucscpp::apply_time_decoder(model, 1, buffers.xt_2, buffers.xt_1,
-                                  buffers.savedt_2);
-    cb(current_progress + segment_progress * 22.0f / 26.0f, "Time: decoder 1");
-
-    demucscpp::apply_freq_decoder(model, 2, buffers.x_1, buffers.x_0,
-                                  buffers.saved_1);
-    cb(current_progress + segment_progress * 23.0f / 26.0f, "Freq: decoder 2");
-
-    demucscpp::apply_time_decoder(model, 2, buffers.xt_1, buffers.xt_0,
-                                  buffers.savedt_1);
-    cb(current_progress + segment_progress * 24.0f / 26.0f, "Time: decoder 2");
-
-    demucscpp::apply_freq_decoder(model, 3, buffers.x_0, buffers.x_out,
-                                  buffers.saved_0);
-    cb(current_progress + segment_progress * 25.0f / 26.0f, "Freq: decoder 3");
-
-    demucscpp::apply_time_decoder(model, 3, buffers.xt_0, buffers.xt_out,
-                                  buffers.savedt_0);
-    cb(current_progress + segment_progress * 26.0f / 26.0f, "Time: decoder 3");
-
-    cb(current_progress + segment_progress, "Mask + istft");
-
-    // xt dim 1 is a fake dim of 1
-    // so we could have symmetry between the tensor3dxf of the freq and time
-    // branches
-
-    int nb_out_sources = model.num_sources;
-
-    // 4 sources, 2 channels * 2 complex channels (real+imag), F bins, T frames
-    Eigen::Tensor4dXf x_4d = Eigen::Tensor4dXf(
-        nb_out_sources, 4, buffers.x.dimension(1), buffers.x.dimension(2));
-
-    // 4 sources, 2 channels, N samples
-    std::vector<Eigen::MatrixXf> xt_3d;
-
-    // add two more sources
-    for (int i = 0; i < nb_out_sources; ++i)
-    {
-        xt_3d.push_back(Eigen::MatrixXf(2, buffers.xt.dimension(2)));
-    }
-
-    // distribute the channels of buffers.x into x_4d
-    // in pytorch it's (16, 2048, 336) i.e. (chan, freq, time)
-    // then apply `.view(4, -1, freq, time)
-
-    // implement above logic in Eigen C++
-    // copy buffers.x into x_4d
-    // apply opposite of
-    // buffers.x(i, j, k) = (buffers.x(i, j, k) - mean) / (epsilon + std_);
-    for (int s = 0; s < nb_out_sources; ++s)
-    { // loop over 4 sources
-        for (int i = 0; i < 4; ++i)
+    // fork again for the decoders, whose skip connections each come from
+    // their own branch
+    demucscpp::parallel_for(
+        2,
+        [&](int branch)
         {
-            for (int j = 0; j < buffers.x.dimension(1); ++j)
+            if (branch == 0)
             {
-                for (int k = 0; k < buffers.x.dimension(2); ++k)
-                {
-                    x_4d(s, i, j, k) =
-                        std_ * buffers.x_out(s * 4 + i, j, k) + mean;
-                }
+                apply_freq_decoders(model, buffers);
             }
-        }
-    }
-
-    // let's also copy buffers.xt into xt_4d
-    for (int s = 0; s < nb_out_sources; ++s)
-    { // loop over 4 sources
-        for (int i = 0; i < 2; ++i)
-        {
-            for (int j = 0; j < buffers.xt.dimension(2); ++j)
+            else
             {
-                xt_3d[s](i, j) = stdt * buffers.xt_out(0, s * 2 + i, j) + meant;
+                apply_time_decoders(model, buffers);
             }
-        }
-    }
+        });
+    demucscpp::report_progress(
+        cb, current_progress + segment_progress * 26.0f / 26.0f,
+        "Time and freq decoders finished");
 
-    // If `cac` is True, `m` is actually a full spectrogram and `z` is ignored.
-    // undo complex-as-channels by splitting the 2nd dim of x_4d into (2, 2)
-    for (int source = 0; source < nb_out_sources; ++source)
-    {
-        Eigen::Tensor3dXcf x_target = Eigen::Tensor3dXcf(
-            2, buffers.x.dimension(1), buffers.x.dimension(2));
+    demucscpp::report_progress(cb, current_progress + segment_progress,
+                               "Mask + istft");
 
-        // in the CaC case, we're simply unstacking the complex
-        // spectrogram from the channel dimension
-        for (int i = 0; i < buffers.z.dimension(0); ++i)
-        {
-            // limiting to j-1 because we're dropping 2049 to 2048 bins
-            for (int j = 0; j < buffers.z.dimension(1) - 1; ++j)
-            {
-                for (int k = 0; k < buffers.z.dimension(2); ++k)
-                {
-                    // buffers.x(2*i, j, k) = buffers.z(i, j, k).real();
-                    // buffers.x(2*i + 1, j, k) = buffers.z(i, j, k).imag();
-                    x_target(i, j, k) =
-                        std::complex<float>(x_4d(source, 2 * i, j, k),
-                                            x_4d(source, 2 * i + 1, j, k));
-                }
-            }
-        }
-
-        // need to re-pad 2: 2 + le on spectrogram
-        // opposite of this
-        // buffers.z = stft_buf.spec.slice(Eigen::array<int, 3>{0, 0, 2},
-        //         Eigen::array<int, 3>{2, (int)stft_buf.spec.dimension(1),
-        //         (int)stft_buf.spec.dimension(2) - 4});
-        // Add padding to spectrogram
-
-        Eigen::array<std::pair<int, int>, 3> paddings = {
-            std::make_pair(0, 0), std::make_pair(0, 1), std::make_pair(2, 2)};
-        Eigen::Tensor3dXcf x_target_padded =
-            x_target.pad(paddings, std::complex<float>(0.0f, 0.0f));
-
-        stft_buf.spec = x_target_padded;
-
-        demucscpp::istft(stft_buf);
-
-        // now we have waveform from istft(x), the frequency branch
-        // that we need to sum with xt, the time branch
-        Eigen::MatrixXf padded_waveform = stft_buf.waveform;
-
-        // undo the reflect pad 1d by copying padded_mix into mix
-        // from range buffers.pad:buffers.pad + buffers.segment_samples
-        Eigen::MatrixXf unpadded_waveform =
-            padded_waveform.block(0, buffers.pad, 2, buffers.segment_samples);
+    apply_mask_istft(buffers.x_out, buffers.xt_out, std_, mean, stdt, meant,
+                     model.num_sources, buffers.pad, stft_buf, buffers.targets_out);
 
-        // sum with xt
-        // choose a different source to sum with in case
-        // they're in different orders...
-        unpadded_waveform += xt_3d[source];
-
-        ss << "mix: " << buffers.mix.rows() << ", " << buffers.mix.cols();
-        cb(current_progress + segment_progress, ss.str());
-        ss.str("");
-
-        // copy target waveform into all 4 dims of targets_out
-        for (int j = 0; j < 2; ++j)
-        {
-            for (int k = 0; k < buffers.mix.cols(); ++k)
-            {
-                buffers.targets_out(source, j, k) = unpadded_waveform(j, k);
-            }
-        }
-    }
+    std::snprintf(msg, sizeof(msg), "mix: %d, %d", (int)buffers.mix.rows(),
+                  (int)buffers.mix.cols());
+    demucscpp::report_progress(cb, current_progress + segment_progress, msg);
 }
 
 void demucscpp_v3::model_v3_inference(
@@ -475,6 +524,8 @@ void demucscpp_v3::model_v3_inference(
     struct demucscpp::stft_buffers &stft_buf, demucscpp::ProgressCallback cb,
     float current_progress, float segment_progress)
 {
+    DEMUCS_PROFILE_SCOPE("model_v3_inference");
+
     // apply demucs inference
     std::ostringstream ss;
     ss << "3., apply_model mix shape: (" << buffers.mix.rows() << ", "
@@ -730,122 +781,10 @@ void demucscpp_v3::model_v3_inference(
 
     cb(current_progress + segment_progress, "Mask + istft");
 
-    // xt dim 1 is a fake dim of 1
-    // so we could have symmetry between the tensor3dxf of the freq and time
-    // branches
-
-    const int nb_out_sources = 4;
-
-    // 4 sources, 2 channels * 2 complex channels (real+imag), F bins, T frames
-    Eigen::Tensor4dXf x_4d = Eigen::Tensor4dXf(
-        nb_out_sources, 4, buffers.x.dimension(1), buffers.x.dimension(2));
-
-    // 4 sources, 2 channels, N samples
-    std::vector<Eigen::MatrixXf> xt_3d = {
-        Eigen::MatrixXf(2, buffers.xt.dimension(2)),
-        Eigen::MatrixXf(2, buffers.xt.dimension(2)),
-        Eigen::MatrixXf(2, buffers.xt.dimension(2)),
-        Eigen::MatrixXf(2, buffers.xt.dimension(2))};
-
-    // distribute the channels of buffers.x into x_4d
-    // in pytorch it's (16, 2048, 336) i.e. (chan, freq, time)
-    // then apply `.view(4, -1, freq, time)
-
-    // implement above logic in Eigen C++
-    // copy buffers.x into x_4d
-    // apply opposite of
-    // buffers.x(i, j, k) = (buffers.x(i, j, k) - mean) / (epsilon + std_);
-    for (int s = 0; s < nb_out_sources; ++s)
-    { // loop over 4 sources
-        for (int i = 0; i < 4; ++i)
-        {
-            for (int j = 0; j < buffers.x.dimension(1); ++j)
-            {
-                for (int k = 0; k < buffers.x.dimension(2); ++k)
-                {
-                    x_4d(s, i, j, k) =
-                        std_ * buffers.x_out(s * 4 + i, j, k) + mean;
-                }
-            }
-        }
-    }
-
-    // let's also copy buffers.xt into xt_4d
-    for (int s = 0; s < nb_out_sources; ++s)
-    { // loop over 4 sources
-        for (int i = 0; i < 2; ++i)
-        {
-            for (int j = 0; j < buffers.xt.dimension(2); ++j)
-            {
-                xt_3d[s](i, j) = stdt * buffers.xt_out(0, s * 2 + i, j) + meant;
-            }
-        }
-    }
-
-    // If `cac` is True, `m` is actually a full spectrogram and `z` is ignored.
-    // undo complex-as-channels by splitting the 2nd dim of x_4d into (2, 2)
-    for (int source = 0; source < nb_out_sources; ++source)
-    {
-        Eigen::Tensor3dXcf x_target = Eigen::Tensor3dXcf(
-            2, buffers.x.dimension(1), buffers.x.dimension(2));
-
-        // in the CaC case, we're simply unstacking the complex
-        // spectrogram from the channel dimension
-        for (int i = 0; i < buffers.z.dimension(0); ++i)
-        {
-            // limiting to j-1 because we're dropping 2049 to 2048 bins
-            for (int j = 0; j < buffers.z.dimension(1) - 1; ++j)
-            {
-                for (int k = 0; k < buffers.z.dimension(2); ++k)
-                {
-                    // buffers.x(2*i, j, k) = buffers.z(i, j, k).real();
-                    // buffers.x(2*i + 1, j, k) = buffers.z(i, j, k).imag();
-                    x_target(i, j, k) =
-                        std::complex<float>(x_4d(source, 2 * i, j, k),
-                                            x_4d(source, 2 * i + 1, j, k));
-                }
-            }
-        }
-
-        // need to re-pad 2: 2 + le on spectrogram
-        // opposite of this
-        // buffers.z = stft_buf.spec.slice(Eigen::array<int, 3>{0, 0, 2},
-        //         Eigen::array<int, 3>{2, (int)stft_buf.spec.dimension(1),
-        //         (int)stft_buf.spec.dimension(2) - 4});
-        // Add padding to spectrogram
+    apply_mask_istft(buffers.x_out, buffers.xt_out, std_, mean, stdt, meant,
+                     4, buffers.pad, stft_buf, buffers.targets_out);
 
-        Eigen::array<std::pair<int, int>, 3> paddings = {
-            std::make_pair(0, 0), std::make_pair(0, 1), std::make_pair(2, 2)};
-        Eigen::Tensor3dXcf x_target_padded =
-            x_target.pad(paddings, std::complex<float>(0.0f, 0.0f));
-
-        stft_buf.spec = x_target_padded;
-
-        demucscpp::istft(stft_buf);
-
-        // now we have waveform from istft(x), the frequency branch
-        // that we need to sum with xt, the time branch
-        Eigen::MatrixXf padded_waveform = stft_buf.waveform;
-
-        // undo the reflect pad 1d by copying padded_mix into mix
-        // from range buffers.pad:buffers.pad + buffers.segment_samples
-        Eigen::MatrixXf unpadded_waveform =
-            padded_waveform.block(0, buffers.pad, 2, buffers.segment_samples);
-
-        // sum with xt
-        unpadded_waveform += xt_3d[source];
-
-        ss << "mix: " << buffers.mix.rows() << ", " << buffers.mix.cols();
-        cb(current_progress + segment_progress, ss.str());
-        ss.str("");
-
-        // copy target waveform into all 4 dims of targets_out
-        for (int j = 0; j < 2; ++j)
-        {
-            for (int k = 0; k < buffers.mix.cols(); ++k)
-            {
-                buffers.targets_out(source, j, k) = unpadded_waveform(j, k);
-            }
-        }
-    }
+    ss << "mix: " << buffers.mix.rows() << ", " << buffers.mix.cols();
+    cb(current_progress + segment_progress, ss.str());
+    ss.str("");
 }
@@ -1,10 +1,20 @@
+#include "conv.hpp"
+#include "crosstransformer.hpp"
 #include "model.hpp"
+#include "threadpool.hpp"
 #include <Eigen/Dense>
 #include <cstdarg>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
 #include <filesystem>
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <type_traits>
+#include <unistd.h>
 #include <vector>
 
 struct vector_file
@@ -59,6 +69,10 @@ static size_t load_single_matrix(struct vector_file &f, std::string &name,
                                  Eigen::MatrixXf &matrix, int *ne,
                                  int32_t nelements, bool direct_f32);
 
+static size_t load_single_matrix(struct vector_file &f, std::string &name,
+                                 demucscpp::gemm_weight &weight, int *ne,
+                                 int32_t nelements, bool direct_f32);
+
 static size_t load_single_tensor3d(struct vector_file &f, std::string &name,
                                    Eigen::Tensor3dXf &tensor, int *ne,
                                    int32_t nelements, bool direct_f32);
@@ -67,6 +81,9 @@ static size_t load_single_tensor4d(struct vector_file &f, std::string &name,
                                    Eigen::Tensor4dXf &tensor, int *ne,
                                    int32_t nelements, bool direct_f32);
 
+static void pack_conv_weights(struct demucscpp::demucs_model *model);
+static void fold_constants(struct demucscpp::demucs_model *model);
+
 bool demucscpp::load_demucs_model(const std::vector<char>& model_bytes, struct demucs_model* model) {
     // Check if the vector is empty
     if (model_bytes.empty()) {
@@ -77,6 +94,81 @@ bool demucscpp::load_demucs_model(const std::vector<char>& model_bytes, struct d
     return load_demucs_model(model_bytes.data(), static_cast<int>(model_bytes.size()), model);
 }
 
+bool demucscpp::load_demucs_model_file(const std::string &model_file,
+                                       struct demucs_model *model,
+                                       uint64_t *content_hash)
+{
+    int fd = open(model_file.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        my_fprintf(stderr, "%s: could not open %s\n", __func__,
+                   model_file.c_str());
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0)
+    {
+        my_fprintf(stderr, "%s: could not stat %s\n", __func__,
+                   model_file.c_str());
+        close(fd);
+        return false;
+    }
+    std::size_t n_bytes = st.st_size;
+
+    // the mapping is backed by the page cache, so unlike reading the file
+    // into a vector it does not hold a second private copy of the weights
+    void *mapping = mmap(nullptr, n_bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        my_fprintf(stderr, "%s: could not mmap %s\n", __func__,
+                   model_file.c_str());
+        return false;
+    }
+
+    // tensors are read front to back, exactly once
+    madvise(mapping, n_bytes, MADV_SEQUENTIAL);
+
+    bool ret = load_demucs_model(static_cast<const char *>(mapping),
+                                 static_cast<int>(n_bytes), model);
+    if (ret && content_hash)
+    {
+        *content_hash = hash_bytes(mapping, n_bytes);
+    }
+
+    munmap(mapping, n_bytes);
+    return ret;
+}
+
+bool demucscpp::load_demucs_session(const std::string &model_file,
+                                    int num_threads,
+                                    struct demucs_session *session,
+                                    weight_precision precision)
+{
+    // updated weights of the same size must not hit the stems of the old
+    // ones, so the cache key takes the file contents rather than its name
+    uint64_t content_hash = 0;
+    if (!load_demucs_model_file(model_file, &session->model, &content_hash))
+    {
+        return false;
+    }
+    set_weight_precision(&session->model, precision);
+    session->num_threads = num_threads;
+
+    std::ostringstream model_id;
+    model_id << std::hex << content_hash;
+    session->model_id =
+        model_id.str() + " " +
+        (precision == weight_precision::int8  ? "int8"
+         : precision == weight_precision::f16 ? "f16"
+                                              : "f32");
+
+    // start the pool now rather than on the first job
+    set_num_threads(num_threads);
+    return true;
+}
+
 // from scripts/convert-pth-to-ggml.py
 bool demucscpp::load_demucs_model(const char* model_data, int n_bytes,
                                   struct demucs_model *model)
@@ -1122,6 +1214,9 @@ bool demucscpp::load_demucs_model(const char* model_data, int n_bytes,
         n_loaded++;
     }
 
+    pack_conv_weights(model);
+    fold_constants(model);
+
     // compute finish time in microseconds using std::chrono
 
     const auto t_end_us =
@@ -1137,141 +1232,521 @@ bool demucscpp::load_demucs_model(const char* model_data, int n_bytes,
     return true;
 }
 
-static size_t load_single_matrix(struct vector_file &f, std::string &name,
-                                 Eigen::MatrixXf &matrix, int *ne,
-                                 int32_t nelements, bool direct_f32)
+// replace w by its packed form and free the original
+template <typename Tensor>
+static void pack_conv(demucscpp::gemm_weight &packed, Tensor &w)
 {
-    if (matrix.size() != nelements)
+    packed = demucscpp::pack_conv_weight(w);
+    w = Tensor();
+}
+
+template <typename Tensor>
+static void pack_conv_tr(demucscpp::gemm_weight &packed, Tensor &w)
+{
+    packed = demucscpp::pack_conv_tr_weight(w);
+    w = Tensor();
+}
+
+static void pack_conv_weights(struct demucscpp::demucs_model *model)
+{
+    for (int i = 0; i < 4; ++i)
     {
-        my_fprintf(stderr, "%s: tensor '%s' has wrong size in model file\n",
-                   __func__, name.data());
-        my_fprintf(
-            stderr,
-            "%s: model file shape: [%d, %d], demucs.cpp shape: [%d, %d]\n",
-            __func__, ne[0], ne[1], (int)matrix.rows(), (int)matrix.cols());
-        return 0;
+        pack_conv(model->encoder_conv_weight_packed[i],
+                  model->encoder_conv_weight[i]);
+        pack_conv(model->encoder_rewrite_weight_packed[i],
+                  model->encoder_rewrite_weight[i]);
+        pack_conv(model->tencoder_conv_weight_packed[i],
+                  model->tencoder_conv_weight[i]);
+        pack_conv(model->tencoder_rewrite_weight_packed[i],
+                  model->tencoder_rewrite_weight[i]);
+        pack_conv_tr(model->decoder_conv_tr_weight_packed[i],
+                     model->decoder_conv_tr_weight[i]);
+        pack_conv(model->decoder_rewrite_weight_packed[i],
+                  model->decoder_rewrite_weight[i]);
+        pack_conv_tr(model->tdecoder_conv_tr_weight_packed[i],
+                     model->tdecoder_conv_tr_weight[i]);
+        pack_conv(model->tdecoder_rewrite_weight_packed[i],
+                  model->tdecoder_rewrite_weight[i]);
     }
 
-    if (!direct_f32) {
-        // loading quantized weights
-        const size_t bpe_half = sizeof(Eigen::half);
-        auto nbytes_tensor = matrix.size() * bpe_half;
-
-        // create a Eigen::half Eigen::Matrix to hold the quantized weights
-        // of the same shape as the float matrix
-        Eigen::Matrix<Eigen::half, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>
-            matrix_half =
-                Eigen::Matrix<Eigen::half, Eigen::Dynamic, Eigen::Dynamic,
-                            Eigen::RowMajor>::Zero(matrix.rows(), matrix.cols());
+    // freq/time, encoder/decoder, layer, dconv
+    for (int i = 0; i < 2; ++i)
+    {
+        for (int j = 0; j < 2; ++j)
+        {
+            for (int k = 0; k < 4; ++k)
+            {
+                for (int l = 0; l < 2; ++l)
+                {
+                    pack_conv(
+                        model->dconv_layers_0_conv1d_weight_packed[i][j][k][l],
+                        model->dconv_layers_0_conv1d_weight[i][j][k][l]);
+                    pack_conv(
+                        model->dconv_layers_3_conv1d_weight_packed[i][j][k][l],
+                        model->dconv_layers_3_conv1d_weight[i][j][k][l]);
+                }
+            }
+        }
+    }
 
-        vector_read(matrix_half.data(), bpe_half, nelements, f);
+    if (model->use_4source_crosstransformer)
+    {
+        auto *ct_4s = static_cast<demucscpp::demucs_crosstransformer_4s *>(
+            model->crosstransformer.get());
+        pack_conv(ct_4s->channel_upsampler_weight_packed,
+                  ct_4s->channel_upsampler_weight);
+        pack_conv(ct_4s->channel_downsampler_weight_packed,
+                  ct_4s->channel_downsampler_weight);
+        pack_conv(ct_4s->channel_upsampler_t_weight_packed,
+                  ct_4s->channel_upsampler_t_weight);
+        pack_conv(ct_4s->channel_downsampler_t_weight_packed,
+                  ct_4s->channel_downsampler_t_weight);
+    }
+}
 
-        // my_fprintf(stdout, "%16s: [%5d, %5d], type = float, %6.2f MB\n",
-        // name.data(), ne[0],
-        //        ne[1], nbytes_tensor / 1024.0 / 1024.0);
+// scale the rows of w and b, the outputs of a linear layer, by gamma
+static void fold_scale(demucscpp::gemm_weight &w, Eigen::VectorXf &b,
+                       Eigen::VectorXf &gamma)
+{
+    w.f32 = gamma.asDiagonal() * w.f32;
+    b = b.cwiseProduct(gamma);
+    gamma = Eigen::VectorXf();
+}
 
-        // and copy them into the float matrix
-        for (int i = 0; i < ne[0]; i++)
+// fold the constant scales into the weights they follow, and build what only
+// depends on the weights and the segment shape once instead of per segment;
+// what that saves per segment is counted from the segment shape
+static void fold_constants(struct demucscpp::demucs_model *model)
+{
+    double multiplies = 0.0;
+    double transcendentals = 0.0;
+    double bytes = 0.0;
+
+    // the dconv layer scale multiplies the glu output, i.e. the value half of
+    // the group norm before it, whose affine takes it instead
+    const int freq_bins[4] = {512, 128, 32, 8};
+    const int time_len[4] = {demucscpp::TIME_BRANCH_LEN_0,
+                             demucscpp::TIME_BRANCH_LEN_1,
+                             demucscpp::TIME_BRANCH_LEN_2,
+                             demucscpp::TIME_BRANCH_LEN_3};
+    for (int i = 0; i < 2; ++i)
+    {
+        for (int j = 0; j < 2; ++j)
         {
-            for (int j = 0; j < ne[1]; j++)
+            for (int k = 0; k < 4; ++k)
             {
-                matrix(i, j) = static_cast<float>(matrix_half(i, j));
+                for (int l = 0; l < 2; ++l)
+                {
+                    auto &scale = model->dconv_layers_6_scale[i][j][k][l];
+                    auto &weight =
+                        model->dconv_layers_4_groupnorm_weight[i][j][k][l];
+                    auto &bias =
+                        model->dconv_layers_4_groupnorm_bias[i][j][k][l];
+                    const int channels = scale.dimension(0);
+                    for (int c = 0; c < channels; ++c)
+                    {
+                        weight(c) *= scale(c);
+                        bias(c) *= scale(c);
+                    }
+                    scale = Eigen::Tensor1dXf();
+
+                    multiplies +=
+                        (double)channels *
+                        (i == 0 ? freq_bins[k] * demucscpp::FREQ_BRANCH_LEN
+                                : time_len[k]);
+                }
             }
         }
-        return nbytes_tensor;
-    } else {
-        // directly load the float32 matrix
-        const size_t bpe_f32 = sizeof(float);
-        auto nbytes_tensor = matrix.size() * bpe_f32;
-
-        // create a float Eigen::Matrix with RowMajor order to hold the weights
-        Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>
-            matrix_row_major =
-                Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic,
-                            Eigen::RowMajor>::Zero(matrix.rows(), matrix.cols());
-
-        vector_read(matrix_row_major.data(), bpe_f32, nelements, f);
-
-        // copy the weights into the ColMajor matrix
-        for (int i = 0; i < ne[0]; i++)
+    }
+
+    // gamma_1 and gamma_2 scale the outputs of out_proj and linear2, each a
+    // pass over the (length, channels) activations of the layer
+    demucscpp::crosstransformer_base &ct = *model->crosstransformer;
+    const int channels = ct.crosstransformer_norm_in_weight.dimension(0);
+    const int lengths[2] = {8 * demucscpp::FREQ_BRANCH_LEN,
+                            demucscpp::TIME_BRANCH_LEN_3};
+    for (int freq_or_time = 0; freq_or_time < 2; ++freq_or_time)
+    {
+        for (int i = 0; i < 3; ++i)
+        {
+            fold_scale(
+                ct.crosstransformer_my_layers_self_attn_out_proj_weight
+                    [freq_or_time][i],
+                ct.crosstransformer_my_layers_self_attn_out_proj_bias
+                    [freq_or_time][i],
+                ct.crosstransformer_my_layers_gamma_1_scale[freq_or_time][i]);
+            fold_scale(
+                ct.crosstransformer_my_layers_linear2_weight[freq_or_time][i],
+                ct.crosstransformer_my_layers_linear2_bias[freq_or_time][i],
+                ct.crosstransformer_my_layers_gamma_2_scale[freq_or_time][i]);
+        }
+        for (int i = 0; i < 2; ++i)
         {
-            for (int j = 0; j < ne[1]; j++)
-            {
-                matrix(i, j) = matrix_row_major(i, j);
-            }
+            fold_scale(
+                ct.crosstransformer_cross_layers_cross_attn_out_proj_weight
+                    [freq_or_time][i],
+                ct.crosstransformer_cross_layers_cross_attn_out_proj_bias
+                    [freq_or_time][i],
+                ct.crosstransformer_cross_layers_gamma_1_scale[freq_or_time]
+                                                              [i]);
+            fold_scale(
+                ct.crosstransformer_cross_layers_linear2_weight[freq_or_time]
+                                                               [i],
+                ct.crosstransformer_cross_layers_linear2_bias[freq_or_time][i],
+                ct.crosstransformer_cross_layers_gamma_2_scale[freq_or_time]
+                                                              [i]);
         }
 
-        return nbytes_tensor;
+        // 5 layers, 2 scales each, each pass reading and writing
+        double elements = 10.0 * lengths[freq_or_time] * channels;
+        multiplies += elements;
+        bytes += 2.0 * sizeof(float) * elements;
     }
+
+    // the frequency embedding, in the layout of one time step of the output
+    // of the first frequency encoder; both scales are absorbed in one
+    //   i.e. eliminate const float freq_emb_scale = 0.2f;
+    const float emb_scale = 10.0f * 0.2f;
+    model->freq_emb_scaled =
+        model->freq_emb_embedding_weight.transpose() * emb_scale;
+    model->freq_emb_embedding_weight = Eigen::MatrixXf();
+    multiplies += model->freq_emb_scaled.size();
+    bytes += 2.0 * sizeof(float) * model->freq_emb_scaled.size();
+
+    // the 2d embedding is one sin or cos per (channel pair, freq or time)
+    // that is then broadcast, written and reordered; the 1d one is a pow, a
+    // sin and a cos per (channel pair, time)
+    demucscpp::init_positional_embeddings(ct);
+    transcendentals += (double)(8 + demucscpp::FREQ_BRANCH_LEN) * channels / 2;
+    transcendentals += 1.5 * demucscpp::TIME_BRANCH_LEN_3 * channels;
+    bytes += 3.0 * sizeof(float) * ct.pos_embed_2d.size();
+    bytes += sizeof(float) * ct.pos_embed_1d.size();
+
+    my_fprintf(stdout,
+               "Folded constants: %.1f M multiplies, %.0f K sin/cos/pow and "
+               "%.1f MB of memory traffic removed per segment\n",
+               multiplies / 1e6, transcendentals / 1e3,
+               bytes / 1024.0 / 1024.0);
 }
 
-static size_t load_single_tensor3d(struct vector_file &f, std::string &name,
-                                   Eigen::Tensor3dXf &tensor, int *ne,
-                                   int32_t nelements, bool direct_f32)
+void demucscpp::set_weight_precision(struct demucs_model *model,
+                                     weight_precision precision)
 {
-    if (tensor.size() != nelements)
+    if (precision == weight_precision::f32)
     {
-        my_fprintf(stderr, "%s: tensor '%s' has wrong size in model file\n",
-                   __func__, name.data());
-        my_fprintf(stderr,
-                   "%s: model file shape: [%d, %d, %d], demucs.cpp shape: [%d, "
-                   "%d, %d]\n",
-                   __func__, ne[0], ne[1], ne[2], (int)tensor.dimension(0),
-                   (int)tensor.dimension(1), (int)tensor.dimension(2));
-        return 0;
+        return;
     }
 
-    if (!direct_f32) {
-        // loading weights
-        const size_t bpe_half = sizeof(Eigen::half);
-        auto nbytes_tensor = tensor.size() * bpe_half;
+    // the weight-bound layers: the linear layers of the transformer, which
+    // are most of the weights, and the 1x1 convs around it; the wider convs
+    // are compute-bound and stay in float
+    std::vector<gemm_weight *> weights;
+    crosstransformer_base &ct = *model->crosstransformer;
+    for (int freq_or_time = 0; freq_or_time < 2; ++freq_or_time)
+    {
+        for (int i = 0; i < 3; ++i)
+        {
+            weights.push_back(
+                &ct.crosstransformer_my_layers_self_attn_in_proj_weight
+                     [freq_or_time][i]);
+            weights.push_back(
+                &ct.crosstransformer_my_layers_self_attn_out_proj_weight
+                     [freq_or_time][i]);
+            weights.push_back(
+                &ct.crosstransformer_my_layers_linear1_weight[freq_or_time][i]);
+            weights.push_back(
+                &ct.crosstransformer_my_layers_linear2_weight[freq_or_time][i]);
+        }
+        for (int i = 0; i < 2; ++i)
+        {
+            weights.push_back(
+                &ct.crosstransformer_cross_layers_cross_attn_in_proj_weight
+                     [freq_or_time][i]);
+            weights.push_back(
+                &ct.crosstransformer_cross_layers_cross_attn_out_proj_weight
+                     [freq_or_time][i]);
+            weights.push_back(
+                &ct.crosstransformer_cross_layers_linear1_weight[freq_or_time]
+                                                                [i]);
+            weights.push_back(
+                &ct.crosstransformer_cross_layers_linear2_weight[freq_or_time]
+                                                                [i]);
+        }
+    }
 
-        // create a Eigen::half Eigen::Matrix to hold the quantized weights
-        // of the same shape as the float matrix
-        Eigen::Tensor<Eigen::half, 3, Eigen::RowMajor> tensor_half(ne[0], ne[1],
-                                                                ne[2]);
-        vector_read(tensor_half.data(), bpe_half, nelements, f);
+    for (int i = 0; i < 4; ++i)
+    {
+        weights.push_back(&model->encoder_rewrite_weight_packed[i]);
+        weights.push_back(&model->tencoder_rewrite_weight_packed[i]);
+    }
 
-        // my_fprintf(stdout, "%16s: [%5d, %5d, %5d], type = float, %6.2f MB\n",
-        // name.data(),
-        //        ne[0], ne[1], ne[2], nbytes_tensor / 1024.0 / 1024.0);
+    if (model->use_4source_crosstransformer)
+    {
+        auto *ct_4s = static_cast<demucs_crosstransformer_4s *>(&ct);
+        weights.push_back(&ct_4s->channel_upsampler_weight_packed);
+        weights.push_back(&ct_4s->channel_downsampler_weight_packed);
+        weights.push_back(&ct_4s->channel_upsampler_t_weight_packed);
+        weights.push_back(&ct_4s->channel_downsampler_t_weight_packed);
+    }
 
-        // Manually copy the data from tensor_half to tensor
-        for (int i = 0; i < ne[0]; ++i)
+    std::size_t nbytes_before = 0;
+    std::size_t nbytes_after = 0;
+    for (gemm_weight *w : weights)
+    {
+        nbytes_before += w->nbytes();
+        if (precision == weight_precision::int8)
         {
-            for (int j = 0; j < ne[1]; ++j)
-            {
-                for (int k = 0; k < ne[2]; ++k)
-                {
-                    tensor(i, j, k) = static_cast<float>(tensor_half(i, j, k));
-                }
-            }
+            w->quantize_int8();
         }
-        return nbytes_tensor;
-    } else {
-        // directly load the float32 tensor
-        const size_t bpe_f32 = sizeof(float);
-        auto nbytes_tensor = tensor.size() * bpe_f32;
+        else
+        {
+            w->convert_f16();
+        }
+        nbytes_after += w->nbytes();
+    }
 
-        // create a float Eigen::Tensor with RowMajor order to hold the weights
-        Eigen::Tensor<float, 3, Eigen::RowMajor> tensor_row_major(ne[0], ne[1], ne[2]);
+    my_fprintf(stdout, "Converted %d weights to %s (%6.2f MB -> %6.2f MB)\n",
+               (int)weights.size(),
+               precision == weight_precision::int8 ? "int8" : "fp16",
+               nbytes_before / 1024.0 / 1024.0,
+               nbytes_after / 1024.0 / 1024.0);
+}
 
-        vector_read(tensor_row_major.data(), bpe_f32, nelements, f);
+// the tensors are converted straight from the model bytes (typically a
+// mapping of the model file) into the model's column-major tensors
+//
+// the bytes are not necessarily aligned to the element size, since the
+// tensor names before them have any length, so elements are loaded with
+// memcpy, which compiles down to plain (unaligned) loads
+//
+// Eigen only has hardware fp16 conversions on aarch64 and with F16C and
+// otherwise emulates them bit by bit, so there a lookup table over all 2^16
+// bit patterns is used instead
+#if defined(__aarch64__) || defined(__F16C__)
+static constexpr bool native_fp16 = true;
+#else
+static constexpr bool native_fp16 = false;
+#endif
+
+static const float *half_to_float_table()
+{
+    if constexpr (native_fp16)
+    {
+        return nullptr;
+    }
+
+    static const std::vector<float> table = []()
+    {
+        std::vector<float> t(1 << 16);
+        for (int bits = 0; bits < (1 << 16); ++bits)
+        {
+            t[bits] = static_cast<float>(
+                Eigen::numext::bit_cast<Eigen::half>((uint16_t)bits));
+        }
+        return t;
+    }();
+    return table.data();
+}
 
-        // Manually copy the data from tensor_row_major to tensor
-        for (int i = 0; i < ne[0]; ++i)
+template <typename T>
+static inline float load_element(const char *data, std::size_t i,
+                                 const float *table)
+{
+    if constexpr (std::is_same_v<T, float>)
+    {
+        float value;
+        std::memcpy(&value, data + i * sizeof(float), sizeof(float));
+        return value;
+    }
+    else
+    {
+        uint16_t bits;
+        std::memcpy(&bits, data + i * sizeof(uint16_t), sizeof(uint16_t));
+        if constexpr (native_fp16)
+        {
+            return static_cast<float>(
+                Eigen::numext::bit_cast<Eigen::half>(bits));
+        }
+        else
         {
-            for (int j = 0; j < ne[1]; ++j)
+            return table[bits];
+        }
+    }
+}
+
+// dst[i + j * dst_stride] = src[i * src_stride + j], in cache-sized tiles so
+// that neither the reads nor the writes walk memory with a large stride
+template <typename T>
+static void convert_transposed(const char *src, std::size_t src_stride,
+                               float *dst, std::size_t dst_stride, int rows,
+                               int cols, const float *table)
+{
+    const int tile = 32;
+    for (int i0 = 0; i0 < rows; i0 += tile)
+    {
+        const int i1 = std::min(i0 + tile, rows);
+        for (int j0 = 0; j0 < cols; j0 += tile)
+        {
+            const int j1 = std::min(j0 + tile, cols);
+            for (int i = i0; i < i1; ++i)
             {
-                for (int k = 0; k < ne[2]; ++k)
+                for (int j = j0; j < j1; ++j)
                 {
-                    tensor(i, j, k) = tensor_row_major(i, j, k);
+                    dst[i + j * dst_stride] =
+                        load_element<T>(src, i * src_stride + j, table);
                 }
             }
         }
+    }
+}
+
+// row-major (d0, ..., dn) data into a column-major (d0, ..., dn) tensor
+template <typename T>
+static void convert_tensor_data(const char *data, float *dst, const int *dims,
+                                int nb_dims)
+{
+    const float *table = half_to_float_table();
+
+    if (nb_dims == 1)
+    {
+        for (int i = 0; i < dims[0]; ++i)
+        {
+            dst[i] = load_element<T>(data, i, table);
+        }
+        return;
+    }
+
+    // for every index of the middle dimensions this is a transpose of the
+    // first and last one
+    const int first = dims[0];
+    const int last = dims[nb_dims - 1];
+
+    std::size_t nb_middle = 1;
+    for (int d = 1; d < nb_dims - 1; ++d)
+    {
+        nb_middle *= dims[d];
+    }
+
+    // row-major stride of the first dim, column-major stride of the last
+    const std::size_t src_stride = nb_middle * last;
+    const std::size_t dst_stride = first * nb_middle;
+
+    for (std::size_t m = 0; m < nb_middle; ++m)
+    {
+        // m is the flat row-major index of the middle dims, and the
+        // column-major offset of the same index has the strides reversed
+        std::size_t rest = m;
+        std::size_t dst_offset = 0;
+        std::size_t dst_middle_stride = first;
+        std::size_t src_middle_stride = nb_middle;
+        for (int d = 1; d < nb_dims - 1; ++d)
+        {
+            src_middle_stride /= dims[d];
+            std::size_t index = rest / src_middle_stride;
+            rest %= src_middle_stride;
+            dst_offset += index * dst_middle_stride;
+            dst_middle_stride *= dims[d];
+        }
+
+        convert_transposed<T>(data + m * last * sizeof(T), src_stride,
+                              dst + dst_offset, dst_stride, first, last,
+                              table);
+    }
+}
+
+// returns a pointer to the next nbytes of the model data and skips past them,
+// or nullptr if the data is truncated
+static const char *vector_take(struct vector_file &f, std::size_t nbytes)
+{
+    if (f.position + nbytes > f.size)
+    {
+        f.position = f.size;
+        return nullptr;
+    }
+    const char *data = f.data + f.position;
+    f.position += nbytes;
+    return data;
+}
+
+// shared tail of the load_single_* functions
+static size_t load_tensor_data(struct vector_file &f, std::string &name,
+                               float *dst, const int *dims, int nb_dims,
+                               bool direct_f32)
+{
+    std::size_t nelements = 1;
+    for (int d = 0; d < nb_dims; ++d)
+    {
+        nelements *= dims[d];
+    }
+
+    const size_t bpe = direct_f32 ? sizeof(float) : sizeof(Eigen::half);
+    size_t nbytes_tensor = nelements * bpe;
+
+    const char *data = vector_take(f, nbytes_tensor);
+    if (data == nullptr)
+    {
+        my_fprintf(stderr, "%s: tensor '%s' is truncated in model file\n",
+                   __func__, name.data());
+        return 0;
+    }
 
-        return nbytes_tensor;
+    if (direct_f32)
+    {
+        convert_tensor_data<float>(data, dst, dims, nb_dims);
+    }
+    else
+    {
+        convert_tensor_data<Eigen::half>(data, dst, dims, nb_dims);
     }
+    return nbytes_tensor;
+}
+
+static size_t load_single_matrix(struct vector_file &f, std::string &name,
+                                 Eigen::MatrixXf &matrix, int *ne,
+                                 int32_t nelements, bool direct_f32)
+{
+    if (matrix.size() != nelements)
+    {
+        my_fprintf(stderr, "%s: tensor '%s' has wrong size in model file\n",
+                   __func__, name.data());
+        my_fprintf(
+            stderr,
+            "%s: model file shape: [%d, %d], demucs.cpp shape: [%d, %d]\n",
+            __func__, ne[0], ne[1], (int)matrix.rows(), (int)matrix.cols());
+        return 0;
+    }
+
+    const int dims[2] = {(int)matrix.rows(), (int)matrix.cols()};
+    return load_tensor_data(f, name, matrix.data(), dims, 2, direct_f32);
+}
+
+// weights are loaded in float, and only quantized once the model is complete
+static size_t load_single_matrix(struct vector_file &f, std::string &name,
+                                 demucscpp::gemm_weight &weight, int *ne,
+                                 int32_t nelements, bool direct_f32)
+{
+    return load_single_matrix(f, name, weight.f32, ne, nelements, direct_f32);
+}
+
+static size_t load_single_tensor3d(struct vector_file &f, std::string &name,
+                                   Eigen::Tensor3dXf &tensor, int *ne,
+                                   int32_t nelements, bool direct_f32)
+{
+    if (tensor.size() != nelements)
+    {
+        my_fprintf(stderr, "%s: tensor '%s' has wrong size in model file\n",
+                   __func__, name.data());
+        my_fprintf(stderr,
+                   "%s: model file shape: [%d, %d, %d], demucs.cpp shape: [%d, "
+                   "%d, %d]\n",
+                   __func__, ne[0], ne[1], ne[2], (int)tensor.dimension(0),
+                   (int)tensor.dimension(1), (int)tensor.dimension(2));
+        return 0;
+    }
+
+    const int dims[3] = {(int)tensor.dimension(0), (int)tensor.dimension(1),
+                          (int)tensor.dimension(2)};
+    return load_tensor_data(f, name, tensor.data(), dims, 3, direct_f32);
 }
 
 static size_t load_single_tensor4d(struct vector_file &f, std::string &name,
@@ -1292,64 +1767,9 @@ static size_t load_single_tensor4d(struct vector_file &f, std::string &name,
         return 0;
     }
 
-    if (!direct_f32) {
-        // loading weights
-        const size_t bpe_half = sizeof(Eigen::half);
-        auto nbytes_tensor = tensor.size() * bpe_half;
-
-        // create a Eigen::half Eigen::Tensor to hold the quantized weights
-        // of the same shape as the float tensor
-        Eigen::Tensor<Eigen::half, 4, Eigen::RowMajor> tensor_half(ne[0], ne[1],
-                                                                ne[2], ne[3]);
-        vector_read(tensor_half.data(), bpe_half, nelements, f);
-
-        // my_fprintf(stdout, "%16s: [%5d, %5d, %5d, %5d], type = float, %6.2f
-        // MB\n", name.data(),
-        //        ne[0], ne[1], ne[2], ne[3], nbytes_tensor / 1024.0 / 1024.0);
-
-        // Manually copy the data from tensor_half to tensor
-        for (int i = 0; i < ne[0]; ++i)
-        {
-            for (int j = 0; j < ne[1]; ++j)
-            {
-                for (int k = 0; k < ne[2]; ++k)
-                {
-                    for (int l = 0; l < ne[3]; ++l)
-                    {
-                        tensor(i, j, k, l) =
-                            static_cast<float>(tensor_half(i, j, k, l));
-                    }
-                }
-            }
-        }
-        return nbytes_tensor;
-    } else {
-        // directly load the float32 tensor
-        const size_t bpe_f32 = sizeof(float);
-        auto nbytes_tensor = tensor.size() * bpe_f32;
-
-        // create a float Eigen::Tensor with RowMajor order to hold the weights
-        Eigen::Tensor<float, 4, Eigen::RowMajor> tensor_row_major(ne[0], ne[1], ne[2], ne[3]);
-
-        vector_read(tensor_row_major.data(), bpe_f32, nelements, f);
-
-        // Manually copy the data from tensor_row_major to tensor
-        for (int i = 0; i < ne[0]; ++i)
-        {
-            for (int j = 0; j < ne[1]; ++j)
-            {
-                for (int k = 0; k < ne[2]; ++k)
-                {
-                    for (int l = 0; l < ne[3]; ++l)
-                    {
-                        tensor(i, j, k, l) = tensor_row_major(i, j, k, l);
-                    }
-                }
-            }
-        }
-
-        return nbytes_tensor;
-    }
+    const int dims[4] = {(int)tensor.dimension(0), (int)tensor.dimension(1),
+                          (int)tensor.dimension(2), (int)tensor.dimension(3)};
+    return load_tensor_data(f, name, tensor.data(), dims, 4, direct_f32);
 }
 
 static size_t load_single_tensor1d(struct vector_file &f, std::string &name,
@@ -1366,33 +1786,8 @@ static size_t load_single_tensor1d(struct vector_file &f, std::string &name,
         return 0;
     }
 
-    if (!direct_f32) {
-        // loading weights
-        const size_t bpe_half = sizeof(Eigen::half);
-        auto nbytes_tensor = tensor.size() * bpe_half;
-
-        // create a Eigen::half Eigen::Tensor to hold the quantized weights
-        // of the same shape as the float tensor
-        Eigen::Tensor<Eigen::half, 1, Eigen::RowMajor> tensor_half(ne[0]);
-        vector_read(tensor_half.data(), bpe_half, nelements, f);
-
-        // my_fprintf(stdout, "%16s: [%5d], type = float, %6.2f MB\n", name.data(),
-        //        ne[0], nbytes_tensor / 1024.0 / 1024.0);
-
-        // Manually copy the data from tensor_half to tensor
-        for (int i = 0; i < ne[0]; ++i)
-        {
-            tensor(i) = static_cast<float>(tensor_half(i));
-        }
-        return nbytes_tensor;
-    } else {
-        // directly load the float32 tensor
-        const size_t bpe_f32 = sizeof(float);
-        auto nbytes_tensor = tensor.size() * bpe_f32;
-
-        vector_read(tensor.data(), bpe_f32, nelements, f);
-        return nbytes_tensor;
-    }
+    const int dims[1] = {(int)tensor.dimension(0)};
+    return load_tensor_data(f, name, tensor.data(), dims, 1, direct_f32);
 }
 
 static size_t load_single_vector(struct vector_file &f, std::string &name,
@@ -1409,33 +1804,8 @@ static size_t load_single_vector(struct vector_file &f, std::string &name,
         return 0;
     }
 
-    if (!direct_f32) {
-        // loading weights
-        const size_t bpe_half = sizeof(Eigen::half);
-        auto nbytes_vector = vector.size() * bpe_half;
-
-        // create a Eigen::half Eigen::Vector to hold the quantized weights
-        // of the same shape as the float vector
-        Eigen::Matrix<Eigen::half, Eigen::Dynamic, 1> vector_half(ne[0]);
-        vector_read(vector_half.data(), bpe_half, nelements, f);
-
-        // my_fprintf(stdout, "%16s: [%5d], type = float, %6.2f MB\n", name.data(),
-        //        ne[0], nbytes_vector / 1024.0 / 1024.0);
-
-        // Manually copy the data from vector_half to vector
-        for (int i = 0; i < ne[0]; ++i)
-        {
-            vector(i) = static_cast<float>(vector_half(i));
-        }
-        return nbytes_vector;
-    } else {
-        // directly load the float32 vector
-        const size_t bpe_f32 = sizeof(float);
-        auto nbytes_vector = vector.size() * bpe_f32;
-
-        vector_read(vector.data(), bpe_f32, nelements, f);
-        return nbytes_vector;
-    }
+    const int dims[1] = {(int)vector.size()};
+    return load_tensor_data(f, name, vector.data(), dims, 1, direct_f32);
 }
 
 bool demucscpp_v3::load_demucs_v3_model(const std::vector<char>& model_bytes, struct demucs_v3_model* model) {
@@ -0,0 +1,336 @@
+#include "profiler.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <vector>
+
+namespace
+{
+
+struct event
+{
+    const char *name;
+    int index;
+    int tid;
+    double start_us;
+    double duration_us;
+    std::uint64_t allocs;
+    std::uint64_t bytes;
+};
+
+#ifdef DEMUCS_PROFILING
+std::atomic<bool> enabled{true};
+#else
+std::atomic<bool> enabled{false};
+#endif
+
+// updated from the malloc wrappers, so they stay plain atomics: anything
+// that could allocate (including thread_local storage in some runtimes)
+// would recurse
+std::atomic<std::uint64_t> nb_allocs{0};
+std::atomic<std::uint64_t> nb_bytes{0};
+
+std::mutex events_mutex;
+std::vector<event> events;
+std::chrono::steady_clock::time_point trace_start =
+    std::chrono::steady_clock::now();
+
+// small sequential thread ids read better in the trace than hashed ones
+std::atomic<int> next_tid{0};
+
+int current_tid()
+{
+    thread_local int tid = next_tid++;
+    return tid;
+}
+
+std::string event_name(const char *name, int index)
+{
+    std::string s(name);
+    if (index >= 0)
+    {
+        s += " " + std::to_string(index);
+    }
+    return s;
+}
+
+// names are literals, but may still contain characters JSON needs escaped
+std::string json_escape(const std::string &s)
+{
+    std::string out;
+    for (char c : s)
+    {
+        if (c == '"' || c == '\\')
+        {
+            out += '\\';
+        }
+        out += c;
+    }
+    return out;
+}
+
+} // namespace
+
+#ifdef DEMUCS_PROFILING
+static void count_allocation(std::size_t size)
+{
+    nb_allocs.fetch_add(1, std::memory_order_relaxed);
+    nb_bytes.fetch_add(size, std::memory_order_relaxed);
+}
+
+// the profiling build links with -Wl,--wrap=malloc (and calloc, realloc), so
+// every call to these in the linked objects, including Eigen's aligned
+// allocator, comes through here
+extern "C"
+{
+    void *__real_malloc(std::size_t size);
+    void *__real_calloc(std::size_t count, std::size_t size);
+    void *__real_realloc(void *ptr, std::size_t size);
+
+    void *__wrap_malloc(std::size_t size)
+    {
+        count_allocation(size);
+        return __real_malloc(size);
+    }
+
+    void *__wrap_calloc(std::size_t count, std::size_t size)
+    {
+        count_allocation(count * size);
+        return __real_calloc(count, size);
+    }
+
+    void *__wrap_realloc(void *ptr, std::size_t size)
+    {
+        count_allocation(size);
+        return __real_realloc(ptr, size);
+    }
+}
+
+// the operator new of a shared C++ runtime calls its own malloc, which the
+// wrapping doesn't reach, so the profiling build replaces it as well
+static void *counted_new(std::size_t size)
+{
+    count_allocation(size);
+    void *ptr = __real_malloc(size == 0 ? 1 : size);
+    if (ptr == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+static void *counted_new(std::size_t size, std::align_val_t align)
+{
+    count_allocation(size);
+    void *ptr = nullptr;
+    std::size_t alignment =
+        std::max(static_cast<std::size_t>(align), sizeof(void *));
+    if (posix_memalign(&ptr, alignment, size == 0 ? 1 : size) != 0)
+    {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void *operator new(std::size_t size) { return counted_new(size); }
+
+void *operator new[](std::size_t size) { return counted_new(size); }
+
+void *operator new(std::size_t size, std::align_val_t align)
+{
+    return counted_new(size, align);
+}
+
+void *operator new[](std::size_t size, std::align_val_t align)
+{
+    return counted_new(size, align);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept
+{
+    count_allocation(size);
+    return __real_malloc(size == 0 ? 1 : size);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept
+{
+    count_allocation(size);
+    return __real_malloc(size == 0 ? 1 : size);
+}
+
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+
+void operator delete[](void *ptr) noexcept { std::free(ptr); }
+
+void operator delete(void *ptr, std::size_t) noexcept { std::free(ptr); }
+
+void operator delete[](void *ptr, std::size_t) noexcept { std::free(ptr); }
+
+void operator delete(void *ptr, std::align_val_t) noexcept { std::free(ptr); }
+
+void operator delete[](void *ptr, std::align_val_t) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t, std::align_val_t) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr, std::size_t, std::align_val_t) noexcept
+{
+    std::free(ptr);
+}
+#endif
+
+void demucscpp::profiler::set_enabled(bool enable) { enabled = enable; }
+
+bool demucscpp::profiler::is_enabled() { return enabled; }
+
+void demucscpp::profiler::reset()
+{
+    std::lock_guard<std::mutex> lock(events_mutex);
+    events.clear();
+    trace_start = std::chrono::steady_clock::now();
+}
+
+bool demucscpp::profiler::write_chrome_trace(const std::string &path)
+{
+    std::ofstream out(path);
+    if (!out)
+    {
+        std::cerr << "Could not open profiler trace file " << path
+                  << std::endl;
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(events_mutex);
+
+    // complete ("X") events, in microseconds
+    out << "{\"traceEvents\":[\n";
+    for (std::size_t i = 0; i < events.size(); ++i)
+    {
+        const event &e = events[i];
+        out << std::fixed << std::setprecision(3) << "{\"name\":\""
+            << json_escape(event_name(e.name, e.index))
+            << "\",\"cat\":\"demucs\",\"ph\":\"X\",\"pid\":0,\"tid\":" << e.tid
+            << ",\"ts\":" << e.start_us << ",\"dur\":" << e.duration_us
+            << ",\"args\":{\"allocs\":" << e.allocs
+            << ",\"bytes\":" << e.bytes << "}}"
+            << (i + 1 < events.size() ? ",\n" : "\n");
+    }
+    out << "],\"displayTimeUnit\":\"ms\"}\n";
+
+    if (!out)
+    {
+        std::cerr << "Could not write profiler trace file " << path
+                  << std::endl;
+        return false;
+    }
+    return true;
+}
+
+std::string demucscpp::profiler::summary()
+{
+    struct total
+    {
+        int count = 0;
+        double total_us = 0.0;
+        double max_us = 0.0;
+        std::uint64_t allocs = 0;
+        std::uint64_t bytes = 0;
+    };
+
+    std::map<std::string, total> totals;
+    {
+        std::lock_guard<std::mutex> lock(events_mutex);
+        for (const event &e : events)
+        {
+            total &t = totals[event_name(e.name, e.index)];
+            t.count++;
+            t.total_us += e.duration_us;
+            t.max_us = std::max(t.max_us, e.duration_us);
+            t.allocs += e.allocs;
+            t.bytes += e.bytes;
+        }
+    }
+
+    std::vector<std::pair<std::string, total>> rows(totals.begin(),
+                                                    totals.end());
+    std::sort(rows.begin(), rows.end(),
+              [](const auto &a, const auto &b)
+              { return a.second.total_us > b.second.total_us; });
+
+    // scopes nest, so the totals of inner scopes are included in the outer
+    // ones and the columns do not add up
+    std::ostringstream ss;
+    ss << std::left << std::setw(32) << "scope" << std::right << std::setw(8)
+       << "calls" << std::setw(12) << "total ms" << std::setw(10) << "mean ms"
+       << std::setw(10) << "max ms" << std::setw(10) << "allocs"
+       << std::setw(12) << "alloc MB" << "\n";
+    ss << std::fixed << std::setprecision(2);
+    for (const auto &row : rows)
+    {
+        const total &t = row.second;
+        ss << std::left << std::setw(32) << row.first << std::right
+           << std::setw(8) << t.count << std::setw(12) << t.total_us / 1000.0
+           << std::setw(10) << t.total_us / 1000.0 / t.count << std::setw(10)
+           << t.max_us / 1000.0 << std::setw(10) << t.allocs << std::setw(12)
+           << (double)t.bytes / (1024.0 * 1024.0) << "\n";
+    }
+    return ss.str();
+}
+
+std::uint64_t demucscpp::profiler::allocations(const std::string &name)
+{
+    std::lock_guard<std::mutex> lock(events_mutex);
+    std::uint64_t allocs = 0;
+    for (const event &e : events)
+    {
+        if (name == e.name)
+        {
+            allocs += e.allocs;
+        }
+    }
+    return allocs;
+}
+
+demucscpp::profiler::scope::scope(const char *name, int index)
+    : name(name), index(index), active(enabled)
+{
+    if (active)
+    {
+        start_allocs = nb_allocs.load(std::memory_order_relaxed);
+        start_bytes = nb_bytes.load(std::memory_order_relaxed);
+        start = std::chrono::steady_clock::now();
+    }
+}
+
+demucscpp::profiler::scope::~scope()
+{
+    if (!active)
+    {
+        return;
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    std::uint64_t allocs =
+        nb_allocs.load(std::memory_order_relaxed) - start_allocs;
+    std::uint64_t bytes = nb_bytes.load(std::memory_order_relaxed) - start_bytes;
+
+    std::lock_guard<std::mutex> lock(events_mutex);
+    events.push_back(
+        {name, index, current_tid(),
+         std::chrono::duration<double, std::micro>(start - trace_start).count(),
+         std::chrono::duration<double, std::micro>(end - start).count(), allocs,
+         bytes});
+}
@@ -0,0 +1,82 @@
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// per-layer profiler of the inference graph
+//
+// building with -DDEMUCS_PROFILING (the DEMUCS_PROFILING cmake option) turns
+// the DEMUCS_PROFILE_SCOPE markers in the encoders, decoders, dconv and
+// crosstransformer layers, stft/istft and the segment loops into timed scopes;
+// without it they compile to nothing and the functions below have nothing to
+// record
+//
+// in profiling builds, recording can also be switched on and off at runtime
+// with set_enabled, and is on by default
+#ifdef DEMUCS_PROFILING
+#define DEMUCS_PROFILE_CONCAT_INNER(a, b) a##b
+#define DEMUCS_PROFILE_CONCAT(a, b) DEMUCS_PROFILE_CONCAT_INNER(a, b)
+#define DEMUCS_PROFILE_SCOPE(...)                                              \
+    demucscpp::profiler::scope DEMUCS_PROFILE_CONCAT(profile_scope_,         \
+                                                     __LINE__)(__VA_ARGS__)
+#else
+#define DEMUCS_PROFILE_SCOPE(...)
+#endif
+
+namespace demucscpp
+{
+namespace profiler
+{
+
+void set_enabled(bool enabled);
+
+bool is_enabled();
+
+// drop all recorded events and restart the trace clock
+void reset();
+
+// write the recorded events as a Chrome trace_event JSON file, which can be
+// opened in chrome://tracing or https://ui.perfetto.dev
+bool write_chrome_trace(const std::string &path);
+
+// a table of the recorded scopes aggregated by name, sorted by total time
+std::string summary();
+
+// the heap allocations made during the recorded scopes of that name, over
+// all their indices
+std::uint64_t allocations(const std::string &name);
+
+// records the wall time between construction and destruction, along with the
+// heap allocations made in between
+//
+// allocations are counted through malloc, calloc and realloc, which the
+// profiling build wraps at link time, and operator new, which it replaces;
+// the counters are process-wide, so when several threads run at once a scope
+// also sees the allocations that the other threads make while it is open
+//
+// name must be a string literal (or otherwise outlive the profiler), and
+// index, if not negative, is appended to it e.g. for the layer number
+class scope
+{
+  public:
+    explicit scope(const char *name, int index = -1);
+    ~scope();
+
+    scope(const scope &) = delete;
+    scope &operator=(const scope &) = delete;
+
+  private:
+    const char *name;
+    int index;
+    bool active;
+    std::chrono::steady_clock::time_point start;
+    std::uint64_t start_allocs;
+    std::uint64_t start_bytes;
+};
+
+} // namespace profiler
+} // namespace demucscpp
+
+#endif // PROFILER_HPP
@@ -0,0 +1,286 @@
+#include "stem_cache.hpp"
+#include "activations.hpp"
+#include "model.hpp"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <system_error>
+#include <tuple>
+#include <vector>
+
+// "DSTM"; bump the version whenever a change to the inference would give
+// different stems for the same key, so that the old entries are dropped
+static const uint32_t STEM_CACHE_MAGIC = 0x4d545344;
+static const uint32_t STEM_CACHE_VERSION = 1;
+static const uint32_t STEM_CACHE_MAX_KEY = 4096;
+static const char *STEM_CACHE_EXTENSION = ".stems";
+
+// the splitmix64 finalizer
+static uint64_t mix64(uint64_t h)
+{
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+template <typename T>
+static bool read_value(std::istream &in, T &value)
+{
+    return (bool)in.read(reinterpret_cast<char *>(&value), sizeof(T));
+}
+
+template <typename T>
+static void write_value(std::ostream &out, const T &value)
+{
+    out.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+uint64_t demucscpp::hash_bytes(const void *data, std::size_t size,
+                               uint64_t seed)
+{
+    const unsigned char *bytes = static_cast<const unsigned char *>(data);
+    const uint64_t k = 0x9e3779b97f4a7c15ULL;
+
+    // four independent lanes over 32-byte blocks, so that the multiplies
+    // overlap instead of forming one long dependency chain
+    uint64_t lanes[4] = {mix64(seed), mix64(seed + 1), mix64(seed + 2),
+                         mix64(seed + 3)};
+    std::size_t i = 0;
+    for (; i + 32 <= size; i += 32)
+    {
+        for (int l = 0; l < 4; ++l)
+        {
+            uint64_t w;
+            std::memcpy(&w, bytes + i + 8 * l, 8);
+            lanes[l] = (lanes[l] ^ w) * k;
+            lanes[l] ^= lanes[l] >> 29;
+        }
+    }
+
+    uint64_t h = mix64((uint64_t)size ^ seed);
+    for (int l = 0; l < 4; ++l)
+    {
+        h = mix64(h ^ lanes[l]);
+    }
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t w;
+        std::memcpy(&w, bytes + i, 8);
+        h = mix64(h ^ w);
+    }
+    uint64_t tail = 0;
+    std::memcpy(&tail, bytes + i, size - i);
+    return mix64(h ^ tail);
+}
+
+std::string demucscpp::stem_cache_key(const struct demucs_session &session,
+                                      const Eigen::MatrixXf &audio)
+{
+    uint64_t audio_hash =
+        hash_bytes(audio.data(), audio.size() * sizeof(float));
+
+    std::ostringstream key;
+    key << "audio " << std::hex << std::setfill('0') << std::setw(16)
+        << audio_hash << std::dec << std::setfill(' ') << " frames "
+        << audio.cols() << " model " << session.model_id
+        << std::setprecision(9) << " segment " << SEGMENT_LEN_SECS
+        << " overlap " << OVERLAP << " shift " << MAX_SHIFT_SECS
+        << " shifts " << session.shifts << " transition " << TRANSITION_POWER
+        << " seed " << session.shift_seed << " math "
+        << (get_activation_accuracy() == activation_accuracy::exact ? "exact"
+                                                                    : "fast")
+        << " silence ";
+
+    const silence_gate &gate = session.silence;
+    if (gate.enabled)
+    {
+        key << gate.rms_threshold << " " << gate.peak_threshold << " "
+            << (gate.fill == silence_fill::mix ? "mix" : "zero");
+    }
+    else
+    {
+        key << "off";
+    }
+    return key.str();
+}
+
+demucscpp::stem_cache::stem_cache(const std::string &dir,
+                                  std::uintmax_t max_bytes)
+    : dir(dir), max_bytes(max_bytes)
+{
+    std::error_code ec;
+    std::filesystem::create_directories(this->dir, ec);
+    if (ec)
+    {
+        std::cerr << "Cannot create the stem cache directory " << dir << ": "
+                  << ec.message() << std::endl;
+    }
+}
+
+std::filesystem::path
+demucscpp::stem_cache::entry_path(const std::string &key) const
+{
+    std::ostringstream name;
+    name << std::hex << std::setfill('0') << std::setw(16)
+         << hash_bytes(key.data(), key.size()) << STEM_CACHE_EXTENSION;
+    return dir / name.str();
+}
+
+bool demucscpp::stem_cache::load(const std::string &key,
+                                 Eigen::Tensor3dXf &stems)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    std::filesystem::path path = entry_path(key);
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+    {
+        return false;
+    }
+
+    uint32_t magic = 0;
+    uint32_t version = 0;
+    uint32_t key_size = 0;
+    bool valid = read_value(file, magic) && read_value(file, version) &&
+                 read_value(file, key_size) && magic == STEM_CACHE_MAGIC &&
+                 version == STEM_CACHE_VERSION &&
+                 key_size <= STEM_CACHE_MAX_KEY;
+
+    // the key guards against two keys with the same file name
+    std::string stored_key(valid ? key_size : 0, '\0');
+    int64_t dims[3] = {0, 0, 0};
+    uint64_t checksum = 0;
+    valid = valid && file.read(&stored_key[0], key_size) &&
+            stored_key == key && read_value(file, dims[0]) &&
+            read_value(file, dims[1]) && read_value(file, dims[2]) &&
+            read_value(file, checksum) && dims[0] > 0 && dims[1] > 0 &&
+            dims[2] > 0;
+
+    if (valid)
+    {
+        stems.resize(dims[0], dims[1], dims[2]);
+        std::streamsize nbytes = stems.size() * sizeof(float);
+        valid = file.read(reinterpret_cast<char *>(stems.data()), nbytes) &&
+                file.peek() == std::ifstream::traits_type::eof() &&
+                hash_bytes(stems.data(), nbytes) == checksum;
+    }
+    file.close();
+
+    std::error_code ec;
+    if (!valid)
+    {
+        std::cerr << "Removing the invalid stem cache entry " << path
+                  << std::endl;
+        std::filesystem::remove(path, ec);
+        stems = Eigen::Tensor3dXf();
+        return false;
+    }
+
+    // a hit makes the entry the most recently used
+    std::filesystem::last_write_time(
+        path, std::filesystem::file_time_type::clock::now(), ec);
+    return true;
+}
+
+void demucscpp::stem_cache::store(const std::string &key,
+                                  const Eigen::Tensor3dXf &stems)
+{
+    std::streamsize nbytes = stems.size() * sizeof(float);
+
+    // an entry over the budget would only be evicted again right away
+    std::uintmax_t entry_bytes =
+        sizeof(STEM_CACHE_MAGIC) + sizeof(STEM_CACHE_VERSION) +
+        sizeof(uint32_t) + key.size() + 3 * sizeof(int64_t) +
+        sizeof(uint64_t) + nbytes;
+    if (entry_bytes > max_bytes)
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    std::filesystem::path path = entry_path(key);
+    std::filesystem::path tmp_path = path;
+    tmp_path += ".tmp";
+    {
+        std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+        write_value(file, STEM_CACHE_MAGIC);
+        write_value(file, STEM_CACHE_VERSION);
+        write_value(file, (uint32_t)key.size());
+        file.write(key.data(), key.size());
+        for (int d = 0; d < 3; ++d)
+        {
+            write_value(file, (int64_t)stems.dimension(d));
+        }
+        write_value(file, hash_bytes(stems.data(), nbytes));
+        file.write(reinterpret_cast<const char *>(stems.data()), nbytes);
+        file.close();
+
+        if (!file)
+        {
+            std::cerr << "Cannot write the stem cache entry " << tmp_path
+                      << std::endl;
+            std::error_code ec;
+            std::filesystem::remove(tmp_path, ec);
+            return;
+        }
+    }
+
+    // readers only ever see a complete entry
+    std::error_code ec;
+    std::filesystem::rename(tmp_path, path, ec);
+    if (ec)
+    {
+        std::cerr << "Cannot store the stem cache entry " << path << ": "
+                  << ec.message() << std::endl;
+        std::filesystem::remove(tmp_path, ec);
+        return;
+    }
+
+    evict();
+}
+
+void demucscpp::stem_cache::evict()
+{
+    std::vector<std::tuple<std::filesystem::file_time_type, std::uintmax_t,
+                           std::filesystem::path>>
+        entries;
+    std::uintmax_t total_bytes = 0;
+
+    std::error_code ec;
+    for (const auto &entry : std::filesystem::directory_iterator(dir, ec))
+    {
+        if (!entry.is_regular_file(ec) ||
+            entry.path().extension() != STEM_CACHE_EXTENSION)
+        {
+            continue;
+        }
+        std::uintmax_t size = entry.file_size(ec);
+        if (ec)
+        {
+            continue;
+        }
+        entries.emplace_back(entry.last_write_time(ec), size, entry.path());
+        total_bytes += size;
+    }
+
+    // oldest first
+    std::sort(entries.begin(), entries.end());
+    for (const auto &entry : entries)
+    {
+        if (total_bytes <= max_bytes)
+        {
+            break;
+        }
+        if (std::filesystem::remove(std::get<2>(entry), ec))
+        {
+            total_bytes -= std::get<1>(entry);
+        }
+    }
+}
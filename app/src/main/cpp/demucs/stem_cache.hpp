@@ -0,0 +1,64 @@
+#ifndef STEM_CACHE_HPP
+#define STEM_CACHE_HPP
+
+#include "tensor.hpp"
+#include <Eigen/Dense>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <string>
+
+namespace demucscpp
+{
+
+struct demucs_session;
+
+// a persistent on-disk cache of the stems of whole inputs, which
+// demucs_inference(session, ...) looks in before running the model when the
+// session has one (see demucs_session::cache)
+//
+// each entry is one file, named after the hash of its key and holding the
+// key itself, the stem dimensions and a checksum of the stems, which are all
+// checked on load; a file that fails the checks is removed and counts as a
+// miss. the least recently used entries (by file modification time, which a
+// hit refreshes) are evicted once the entries take more than max_bytes
+class stem_cache
+{
+  public:
+    stem_cache(const std::string &dir, std::uintmax_t max_bytes);
+
+    stem_cache(const stem_cache &) = delete;
+    stem_cache &operator=(const stem_cache &) = delete;
+
+    // the stems stored under key, if there is an intact entry for it
+    bool load(const std::string &key, Eigen::Tensor3dXf &stems);
+
+    // does nothing if the entry alone would take more than max_bytes
+    void store(const std::string &key, const Eigen::Tensor3dXf &stems);
+
+  private:
+    std::filesystem::path entry_path(const std::string &key) const;
+
+    void evict();
+
+    std::filesystem::path dir;
+    std::uintmax_t max_bytes;
+    std::mutex mutex;
+};
+
+// 64-bit hash of a byte range, fast enough to run over a whole decoded track
+// (it mixes in 8 bytes at a time), but not cryptographic
+uint64_t hash_bytes(const void *data, std::size_t size, uint64_t seed = 0);
+
+// the key of the stems of audio as the session would compute them: a hash
+// of the samples and their count, a hash of the model file and the weight
+// precision, the segment, overlap, shift and transition parameters, the
+// number of shifts and their seed, the activation accuracy and the silence
+// gate
+std::string stem_cache_key(const struct demucs_session &session,
+                           const Eigen::MatrixXf &audio);
+
+} // namespace demucscpp
+
+#endif // STEM_CACHE_HPP
@@ -26,6 +26,9 @@ typedef Tensor<float, 3> Tensor3dXf;
 typedef Tensor<float, 2> Tensor2dXf;
 typedef Tensor<float, 1> Tensor1dXf;
 typedef Tensor<std::complex<float>, 3> Tensor3dXcf;
+
+// a view of float memory owned elsewhere, e.g. an activation arena
+typedef TensorMap<Tensor3dXf> Tensor3dXfMap;
 } // namespace Eigen
 
 #endif // TENSOR_HPP
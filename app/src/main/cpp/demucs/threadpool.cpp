@@ -0,0 +1,203 @@
+#include "threadpool.hpp"
+#include <Eigen/ThreadPool>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace
+{
+
+std::mutex pool_mutex;
+std::unique_ptr<Eigen::ThreadPool> pool;
+
+// read without the mutex, as the kernels check them on every dispatch
+std::atomic<int> pool_num_threads(1);
+thread_local bool is_worker_thread = false;
+
+// shared between the calling thread and the scheduled helpers; helpers that
+// only get to run after the loop is done find no index left and return
+// without touching fn, whose captures may be gone by then
+struct parallel_for_state
+{
+    std::function<void(int)> fn;
+    int n;
+    int next = 0;
+    int running = 0;
+    std::exception_ptr caller_error;
+    std::exception_ptr worker_error;
+    std::mutex mutex;
+    std::condition_variable done;
+
+    // the caller and the helpers that still hold the state
+    std::atomic<int> refs{0};
+};
+
+// parallel_for runs on every GEMM, so its states are recycled instead of
+// allocated per call; a state goes back here once its caller and all of its
+// helpers have let go of it
+std::mutex free_states_mutex;
+std::vector<std::unique_ptr<parallel_for_state>> free_states;
+
+parallel_for_state *acquire_state(int refs)
+{
+    std::unique_ptr<parallel_for_state> state;
+    {
+        std::lock_guard<std::mutex> lock(free_states_mutex);
+        if (!free_states.empty())
+        {
+            state = std::move(free_states.back());
+            free_states.pop_back();
+        }
+    }
+    if (!state)
+    {
+        state = std::make_unique<parallel_for_state>();
+    }
+    state->next = 0;
+    state->running = 0;
+    state->caller_error = nullptr;
+    state->worker_error = nullptr;
+    state->refs = refs;
+    return state.release();
+}
+
+void release_state(parallel_for_state *state)
+{
+    if (--state->refs == 0)
+    {
+        std::lock_guard<std::mutex> lock(free_states_mutex);
+        free_states.emplace_back(state);
+    }
+}
+
+void run_indices(parallel_for_state &state, bool is_caller)
+{
+    for (;;)
+    {
+        int i;
+        {
+            std::lock_guard<std::mutex> lock(state.mutex);
+            if (state.next >= state.n)
+            {
+                return;
+            }
+            i = state.next++;
+            ++state.running;
+        }
+
+        std::exception_ptr error;
+        try
+        {
+            state.fn(i);
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+
+        std::lock_guard<std::mutex> lock(state.mutex);
+        if (error)
+        {
+            // stop handing out indices
+            state.next = state.n;
+            std::exception_ptr &slot =
+                is_caller ? state.caller_error : state.worker_error;
+            if (!slot)
+            {
+                slot = error;
+            }
+        }
+        if (--state.running == 0 && state.next >= state.n)
+        {
+            state.done.notify_all();
+        }
+    }
+}
+
+} // namespace
+
+void demucscpp::set_num_threads(int num_threads)
+{
+    num_threads = std::max(num_threads, 1);
+
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    if (num_threads == pool_num_threads)
+    {
+        return;
+    }
+
+    // the destructor joins the old workers
+    pool.reset();
+    if (num_threads > 1)
+    {
+        pool = std::make_unique<Eigen::ThreadPool>(num_threads - 1);
+    }
+    pool_num_threads = num_threads;
+}
+
+int demucscpp::get_num_threads() { return pool_num_threads; }
+
+bool demucscpp::in_worker_thread() { return is_worker_thread; }
+
+void demucscpp::parallel_for(int n, const std::function<void(int)> &fn)
+{
+    Eigen::ThreadPool *p;
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        p = pool.get();
+    }
+
+    if (n <= 1 || p == nullptr || is_worker_thread)
+    {
+        for (int i = 0; i < n; ++i)
+        {
+            fn(i);
+        }
+        return;
+    }
+
+    int nb_helpers = std::min(n - 1, p->NumThreads());
+
+    // the tasks only capture a pointer, which std::function keeps inline
+    parallel_for_state *state = acquire_state(nb_helpers + 1);
+    state->fn = fn;
+    state->n = n;
+
+    for (int h = 0; h < nb_helpers; ++h)
+    {
+        p->Schedule(
+            [state]()
+            {
+                is_worker_thread = true;
+                run_indices(*state, false);
+                release_state(state);
+            });
+    }
+
+    run_indices(*state, true);
+
+    std::exception_ptr caller_error;
+    std::exception_ptr worker_error;
+    {
+        std::unique_lock<std::mutex> lock(state->mutex);
+        state->done.wait(
+            lock, [state]()
+            { return state->running == 0 && state->next >= state->n; });
+        caller_error = state->caller_error;
+        worker_error = state->worker_error;
+    }
+    release_state(state);
+
+    if (caller_error)
+    {
+        std::rethrow_exception(caller_error);
+    }
+    if (worker_error)
+    {
+        std::rethrow_exception(worker_error);
+    }
+}
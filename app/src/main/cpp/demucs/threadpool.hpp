@@ -0,0 +1,47 @@
+#ifndef THREADPOOL_HPP
+#define THREADPOOL_HPP
+
+#include <functional>
+
+namespace demucscpp
+{
+
+// set the number of threads used by demucs, including the calling thread
+// i.e. 1 (the default) disables threading, and n > 1 starts a process-wide
+// pool of n - 1 worker threads that is kept alive until the next change
+void set_num_threads(int num_threads);
+
+int get_num_threads();
+
+// true when called from one of the pool's worker threads
+bool in_worker_thread();
+
+// run fn(i) for every i in [0, n) on the pool workers and the calling thread,
+// returning once all of them have completed
+//
+// indices are claimed dynamically so uneven work items balance out, and the
+// calling thread always takes part, so the call completes even if every
+// worker is busy
+//
+// nested calls from inside a worker run serially on that worker: this keeps
+// the pool from deadlocking on itself and avoids oversubscription when e.g.
+// segment workers call into multithreaded kernels
+//
+// if fn throws, no further indices are started and the first exception is
+// rethrown on the calling thread after the running ones have finished;
+// an exception thrown on the calling thread takes precedence
+void parallel_for(int n, const std::function<void(int)> &fn);
+
+// the same for any callable, which is only referenced by the std::function
+// above instead of being copied into one, as a std::function allocates for
+// the larger lambdas
+template <typename Fn> void parallel_for(int n, Fn &&fn)
+{
+    // a const lvalue, so that this calls the overload above and not itself
+    const std::function<void(int)> fn_ref = std::ref(fn);
+    parallel_for(n, fn_ref);
+}
+
+} // namespace demucscpp
+
+#endif // THREADPOOL_HPP
@@ -0,0 +1,832 @@
+// command-line benchmark of the separation core, for Linux build hosts
+//
+// runs demucs_inference on an audio file (or synthetic audio) through the
+// same session API as the app, without JNI, and reports the real-time
+// factor, the load and inference timings, peak RSS and the thread count;
+// with --from/--to it runs demucs_inference_range on that section instead;
+// with reduced-precision weights, the silence gate or a range it can also
+// report the SDR of each target against the float model on the whole
+// input; profiling builds
+// (-DDEMUCS_PROFILING=ON) also print the per-layer table of
+// demucs/profiler.hpp and can write a Chrome trace, and with --check-allocs
+// fail if the segments of the last run allocated
+//
+// demucs_bench --kernels instead times the activation kernels of
+// demucs/activations.hpp per element, in both accuracies, with their largest
+// error against a double reference
+#include "demucs/activations.hpp"
+#include "demucs/dsp.hpp"
+#include "demucs/model.hpp"
+#include "demucs/profiler.hpp"
+#include "demucs/tensor.hpp"
+#include "demucs/threadpool.hpp"
+#include "resampler/MultiChannelResampler.h"
+#include <Eigen/Dense>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <libnyquist/Common.h>
+#include <libnyquist/Decoders.h>
+#include <libnyquist/Encoders.h>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <sys/resource.h>
+#include <vector>
+
+using namespace demucscpp;
+using namespace nqr;
+
+namespace
+{
+
+// demucs_inference shifts the input by random offsets drawn with rand()
+const unsigned int bench_seed = 42;
+
+struct bench_options
+{
+    std::string model_file;
+    std::string audio_file;
+    float synthetic_secs = 0.0f;
+    float silent_secs = 0.0f;
+    float from_secs = 0.0f;
+    float to_secs = 0.0f;
+    int num_threads = 1;
+    int shifts = 1;
+    int repeat = 1;
+    int warmup = 0;
+    weight_precision precision = weight_precision::f32;
+    activation_accuracy accuracy = activation_accuracy::fast;
+    silence_gate silence;
+    bool compare = false;
+    bool check_allocs = false;
+    std::string out_dir;
+    std::string trace_file;
+    std::string cache_dir;
+    int cache_mb = 1024;
+    std::string checkpoint_dir;
+    float stop_at = 0.0f;
+};
+
+void usage(const char *argv0)
+{
+    std::cerr
+        << "usage: " << argv0
+        << " <model.bin> (<audio file> | --synthetic <seconds>) [options]\n"
+        << "       " << argv0 << " --kernels\n"
+        << "  --threads <n>   threads, including the calling one (default 1)\n"
+        << "  --shifts <n>    shifted passes to average (default 1)\n"
+        << "  --repeat <n>    timed runs (default 1)\n"
+        << "  --warmup <n>    untimed runs before the timed ones (default 0)\n"
+        << "  --weights <p>   weight precision, f32 (default), f16 or int8\n"
+        << "  --math <a>      activation accuracy, fast (default) or exact\n"
+        << "  --silent <s>    seconds of silence to append to the audio\n"
+        << "  --skip-silence  skip the segments below the silence gate\n"
+        << "  --silence-rms <t>, --silence-peak <t>\n"
+        << "                  thresholds of the gate, relative to the std of\n"
+        << "                  the input (default 0.001 and 0.01)\n"
+        << "  --silence-fill <f>\n"
+        << "                  skipped stems, zero (default) or mix\n"
+        << "  --from <s>, --to <s>\n"
+        << "                  only separate that section of the audio\n"
+        << "  --compare       report the SDR of each target against f32\n"
+        << "                  weights with exact activations and no gate,\n"
+        << "                  on the whole audio\n"
+        << "  --cache <dir>   keep the stems in a stem cache there\n"
+        << "  --cache-mb <n>  size budget of the stem cache (default 1024)\n"
+        << "  --checkpoint <dir>\n"
+        << "                  checkpoint the runs in that directory\n"
+        << "  --stop-at <p>   first stop a run at progress p (0 to 1), which\n"
+        << "                  the timed runs resume with --checkpoint\n"
+        << "  --out <dir>     write the separated targets of the last run\n"
+        << "  --trace <file>  write a Chrome trace (profiling builds only)\n"
+        << "  --check-allocs  fail if the segments of the last run allocate,\n"
+        << "                  after at least one warmup run (profiling builds\n"
+        << "                  only)\n";
+}
+
+bool parse_options(int argc, char **argv, bench_options &opts)
+{
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--synthetic" && has_value)
+        {
+            opts.synthetic_secs = std::atof(argv[++i]);
+        }
+        else if (arg == "--threads" && has_value)
+        {
+            opts.num_threads = std::atoi(argv[++i]);
+        }
+        else if (arg == "--shifts" && has_value)
+        {
+            opts.shifts = std::atoi(argv[++i]);
+        }
+        else if (arg == "--repeat" && has_value)
+        {
+            opts.repeat = std::atoi(argv[++i]);
+        }
+        else if (arg == "--warmup" && has_value)
+        {
+            opts.warmup = std::atoi(argv[++i]);
+        }
+        else if (arg == "--weights" && has_value)
+        {
+            std::string p = argv[++i];
+            if (p == "f32")
+            {
+                opts.precision = weight_precision::f32;
+            }
+            else if (p == "int8")
+            {
+                opts.precision = weight_precision::int8;
+            }
+            else if (p == "f16")
+            {
+                opts.precision = weight_precision::f16;
+            }
+            else
+            {
+                std::cerr << "unknown weight precision " << p << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--math" && has_value)
+        {
+            std::string a = argv[++i];
+            if (a == "fast")
+            {
+                opts.accuracy = activation_accuracy::fast;
+            }
+            else if (a == "exact")
+            {
+                opts.accuracy = activation_accuracy::exact;
+            }
+            else
+            {
+                std::cerr << "unknown activation accuracy " << a << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--silent" && has_value)
+        {
+            opts.silent_secs = std::atof(argv[++i]);
+        }
+        else if (arg == "--skip-silence")
+        {
+            opts.silence.enabled = true;
+        }
+        else if (arg == "--silence-rms" && has_value)
+        {
+            opts.silence.rms_threshold = std::atof(argv[++i]);
+        }
+        else if (arg == "--silence-peak" && has_value)
+        {
+            opts.silence.peak_threshold = std::atof(argv[++i]);
+        }
+        else if (arg == "--silence-fill" && has_value)
+        {
+            std::string f = argv[++i];
+            if (f == "zero")
+            {
+                opts.silence.fill = silence_fill::zero;
+            }
+            else if (f == "mix")
+            {
+                opts.silence.fill = silence_fill::mix;
+            }
+            else
+            {
+                std::cerr << "unknown silence fill " << f << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--from" && has_value)
+        {
+            opts.from_secs = std::atof(argv[++i]);
+        }
+        else if (arg == "--to" && has_value)
+        {
+            opts.to_secs = std::atof(argv[++i]);
+        }
+        else if (arg == "--compare")
+        {
+            opts.compare = true;
+        }
+        else if (arg == "--check-allocs")
+        {
+            opts.check_allocs = true;
+        }
+        else if (arg == "--cache" && has_value)
+        {
+            opts.cache_dir = argv[++i];
+        }
+        else if (arg == "--cache-mb" && has_value)
+        {
+            opts.cache_mb = std::atoi(argv[++i]);
+        }
+        else if (arg == "--checkpoint" && has_value)
+        {
+            opts.checkpoint_dir = argv[++i];
+        }
+        else if (arg == "--stop-at" && has_value)
+        {
+            opts.stop_at = std::atof(argv[++i]);
+        }
+        else if (arg == "--out" && has_value)
+        {
+            opts.out_dir = argv[++i];
+        }
+        else if (arg == "--trace" && has_value)
+        {
+            opts.trace_file = argv[++i];
+        }
+        else if (arg.rfind("--", 0) == 0)
+        {
+            std::cerr << "unknown or incomplete option " << arg << std::endl;
+            return false;
+        }
+        else
+        {
+            positional.push_back(arg);
+        }
+    }
+
+    if (positional.empty() || positional.size() > 2)
+    {
+        return false;
+    }
+    opts.model_file = positional[0];
+    if (positional.size() == 2)
+    {
+        opts.audio_file = positional[1];
+    }
+
+    // exactly one audio source
+    if (opts.audio_file.empty() == (opts.synthetic_secs <= 0.0f))
+    {
+        return false;
+    }
+
+    // the first run allocates the buffers that the later ones reuse
+    if (opts.check_allocs)
+    {
+        opts.warmup = std::max(opts.warmup, 1);
+    }
+    return opts.num_threads >= 1 && opts.shifts >= 1 && opts.repeat >= 1 &&
+           opts.warmup >= 0 && opts.silent_secs >= 0.0f && opts.cache_mb >= 0;
+}
+
+// stereo at SUPPORTED_SAMPLE_RATE, as in the app
+Eigen::MatrixXf load_audio_file(const std::string &filename)
+{
+    std::shared_ptr<AudioData> fileData = std::make_shared<AudioData>();
+    NyquistIO loader;
+    loader.Load(fileData.get(), filename);
+
+    if (fileData->channelCount != 2 && fileData->channelCount != 1)
+    {
+        std::cerr << "[ERROR] demucs.cpp only supports mono and stereo audio"
+                  << std::endl;
+        return Eigen::MatrixXf();
+    }
+
+    size_t N = fileData->samples.size() / fileData->channelCount;
+    Eigen::MatrixXf audio(2, N);
+    for (size_t i = 0; i < N; ++i)
+    {
+        audio(0, i) = fileData->samples[i * fileData->channelCount];
+        audio(1, i) = fileData->samples[i * fileData->channelCount +
+                                        fileData->channelCount - 1];
+    }
+
+    if (fileData->sampleRate == SUPPORTED_SAMPLE_RATE)
+    {
+        return audio;
+    }
+
+    std::cout << "Resampling from " << fileData->sampleRate << " to "
+              << SUPPORTED_SAMPLE_RATE << std::endl;
+
+    // audio is always stereo by now
+    std::unique_ptr<RESAMPLER_OUTER_NAMESPACE::resampler::MultiChannelResampler>
+        resampler(RESAMPLER_OUTER_NAMESPACE::resampler::MultiChannelResampler::
+                      make(2, fileData->sampleRate, SUPPORTED_SAMPLE_RATE,
+                           RESAMPLER_OUTER_NAMESPACE::resampler::
+                               MultiChannelResampler::Quality::Best));
+
+    int nb_out = (int)((long long)N * SUPPORTED_SAMPLE_RATE /
+                       fileData->sampleRate) +
+                 1;
+    Eigen::MatrixXf resampled = Eigen::MatrixXf::Zero(2, nb_out);
+
+    const float *in = audio.data();
+    float *out = resampled.data();
+    size_t frames_left = N;
+    int nb_resampled = 0;
+    while (frames_left > 0 && nb_resampled < nb_out)
+    {
+        if (resampler->isWriteNeeded())
+        {
+            resampler->writeNextFrame(in);
+            in += 2;
+            frames_left--;
+        }
+        else
+        {
+            resampler->readNextFrame(out);
+            out += 2;
+            nb_resampled++;
+        }
+    }
+    return resampled.leftCols(nb_resampled);
+}
+
+// sines plus a little noise, so that every model branch sees real content
+Eigen::MatrixXf synthetic_audio(float secs)
+{
+    int n = (int)(secs * SUPPORTED_SAMPLE_RATE);
+    Eigen::MatrixXf audio(2, n);
+
+    std::mt19937 gen(42);
+    std::uniform_real_distribution<float> noise(-1.0f, 1.0f);
+    const float two_pi = 2.0f * 3.14159265359f;
+    for (int i = 0; i < n; ++i)
+    {
+        float t = (float)i / SUPPORTED_SAMPLE_RATE;
+        audio(0, i) = 0.3f * std::sin(two_pi * 220.0f * t) + 0.1f * noise(gen);
+        audio(1, i) = 0.3f * std::sin(two_pi * 330.0f * t) +
+                      0.2f * std::sin(two_pi * 55.0f * t) + 0.1f * noise(gen);
+    }
+    return audio;
+}
+
+void write_audio_file(const Eigen::MatrixXf &waveform,
+                      const std::string &filename)
+{
+    std::shared_ptr<AudioData> fileData = std::make_shared<AudioData>();
+    fileData->sampleRate = SUPPORTED_SAMPLE_RATE;
+    fileData->channelCount = 2;
+    fileData->samples.resize(waveform.cols() * 2);
+    for (long int i = 0; i < waveform.cols(); ++i)
+    {
+        fileData->samples[2 * i] = waveform(0, i);
+        fileData->samples[2 * i + 1] = waveform(1, i);
+    }
+
+    int status = encode_wav_to_disk(
+        {fileData->channelCount, PCM_FLT, DITHER_TRIANGLE}, fileData.get(),
+        filename);
+    if (status != EncoderError::NoError)
+    {
+        std::cerr << "Error writing " << filename << std::endl;
+    }
+}
+
+double peak_rss_mb()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    // kilobytes on Linux
+    return usage.ru_maxrss / 1024.0;
+}
+
+// 10 log10(|ref|^2 / |ref - est|^2) of each target, in dB
+std::vector<double> target_sdrs(const Eigen::Tensor3dXf &ref,
+                                const Eigen::Tensor3dXf &est)
+{
+    std::vector<double> sdrs;
+    for (int target = 0; target < ref.dimension(0); ++target)
+    {
+        double signal = 0.0;
+        double noise = 0.0;
+        for (int channel = 0; channel < ref.dimension(1); ++channel)
+        {
+            for (int i = 0; i < ref.dimension(2); ++i)
+            {
+                double r = ref(target, channel, i);
+                double e = est(target, channel, i);
+                signal += r * r;
+                noise += (r - e) * (r - e);
+            }
+        }
+        sdrs.push_back(10.0 * std::log10(std::max(signal, 1e-30) /
+                                         std::max(noise, 1e-30)));
+    }
+    return sdrs;
+}
+
+const char *precision_name(weight_precision precision)
+{
+    switch (precision)
+    {
+    case weight_precision::int8:
+        return "int8";
+    case weight_precision::f16:
+        return "f16";
+    default:
+        return "f32";
+    }
+}
+
+const char *accuracy_name(activation_accuracy accuracy)
+{
+    return accuracy == activation_accuracy::exact ? "exact" : "fast";
+}
+
+double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         start)
+        .count();
+}
+
+struct activation_kernel
+{
+    const char *name;
+    void (*run)(float *, Eigen::Index);
+    double (*reference)(double);
+    // exp is compared by its relative error, the others by their error
+    // relative to max(1, |result|), as gelu(x) is about x for large x
+    bool relative;
+};
+
+// ns per element and the largest error of each kernel over uniform inputs in
+// [-10, 10], which covers the activations the model sees
+void run_kernel_bench()
+{
+    const activation_kernel kernels[] = {
+        {"gelu", gelu_inplace,
+         [](double x)
+         { return 0.5 * x * (1.0 + std::erf(x / std::sqrt(2.0))); },
+         false},
+        {"sigmoid", sigmoid_inplace,
+         [](double x) { return 1.0 / (1.0 + std::exp(-x)); }, false},
+        {"tanh", tanh_inplace, [](double x) { return std::tanh(x); }, false},
+        {"exp", exp_inplace, [](double x) { return std::exp(x); }, true}};
+
+    const int n = 1 << 16;
+    const int repeat = 200;
+
+    std::vector<float> input(n);
+    std::mt19937 gen(bench_seed);
+    std::uniform_real_distribution<float> dist(-10.0f, 10.0f);
+    for (float &x : input)
+    {
+        x = dist(gen);
+    }
+    std::vector<float> x(n);
+
+    std::cout << std::left << std::setw(10) << "kernel" << std::setw(8)
+              << "math" << std::right << std::setw(10) << "ns/elem"
+              << std::setw(14) << "Melem/s" << std::setw(12) << "max error"
+              << "\n";
+    for (const activation_kernel &kernel : kernels)
+    {
+        for (activation_accuracy accuracy :
+             {activation_accuracy::exact, activation_accuracy::fast})
+        {
+            set_activation_accuracy(accuracy);
+
+            double max_error = 0.0;
+            x = input;
+            kernel.run(x.data(), n);
+            for (int i = 0; i < n; ++i)
+            {
+                double ref = kernel.reference(input[i]);
+                double error =
+                    std::abs(x[i] - ref) /
+                    (kernel.relative ? std::abs(ref)
+                                     : std::max(1.0, std::abs(ref)));
+                max_error = std::max(max_error, error);
+            }
+
+            // the same inputs on every pass, so the timing does not depend
+            // on where the previous pass left them
+            double secs = 0.0;
+            for (int r = 0; r < repeat; ++r)
+            {
+                x = input;
+                auto start = std::chrono::steady_clock::now();
+                kernel.run(x.data(), n);
+                secs += seconds_since(start);
+            }
+            double ns = secs * 1e9 / ((double)n * repeat);
+
+            std::cout << std::left << std::setw(10) << kernel.name
+                      << std::setw(8) << accuracy_name(accuracy) << std::right
+                      << std::fixed << std::setprecision(3) << std::setw(10)
+                      << ns << std::setprecision(1) << std::setw(14)
+                      << 1e3 / ns << std::scientific << std::setprecision(2)
+                      << std::setw(12) << max_error << std::defaultfloat
+                      << "\n";
+        }
+    }
+    set_activation_accuracy(activation_accuracy::fast);
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    if (argc == 2 && std::string(argv[1]) == "--kernels")
+    {
+        run_kernel_bench();
+        return 0;
+    }
+
+    bench_options opts;
+    if (!parse_options(argc, argv, opts))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // the core logs to std::cout as it goes, which would drown out the report
+    std::stringstream core_log;
+    std::streambuf *cout_buf = std::cout.rdbuf(core_log.rdbuf());
+
+    auto start = std::chrono::steady_clock::now();
+    demucs_session session;
+    if (!load_demucs_session(opts.model_file, opts.num_threads, &session,
+                             opts.precision))
+    {
+        std::cerr << "Error loading model " << opts.model_file << std::endl;
+        return 1;
+    }
+    double load_secs = seconds_since(start);
+    set_activation_accuracy(opts.accuracy);
+    session.silence = opts.silence;
+    session.shifts = opts.shifts;
+
+    // the same random shifts on every run (and in the comparison)
+    session.shift_seed = bench_seed;
+    if (!opts.cache_dir.empty())
+    {
+        // only the first run misses the cache
+        session.cache = std::make_shared<stem_cache>(
+            opts.cache_dir, (std::uintmax_t)opts.cache_mb * 1024 * 1024);
+    }
+    session.checkpoint_dir = opts.checkpoint_dir;
+
+    start = std::chrono::steady_clock::now();
+    Eigen::MatrixXf audio = opts.audio_file.empty()
+                                ? synthetic_audio(opts.synthetic_secs)
+                                : load_audio_file(opts.audio_file);
+    double audio_load_secs = seconds_since(start);
+    if (audio.cols() == 0)
+    {
+        std::cerr << "Error loading audio " << opts.audio_file << std::endl;
+        return 1;
+    }
+    if (opts.silent_secs > 0.0f)
+    {
+        int nb_silent = (int)(opts.silent_secs * SUPPORTED_SAMPLE_RATE);
+        audio.conservativeResize(Eigen::NoChange, audio.cols() + nb_silent);
+        audio.rightCols(nb_silent).setZero();
+    }
+    double audio_secs = (double)audio.cols() / SUPPORTED_SAMPLE_RATE;
+
+    // --to defaults to the end of the audio
+    bool has_range = opts.from_secs > 0.0f || opts.to_secs > 0.0f;
+    int range_begin = (int)(opts.from_secs * SUPPORTED_SAMPLE_RATE);
+    int range_end = opts.to_secs > 0.0f
+                        ? (int)(opts.to_secs * SUPPORTED_SAMPLE_RATE)
+                        : (int)audio.cols();
+    if (has_range &&
+        (range_begin >= range_end || range_end > (int)audio.cols()))
+    {
+        std::cerr << "Invalid range of a " << audio_secs << " s input"
+                  << std::endl;
+        return 1;
+    }
+
+    ProgressCallback cb = [](float, const std::string &) {};
+
+    if (opts.stop_at > 0.0f)
+    {
+        // a job stopped part way, as with the stop button of the app
+        ProgressCallback stop_cb = [&](float progress, const std::string &)
+        {
+            if (progress >= opts.stop_at)
+            {
+                throw std::runtime_error("stopped");
+            }
+        };
+        try
+        {
+            demucs_inference(session, audio, stop_cb);
+        }
+        catch (const std::runtime_error &)
+        {
+        }
+        core_log.str("");
+    }
+
+    Eigen::Tensor3dXf targets;
+    std::vector<double> run_secs;
+    for (int run = 0; run < opts.warmup + opts.repeat; ++run)
+    {
+        // only the last timed run is kept in the profile
+        profiler::reset();
+
+        start = std::chrono::steady_clock::now();
+        targets = has_range ? demucs_inference_range(session, audio,
+                                                     range_begin, range_end, cb)
+                            : demucs_inference(session, audio, cb);
+        double secs = seconds_since(start);
+
+        if (run >= opts.warmup)
+        {
+            run_secs.push_back(secs);
+        }
+        core_log.str("");
+    }
+
+    std::cout.rdbuf(cout_buf);
+
+    std::vector<double> sorted = run_secs;
+    std::sort(sorted.begin(), sorted.end());
+    double mean =
+        std::accumulate(sorted.begin(), sorted.end(), 0.0) / sorted.size();
+    double variance = 0.0;
+    for (double s : sorted)
+    {
+        variance += (s - mean) * (s - mean);
+    }
+    double stddev = std::sqrt(variance / sorted.size());
+    double median = sorted.size() % 2 == 1
+                        ? sorted[sorted.size() / 2]
+                        : 0.5 * (sorted[sorted.size() / 2 - 1] +
+                                 sorted[sorted.size() / 2]);
+
+    std::cout << std::fixed << std::setprecision(3);
+    std::cout << "model:           " << opts.model_file << " ("
+              << session.model.num_sources << " sources)\n";
+    std::cout << "audio:           "
+              << (opts.audio_file.empty() ? "synthetic" : opts.audio_file)
+              << ", " << audio_secs << " s\n";
+    if (opts.stop_at > 0.0f)
+    {
+        std::cout << "stopped at:      " << opts.stop_at
+                  << (opts.checkpoint_dir.empty() ? "" : ", then resumed")
+                  << "\n";
+    }
+    if (session.cache)
+    {
+        std::cout << "stem cache:      " << opts.cache_dir << " ("
+                  << opts.cache_mb << " MB)\n";
+    }
+    if (has_range)
+    {
+        std::cout << "range:           "
+                  << (double)range_begin / SUPPORTED_SAMPLE_RATE << " s to "
+                  << (double)range_end / SUPPORTED_SAMPLE_RATE << " s\n";
+    }
+    std::cout << "threads:         " << get_num_threads() << "\n";
+    std::cout << "shifts:          " << opts.shifts << "\n";
+    std::cout << "weights:         " << precision_name(opts.precision)
+              << "\n";
+    std::cout << "math:            " << accuracy_name(opts.accuracy) << "\n";
+    std::cout << "silence gate:    ";
+    if (opts.silence.enabled)
+    {
+        std::cout << "rms < " << opts.silence.rms_threshold << ", peak < "
+                  << opts.silence.peak_threshold << ", "
+                  << (opts.silence.fill == silence_fill::mix ? "mix" : "zero")
+                  << " fill, " << session.workspace.nb_silent_segments
+                  << " of " << session.workspace.nb_segments
+                  << " segments skipped\n";
+    }
+    else
+    {
+        std::cout << "off\n";
+    }
+    std::cout << "model load:      " << load_secs << " s\n";
+    std::cout << "audio load:      " << audio_load_secs << " s\n";
+    std::cout << "runs:            " << run_secs.size() << " (+" << opts.warmup
+              << " warmup)\n";
+    std::cout << "inference:       min " << sorted.front() << " s, median "
+              << median << " s, mean " << mean << " s, stddev " << stddev
+              << " s, max " << sorted.back() << " s\n";
+    std::cout << "real-time factor: " << median / audio_secs
+              << " (median inference time / audio length)\n";
+    std::cout << "peak RSS:        " << peak_rss_mb() << " MB\n";
+    if (!session.workspace.segment_buffers.empty())
+    {
+        const activation_plan &plan =
+            session.workspace.segment_buffers.front()->plan;
+        std::cout << "activations:     " << plan.arena_bytes / (1024.0 * 1024.0)
+                  << " MB arena per segment worker ("
+                  << plan.separate_bytes() / (1024.0 * 1024.0)
+                  << " MB as separate buffers)\n";
+    }
+
+#ifdef DEMUCS_PROFILING
+    std::cout << "\nper-stage timings of the last run:\n"
+              << profiler::summary();
+    if (!opts.trace_file.empty() &&
+        profiler::write_chrome_trace(opts.trace_file))
+    {
+        std::cout << "wrote trace to " << opts.trace_file << "\n";
+    }
+    if (opts.check_allocs)
+    {
+        std::uint64_t segment_allocs = profiler::allocations("segment") +
+                                       profiler::allocations("silent segment") +
+                                       profiler::allocations("overlap-add");
+        std::cout << "segment allocations: " << segment_allocs << "\n";
+        if (segment_allocs > 0)
+        {
+            std::cerr << "The segments of the last run allocated "
+                      << segment_allocs << " times" << std::endl;
+            return 1;
+        }
+    }
+#else
+    if (!opts.trace_file.empty())
+    {
+        std::cerr << "--trace needs a build with -DDEMUCS_PROFILING=ON"
+                  << std::endl;
+    }
+    if (opts.check_allocs)
+    {
+        std::cerr << "--check-allocs needs a build with -DDEMUCS_PROFILING=ON"
+                  << std::endl;
+        return 1;
+    }
+#endif
+
+    if (!opts.out_dir.empty())
+    {
+        std::filesystem::create_directories(opts.out_dir);
+        for (int target = 0; target < targets.dimension(0); ++target)
+        {
+            Eigen::Tensor2dXf current_target = targets.chip<0>(target);
+            Eigen::MatrixXf waveform = Eigen::Map<Eigen::MatrixXf>(
+                current_target.data(), 2, targets.dimension(2));
+            write_audio_file(waveform,
+                             (std::filesystem::path(opts.out_dir) /
+                              ("target_" + std::to_string(target) + ".wav"))
+                                 .string());
+        }
+    }
+
+    // last, since the float model is loaded next to the other one and the
+    // peak RSS above would otherwise include it
+    if (opts.compare && (opts.precision != weight_precision::f32 ||
+                         opts.accuracy != activation_accuracy::exact ||
+                         opts.silence.enabled || has_range))
+    {
+        std::cout.rdbuf(core_log.rdbuf());
+        set_activation_accuracy(activation_accuracy::exact);
+        demucs_session ref_session;
+        bool loaded = load_demucs_session(opts.model_file, opts.num_threads,
+                                          &ref_session);
+        Eigen::Tensor3dXf ref_targets;
+        if (loaded)
+        {
+            ref_session.shifts = session.shifts;
+            ref_session.shift_seed = session.shift_seed;
+            ref_targets = demucs_inference(ref_session, audio, cb);
+        }
+        if (loaded && has_range)
+        {
+            ref_targets = Eigen::Tensor3dXf(ref_targets.slice(
+                Eigen::array<Eigen::Index, 3>({0, 0, range_begin}),
+                Eigen::array<Eigen::Index, 3>(
+                    {ref_targets.dimension(0), 2, range_end - range_begin})));
+        }
+        std::cout.rdbuf(cout_buf);
+
+        if (!loaded)
+        {
+            std::cerr << "Error loading model " << opts.model_file
+                      << std::endl;
+            return 1;
+        }
+
+        std::vector<double> sdrs = target_sdrs(ref_targets, targets);
+        std::cout << "\nSDR of the " << precision_name(opts.precision) << ", "
+                  << accuracy_name(opts.accuracy)
+                  << (opts.silence.enabled ? ", gated" : "")
+                  << (has_range ? ", range" : "")
+                  << " targets against f32, exact:\n";
+        for (std::size_t target = 0; target < sdrs.size(); ++target)
+        {
+            std::cout << "  target " << target << ": " << sdrs[target]
+                      << " dB\n";
+        }
+    }
+
+    return 0;
+}
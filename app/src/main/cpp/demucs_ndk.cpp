@@ -1,5 +1,6 @@
 #include "demucs/dsp.hpp"
 #include "demucs/model.hpp"
+#include "demucs/profiler.hpp"
 #include "demucs/tensor.hpp"
 #include <Eigen/Core>
 #include <Eigen/Dense>
@@ -23,6 +24,9 @@
 using namespace demucscpp;
 using namespace nqr;
 
+// size budget of the on-disk stem cache
+static const std::uintmax_t STEM_CACHE_BYTES = 1024ull * 1024 * 1024;
+
 // Example definition in your NDK code
 volatile bool shouldStop = false;
 
@@ -285,14 +289,77 @@ Java_com_github_sevagh_demucs_1android_DemucsAndroidForegroundService_stopInfere
 shouldStop = true;
 }
 
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_com_github_sevagh_demucs_1android_DemucsAndroidForegroundService_createSession(JNIEnv *env, jobject thiz,
+                                                              jobjectArray jModelFilePaths,
+                                                              jint jNumThreads,
+                                                              jstring jCacheDir,
+                                                              jstring jCheckpointDir) {
+    AndroidLogBuf coutLogBuf(env, thiz);
+    AndroidLogBuf cerrLogBuf(env, thiz);
+
+    std::streambuf *oldCoutBuf = std::cout.rdbuf(&coutLogBuf);
+    std::streambuf *oldCerrBuf = std::cerr.rdbuf(&cerrLogBuf);
+
+    // the first model file is the one used for inference
+    if (env->GetArrayLength(jModelFilePaths) < 1) {
+        std::cerr << "Error: no model file given" << std::endl;
+        std::cout.rdbuf(oldCoutBuf);
+        std::cerr.rdbuf(oldCerrBuf);
+        return 0;
+    }
+    jstring jstr = (jstring) env->GetObjectArrayElement(jModelFilePaths, 0);
+    const char *modelFilePath = env->GetStringUTFChars(jstr, nullptr);
+    std::string model_file(modelFilePath);
+    env->ReleaseStringUTFChars(jstr, modelFilePath);
+
+    std::cout << "Loading Demucs model weights file: " << model_file
+              << std::endl;
+
+    auto *session = new demucs_session();
+    auto ret = load_demucs_session(model_file, jNumThreads, session);
+
+    // re-running the same song (re-exports, custom mixes) reuses its stems;
+    // a 5-minute track takes about 400 MB of float stems
+    const char *cacheDir = env->GetStringUTFChars(jCacheDir, nullptr);
+    session->cache = std::make_shared<stem_cache>(cacheDir, STEM_CACHE_BYTES);
+    env->ReleaseStringUTFChars(jCacheDir, cacheDir);
+
+    // a job that was stopped, or killed with the service, resumes where it
+    // was when it is started again on the same file
+    const char *checkpointDir = env->GetStringUTFChars(jCheckpointDir, nullptr);
+    session->checkpoint_dir = checkpointDir;
+    env->ReleaseStringUTFChars(jCheckpointDir, checkpointDir);
+    std::cout << "demucs_model_load returned " << (ret ? "true" : "false")
+              << std::endl;
+
+    std::cout.rdbuf(oldCoutBuf);
+    std::cerr.rdbuf(oldCerrBuf);
+
+    if (!ret) {
+        delete session;
+        return 0;
+    }
+    return reinterpret_cast<jlong>(session);
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_com_github_sevagh_demucs_1android_DemucsAndroidForegroundService_releaseSession(JNIEnv *env, jclass clazz,
+                                                              jlong jSession) {
+    delete reinterpret_cast<demucs_session *>(jSession);
+}
+
 extern "C"
 JNIEXPORT jobjectArray JNICALL
 Java_com_github_sevagh_demucs_1android_DemucsAndroidForegroundService_demucsInference(JNIEnv *env, jobject thiz,
+                                                              jlong jSession,
                                                               jstring jAudioFilePath,
                                                               jstring jModelName,
-                                                              jobjectArray jModelFilePaths,
                                                               jstring jOutDir) {
     std::vector<std::string> written_paths;
+    demucs_session &session = *reinterpret_cast<demucs_session *>(jSession);
 
     AndroidLogBuf coutLogBuf(env, thiz);
     AndroidLogBuf cerrLogBuf(env, thiz);
@@ -314,16 +381,6 @@ Java_com_github_sevagh_demucs_1android_DemucsAndroidForegroundService_demucsInfe
     std::string out_dir(outDir);
     env->ReleaseStringUTFChars(jOutDir, outDir);
 
-    // Handle the array of model file paths
-    jsize modelFilePathsLength = env->GetArrayLength(jModelFilePaths);
-    std::vector<std::string> modelFilePathsStr;
-    for (jsize i = 0; i < modelFilePathsLength; i++) {
-        jstring jstr = (jstring) env->GetObjectArrayElement(jModelFilePaths, i);
-        const char *modelFilePath = env->GetStringUTFChars(jstr, nullptr);
-        modelFilePathsStr.push_back(std::string(modelFilePath));
-        env->ReleaseStringUTFChars(jstr, modelFilePath);
-    }
-
     // on new inference, reset the stop flag
     shouldStop = false;
 
@@ -349,39 +406,9 @@ Java_com_github_sevagh_demucs_1android_DemucsAndroidForegroundService_demucsInfe
         return nullptr;
     }
 
-    // load model files into std::vector<char>
-    std::vector<std::vector<char>> models_data;
-    for (const auto &model_file: modelFilePathsStr) {
-        std::cout << "Loading Demucs model weights file: " << model_file
-                  << std::endl;
-        std::ifstream file(model_file, std::ios::binary);
-        if (!file) {
-            std::cerr << "Error: could not open model file " << model_file
-                      << std::endl;
-            return nullptr;
-        }
-        std::vector<char> model_data((std::istreambuf_iterator<char>(file)),
-                                     std::istreambuf_iterator<char>());
-        models_data.push_back(model_data);
-    }
-
-    std::vector<demucs_model> models; // No need to pre-size the vector
-
-    for (const auto &model_data: models_data) {
-        demucs_model model{};
-        auto ret = load_demucs_model(model_data, &model);
-        std::cout << "demucs_model_load returned " << (ret ? "true" : "false")
-                  << std::endl;
-        if (!ret) {
-            std::cerr << "Error loading model" << std::endl;
-            return nullptr;
-        }
-        models.emplace_back(std::move(model));
-    }
-
     // hardcode for 4-source model only
     // free models
-    int nb_sources = models[0].num_sources;
+    int nb_sources = session.model.num_sources;
 
     std::cout << "Starting Demucs (" << std::to_string(nb_sources)
               << "-source) inference" << std::endl;
@@ -403,14 +430,28 @@ Java_com_github_sevagh_demucs_1android_DemucsAndroidForegroundService_demucsInfe
     // create 4 audio matrix same size, to hold output
     Eigen::Tensor3dXf audio_targets;
 
+#ifdef DEMUCS_PROFILING
+    profiler::reset();
+#endif
+
     try {
-        audio_targets = demucscpp::demucs_inference(models[0], audio, cb);
+        audio_targets = demucscpp::demucs_inference(session, audio, cb);
     } catch (const StopOperationException &e) {
         std::cout << "Stop operation requested" << std::endl;
         return nullptr;
     }
 
-    int nb_out_sources = models[0].num_sources;
+#ifdef DEMUCS_PROFILING
+    // per-layer timings of this job, next to the separated stems
+    if (profiler::is_enabled()) {
+        std::filesystem::create_directories(out_dir);
+        profiler::write_chrome_trace(
+                (std::filesystem::path(out_dir) / "demucs_trace.json").string());
+        std::cout << "Profile:\n" << profiler::summary() << std::endl;
+    }
+#endif
+
+    int nb_out_sources = session.model.num_sources;
     Eigen::MatrixXf instrum_waveform = Eigen::MatrixXf::Zero(2, audio.cols());
 
     std::filesystem::path p = out_dir;
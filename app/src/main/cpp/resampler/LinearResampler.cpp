@@ -14,6 +14,8 @@
  * limitations under the License.
  */
 
+#include <cstring>
+
 #include "LinearResampler.h"
 
 using namespace RESAMPLER_OUTER_NAMESPACE::resampler;
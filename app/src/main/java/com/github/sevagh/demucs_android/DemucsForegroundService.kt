@@ -10,6 +10,9 @@ import android.util.Log
 import androidx.core.app.NotificationCompat
 import androidx.core.content.ContextCompat
 import androidx.localbroadcastmanager.content.LocalBroadcastManager
+import java.io.File
+import java.util.concurrent.locks.ReentrantLock
+import kotlin.concurrent.withLock
 
 class DemucsAndroidForegroundService : Service() {
 
@@ -24,18 +27,18 @@ class DemucsAndroidForegroundService : Service() {
         val selectedModel = intent?.getStringExtra("model") ?: ""
         val modelFilePaths = intent?.getStringArrayExtra("modelFilePaths") ?: arrayOf()
         val outDir = intent?.getStringExtra("outDir") ?: ""
+        val numThreads = intent?.getIntExtra("numThreads", defaultNumThreads()) ?: defaultNumThreads()
 
         // Start in the foreground with a persistent notification
         startForeground(NOTIFICATION_ID, createNotification())
 
         // Launch your long-running NDK process in a background thread
         Thread {
-            // Replace 'demucsInference' with your actual NDK method call
-            // Example call: demucsInference(audioFilePath, selectedModel, modelFilePaths, numThreads)
-            // Notify completion or handle errors
-
             // Stop the service once the processing is done
-            val writtenStems = demucsInference(audioFilePath, selectedModel, modelFilePaths, outDir)
+            val writtenStems = sessionLock.withLock {
+                val session = acquireSession(modelFilePaths, numThreads)
+                if (session == 0L) null else demucsInference(session, audioFilePath, selectedModel, outDir)
+            }
 
             val completionIntent = Intent("ACTION_DEMIX_JOB_COMPLETED").apply {
                 putExtra("writtenStems", writtenStems)
@@ -55,6 +58,30 @@ class DemucsAndroidForegroundService : Service() {
         LocalBroadcastManager.getInstance(this).sendBroadcast(Intent("ACTION_DEMIX_JOB_STOPPED"))
     }
 
+    // each thread demixes its own segment with its own set of buffers,
+    // so cap it to keep the memory use reasonable on phones with many cores
+    private fun defaultNumThreads(): Int {
+        return Runtime.getRuntime().availableProcessors().coerceIn(1, MAX_DEFAULT_THREADS)
+    }
+
+    // the loaded model, its buffers and the thread pool are kept in native
+    // memory across jobs, and only rebuilt when the model or thread count changes
+    private fun acquireSession(modelFilePaths: Array<String>, numThreads: Int): Long {
+        val key = modelFilePaths.joinToString("|") + "@" + numThreads
+        if (sessionHandle != 0L && key == sessionKey) {
+            return sessionHandle
+        }
+
+        releaseSessionLocked()
+        sessionHandle = createSession(
+            modelFilePaths, numThreads,
+            File(cacheDir, STEM_CACHE_DIR).absolutePath,
+            File(filesDir, CHECKPOINT_DIR).absolutePath
+        )
+        sessionKey = if (sessionHandle != 0L) key else null
+        return sessionHandle
+    }
+
     fun inferenceProgressUpdate(progress: Float, message: String) {
         val intent = Intent("ACTION_DEMIX_PROGRESS_UPDATE").apply {
             putExtra("EXTRA_PROGRESS", progress)
@@ -95,12 +122,47 @@ class DemucsAndroidForegroundService : Service() {
         private const val NOTIFICATION_CHANNEL_DESCRIPTION = "Music demixing job is currently running..."
         private const val NOTIFICATION_CONTENT_TITLE = "Demixing in progress"
         private const val NOTIFICATION_CONTENT_TEXT = "Your audio file is being processed..."
+        private const val MAX_DEFAULT_THREADS = 4
+
+        // separated stems of past jobs, kept by the native session
+        private const val STEM_CACHE_DIR = "stem_cache"
+
+        // progress of the last job, which survives the service being killed
+        private const val CHECKPOINT_DIR = "checkpoints"
+
+        // guards the cached session, which is held for the whole of a job
+        private val sessionLock = ReentrantLock()
+        private var sessionHandle = 0L
+        private var sessionKey: String? = null
 
         init {
             System.loadLibrary("demucs_ndk")
         }
+
+        // frees the cached model and buffers, unless a job is using them
+        fun releaseCachedSession() {
+            if (sessionLock.tryLock()) {
+                try {
+                    releaseSessionLocked()
+                } finally {
+                    sessionLock.unlock()
+                }
+            }
+        }
+
+        private fun releaseSessionLocked() {
+            if (sessionHandle != 0L) {
+                releaseSession(sessionHandle)
+                sessionHandle = 0L
+                sessionKey = null
+            }
+        }
+
+        @JvmStatic
+        private external fun releaseSession(session: Long)
     }
 
     private external fun stopInference()
-    private external fun demucsInference(audioFilePath: String, modelName: String, modelFilePaths: Array<String>, outDir: String): Array<String>
+    private external fun createSession(modelFilePaths: Array<String>, numThreads: Int, cacheDir: String, checkpointDir: String): Long
+    private external fun demucsInference(session: Long, audioFilePath: String, modelName: String, outDir: String): Array<String>?
 }
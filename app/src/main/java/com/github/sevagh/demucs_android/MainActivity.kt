@@ -1,5 +1,6 @@
 package com.github.sevagh.demucs_android
 
+import android.content.ComponentCallbacks2
 import android.os.Bundle
 import androidx.appcompat.app.AppCompatActivity
 import androidx.appcompat.app.AppCompatDelegate
@@ -21,4 +22,14 @@ class MainActivity : AppCompatActivity() {
             }
         }
     }
+
+    override fun onTrimMemory(level: Int) {
+        super.onTrimMemory(level)
+
+        // the cached demixing session holds the model and hundreds of MB of buffers
+        if (level == ComponentCallbacks2.TRIM_MEMORY_RUNNING_CRITICAL ||
+            level >= ComponentCallbacks2.TRIM_MEMORY_BACKGROUND) {
+            DemucsAndroidForegroundService.releaseCachedSession()
+        }
+    }
 }